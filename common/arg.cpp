@@ -494,6 +494,14 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
             params.cpuparams.poll = std::stoul(value);
         }
     ));
+    add_opt(llama_arg(
+        {"--spin-us"}, "N",
+        format("keep the threadpool workers spinning for up to N us between the sub-graphs of a decode step\n"
+               "(0 - sleep as per --poll, -1 - spin for the whole step, default: %d, no effect with OpenMP)", params.spin_us),
+        [](gpt_params & params, int value) {
+            params.spin_us = value;
+        }
+    ).set_env("LLAMA_ARG_SPIN_US"));
     add_opt(llama_arg(
         {"-Cb", "--cpu-mask-batch"}, "M",
         "CPU affinity mask: arbitrarily long hex. Complements cpu-range-batch (default: same as --cpu-mask)",
@@ -646,14 +654,14 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
         [](gpt_params & params, const std::string & value) {
             params.lookup_cache_static = value;
         }
-    ).set_examples({LLAMA_EXAMPLE_LOOKUP}));
+    ).set_examples({LLAMA_EXAMPLE_LOOKUP, LLAMA_EXAMPLE_SERVER}));
     add_opt(llama_arg(
         {"-lcd", "--lookup-cache-dynamic"}, "FNAME",
         "path to dynamic lookup cache to use for lookup decoding (updated by generation)",
         [](gpt_params & params, const std::string & value) {
             params.lookup_cache_dynamic = value;
         }
-    ).set_examples({LLAMA_EXAMPLE_LOOKUP}));
+    ).set_examples({LLAMA_EXAMPLE_LOOKUP, LLAMA_EXAMPLE_SERVER}));
     add_opt(llama_arg(
         {"-c", "--ctx-size"}, "N",
         format("size of the prompt context (default: %d, 0 = loaded from model)", params.n_ctx),
@@ -779,6 +787,21 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
             params.flash_attn = true;
         }
     ).set_env("LLAMA_ARG_FLASH_ATTN"));
+    add_opt(llama_arg(
+        {"--fused-ops"},
+        format("use fused CPU kernels for the attention norm + QKV and the SwiGLU FFN during decode (default: %s)", params.fused_ops ? "enabled" : "disabled"),
+        [](gpt_params & params) {
+            params.fused_ops = true;
+        }
+    ).set_env("LLAMA_ARG_FUSED_OPS"));
+    add_opt(llama_arg(
+        {"--top-logits"}, "N",
+        format("only compute and copy back the N largest logits of each output, sampling then only sees these candidates\n"
+               "(0 = full logits, default: %d)", params.n_top_logits),
+        [](gpt_params & params, int value) {
+            params.n_top_logits = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_MAIN, LLAMA_EXAMPLE_INFILL, LLAMA_EXAMPLE_SERVER, LLAMA_EXAMPLE_PARALLEL, LLAMA_EXAMPLE_LOOKUP}).set_env("LLAMA_ARG_TOP_LOGITS"));
     add_opt(llama_arg(
         {"-p", "--prompt"}, "PROMPT",
         ex == LLAMA_EXAMPLE_MAIN
@@ -1165,6 +1188,13 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
             params.sparams.grammar = json_schema_to_grammar(json::parse(value));
         }
     ).set_sparam());
+    add_opt(llama_arg(
+        {"--grammar-compiled"},
+        format("memoize the tokens allowed in each grammar state over the whole vocabulary, faster for grammars that revisit states, e.g. JSON (default: %s)", params.sparams.grammar_compiled ? "enabled" : "disabled"),
+        [](gpt_params & params) {
+            params.sparams.grammar_compiled = true;
+        }
+    ).set_sparam());
     add_opt(llama_arg(
         {"--pooling"}, "{none,mean,cls,last,rank}",
         "pooling type for embeddings, use model default if unspecified",
@@ -1380,6 +1410,29 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
             params.defrag_thold = std::stof(value);
         }
     ).set_env("LLAMA_ARG_DEFRAG_THOLD"));
+    add_opt(llama_arg(
+        {"--kv-block-size"}, "N",
+        format("allocate KV cache cells per sequence in blocks of N cells, so new tokens do not need a contiguous\n"
+               "range of free cells (CPU only, 0 = contiguous, default: %d)", params.kv_block_size),
+        [](gpt_params & params, int value) {
+            params.kv_block_size = value;
+        }
+    ).set_env("LLAMA_ARG_KV_BLOCK_SIZE"));
+    add_opt(llama_arg(
+        {"--kv-window"}, "N",
+        format("streaming KV cache: keep the last N tokens of each sequence plus the attention sinks and evict\n"
+               "the older tokens, instead of shifting the context when it is full (0 = disabled, default: %d)", params.n_kv_window),
+        [](gpt_params & params, int value) {
+            params.n_kv_window = value;
+        }
+    ).set_env("LLAMA_ARG_KV_WINDOW"));
+    add_opt(llama_arg(
+        {"--kv-sink"}, "N",
+        format("number of first tokens of each sequence kept as attention sinks with --kv-window (default: %d)", params.n_kv_sink),
+        [](gpt_params & params, int value) {
+            params.n_kv_sink = value;
+        }
+    ).set_env("LLAMA_ARG_KV_SINK"));
     add_opt(llama_arg(
         {"-np", "--parallel"}, "N",
         format("number of parallel sequences to decode (default: %d)", params.n_parallel),
@@ -1445,6 +1498,27 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
             params.use_mmap = false;
         }
     ).set_env("LLAMA_ARG_NO_MMAP"));
+    add_opt(llama_arg(
+        {"--repack"},
+        format("repack Q4_0 weights into the interleaved layout for this CPU at load time, mmapped weights are cached in <model>.<type>.repack (default: %s)", params.repack ? "enabled" : "disabled"),
+        [](gpt_params & params) {
+            params.repack = true;
+        }
+    ).set_env("LLAMA_ARG_REPACK"));
+    add_opt(llama_arg(
+        {"--warm-start"},
+        format("cache the derived vocab (BPE merges, special token and piece caches) in <model>.warm and restore it on the next start (default: %s)", params.warm_start ? "enabled" : "disabled"),
+        [](gpt_params & params) {
+            params.warm_start = true;
+        }
+    ).set_env("LLAMA_ARG_WARM_START"));
+    add_opt(llama_arg(
+        {"--hugepages"},
+        format("back the model weights with transparent huge pages, Linux only (default: %s)", params.hugepages ? "enabled" : "disabled"),
+        [](gpt_params & params) {
+            params.hugepages = true;
+        }
+    ).set_env("LLAMA_ARG_HUGEPAGES"));
     add_opt(llama_arg(
         {"--numa"}, "TYPE",
         "attempt optimizations that help on some NUMA systems\n"
@@ -1552,6 +1626,13 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
             params.check_tensors = true;
         }
     ));
+    add_opt(llama_arg(
+        {"--load-threads"}, "N",
+        format("number of threads reading the model data when mmap is not used (default: %d, 0 = auto)", params.n_load_threads),
+        [](gpt_params & params, int value) {
+            params.n_load_threads = value;
+        }
+    ).set_env("LLAMA_ARG_LOAD_THREADS"));
     add_opt(llama_arg(
         {"--override-kv"}, "KEY=TYPE:VALUE",
         "advanced option to override model metadata by key. may be specified multiple times.\n"
@@ -1948,6 +2029,57 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
             params.slot_prompt_similarity = std::stof(value);
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}));
+    add_opt(llama_arg(
+        {"--prefill-chunk"}, "N",
+        format("max number of prompt tokens per batch while other slots are generating, long prompts are processed\n"
+               "in chunks interleaved with the generation (0 = up to the batch size, default: %d)", params.n_prefill_chunk),
+        [](gpt_params & params, int value) {
+            params.n_prefill_chunk = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREFILL_CHUNK"));
+    add_opt(llama_arg(
+        {"--prefix-cache"}, "N",
+        format("keep up to N evaluated prompt prefixes in a radix tree shared by all slots, requests with a cached prefix\n"
+               "reuse its KV cells instead of evaluating it again (requires cache_prompt, 0 = disabled, default: %d)", params.n_prefix_cache),
+        [](gpt_params & params, int value) {
+            params.n_prefix_cache = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREFIX_CACHE"));
+    add_opt(llama_arg(
+        {"--prefix-cache-dir"}, "PATH",
+        "spill the prefixes evicted from the prefix cache to state files in PATH and restore them from there\n"
+        "instead of evaluating them again (requires --prefix-cache, default: disabled)",
+        [](gpt_params & params, const std::string & value) {
+            params.prefix_cache_dir = value;
+            // if doesn't end with DIRECTORY_SEPARATOR, add it
+            if (!params.prefix_cache_dir.empty() && params.prefix_cache_dir[params.prefix_cache_dir.size() - 1] != DIRECTORY_SEPARATOR) {
+                params.prefix_cache_dir += DIRECTORY_SEPARATOR;
+            }
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREFIX_CACHE_DIR"));
+    add_opt(llama_arg(
+        {"--prefix-cache-dir-size"}, "N",
+        format("size limit of the files in --prefix-cache-dir in MiB (default: %d)", params.prefix_cache_dir_size),
+        [](gpt_params & params, int value) {
+            params.prefix_cache_dir_size = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREFIX_CACHE_DIR_SIZE"));
+    add_opt(llama_arg(
+        {"--lookup-draft"}, "N",
+        format("draft up to N tokens per slot and step from n-gram caches of the prompt and of previous generations\n"
+               "(see --lookup-cache-static/dynamic) and verify them in the shared batch (0 = disabled, default: %d)", params.n_lookup_draft),
+        [](gpt_params & params, int value) {
+            params.n_lookup_draft = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_LOOKUP_DRAFT"));
+    add_opt(llama_arg(
+        {"--lookup-cache-max"}, "N",
+        format("max number of n-grams kept from the finished generations for --lookup-draft, the least frequent\n"
+               "n-grams are dropped first (default: %d)", params.n_lookup_cache_max),
+        [](gpt_params & params, int value) {
+            params.n_lookup_cache_max = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_LOOKUP_CACHE_MAX"));
     add_opt(llama_arg(
         {"--lora-init-without-apply"},
         format("load LoRA adapters without applying them (apply later via POST /lora-adapters) (default: %s)", params.lora_init_without_apply ? "enabled" : "disabled"),
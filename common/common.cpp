@@ -43,6 +43,7 @@
 #include <fcntl.h>
 #include <io.h>
 #else
+#include <dirent.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -776,6 +777,44 @@ bool fs_create_directory_with_parents(const std::string & path) {
 #endif // _WIN32
 }
 
+std::vector<std::string> fs_list_files(const std::string & path) {
+    std::vector<std::string> files;
+#ifdef _WIN32
+    std::wstring_convert<std::codecvt_utf8<wchar_t>> converter;
+    std::wstring wpath = converter.from_bytes(path);
+
+    WIN32_FIND_DATAW data;
+    HANDLE h = FindFirstFileW((wpath + L"\\*").c_str(), &data);
+    if (h == INVALID_HANDLE_VALUE) {
+        return files;
+    }
+
+    do {
+        if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+            files.push_back(converter.to_bytes(data.cFileName));
+        }
+    } while (FindNextFileW(h, &data));
+
+    FindClose(h);
+#else
+    DIR * dir = opendir(path.c_str());
+    if (dir == nullptr) {
+        return files;
+    }
+
+    while (const struct dirent * ent = readdir(dir)) {
+        struct stat info;
+        const std::string file = path + "/" + ent->d_name;
+        if (stat(file.c_str(), &info) == 0 && S_ISREG(info.st_mode)) {
+            files.push_back(ent->d_name);
+        }
+    }
+
+    closedir(dir);
+#endif // _WIN32
+    return files;
+}
+
 std::string fs_get_cache_directory() {
     std::string cache_directory = "";
     auto ensure_trailing_slash = [](std::string p) {
@@ -992,6 +1031,10 @@ struct llama_model_params llama_model_params_from_gpt_params(const gpt_params &
     mparams.use_mmap        = params.use_mmap;
     mparams.use_mlock       = params.use_mlock;
     mparams.check_tensors   = params.check_tensors;
+    mparams.n_load_threads  = params.n_load_threads;
+    mparams.repack          = params.repack;
+    mparams.warm_start      = params.warm_start;
+    mparams.hugepages       = params.hugepages;
     std::copy(std::begin(params.n_layer_window), std::end(params.n_layer_window), mparams.n_layer_window);
     if (params.kv_overrides.empty()) {
         mparams.kv_overrides = NULL;
@@ -1072,10 +1115,16 @@ struct llama_context_params llama_context_params_from_gpt_params(const gpt_param
     cparams.pooling_type      = params.pooling_type;
     cparams.attention_type    = params.attention_type;
     cparams.defrag_thold      = params.defrag_thold;
+    cparams.kv_block_size     = params.kv_block_size;
+    cparams.n_kv_window       = params.n_kv_window;
+    cparams.n_kv_sink         = params.n_kv_sink;
+    cparams.spin_us           = params.spin_us;
+    cparams.n_top_logits      = params.n_top_logits;
     cparams.cb_eval           = params.cb_eval;
     cparams.cb_eval_user_data = params.cb_eval_user_data;
     cparams.offload_kqv       = !params.no_kv_offload;
     cparams.flash_attn        = params.flash_attn;
+    cparams.fused_ops         = params.fused_ops;
     cparams.no_perf           = params.no_perf;
 
     if (params.reranking) {
@@ -1536,6 +1585,41 @@ std::vector<llama_token> llama_tokenize(
     return result;
 }
 
+std::vector<std::vector<llama_token>> llama_tokenize_batch(
+            const struct llama_model * model,
+      const std::vector<std::string> & texts,
+                                bool   add_special,
+                                bool   parse_special,
+                             int32_t   n_threads) {
+    std::vector<const char *> ptrs;
+    std::vector<int32_t>      lens;
+    ptrs.reserve(texts.size());
+    lens.reserve(texts.size());
+
+    // upper limit for the number of tokens
+    int n_tokens = 0;
+    for (const auto & text : texts) {
+        ptrs.push_back(text.data());
+        lens.push_back(text.length());
+        n_tokens += text.length() + 2 * add_special;
+    }
+
+    std::vector<llama_token> tokens(n_tokens);
+    std::vector<int32_t>     offsets(texts.size() + 1);
+    n_tokens = llama_tokenize_batch(model, ptrs.data(), lens.data(), texts.size(), tokens.data(), tokens.size(), offsets.data(), n_threads, add_special, parse_special);
+    if (n_tokens < 0) {
+        tokens.resize(-n_tokens);
+        int check = llama_tokenize_batch(model, ptrs.data(), lens.data(), texts.size(), tokens.data(), tokens.size(), offsets.data(), n_threads, add_special, parse_special);
+        GGML_ASSERT(check == -n_tokens);
+    }
+
+    std::vector<std::vector<llama_token>> result(texts.size());
+    for (size_t i = 0; i < texts.size(); ++i) {
+        result[i].assign(tokens.begin() + offsets[i], tokens.begin() + offsets[i + 1]);
+    }
+    return result;
+}
+
 std::string llama_token_to_piece(const struct llama_context * ctx, llama_token token, bool special) {
     std::string piece;
     piece.resize(piece.capacity());  // using string internal cache, 15 bytes + '\n'
@@ -2035,6 +2119,7 @@ void yaml_dump_non_result_info(FILE * stream, const gpt_params & params, const l
     fprintf(stream, "frequency_penalty: %f # default: 0.0 \n", sparams.penalty_freq);
     yaml_dump_string_multiline(stream, "grammar", sparams.grammar.c_str());
     fprintf(stream, "grammar-file: # never logged, see grammar instead. Can still be specified for input.\n");
+    fprintf(stream, "grammar_compiled: %s # default: false\n", sparams.grammar_compiled ? "true" : "false");
     fprintf(stream, "hellaswag: %s # default: false\n", params.hellaswag ? "true" : "false");
     fprintf(stream, "hellaswag_tasks: %zu # default: 400\n", params.hellaswag_tasks);
     fprintf(stream, "ignore_eos: %s # default: false\n", sparams.ignore_eos ? "true" : "false");
@@ -2075,6 +2160,7 @@ void yaml_dump_non_result_info(FILE * stream, const gpt_params & params, const l
     fprintf(stream, "model_draft: %s # default:\n", params.model_draft.c_str());
     fprintf(stream, "multiline_input: %s # default: false\n", params.multiline_input ? "true" : "false");
     fprintf(stream, "n_gpu_layers: %d # default: -1\n", params.n_gpu_layers);
+    fprintf(stream, "n_load_threads: %d # default: 0\n", params.n_load_threads);
     fprintf(stream, "n_predict: %d # default: -1 (unlimited)\n", params.n_predict);
     fprintf(stream, "n_probs: %d # only used by server binary, default: 0\n", sparams.n_probs);
     fprintf(stream, "no_mmap: %s # default: false\n", !params.use_mmap ? "true" : "false");
@@ -2087,6 +2173,9 @@ void yaml_dump_non_result_info(FILE * stream, const gpt_params & params, const l
     fprintf(stream, "prompt_cache_all: %s # default: false\n", params.prompt_cache_all ? "true" : "false");
     fprintf(stream, "prompt_cache_ro: %s # default: false\n", params.prompt_cache_ro ? "true" : "false");
     yaml_dump_vector_int(stream, "prompt_tokens", prompt_tokens);
+    fprintf(stream, "repack: %s # default: false\n", params.repack ? "true" : "false");
+    fprintf(stream, "warm_start: %s # default: false\n", params.warm_start ? "true" : "false");
+    fprintf(stream, "hugepages: %s # default: false\n", params.hugepages ? "true" : "false");
     fprintf(stream, "repeat_penalty: %f # default: 1.1\n", sparams.penalty_repeat);
 
     fprintf(stream, "reverse_prompt:\n");
@@ -2102,9 +2191,15 @@ void yaml_dump_non_result_info(FILE * stream, const gpt_params & params, const l
 
     fprintf(stream, "rope_freq_base: %f # default: 10000.0\n", params.rope_freq_base);
     fprintf(stream, "rope_freq_scale: %f # default: 1.0\n", params.rope_freq_scale);
+    fprintf(stream, "spin_us: %d # default: 0\n", params.spin_us);
+    fprintf(stream, "n_top_logits: %d # default: 0\n", params.n_top_logits);
+    fprintf(stream, "kv_block_size: %d # default: 0\n", params.kv_block_size);
+    fprintf(stream, "n_kv_window: %d # default: 0\n", params.n_kv_window);
+    fprintf(stream, "n_kv_sink: %d # default: 4\n", params.n_kv_sink);
     fprintf(stream, "simple_io: %s # default: false\n", params.simple_io ? "true" : "false");
     fprintf(stream, "cont_batching: %s # default: false\n", params.cont_batching ? "true" : "false");
     fprintf(stream, "flash_attn: %s # default: false\n", params.flash_attn ? "true" : "false");
+    fprintf(stream, "fused_ops: %s # default: false\n", params.fused_ops ? "true" : "false");
     fprintf(stream, "temp: %f # default: 0.8\n", sparams.temp);
 
     const std::vector<float> tensor_split_vector(params.tensor_split, params.tensor_split + llama_max_devices());
@@ -134,6 +134,7 @@ struct gpt_sampler_params {
     };
 
     std::string grammar; // optional BNF-like grammar to constrain sampling
+    bool grammar_compiled = false; // memoize the grammar token masks per grammar state
 
     std::vector<llama_logit_bias> logit_bias; // logit biases to apply
 
@@ -160,6 +161,7 @@ struct gpt_params {
     float   p_split               =  0.1f; // speculative decoding split probability
     int32_t n_gpu_layers          =    -1; // number of layers to store in VRAM (-1 - use default)
     int32_t n_gpu_layers_draft    =    -1; // number of layers to store in VRAM for the draft model (-1 - use default)
+    int32_t n_load_threads        =     0; // number of threads reading the model without mmap (0 - auto)
     int32_t main_gpu              =     0; // the GPU that is used for scratch and small tensors
     float   tensor_split[128]     =   {0}; // how split tensors should be distributed across GPUs
     int32_t grp_attn_n            =     1; // group-attention factor
@@ -173,6 +175,11 @@ struct gpt_params {
     float   yarn_beta_slow        =  1.0f; // YaRN high correction dim
     int32_t yarn_orig_ctx         =     0; // YaRN original context length
     float   defrag_thold          = -1.0f; // KV cache defragmentation threshold
+    int32_t kv_block_size         =     0; // cells per KV cache block (0 = contiguous KV cache)
+    int32_t n_kv_window           =     0; // last tokens of a sequence kept in the KV cache (0 = no eviction)
+    int32_t n_kv_sink             =     4; // first tokens of a sequence kept in the KV cache as attention sinks
+    int32_t spin_us               =     0; // threadpool spin budget between sub-graphs in us (0 = off, -1 = whole decode step)
+    int32_t n_top_logits          =     0; // only keep the top logits of each output (0 = full logits)
 
     struct cpu_params cpuparams;
     struct cpu_params cpuparams_batch;
@@ -250,6 +257,7 @@ struct gpt_params {
     bool simple_io         = false; // improves compatibility with subprocesses and limited consoles
     bool cont_batching     = true;  // insert new sequences for decoding on-the-fly
     bool flash_attn        = false; // flash attention
+    bool fused_ops         = false; // fused CPU kernels for norm + QKV and SwiGLU FFN
     bool no_perf           = false; // disable performance metrics
     bool ctx_shift         = true;  // context shift on inifinite text generation
 
@@ -263,6 +271,9 @@ struct gpt_params {
     bool no_kv_offload     = false; // disable KV offloading
     bool warmup            = true;  // warmup run
     bool check_tensors     = false; // validate tensor data
+    bool repack            = false; // repack Q4_0 weights into the interleaved layout for this CPU
+    bool warm_start        = false; // restore the derived vocab from the <model>.warm snapshot
+    bool hugepages         = false; // back the model weights with transparent huge pages
 
     std::string cache_type_k = "f16"; // KV cache data type for the K
     std::string cache_type_v = "f16"; // KV cache data type for the V
@@ -304,6 +315,16 @@ struct gpt_params {
 
     float slot_prompt_similarity = 0.5f;
 
+    int32_t n_prefill_chunk = 0; // max prompt tokens per batch while other slots are generating (0 = n_batch)
+
+    int32_t n_prefix_cache = 0; // max number of KV prefixes shared across slots (0 = disabled)
+
+    std::string prefix_cache_dir;             // directory of the on-disk tier of the prefix cache (empty = disabled)
+    int32_t     prefix_cache_dir_size = 4096; // size limit of the on-disk tier in MiB
+
+    int32_t n_lookup_draft     = 0;       // max tokens drafted from the n-gram caches per slot and step (0 = disabled)
+    int32_t n_lookup_cache_max = 1000000; // max n-grams kept in the dynamic n-gram cache of the finished generations
+
     // batched-bench params
     bool is_pp_shared = false;
 
@@ -398,6 +419,7 @@ std::string string_from(const struct llama_context * ctx, const struct llama_bat
 
 bool fs_validate_filename(const std::string & filename);
 bool fs_create_directory_with_parents(const std::string & path);
+std::vector<std::string> fs_list_files(const std::string & path); // names of the regular files in a directory
 
 std::string fs_get_cache_directory();
 std::string fs_get_cache_file(const std::string & filename);
@@ -453,6 +475,14 @@ std::vector<llama_token> llama_tokenize(
                         bool   add_special,
                         bool   parse_special = false);
 
+// tokenizes several strings at once with llama_tokenize_batch (n_threads <= 0 - all cores)
+std::vector<std::vector<llama_token>> llama_tokenize_batch(
+            const struct llama_model * model,
+      const std::vector<std::string> & texts,
+                                bool   add_special,
+                                bool   parse_special = false,
+                             int32_t   n_threads = 0);
+
 // tokenizes a token into a piece, optionally renders special/control tokens
 // should work similar to Python's `tokenizer.id_to_piece`
 std::string llama_token_to_piece(
@@ -2,6 +2,7 @@
 #include "common.h"
 #include "log.h"
 
+#include <algorithm>
 #include <cinttypes>
 #include <cstdint>
 #include <cstdio>
@@ -191,7 +192,7 @@ void llama_ngram_cache_draft(
             break;
         }
 
-        LOG(" - draft candidate: token=%d\n", drafted_token);
+        LOG_DBG(" - draft candidate: token=%d\n", drafted_token);
         draft.push_back(drafted_token);
     }
 }
@@ -283,3 +284,30 @@ void llama_ngram_cache_merge(llama_ngram_cache & ngram_cache_target, llama_ngram
         }
     }
 }
+
+void llama_ngram_cache_prune(llama_ngram_cache & ngram_cache, size_t n_max) {
+    if (ngram_cache.size() <= n_max) {
+        return;
+    }
+
+    std::vector<std::pair<int64_t, llama_ngram_cache::iterator>> ngram_counts;
+    ngram_counts.reserve(ngram_cache.size());
+
+    for (llama_ngram_cache::iterator it = ngram_cache.begin(); it != ngram_cache.end(); ++it) {
+        int64_t count_sum = 0;
+        for (const std::pair<llama_token, int32_t> token_count : it->second) {
+            count_sum += token_count.second;
+        }
+        ngram_counts.emplace_back(count_sum, it);
+    }
+
+    // move the n_max most frequent ngrams to the front, erasing an element does not invalidate the other iterators
+    std::nth_element(ngram_counts.begin(), ngram_counts.begin() + n_max, ngram_counts.end(),
+        [](const std::pair<int64_t, llama_ngram_cache::iterator> & a, const std::pair<int64_t, llama_ngram_cache::iterator> & b) {
+            return a.first > b.first;
+        });
+
+    for (size_t i = n_max; i < ngram_counts.size(); ++i) {
+        ngram_cache.erase(ngram_counts[i].second);
+    }
+}
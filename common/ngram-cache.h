@@ -99,3 +99,8 @@ llama_ngram_cache llama_ngram_cache_load(std::string & filename);
 // ngram_cache_target: the ngram cache to which to add the information from ngram_cache_add.
 // ngram_cache_add:    the ngram cache to add to ngram_cache_target.
 void llama_ngram_cache_merge(llama_ngram_cache & ngram_cache_target, llama_ngram_cache & ngram_cache_add);
+
+// Prune an ngram cache to its most frequent ngrams.
+// ngram_cache: the ngram cache to prune.
+// n_max:       the maximum number of ngrams to keep, the ngrams with the lowest total count are removed first.
+void llama_ngram_cache_prune(llama_ngram_cache & ngram_cache, size_t n_max);
@@ -2,7 +2,12 @@
 
 #include "common.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <exception>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
 
 // the ring buffer works similarly to std::deque, but with a fixed capacity
@@ -108,13 +113,12 @@ struct gpt_sampler {
 
     std::vector<llama_token_data> cur;
 
-    llama_token_data_array cur_p;
-
-    void set_logits(struct llama_context * ctx, int idx) {
-        const auto * logits = llama_get_logits_ith(ctx, idx);
+    // candidates of the current output when the context only keeps the top logits
+    std::vector<llama_token_data> top;
 
-        const int n_vocab = llama_n_vocab(llama_get_model(ctx));
+    llama_token_data_array cur_p;
 
+    void set_logits(const float * logits, int n_vocab) {
         cur.resize(n_vocab);
 
         for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
@@ -123,6 +127,21 @@ struct gpt_sampler {
 
         cur_p = { cur.data(), cur.size(), -1, false };
     }
+
+    void set_top() {
+        cur = top;
+
+        cur_p = { cur.data(), cur.size(), -1, true };
+    }
+
+    // apply the chain straight to the logits - only the candidates that survive top-k are materialized
+    void apply_chain(const float * logits, int n_vocab) {
+        cur.resize(n_vocab);
+
+        cur_p = { cur.data(), cur.size(), -1, false };
+
+        llama_sampler_chain_apply_logits(chain, logits, n_vocab, &cur_p);
+    }
 };
 
 std::string gpt_sampler_params::print() const {
@@ -146,10 +165,12 @@ struct gpt_sampler * gpt_sampler_init(const struct llama_model * model, const st
 
     auto * result = new gpt_sampler {
         /* .params = */ params,
-        /* .grmr   = */ llama_sampler_init_grammar(model, params.grammar.c_str(), "root"),
+        /* .grmr   = */ params.grammar_compiled ? llama_sampler_init_grammar_compiled(model, params.grammar.c_str(), "root")
+                                            : llama_sampler_init_grammar         (model, params.grammar.c_str(), "root"),
         /* .chain  = */ llama_sampler_chain_init(lparams),
         /* .prev   = */ ring_buffer<llama_token>(std::max(32, params.n_prev)),
         /* .cur    = */ {},
+        /* .top    = */ {},
         /* .cur_p  = */ {},
     };
 
@@ -257,6 +278,7 @@ struct gpt_sampler * gpt_sampler_clone(gpt_sampler * gsmpl) {
         /* .chain  = */ llama_sampler_clone(gsmpl->chain),
         /* .prev   = */ gsmpl->prev,
         /* .cur    = */ gsmpl->cur,
+        /* .top    = */ gsmpl->top,
         /* .cur_p  = */ gsmpl->cur_p,
     };
 }
@@ -272,18 +294,26 @@ void gpt_perf_print(const struct llama_context * ctx, const struct gpt_sampler *
     }
 }
 
-llama_token gpt_sampler_sample(struct gpt_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first) {
-    gsmpl->set_logits(ctx, idx);
-
+static llama_token gpt_sampler_sample_logits(struct gpt_sampler * gsmpl, const float * logits, int n_vocab, bool grammar_first) {
     auto & grmr  = gsmpl->grmr;
     auto & chain = gsmpl->chain;
-    auto & cur_p = gsmpl->cur_p; // initialized by set_logits
+    auto & cur_p = gsmpl->cur_p; // initialized by set_logits / set_top / apply_chain
 
-    if (grammar_first) {
-        llama_sampler_apply(grmr, &cur_p);
-    }
+    // logits == nullptr: the context only keeps the top logits, the candidates are in gsmpl->top
+    if (grammar_first || logits == nullptr) {
+        if (logits == nullptr) {
+            gsmpl->set_top();
+        } else {
+            gsmpl->set_logits(logits, n_vocab);
+        }
 
-    llama_sampler_apply(chain, &cur_p);
+        if (grammar_first) {
+            llama_sampler_apply(grmr, &cur_p);
+        }
+        llama_sampler_apply(chain, &cur_p);
+    } else {
+        gsmpl->apply_chain(logits, n_vocab);
+    }
 
     GGML_ASSERT(cur_p.selected != -1 && "no selected token during sampling - check your sampling configuration");
 
@@ -308,7 +338,11 @@ llama_token gpt_sampler_sample(struct gpt_sampler * gsmpl, struct llama_context
 
     // resampling:
     // if the token is not valid, sample again, but first apply the grammar sampler and then the sampling chain
-    gsmpl->set_logits(ctx, idx);
+    if (logits == nullptr) {
+        gsmpl->set_top();
+    } else {
+        gsmpl->set_logits(logits, n_vocab);
+    }
 
     llama_sampler_apply(grmr,  &cur_p);
     llama_sampler_apply(chain, &cur_p);
@@ -318,6 +352,96 @@ llama_token gpt_sampler_sample(struct gpt_sampler * gsmpl, struct llama_context
     return cur_p.data[cur_p.selected].id;
 }
 
+// returns the logits of output idx, or nullptr after copying its candidates into gsmpl->top
+// when the context only keeps the top logits of each output
+static const float * gpt_sampler_fetch_logits(struct gpt_sampler * gsmpl, struct llama_context * ctx, int idx) {
+    const int n_top = llama_n_top_logits(ctx);
+    if (n_top <= 0) {
+        return llama_get_logits_ith(ctx, idx);
+    }
+
+    gsmpl->top.resize(n_top);
+
+    const int n = llama_get_logits_top_ith(ctx, idx, gsmpl->top.data(), n_top);
+    GGML_ASSERT(n >= 0 && "failed to get the top logits");
+
+    gsmpl->top.resize(n);
+
+    return nullptr;
+}
+
+llama_token gpt_sampler_sample(struct gpt_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first) {
+    const auto * logits = gpt_sampler_fetch_logits(gsmpl, ctx, idx);
+
+    const int n_vocab = llama_n_vocab(llama_get_model(ctx));
+
+    return gpt_sampler_sample_logits(gsmpl, logits, n_vocab, grammar_first);
+}
+
+std::vector<llama_token> gpt_sampler_sample_batch(
+        const std::vector<struct gpt_sampler *> & gsmpls,
+        struct llama_context * ctx,
+        const std::vector<int> & idxs,
+        bool grammar_first,
+        int n_threads) {
+    GGML_ASSERT(gsmpls.size() == idxs.size());
+
+    const int n = gsmpls.size();
+
+    const int n_vocab = llama_n_vocab(llama_get_model(ctx));
+
+    if (n_threads <= 0) {
+        n_threads = llama_n_threads(ctx);
+    }
+
+    // fetching the logits synchronizes the context - resolve the outputs on this thread
+    std::vector<const float *> logits(n);
+    for (int i = 0; i < n; ++i) {
+        logits[i] = gpt_sampler_fetch_logits(gsmpls[i], ctx, idxs[i]);
+    }
+
+    std::vector<llama_token> result(n);
+
+    n_threads = std::max(1, std::min(n_threads, n));
+
+    // the calling thread takes part, the first exception stops the remaining sequences and is rethrown here
+    std::atomic<int> next{0};
+    std::exception_ptr error;
+    std::mutex mutex_error;
+
+    auto work = [&]() {
+        try {
+            for (int i = next++; i < n; i = next++) {
+                result[i] = gpt_sampler_sample_logits(gsmpls[i], logits[i], n_vocab, grammar_first);
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex_error);
+            if (!error) {
+                error = std::current_exception();
+            }
+            next = n;
+        }
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(n_threads - 1);
+    for (int i = 1; i < n_threads; ++i) {
+        workers.emplace_back(work);
+    }
+
+    work();
+
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    return result;
+}
+
 uint32_t gpt_sampler_get_seed(const struct gpt_sampler * gsmpl) {
     return llama_sampler_get_seed(gsmpl->chain);
 }
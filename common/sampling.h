@@ -60,6 +60,19 @@ void gpt_perf_print(const struct llama_context * ctx, const struct gpt_sampler *
 //
 llama_token gpt_sampler_sample(struct gpt_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first = false);
 
+// sample several sequences at once, e.g. one per sequence after a batched llama_decode:
+//
+//   result[i] = gpt_sampler_sample(gsmpls[i], ctx, idxs[i], grammar_first)
+//
+// the samplers must be distinct objects - they run in parallel on up to n_threads threads (0 - the threads of the context)
+//
+std::vector<llama_token> gpt_sampler_sample_batch(
+        const std::vector<struct gpt_sampler *> & gsmpls,
+        struct llama_context * ctx,
+        const std::vector<int> & idxs,
+        bool grammar_first = false,
+        int n_threads = 0);
+
 uint32_t gpt_sampler_get_seed(const struct gpt_sampler * gsmpl);
 
 // helpers
@@ -316,7 +316,8 @@ int main(int argc, char ** argv) {
         }
 
         // tokenize negative prompt
-        if ((int) embd_inp.size() > n_ctx - 4) {
+        // with a KV window the old tokens are evicted while the prompt is evaluated, so it may exceed the context
+        if (params.n_kv_window == 0 && (int) embd_inp.size() > n_ctx - 4) {
             LOG_ERR("%s: prompt is too long (%d tokens, max %d)\n", __func__, (int) embd_inp.size(), n_ctx - 4);
             return 1;
         }
@@ -556,7 +557,8 @@ int main(int argc, char ** argv) {
             int max_embd_size = n_ctx - 4;
 
             // Ensure the input doesn't exceed the context size by truncating embd if necessary.
-            if ((int) embd.size() > max_embd_size) {
+            // A KV window evicts the old tokens instead, the input is evaluated in full.
+            if (params.n_kv_window == 0 && (int) embd.size() > max_embd_size) {
                 const int skipped_tokens = (int) embd.size() - max_embd_size;
                 embd.resize(max_embd_size);
 
@@ -570,8 +572,9 @@ int main(int argc, char ** argv) {
                 // if we run out of context:
                 // - take the n_keep first tokens from the original prompt (via n_past)
                 // - take half of the last (n_ctx - n_keep) tokens and recompute the logits in batches
+                // (with a KV window the context never runs out, the old tokens are evicted by llama_decode)
 
-                if (n_past + (int) embd.size() >= n_ctx) {
+                if (params.n_kv_window == 0 && n_past + (int) embd.size() >= n_ctx) {
                     if (!params.ctx_shift){
                         LOG_DBG("\n\n%s: context full and context shift is disabled => stopping\n", __func__);
                         break;
@@ -647,10 +650,13 @@ int main(int argc, char ** argv) {
             }
 
             if (my_rank == 0) {
-                for (int i = 0; i < (int) embd.size(); i += params.n_batch) {
+                // llama_decode evaluates a single ubatch, and with a KV window the input can exceed the context
+                const int n_batch = llama_n_ubatch(ctx);
+
+                for (int i = 0; i < (int) embd.size(); i += n_batch) {
                     int n_eval = (int) embd.size() - i;
-                    if (n_eval > params.n_batch) {
-                        n_eval = params.n_batch;
+                    if (n_eval > n_batch) {
+                        n_eval = n_batch;
                     }
                     if (llama_decode(ctx, llama_batch_get_one(&embd[i], n_eval, n_past, 0)) != 0) {
                         LOG_ERR("%s : failed to eval\n", __func__);
@@ -332,15 +332,30 @@ int main(int argc, char ** argv) {
 
             LOG_DBG("%s : decoded batch of %d tokens\n", __func__, n_tokens);
 
+            // sample the clients that have an output in this part of the batch in parallel
+            std::vector<client *>      clients_cur;
+            std::vector<gpt_sampler *> smpls_cur;
+            std::vector<int>           idxs_cur;
+
             for (auto & client : clients) {
                 if (client.i_batch < (int) i || client.i_batch >= (int) (i + n_tokens)) {
                     continue;
                 }
 
+                clients_cur.push_back(&client);
+                smpls_cur.push_back(client.smpl);
+                idxs_cur.push_back(client.i_batch - i);
+            }
+
+            const std::vector<llama_token> ids = gpt_sampler_sample_batch(smpls_cur, ctx, idxs_cur);
+
+            for (size_t j = 0; j < clients_cur.size(); ++j) {
+                auto & client = *clients_cur[j];
+
                 //printf("client %d, seq %d, token %d, pos %d, batch %d\n",
                 //        client.id, client.seq_id, client.sampled, client.n_decoded, client.i_batch);
 
-                const llama_token id = gpt_sampler_sample(client.smpl, ctx, client.i_batch - i);
+                const llama_token id = ids[j];
 
                 gpt_sampler_accept(client.smpl, id, true);
 
@@ -184,8 +184,15 @@ int main(int argc, char ** argv) {
     GGML_ASSERT(params.n_batch >= params.n_ctx);
 
     // tokenize the prompts and trim
-    for (auto & chunk : chunks) {
-        auto inp = ::llama_tokenize(ctx, chunk.textdata, true, false);
+    std::vector<std::string> texts;
+    texts.reserve(chunks.size());
+    for (const auto & chunk : chunks) {
+        texts.push_back(chunk.textdata);
+    }
+    auto inputs = ::llama_tokenize_batch(model, texts, true, false, params.cpuparams_batch.n_threads);
+    for (size_t i = 0; i < chunks.size(); i++) {
+        auto & chunk = chunks[i];
+        auto & inp   = inputs[i];
         if (inp.size() > n_batch) {
             LOG_ERR("%s: chunk size (%lld) exceeds batch size (%lld), increase batch size and re-run\n",
                     __func__, (long long int) inp.size(), (long long int) n_batch);
@@ -195,7 +202,7 @@ int main(int argc, char ** argv) {
         if (llama_token_eos(model) >= 0 && (inp.empty() || inp.back() != llama_token_eos(model))) {
             inp.push_back(llama_token_eos(model));
         }
-        chunk.tokens = inp;
+        chunk.tokens = std::move(inp);
     }
 
     // tokenization stats
@@ -3,6 +3,7 @@
 #include "arg.h"
 #include "common.h"
 #include "log.h"
+#include "ngram-cache.h"
 #include "sampling.h"
 #include "json-schema-to-grammar.h"
 #include "llama.h"
@@ -31,11 +32,15 @@
 #include "json-schema-to-grammar.mjs.hpp"
 #include "loading.html.hpp"
 
+#include <array>
 #include <atomic>
 #include <condition_variable>
 #include <cstddef>
 #include <cinttypes>
 #include <deque>
+#include <fstream>
+#include <future>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <signal.h>
@@ -105,6 +110,23 @@ struct server_task {
 
     server_task_cmpl_type cmpl_type = SERVER_TASK_CMPL_TYPE_NORMAL;
 
+    // scheduling
+    int32_t priority   = 0;  // tasks with a higher priority are started first
+    int64_t t_deadline = -1; // time by which the task must have started, -1 = none
+    int64_t t_posted   = -1; // set by server_queue
+
+    // whether this task should be started before other
+    bool before(const server_task & other) const {
+        if (priority != other.priority) {
+            return priority > other.priority;
+        }
+        if (t_deadline != other.t_deadline) {
+            // earliest deadline first, tasks without a deadline last
+            return other.t_deadline < 0 || (t_deadline >= 0 && t_deadline < other.t_deadline);
+        }
+        return id < other.id;
+    }
+
     // utility function
     static std::unordered_set<int> get_list_id(const std::vector<server_task> & tasks) {
         std::unordered_set<int> ids(tasks.size());
@@ -122,6 +144,12 @@ struct server_task_result {
 
     bool stop;
     bool error;
+
+    // partial result of a plain completion stream, sent without building data (see server_sent_event_partial)
+    bool        partial = false;
+    std::string content;
+    int         id_slot = -1;
+    size_t      index   = 0;
 };
 
 struct slot_params {
@@ -131,6 +159,7 @@ struct slot_params {
     int32_t  n_keep    =  0; // number of tokens to keep from initial prompt
     int32_t  n_discard =  0; // number of tokens after n_keep that may be discarded when shifting context, 0 defaults to half
     int32_t  n_predict = -1; // new tokens to predict
+    int32_t  n_draft   =  0; // max tokens drafted from the n-gram caches per step (0 = disabled)
 
     std::vector<std::string> antiprompt;
 
@@ -172,8 +201,18 @@ struct server_slot {
     std::vector<llama_token> cache_tokens;
     std::vector<completion_token_output> generated_token_probs;
 
+    int id_prefix = -1; // node of the shared prefix cache the slot is attached to
+
+    // state of a prefix being read from the disk tier of the prefix cache
+    std::shared_future<std::vector<uint8_t>> prefix_load;
+    int32_t n_prefix_load = 0;
+
     server_task_cmpl_type cmpl_type = SERVER_TASK_CMPL_TYPE_NORMAL;
 
+    // scheduling of the prompt processing, copied from the task
+    int32_t priority   = 0;
+    int64_t t_deadline = -1;
+
     bool has_next_token = true;
     bool truncated      = false;
     bool stopped_eos    = false;
@@ -199,10 +238,20 @@ struct server_slot {
 
     int32_t n_past_se = 0; // self-extend
 
+    // lookup decoding: n-gram cache of the prompt and the generated tokens, and the tokens drafted for the current step
+    llama_ngram_cache        ngram_cache;
+    std::vector<llama_token> ngram_tokens;
+    std::vector<llama_token> draft;
+
+    int32_t i_batch_draft = -1;
+
     // stats
     size_t n_sent_text = 0; // number of sent text character
     size_t n_sent_token_probs = 0;
 
+    int32_t n_drafted        = 0;
+    int32_t n_draft_accepted = 0;
+
     int64_t t_start_process_prompt;
     int64_t t_start_generation;
 
@@ -227,8 +276,13 @@ struct server_slot {
         cmpl_type          = SERVER_TASK_CMPL_TYPE_NORMAL;
         ga_i               = 0;
         n_past_se          = 0;
+        n_drafted          = 0;
+        n_draft_accepted   = 0;
 
         generated_token_probs.clear();
+        ngram_cache.clear();
+        ngram_tokens.clear();
+        draft.clear();
     }
 
     bool has_budget(gpt_params &global_params) {
@@ -280,6 +334,9 @@ struct server_slot {
             {"predicted_ms",           t_token_generation},
             {"predicted_per_token_ms", t_token_generation / n_decoded},
             {"predicted_per_second",   1e3 / t_token_generation * n_decoded},
+
+            {"drafted_n",              n_drafted},
+            {"drafted_accepted_n",     n_draft_accepted},
         };
     }
 
@@ -326,6 +383,10 @@ struct server_slot {
                 t_prompt_processing, n_prompt_tokens_processed, t_prompt, n_prompt_second,
                 t_token_generation, n_decoded, t_gen, n_gen_second,
                 t_prompt_processing + t_token_generation, n_prompt_tokens_processed + n_decoded);
+
+        if (n_drafted > 0) {
+            SLT_INF(*this, "draft acceptance = %.2f%% (%d accepted / %d drafted)\n", 100.0 * n_draft_accepted / n_drafted, n_draft_accepted, n_drafted);
+        }
     }
 };
 
@@ -346,6 +407,14 @@ struct server_metrics {
     uint64_t n_decode_total     = 0;
     uint64_t n_busy_slots_total = 0;
 
+    uint64_t n_draft_total          = 0;
+    uint64_t n_draft_accepted_total = 0;
+
+    uint64_t n_tasks_started_total           = 0;
+    uint64_t t_tasks_wait_total              = 0; // us from posting a task until it started
+    uint64_t t_tasks_wait_max                = 0;
+    uint64_t n_tasks_deadline_exceeded_total = 0;
+
     void init() {
         t_start = ggml_time_us();
     }
@@ -362,6 +431,16 @@ struct server_metrics {
         n_tokens_predicted         += slot.n_decoded;
         t_tokens_generation        += slot.t_token_generation;
         t_tokens_generation_total  += slot.t_token_generation;
+        n_draft_total              += slot.n_drafted;
+        n_draft_accepted_total     += slot.n_draft_accepted;
+    }
+
+    void on_task_started(const server_task & task) {
+        const uint64_t t_wait = task.t_posted >= 0 ? ggml_time_us() - task.t_posted : 0;
+
+        n_tasks_started_total++;
+        t_tasks_wait_total += t_wait;
+        t_tasks_wait_max    = std::max(t_tasks_wait_max, t_wait);
     }
 
     void on_decoded(const std::vector<server_slot> & slots) {
@@ -378,71 +457,144 @@ struct server_metrics {
         t_prompt_processing       = 0;
         n_tokens_predicted        = 0;
         t_tokens_generation       = 0;
+        t_tasks_wait_max          = 0;
+    }
+};
+
+// unbounded multi-producer single-consumer queue, push() and try_pop() are lock-free
+// the consumer can block in wait(), producers only take the lock to wake it up when it is asleep
+template<typename T>
+struct server_mpsc_queue {
+    struct node {
+        std::atomic<node *> next = { nullptr };
+        T value;
+    };
+
+    std::atomic<node *> head; // last pushed node, shared by the producers
+    node *              tail; // already consumed node, owned by the consumer
+
+    std::atomic<bool>       sleeping = { false };
+    std::mutex              mutex;
+    std::condition_variable condition;
+
+    server_mpsc_queue() {
+        tail = new node();
+        head.store(tail);
+    }
+
+    ~server_mpsc_queue() {
+        T value;
+        while (try_pop(value)) {}
+        delete tail;
+    }
+
+    server_mpsc_queue(const server_mpsc_queue &) = delete;
+    server_mpsc_queue & operator=(const server_mpsc_queue &) = delete;
+
+    void push(T value) {
+        node * n = new node();
+        n->value = std::move(value);
+
+        node * prev = head.exchange(n, std::memory_order_acq_rel);
+        prev->next.store(n, std::memory_order_seq_cst);
+
+        if (sleeping.load(std::memory_order_seq_cst)) {
+            notify();
+        }
+    }
+
+    // consumer only
+    bool try_pop(T & value) {
+        node * next = tail->next.load(std::memory_order_acquire);
+        if (next == nullptr) {
+            return false;
+        }
+
+        value = std::move(next->value);
+
+        delete tail;
+        tail = next;
+
+        return true;
+    }
+
+    // consumer only
+    bool empty() const {
+        return tail->next.load(std::memory_order_seq_cst) == nullptr;
+    }
+
+    // consumer only, block until the queue is not empty or stop() is true
+    template<typename F>
+    void wait(F stop) {
+        std::unique_lock<std::mutex> lock(mutex);
+        sleeping.store(true, std::memory_order_seq_cst);
+        condition.wait(lock, [&]{
+            return !empty() || stop();
+        });
+        sleeping.store(false, std::memory_order_relaxed);
+    }
+
+    void notify() {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.notify_one();
     }
 };
 
 struct server_queue {
-    int id = 0;
-    bool running;
+    std::atomic<int>  id      = { 0 };
+    std::atomic<bool> running = { false };
+
+    struct posted_task {
+        server_task task;
+        bool        front = false;
+    };
+
+    // tasks posted by any thread, consumed by the main loop
+    server_mpsc_queue<posted_task> queue_posted;
 
-    // queues
+    // queues, only accessed by the main loop
     std::deque<server_task> queue_tasks;
     std::deque<server_task> queue_tasks_deferred;
 
-    std::mutex mutex_tasks;
-    std::condition_variable condition_tasks;
-
     // callback functions
     std::function<void(server_task&)> callback_new_task;
     std::function<void(void)>         callback_update_slots;
 
     // Add a new task to the end of the queue
     int post(server_task task, bool front = false) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
         if (task.id == -1) {
             task.id = id++;
         }
+        task.t_posted = ggml_time_us();
         QUE_DBG("new task, id = %d, front = %d\n", task.id, front);
-        if (front) {
-            queue_tasks.push_front(std::move(task));
-        } else {
-            queue_tasks.push_back(std::move(task));
-        }
-        condition_tasks.notify_one();
-        return task.id;
+        const int id_task = task.id;
+        queue_posted.push({ std::move(task), front });
+        return id_task;
     }
 
     // multi-task version of post()
     int post(std::vector<server_task> & tasks, bool front = false) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
+        const int64_t t_posted = ggml_time_us();
         for (auto & task : tasks) {
             if (task.id == -1) {
                 task.id = id++;
             }
+            task.t_posted = t_posted;
             QUE_DBG("new task, id = %d/%d, front = %d\n", task.id, (int) tasks.size(), front);
-            if (front) {
-                queue_tasks.push_front(std::move(task));
-            } else {
-                queue_tasks.push_back(std::move(task));
-            }
+            queue_posted.push({ std::move(task), front });
         }
-        condition_tasks.notify_one();
         return 0;
     }
 
     // Add a new task, but defer until one slot is available
     void defer(server_task task) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
         QUE_DBG("defer task, id = %d\n", task.id);
         queue_tasks_deferred.push_back(std::move(task));
-        condition_tasks.notify_one();
     }
 
     // Get the next id for creating a new task
     int get_new_id() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        int new_id = id++;
-        return new_id;
+        return id++;
     }
 
     // Register function to process a new task
@@ -455,21 +607,28 @@ struct server_queue {
         callback_update_slots = std::move(callback);
     }
 
-    // Call when the state of one slot is changed, it will move one task from deferred to main queue
+    // Call when the state of one slot is changed, it will move the first deferred task by priority and deadline to main queue
     void pop_deferred_task() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
         if (!queue_tasks_deferred.empty()) {
-            queue_tasks.emplace_back(std::move(queue_tasks_deferred.front()));
-            queue_tasks_deferred.pop_front();
+            auto it_next = queue_tasks_deferred.begin();
+            for (auto it = queue_tasks_deferred.begin(); it != queue_tasks_deferred.end(); ++it) {
+                if (it->before(*it_next)) {
+                    it_next = it;
+                }
+            }
+            queue_tasks.emplace_back(std::move(*it_next));
+            queue_tasks_deferred.erase(it_next);
         }
-        condition_tasks.notify_one();
+    }
+
+    size_t n_deferred() const {
+        return queue_tasks_deferred.size();
     }
 
     // end the start_loop routine
     void terminate() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
         running = false;
-        condition_tasks.notify_all();
+        queue_posted.notify();
     }
 
     /**
@@ -486,14 +645,22 @@ struct server_queue {
             QUE_DBG("%s", "processing new tasks\n");
 
             while (true) {
-                std::unique_lock<std::mutex> lock(mutex_tasks);
+                // move the posted tasks to the main queue
+                posted_task posted;
+                size_t n_front = 0;
+                while (queue_posted.try_pop(posted)) {
+                    if (posted.front) {
+                        queue_tasks.insert(queue_tasks.begin() + n_front++, std::move(posted.task));
+                    } else {
+                        queue_tasks.push_back(std::move(posted.task));
+                    }
+                }
+
                 if (queue_tasks.empty()) {
-                    lock.unlock();
                     break;
                 }
-                server_task task = queue_tasks.front();
+                server_task task = std::move(queue_tasks.front());
                 queue_tasks.pop_front();
-                lock.unlock();
 
                 QUE_DBG("processing task, id = %d\n", task.id);
                 callback_new_task(task);
@@ -505,84 +672,106 @@ struct server_queue {
             callback_update_slots();
 
             QUE_DBG("%s", "waiting for new tasks\n");
-            {
-                std::unique_lock<std::mutex> lock(mutex_tasks);
-                if (queue_tasks.empty()) {
-                    if (!running) {
-                        QUE_DBG("%s", "terminate\n");
-                        return;
-                    }
-                    condition_tasks.wait(lock, [&]{
-                        return (!queue_tasks.empty() || !running);
-                    });
+            if (queue_tasks.empty() && queue_posted.empty()) {
+                if (!running) {
+                    QUE_DBG("%s", "terminate\n");
+                    return;
                 }
+                queue_posted.wait([&]{
+                    return !running;
+                });
             }
         }
     }
 };
 
 struct server_response {
-    // for keeping track of all tasks waiting for the result
-    std::unordered_set<int> waiting_task_ids;
+    // results of the tasks of one request, sent by the main loop and received by the thread of the request
+    using channel = server_mpsc_queue<server_task_result>;
+
+    // waiting task id -> channel of its request
+    // sharded so that concurrent requests do not contend on a single lock, sending a result is a lookup and a lock-free push
+    struct shard {
+        std::mutex mutex;
+        std::unordered_map<int, std::shared_ptr<channel>> channels;
+    };
 
-    // the main result queue
-    std::vector<server_task_result> queue_results;
+    std::array<shard, 64> shards;
 
-    std::mutex mutex_results;
-    std::condition_variable condition_results;
+    shard & get_shard(int id_task) {
+        return shards[(uint32_t) id_task % shards.size()];
+    }
 
     // add the id_task to the list of tasks waiting for response
     void add_waiting_task_id(int id_task) {
-        SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", id_task, (int) waiting_task_ids.size());
+        SRV_DBG("add task %d to waiting list\n", id_task);
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.insert(id_task);
+        shard & s = get_shard(id_task);
+        std::unique_lock<std::mutex> lock(s.mutex);
+        s.channels[id_task] = std::make_shared<channel>();
     }
 
+    // the tasks share one channel
     void add_waiting_tasks(const std::vector<server_task> & tasks) {
-        std::unique_lock<std::mutex> lock(mutex_results);
+        const auto ch = std::make_shared<channel>();
 
         for (const auto & task : tasks) {
-            SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", task.id, (int) waiting_task_ids.size());
-            waiting_task_ids.insert(task.id);
+            SRV_DBG("add task %d to waiting list\n", task.id);
+
+            shard & s = get_shard(task.id);
+            std::unique_lock<std::mutex> lock(s.mutex);
+            s.channels[task.id] = ch;
         }
     }
 
     // when the request is finished, we can remove task associated with it
     void remove_waiting_task_id(int id_task) {
-        SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
+        SRV_DBG("remove task %d from waiting list\n", id_task);
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.erase(id_task);
+        shard & s = get_shard(id_task);
+        std::unique_lock<std::mutex> lock(s.mutex);
+        s.channels.erase(id_task);
     }
 
     void remove_waiting_task_ids(const std::unordered_set<int> & id_tasks) {
-        std::unique_lock<std::mutex> lock(mutex_results);
-
         for (const auto & id_task : id_tasks) {
-            SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
-            waiting_task_ids.erase(id_task);
+            remove_waiting_task_id(id_task);
         }
     }
 
-    // This function blocks the thread until there is a response for one of the id_tasks
-    server_task_result recv(const std::unordered_set<int> & id_tasks) {
-        while (true) {
-            std::unique_lock<std::mutex> lock(mutex_results);
-            condition_results.wait(lock, [&]{
-                return !queue_results.empty();
-            });
+    std::shared_ptr<channel> get_channel(int id_task) {
+        shard & s = get_shard(id_task);
+        std::unique_lock<std::mutex> lock(s.mutex);
+        const auto it = s.channels.find(id_task);
+        return it != s.channels.end() ? it->second : nullptr;
+    }
 
-            for (int i = 0; i < (int) queue_results.size(); i++) {
-                if (id_tasks.find(queue_results[i].id) != id_tasks.end()) {
-                    server_task_result res = queue_results[i];
-                    queue_results.erase(queue_results.begin() + i);
-                    return res;
-                }
+    std::shared_ptr<channel> get_channel(const std::unordered_set<int> & id_tasks) {
+        for (const auto & id_task : id_tasks) {
+            auto ch = get_channel(id_task);
+            if (ch) {
+                return ch;
             }
         }
+        return nullptr;
+    }
 
-        // should never reach here
+    // This function blocks the thread until there is a response on the channel
+    server_task_result recv(channel & ch) {
+        server_task_result res;
+        while (!ch.try_pop(res)) {
+            ch.wait([]{
+                return false;
+            });
+        }
+        return res;
+    }
+
+    // This function blocks the thread until there is a response for one of the id_tasks
+    server_task_result recv(const std::unordered_set<int> & id_tasks) {
+        const auto ch = get_channel(id_tasks);
+        GGML_ASSERT(ch != nullptr && "the tasks are not waiting for a result");
+        return recv(*ch);
     }
 
     // single-task version of recv()
@@ -595,16 +784,482 @@ struct server_response {
     void send(server_task_result & result) {
         SRV_DBG("sending result for task id = %d\n", result.id);
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        for (const auto & id_task : waiting_task_ids) {
-            if (result.id == id_task) {
-                SRV_DBG("task id = %d moved to result queue\n", result.id);
+        const auto ch = get_channel(result.id);
+        if (ch) {
+            SRV_DBG("task id = %d moved to result queue\n", result.id);
 
-                queue_results.push_back(std::move(result));
-                condition_results.notify_all();
-                return;
+            ch->push(std::move(result));
+        }
+    }
+};
+
+// token-level radix tree of KV cache prefixes, shared by all slots
+// every node owns a sequence that holds the KV cells of its tokens - a slot attaches to a cached prefix by copying
+// the sequences along the path into its own sequence, which shares the cells instead of recomputing them
+// positions are relative to the end of the system prompt
+struct server_prefix_cache {
+    struct node {
+        std::vector<llama_token> tokens; // tokens of the edge from the parent
+
+        llama_pos    p0     = 0;  // position of the first token
+        llama_seq_id seq_id = -1; // -1 if the node is unused
+        int          parent = -1;
+
+        int     n_ref       = 0; // number of slots whose sequence shares the cells of the prefix ending in this node
+        int64_t t_last_used = -1;
+
+        std::map<llama_token, int> children; // first token -> node
+    };
+
+    llama_context * ctx = nullptr;
+
+    std::vector<node>         nodes; // nodes[0] is the root
+    std::vector<int>          free_nodes;
+    std::vector<llama_seq_id> free_seqs;
+
+    // called with a leaf before it is evicted, while its cells are still in the cache
+    std::function<void(int)> on_evict;
+
+    llama_seq_id seq_id_first = 0;
+    int32_t      n_seqs       = 0;
+
+    void init(llama_context * ctx_, llama_seq_id seq_id_first_, int32_t n_seqs_) {
+        ctx          = ctx_;
+        seq_id_first = seq_id_first_;
+        n_seqs       = n_seqs_;
+
+        clear();
+    }
+
+    bool enabled() const {
+        return n_seqs > 0;
+    }
+
+    // drop all prefixes and their sequences
+    void reset() {
+        for (const auto & nd : nodes) {
+            if (nd.seq_id >= 0) {
+                llama_kv_cache_seq_rm(ctx, nd.seq_id, -1, -1);
             }
         }
+
+        clear();
+    }
+
+    // drop all prefixes, the caller is responsible for the KV cells (used when the whole KV cache is cleared)
+    void clear() {
+        nodes.assign(1, node());
+        free_nodes.clear();
+        free_seqs.clear();
+
+        for (int32_t i = n_seqs - 1; i >= 0; --i) {
+            free_seqs.push_back(seq_id_first + i);
+        }
+    }
+
+    // find the longest cached prefix of tokens, returns its length and the node it ends in
+    int32_t match(const std::vector<llama_token> & tokens, int & id_node) const {
+        int32_t n = 0;
+
+        id_node = 0;
+
+        while (n < (int32_t) tokens.size()) {
+            const auto it = nodes[id_node].children.find(tokens[n]);
+            if (it == nodes[id_node].children.end()) {
+                break;
+            }
+
+            id_node = it->second;
+
+            const auto & nd = nodes[id_node];
+
+            size_t k = 0;
+            while (k < nd.tokens.size() && n < (int32_t) tokens.size() && nd.tokens[k] == tokens[n]) {
+                k++;
+                n++;
+            }
+
+            if (k < nd.tokens.size()) {
+                break;
+            }
+        }
+
+        return n;
+    }
+
+    // all tokens from the root to the end of id_node
+    std::vector<llama_token> path_tokens(int id_node) const {
+        std::vector<llama_token> res;
+        for (int id = id_node; id > 0; id = nodes[id].parent) {
+            res.insert(res.begin(), nodes[id].tokens.begin(), nodes[id].tokens.end());
+        }
+        return res;
+    }
+
+    // share the first n_tokens of the prefix ending in id_node with seq_id_dst
+    void attach(int id_node, int32_t n_tokens, llama_seq_id seq_id_dst, llama_pos n_sys) {
+        const int64_t t_now = ggml_time_us();
+
+        for (int id = id_node; id > 0; id = nodes[id].parent) {
+            auto & nd = nodes[id];
+
+            const llama_pos p1 = std::min<llama_pos>(nd.p0 + nd.tokens.size(), n_tokens);
+            if (p1 > nd.p0) {
+                llama_kv_cache_seq_cp(ctx, nd.seq_id, seq_id_dst, n_sys + nd.p0, n_sys + p1);
+            }
+
+            nd.t_last_used = t_now;
+        }
+    }
+
+    // cache the tokens held by seq_id_src at positions [n_sys, n_sys + tokens.size()), returns the node the prefix ends in
+    int insert(const std::vector<llama_token> & tokens, llama_seq_id seq_id_src, llama_pos n_sys) {
+        const int64_t t_now = ggml_time_us();
+
+        int     id_cur = 0;
+        int32_t n      = 0;
+
+        while (n < (int32_t) tokens.size()) {
+            const auto it = nodes[id_cur].children.find(tokens[n]);
+
+            if (it == nodes[id_cur].children.end()) {
+                // the rest of the tokens becomes a new leaf
+                const int id_new = alloc_node(id_cur);
+                if (id_new < 0) {
+                    break;
+                }
+
+                auto & nd = nodes[id_new];
+
+                nd.tokens.assign(tokens.begin() + n, tokens.end());
+                nd.p0     = n;
+                nd.parent = id_cur;
+
+                nodes[id_cur].children[tokens[n]] = id_new;
+
+                llama_kv_cache_seq_cp(ctx, seq_id_src, nd.seq_id, n_sys + n, n_sys + (llama_pos) tokens.size());
+
+                id_cur = id_new;
+                n      = tokens.size();
+                break;
+            }
+
+            const int id_child = it->second;
+
+            size_t k = 0;
+            while (k < nodes[id_child].tokens.size() && n + (int32_t) k < (int32_t) tokens.size() && nodes[id_child].tokens[k] == tokens[n + k]) {
+                k++;
+            }
+
+            if (k < nodes[id_child].tokens.size()) {
+                // diverges inside the edge - split off the common part
+                const int id_split = split(id_child, k, n_sys);
+                if (id_split < 0) {
+                    break;
+                }
+
+                id_cur = id_split;
+            } else {
+                id_cur = id_child;
+            }
+
+            nodes[id_cur].t_last_used = t_now;
+            n += k;
+        }
+
+        for (int id = id_cur; id > 0; id = nodes[id].parent) {
+            nodes[id].t_last_used = t_now;
+        }
+
+        return id_cur;
+    }
+
+    void ref(int id_node) {
+        if (id_node > 0) {
+            nodes[id_node].n_ref++;
+        }
+    }
+
+    void unref(int id_node) {
+        if (id_node > 0) {
+            GGML_ASSERT(nodes[id_node].n_ref > 0);
+            nodes[id_node].n_ref--;
+        }
+    }
+
+    // drop the least recently used leaf that no slot is attached to, returns false if there is none
+    bool evict() {
+        int id_lru = -1;
+
+        for (int id = 1; id < (int) nodes.size(); ++id) {
+            const auto & nd = nodes[id];
+            if (nd.seq_id < 0 || nd.n_ref > 0 || !nd.children.empty()) {
+                continue;
+            }
+
+            if (id_lru < 0 || nd.t_last_used < nodes[id_lru].t_last_used) {
+                id_lru = id;
+            }
+        }
+
+        if (id_lru < 0) {
+            return false;
+        }
+
+        if (on_evict) {
+            on_evict(id_lru);
+        }
+
+        auto & nd = nodes[id_lru];
+
+        SRV_DBG("evicting prefix, node = %d, p0 = %d, n_tokens = %zu\n", id_lru, nd.p0, nd.tokens.size());
+
+        llama_kv_cache_seq_rm(ctx, nd.seq_id, -1, -1);
+
+        nodes[nd.parent].children.erase(nd.tokens[0]);
+
+        free_seqs.push_back(nd.seq_id);
+        free_nodes.push_back(id_lru);
+
+        nd = node();
+
+        return true;
+    }
+
+    int32_t n_tokens() const {
+        int32_t res = 0;
+        for (const auto & nd : nodes) {
+            if (nd.seq_id >= 0) {
+                res += nd.tokens.size();
+            }
+        }
+        return res;
+    }
+
+private:
+    // the node id_pin is never evicted to make room
+    int alloc_node(int id_pin) {
+        nodes[id_pin].n_ref++;
+        while (free_seqs.empty() && evict()) {}
+        nodes[id_pin].n_ref--;
+
+        if (free_seqs.empty()) {
+            return -1;
+        }
+
+        int id;
+        if (!free_nodes.empty()) {
+            id = free_nodes.back();
+            free_nodes.pop_back();
+        } else {
+            id = nodes.size();
+            nodes.emplace_back();
+        }
+
+        nodes[id].seq_id = free_seqs.back();
+        free_seqs.pop_back();
+
+        return id;
+    }
+
+    // move the first k tokens of id_node into a new parent node, id_node keeps the rest (and its refs)
+    int split(int id_node, size_t k, llama_pos n_sys) {
+        const int id_new = alloc_node(id_node);
+        if (id_new < 0) {
+            return -1;
+        }
+
+        auto & nd = nodes[id_node];
+        auto & np = nodes[id_new];
+
+        np.tokens.assign(nd.tokens.begin(), nd.tokens.begin() + k);
+        np.p0          = nd.p0;
+        np.parent      = nd.parent;
+        np.t_last_used = nd.t_last_used;
+        np.children[nd.tokens[k]] = id_node;
+
+        nodes[nd.parent].children[nd.tokens[0]] = id_new;
+
+        llama_kv_cache_seq_cp(ctx, nd.seq_id, np.seq_id, n_sys + np.p0, n_sys + np.p0 + k);
+        llama_kv_cache_seq_rm(ctx, nd.seq_id,            n_sys + np.p0, n_sys + np.p0 + k);
+
+        nd.tokens.erase(nd.tokens.begin(), nd.tokens.begin() + k);
+        nd.p0    += k;
+        nd.parent = id_new;
+
+        return id_new;
+    }
+};
+
+// second tier of the prefix cache on local disk
+// prefixes evicted from the radix tree are spilled as sequence state files, indexed by a hash of their tokens
+// files are written and read on background threads, only the (de)serialization of the KV cells runs on the main loop
+struct server_prefix_disk {
+    struct entry {
+        std::vector<llama_token> tokens;
+        std::string              path;
+
+        size_t  n_bytes     = 0;
+        int64_t t_last_used = -1;
+
+        std::shared_future<bool> written;
+    };
+
+    std::string dir;
+    size_t      n_bytes_max = 0;
+    size_t      n_bytes     = 0;
+
+    std::unordered_map<uint64_t, entry> entries;
+    std::map<int32_t, int32_t>          n_entries_len; // prefix length -> number of entries
+
+    void init(const std::string & dir_, size_t n_bytes_max_) {
+        dir         = dir_;
+        n_bytes_max = n_bytes_max_;
+
+        // the token index is not persisted, the files left by a previous run cannot be matched and only take space
+        int n_removed = 0;
+        for (const auto & name : fs_list_files(dir)) {
+            if (name.rfind("prefix-", 0) == 0 && ends_with(name, ".bin")) {
+                n_removed += std::remove((dir + name).c_str()) == 0;
+            }
+        }
+        if (n_removed > 0) {
+            SRV_INF("removed %d stale prefix files from '%s'\n", n_removed, dir.c_str());
+        }
+    }
+
+    bool enabled() const {
+        return !dir.empty();
+    }
+
+    static uint64_t hash(const llama_token * tokens, size_t n, uint64_t h = 0xcbf29ce484222325ULL) {
+        for (size_t i = 0; i < n; ++i) {
+            h ^= (uint32_t) tokens[i];
+            h *= 0x100000001b3ULL;
+        }
+        return h;
+    }
+
+    // find the longest stored prefix of tokens, returns its length and its key
+    int32_t match(const std::vector<llama_token> & tokens, uint64_t & key) const {
+        uint64_t h     = hash(nullptr, 0);
+        int32_t  n_cur = 0;
+        int32_t  n_res = 0;
+
+        // the lengths are visited in increasing order, so the prefix hash can be extended incrementally
+        for (const auto & it : n_entries_len) {
+            const int32_t n = it.first;
+            if (n > (int32_t) tokens.size()) {
+                break;
+            }
+
+            h     = hash(tokens.data() + n_cur, n - n_cur, h);
+            n_cur = n;
+
+            const auto e = entries.find(h);
+            if (e != entries.end() && std::equal(e->second.tokens.begin(), e->second.tokens.end(), tokens.begin())) {
+                key   = h;
+                n_res = n;
+            }
+        }
+
+        return n_res;
+    }
+
+    void store(const std::vector<llama_token> & tokens, std::vector<uint8_t> && data) {
+        const uint64_t key = hash(tokens.data(), tokens.size());
+        if (entries.find(key) != entries.end()) {
+            return;
+        }
+
+        entry e;
+        e.tokens      = tokens;
+        char name[64];
+        snprintf(name, sizeof(name), "prefix-%016" PRIx64 ".bin", key);
+
+        e.path        = dir + name;
+        e.n_bytes     = data.size();
+        e.t_last_used = ggml_time_us();
+
+        auto buf = std::make_shared<std::vector<uint8_t>>(std::move(data));
+        e.written = std::async(std::launch::async, [path = e.path, buf]() {
+            std::ofstream file(path, std::ios::binary);
+            file.write((const char *) buf->data(), buf->size());
+            return file.good();
+        }).share();
+
+        n_bytes += e.n_bytes;
+        n_entries_len[tokens.size()]++;
+        entries.emplace(key, std::move(e));
+
+        // the entries that are still being written are kept, the budget is enforced again on the next store
+        while (n_bytes > n_bytes_max && entries.size() > 1) {
+            if (!remove_lru(false)) {
+                break;
+            }
+        }
+    }
+
+    // read the state of an entry in the background, an empty result means the read failed
+    std::shared_future<std::vector<uint8_t>> load(uint64_t key) {
+        entry & e = entries.at(key);
+        e.t_last_used = ggml_time_us();
+
+        return std::async(std::launch::async, [path = e.path, n_bytes = e.n_bytes, written = e.written]() {
+            std::vector<uint8_t> data;
+            if (!written.get()) {
+                return data;
+            }
+
+            std::ifstream file(path, std::ios::binary);
+            data.resize(n_bytes);
+            if (!file.read((char *) data.data(), n_bytes)) {
+                data.clear();
+            }
+            return data;
+        }).share();
+    }
+
+    void clear() {
+        while (!entries.empty()) {
+            remove_lru(true);
+        }
+    }
+
+private:
+    static bool is_written(const entry & e) {
+        return e.written.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
+
+    // remove the least recently used entry, returns false if there is none to remove
+    // without wait, the entries that are still being written are skipped so that the main loop does not block
+    bool remove_lru(bool wait) {
+        auto lru = entries.end();
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            if (!wait && !is_written(it->second)) {
+                continue;
+            }
+            if (lru == entries.end() || it->second.t_last_used < lru->second.t_last_used) {
+                lru = it;
+            }
+        }
+
+        if (lru == entries.end()) {
+            return false;
+        }
+
+        // wait for the write so that the file is not recreated after the removal
+        // a load that is still pending fails and its slot evaluates the prompt instead
+        lru->second.written.wait();
+        std::remove(lru->second.path.c_str());
+
+        n_bytes -= lru->second.n_bytes;
+        if (--n_entries_len[lru->second.tokens.size()] == 0) {
+            n_entries_len.erase(lru->second.tokens.size());
+        }
+        entries.erase(lru);
+
+        return true;
     }
 };
 
@@ -638,10 +1293,24 @@ struct server_context {
 
     server_metrics metrics;
 
+    server_prefix_cache prefix_cache;
+    server_prefix_disk  prefix_disk;
+
+    // n-gram caches used by the slots for lookup decoding, in addition to their own
+    llama_ngram_cache ngram_cache_static;  // built from a corpus, read-only
+    llama_ngram_cache ngram_cache_dynamic; // gathered from the finished generations
+
     // Necessary similarity of prompt for slot selection
     float slot_prompt_similarity = 0.0f;
 
     ~server_context() {
+        if (!params.lookup_cache_dynamic.empty() && !ngram_cache_dynamic.empty()) {
+            llama_ngram_cache_save(ngram_cache_dynamic, params.lookup_cache_dynamic);
+        }
+
+        // the spilled prefixes are only valid for this process
+        prefix_disk.clear();
+
         if (ctx) {
             llama_free(ctx);
             ctx = nullptr;
@@ -665,8 +1334,11 @@ struct server_context {
     bool load_model(const gpt_params & params_) {
         params = params_;
 
-        // dedicate one sequence to the system prompt
-        params.n_parallel += 1;
+        // dedicate one sequence to the system prompt and one to each node of the prefix cache
+        // (plus one to gather the prefixes spilled to disk)
+        const int32_t n_seq_prefix = params.n_prefix_cache > 0 ? params.n_prefix_cache + !params.prefix_cache_dir.empty() : 0;
+
+        params.n_parallel += 1 + n_seq_prefix;
 
         llama_init_result llama_init = llama_init_from_gpt_params(params);
 
@@ -674,7 +1346,7 @@ struct server_context {
         ctx   = llama_init.context;
         loras = llama_init.lora_adapters;
 
-        params.n_parallel -= 1; // but be sneaky about it
+        params.n_parallel -= 1 + n_seq_prefix; // but be sneaky about it
 
         if (model == nullptr) {
             SRV_ERR("failed to load model, '%s'\n", params.model.c_str());
@@ -683,6 +1355,45 @@ struct server_context {
 
         n_ctx = llama_n_ctx(ctx);
 
+        if (params.n_prefix_cache > 0) {
+            if (llama_model_is_recurrent(model)) {
+                SRV_WRN("%s", "prefix cache is not supported by recurrent models, disabling\n");
+            } else if (params.n_kv_window > 0) {
+                // the evicted tokens would leave holes in the shared prefixes
+                SRV_WRN("%s", "prefix cache is not supported with a KV window, disabling\n");
+            } else {
+                prefix_cache.init(ctx, params.n_parallel + 1, params.n_prefix_cache);
+
+                if (!params.prefix_cache_dir.empty()) {
+                    if (!fs_create_directory_with_parents(params.prefix_cache_dir)) {
+                        SRV_ERR("failed to create prefix cache directory '%s'\n", params.prefix_cache_dir.c_str());
+                        return false;
+                    }
+
+                    prefix_disk.init(params.prefix_cache_dir, (size_t) params.prefix_cache_dir_size*1024*1024);
+
+                    prefix_cache.on_evict = [this](int id_node) {
+                        prefix_spill(id_node);
+                    };
+                }
+            }
+        }
+
+        if (!params.lookup_cache_static.empty()) {
+            try {
+                ngram_cache_static = llama_ngram_cache_load(params.lookup_cache_static);
+            } catch (std::ifstream::failure const &) {
+                SRV_ERR("failed to open static lookup cache, '%s'\n", params.lookup_cache_static.c_str());
+                return false;
+            }
+        }
+
+        if (!params.lookup_cache_dynamic.empty()) {
+            try {
+                ngram_cache_dynamic = llama_ngram_cache_load(params.lookup_cache_dynamic);
+            } catch (std::ifstream::failure const &) {} // if the file does not exist it will be created on exit
+        }
+
         add_bos_token = llama_add_bos_token(model);
         has_eos_token = !llama_add_eos_token(model);
 
@@ -729,7 +1440,20 @@ struct server_context {
 
             slot.sparams = params.sparams;
 
-            slot.callback_on_release = [this](int) {
+            slot.callback_on_release = [this](int id_slot) {
+                // the n-grams of the finished generation help drafting for the next requests
+                server_slot & released = slots[id_slot];
+                if (!released.ngram_cache.empty()) {
+                    llama_ngram_cache_merge(ngram_cache_dynamic, released.ngram_cache);
+                    released.ngram_cache.clear();
+
+                    // keep the most frequent n-grams, with some slack so that not every release prunes
+                    const size_t n_max = std::max(0, params.n_lookup_cache_max);
+                    if (ngram_cache_dynamic.size() > n_max + n_max/8) {
+                        llama_ngram_cache_prune(ngram_cache_dynamic, n_max);
+                    }
+                }
+
                 queue_tasks.pop_deferred_task();
             };
 
@@ -888,6 +1612,7 @@ struct server_context {
         slot.params.stream             = json_value(data, "stream",            false);
         slot.params.cache_prompt       = json_value(data, "cache_prompt",      false);
         slot.params.n_predict          = json_value(data, "n_predict",         json_value(data, "max_tokens", default_params.n_predict));
+        slot.params.n_draft            = json_value(data, "n_draft",           params.n_lookup_draft);
         slot.sparams.top_k             = json_value(data, "top_k",             default_sparams.top_k);
         slot.sparams.top_p             = json_value(data, "top_p",             default_sparams.top_p);
         slot.sparams.min_p             = json_value(data, "min_p",             default_sparams.min_p);
@@ -926,6 +1651,7 @@ struct server_context {
         } else {
             slot.sparams.grammar       = json_value(data, "grammar",           default_sparams.grammar);
         }
+        slot.sparams.grammar_compiled  = json_value(data, "grammar_compiled",  default_sparams.grammar_compiled);
 
         if (slot.params.cache_prompt && slot.ga_n != 1) {
             slot.params.cache_prompt = false;
@@ -1064,12 +1790,46 @@ struct server_context {
         // clear the entire KV cache
         llama_kv_cache_clear(ctx);
         clean_kv_cache = false;
+
+        if (prefix_cache.enabled()) {
+            prefix_cache.clear();
+            for (server_slot & slot : slots) {
+                slot.id_prefix = -1;
+            }
+        }
+    }
+
+    // write the state of a prefix that is about to be evicted to the disk tier
+    void prefix_spill(int id_node) {
+        const std::vector<llama_token> tokens = prefix_cache.path_tokens(id_node);
+
+        const llama_seq_id seq_id_tmp = prefix_cache.seq_id_first + prefix_cache.n_seqs;
+
+        prefix_cache.attach(id_node, tokens.size(), seq_id_tmp, system_tokens.size());
+
+        std::vector<uint8_t> data(llama_state_seq_get_size(ctx, seq_id_tmp));
+        const size_t n_written = llama_state_seq_get_data(ctx, data.data(), data.size(), seq_id_tmp);
+
+        llama_kv_cache_seq_rm(ctx, seq_id_tmp, -1, -1);
+
+        if (n_written == 0) {
+            SRV_WRN("failed to get the state of a prefix, n_tokens = %zu\n", tokens.size());
+            return;
+        }
+
+        SRV_DBG("spilling prefix to disk, n_tokens = %zu, size = %zu\n", tokens.size(), n_written);
+
+        data.resize(n_written);
+        prefix_disk.store(tokens, std::move(data));
     }
 
     void system_prompt_update() {
         SRV_DBG("updating system prompt: '%s'\n", system_prompt.c_str());
 
         kv_cache_clear();
+
+        // the spilled prefixes follow the old system prompt
+        prefix_disk.clear();
         system_tokens.clear();
 
         if (!system_prompt.empty()) {
@@ -1192,7 +1952,8 @@ struct server_context {
         }
 
         // if context shift is disabled, we stop when it reaches the context limit
-        if (slot.n_decoded >= slot.n_ctx) {
+        // (a KV window evicts the old tokens instead)
+        if (params.n_kv_window == 0 && slot.n_decoded >= slot.n_ctx) {
             slot.truncated      = true;
             slot.stopped_limit  = true;
             slot.has_next_token = false;
@@ -1209,7 +1970,7 @@ struct server_context {
 
         const auto n_ctx_train = llama_n_ctx_train(model);
 
-        if (slot.params.n_predict < 1 && slot.n_predict < 1 && slot.ga_n == 1 && slot.n_prompt_tokens + slot.n_decoded >= n_ctx_train) {
+        if (slot.params.n_predict < 1 && slot.n_predict < 1 && slot.ga_n == 1 && params.n_kv_window == 0 && slot.n_prompt_tokens + slot.n_decoded >= n_ctx_train) {
             slot.truncated      = true;
             slot.stopped_limit  = true;
             slot.has_next_token = false; // stop prediction
@@ -1258,12 +2019,14 @@ struct server_context {
             {"max_tokens",                slot.params.n_predict}, // User configured n_predict
             {"n_keep",                    slot.params.n_keep},
             {"n_discard",                 slot.params.n_discard},
+            {"n_draft",                   slot.params.n_draft},
             {"ignore_eos",                slot.sparams.ignore_eos},
             {"stream",                    slot.params.stream},
           //{"logit_bias",                slot.sparams.logit_bias},
             {"n_probs",                   slot.sparams.n_probs},
             {"min_keep",                  slot.sparams.min_keep},
             {"grammar",                   slot.sparams.grammar},
+            {"grammar_compiled",          slot.sparams.grammar_compiled},
             {"samplers",                  samplers},
         };
     }
@@ -1293,6 +2056,18 @@ struct server_context {
         res.id       = slot.id_task;
         res.error    = false;
         res.stop     = false;
+
+        // fast path: the HTTP thread writes the event directly from the content
+        if (slot.sparams.n_probs == 0 && !slot.oaicompat) {
+            res.partial = true;
+            res.content = std::move(tkn.text_to_send);
+            res.id_slot = slot.id;
+            res.index   = slot.index;
+
+            queue_results.send(res);
+            return;
+        }
+
         res.data     = json {
             {"content",    tkn.text_to_send},
             {"stop",       false},
@@ -1468,6 +2243,10 @@ struct server_context {
             task.id        = queue_tasks.get_new_id();
             task.cmpl_type = cmpl_type;
             task.type      = SERVER_TASK_TYPE_COMPLETION;
+            task.priority  = json_value(task_data, "priority", 0);
+            if (task_data.contains("deadline_ms")) {
+                task.t_deadline = ggml_time_us() + 1000*json_value(task_data, "deadline_ms", (int64_t) 0);
+            }
             if (replace_prompt) {
                 task.data  = task_data;
                 task.data["prompt"] = std::move(prompt);
@@ -1546,9 +2325,12 @@ struct server_context {
             const std::function<void(std::vector<server_task_result>&)> & result_handler,
             const std::function<void(json)> & error_handler) {
         // TODO: currently, there is no way to detect the client has cancelled the request
+        const auto ch = queue_results.get_channel(id_tasks);
+        GGML_ASSERT(ch != nullptr && "the tasks are not waiting for a result");
+
         std::vector<server_task_result> results(id_tasks.size());
         for (size_t i = 0; i < id_tasks.size(); i++) {
-            server_task_result result = queue_results.recv(id_tasks);
+            server_task_result result = queue_results.recv(*ch);
 
             if (result.error) {
                 error_handler(result.data);
@@ -1569,9 +2351,34 @@ struct server_context {
             const std::unordered_set<int> & id_tasks, const
             std::function<bool(server_task_result&)> & result_handler, const
             std::function<void(json)> & error_handler) {
+        const auto ch = queue_results.get_channel(id_tasks);
+        GGML_ASSERT(ch != nullptr && "the tasks are not waiting for a result");
+
         size_t n_finished = 0;
+
+        server_task_result next;
+        bool has_next = false;
+
         while (true) {
-            server_task_result result = queue_results.recv(id_tasks);
+            server_task_result result;
+            if (has_next) {
+                result   = std::move(next);
+                has_next = false;
+            } else {
+                result = queue_results.recv(*ch);
+            }
+
+            // the client is slower than the generation - send the tokens that are already queued in one event
+            if (result.partial) {
+                while (ch->try_pop(next)) {
+                    if (!next.partial || next.id != result.id) {
+                        has_next = true;
+                        break;
+                    }
+                    result.content += next.content;
+                }
+            }
+
             if (!result_handler(result)) {
                 cancel_tasks(id_tasks);
                 break;
@@ -1627,6 +2434,15 @@ struct server_context {
                         break;
                     }
 
+                    if (task.t_deadline >= 0 && ggml_time_us() > task.t_deadline) {
+                        SRV_WRN("task deadline exceeded before it could start, id_task = %d\n", task.id);
+                        metrics.n_tasks_deadline_exceeded_total++;
+                        send_error(task, "the request could not be started before its deadline", ERROR_TYPE_UNAVAILABLE);
+                        // the slot that was freed for this task is still free
+                        queue_tasks.pop_deferred_task();
+                        break;
+                    }
+
                     if (task.data.contains("system_prompt")) {
                         std::string sys_prompt = json_value(task.data, "system_prompt", std::string());
                         system_prompt_set(sys_prompt);
@@ -1639,9 +2455,13 @@ struct server_context {
 
                     slot->reset();
 
-                    slot->id_task   = task.id;
-                    slot->cmpl_type = task.cmpl_type;
-                    slot->index     = json_value(task.data, "index", 0);
+                    slot->id_task    = task.id;
+                    slot->cmpl_type  = task.cmpl_type;
+                    slot->index      = json_value(task.data, "index", 0);
+                    slot->priority   = task.priority;
+                    slot->t_deadline = task.t_deadline;
+
+                    metrics.on_task_started(task);
 
                     if (!launch_slot_with_task(*slot, task)) {
                         SRV_ERR("failed to launch slot with task, id_task = %d\n", task.id);
@@ -1702,7 +2522,7 @@ struct server_context {
                     res.data     = {
                         { "idle",                            n_idle_slots       },
                         { "processing",                      n_processing_slots },
-                        { "deferred",                        queue_tasks.queue_tasks_deferred.size() },
+                        { "deferred",                        queue_tasks.n_deferred() },
                         { "t_start",                         metrics.t_start},
 
                         { "n_prompt_tokens_processed_total", metrics.n_prompt_tokens_processed_total},
@@ -1718,6 +2538,14 @@ struct server_context {
                         { "n_decode_total",                  metrics.n_decode_total},
                         { "n_busy_slots_total",              metrics.n_busy_slots_total},
 
+                        { "n_draft_total",                   metrics.n_draft_total},
+                        { "n_draft_accepted_total",          metrics.n_draft_accepted_total},
+
+                        { "n_tasks_started_total",           metrics.n_tasks_started_total},
+                        { "t_tasks_wait_total",              metrics.t_tasks_wait_total},
+                        { "t_tasks_wait_max",                metrics.t_tasks_wait_max},
+                        { "n_tasks_deadline_exceeded_total", metrics.n_tasks_deadline_exceeded_total},
+
                         { "kv_cache_tokens_count",           llama_get_kv_cache_token_count(ctx)},
                         { "kv_cache_used_cells",             llama_get_kv_cache_used_cells(ctx)},
 
@@ -1800,6 +2628,9 @@ struct server_context {
                     }
                     slot->cache_tokens.resize(token_count);
 
+                    prefix_cache.unref(slot->id_prefix);
+                    slot->id_prefix = -1;
+
                     const int64_t t_end = ggml_time_us();
                     const double t_restore_ms = (t_end - t_start) / 1000.0;
 
@@ -1838,6 +2669,9 @@ struct server_context {
                     llama_kv_cache_seq_rm(ctx, slot->id + 1, -1, -1);
                     slot->cache_tokens.clear();
 
+                    prefix_cache.unref(slot->id_prefix);
+                    slot->id_prefix = -1;
+
                     server_task_result result;
                     result.id = task.id;
                     result.stop = true;
@@ -1900,7 +2734,7 @@ struct server_context {
         // apply context-shift if needed
         // TODO: simplify and improve
         for (server_slot & slot : slots) {
-            if (slot.ga_n == 1) {
+            if (slot.ga_n == 1 && params.n_kv_window == 0) {
                 if (slot.is_processing() && (int) system_tokens.size() + slot.n_past >= slot.n_ctx - 1) {
                     if (!params.ctx_shift) {
                         // this check is redundant (for good)
@@ -1917,6 +2751,38 @@ struct server_context {
 
                     SLT_WRN(slot, "slot context shift, n_keep = %d, n_left = %d, n_discard = %d\n", n_keep, n_left, n_discard);
 
+                    // the shift moves the positions of the cells that the slot shares with the prefix cache and, through it,
+                    // with the other slots attached to the same prefixes - these cells hold the tokens common to both slots
+                    if (prefix_cache.enabled()) {
+                        const auto shares_cells = [&](const server_slot & other) {
+                            return &other != &slot && (int) (system_tokens.size() + common_part(slot.cache_tokens, other.cache_tokens)) > n_keep;
+                        };
+
+                        bool shared = false;
+                        for (const server_slot & other : slots) {
+                            shared = shared || (shares_cells(other) && other.is_processing());
+                        }
+
+                        if (shared) {
+                            slot.release();
+                            send_error(slot, "context shift is not possible while the KV cache of the slot is shared with another slot", ERROR_TYPE_SERVER);
+                            continue;
+                        }
+
+                        // the idle slots give up their cached prompt instead
+                        for (server_slot & other : slots) {
+                            if (shares_cells(other)) {
+                                llama_kv_cache_seq_rm(ctx, other.id + 1, system_tokens.size(), -1);
+                                other.cache_tokens.clear();
+                            }
+                        }
+
+                        prefix_cache.reset();
+                        for (server_slot & other : slots) {
+                            other.id_prefix = -1;
+                        }
+                    }
+
                     llama_kv_cache_seq_rm (ctx, slot.id + 1, n_keep            , n_keep + n_discard);
                     llama_kv_cache_seq_add(ctx, slot.id + 1, n_keep + n_discard, system_tokens.size() + slot.n_past, -n_discard);
 
@@ -1966,15 +2832,83 @@ struct server_context {
         int32_t n_batch  = llama_n_batch(ctx);
         int32_t n_ubatch = llama_n_ubatch(ctx);
 
+        // then, draft the next tokens of the generating slots from the n-gram caches
+        // the drafts are verified with the outputs of this batch, so they are kept within its first ubatch
+        const int32_t i_batch_draft = batch.n_tokens;
+
+        for (auto & slot : slots) {
+            if (slot.state != SLOT_STATE_GENERATING || slot.params.n_draft <= 0 || slot.ga_n != 1) {
+                continue;
+            }
+
+            int32_t n_draft = std::min(slot.params.n_draft, std::min(n_batch, n_ubatch) - batch.n_tokens);
+
+            // do not draft past the context of the slot or the number of tokens left to predict
+            if (params.n_kv_window == 0) {
+                n_draft = std::min(n_draft, slot.n_ctx - 1 - (int32_t) system_tokens.size() - slot.n_past);
+            }
+
+            const int32_t n_predict = slot.params.n_predict != -1 ? slot.params.n_predict : params.n_predict;
+            if (n_predict != -1) {
+                n_draft = std::min(n_draft, n_predict - slot.n_decoded - 1);
+            }
+
+            if (n_draft <= 0) {
+                continue;
+            }
+
+            // the draft starts with the token sampled last, which is already in the batch
+            slot.draft.assign(1, slot.sampled);
+            llama_ngram_cache_draft(slot.ngram_tokens, slot.draft, n_draft, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX,
+                    slot.ngram_cache, ngram_cache_dynamic, ngram_cache_static);
+            slot.draft.erase(slot.draft.begin());
+
+            slot.i_batch_draft = batch.n_tokens;
+            slot.n_drafted    += slot.draft.size();
+
+            for (size_t k = 0; k < slot.draft.size(); ++k) {
+                llama_batch_add(batch, slot.draft[k], system_tokens.size() + slot.n_past + k, { slot.id + 1 }, true);
+            }
+        }
+
+        int32_t n_drafts = batch.n_tokens - i_batch_draft;
+
         // track if this is an embedding or non-embedding batch
         // if we've added sampled tokens above, we are in non-embedding mode
         // -1: none, 0: non-embedding, 1: embedding
         // TODO: make enum
         int32_t batch_type = batch.n_tokens > 0 ? 0 : -1;
 
+        // while slots are generating, bound the prompt tokens of this step so that long prompts are processed in chunks
+        // interleaved with the generation instead of stalling it
+        int32_t n_batch_prompt = n_batch;
+        if (batch.n_tokens > 0 && params.n_prefill_chunk > 0) {
+            n_batch_prompt = std::min(n_batch, batch.n_tokens + params.n_prefill_chunk);
+        }
+
+        // process the pending prompts by priority and deadline
+        std::vector<server_slot *> slots_prompt;
+        for (auto & slot : slots) {
+            if (slot.state == SLOT_STATE_PROCESSING_PROMPT) {
+                slots_prompt.push_back(&slot);
+            }
+        }
+
+        std::stable_sort(slots_prompt.begin(), slots_prompt.end(), [](const server_slot * a, const server_slot * b) {
+            if (a->priority != b->priority) {
+                return a->priority > b->priority;
+            }
+            return b->t_deadline < 0 ? a->t_deadline >= 0 : (a->t_deadline >= 0 && a->t_deadline < b->t_deadline);
+        });
+
+        // a pending read of a prefix from disk, the slot is skipped until the read completes
+        std::shared_future<std::vector<uint8_t>> prefix_load_pending;
+
         // next, batch any pending prompts without exceeding n_batch
         if (params.cont_batching || batch.n_tokens == 0) {
-            for (auto & slot : slots) {
+            for (server_slot * slot_prompt : slots_prompt) {
+                server_slot & slot = *slot_prompt;
+
                 // this slot still has a prompt to be processed
                 if (slot.state == SLOT_STATE_PROCESSING_PROMPT) {
                     auto & prompt_tokens = slot.prompt_tokens;
@@ -2068,7 +3002,7 @@ struct server_context {
                                 continue;
                             }
                         } else {
-                            if (!params.ctx_shift) {
+                            if (!params.ctx_shift && params.n_kv_window == 0) {
                                 // if context shift is disabled, we make sure prompt size is smaller than KV size
                                 if ((int) system_tokens.size() + slot.n_prompt_tokens >= slot.n_ctx) {
                                     slot.release();
@@ -2082,7 +3016,8 @@ struct server_context {
                             slot.params.n_keep = std::min(slot.n_ctx - 4, slot.params.n_keep);
 
                             // if input prompt is too big, truncate it (if group attention self-extend is disabled)
-                            if (slot.ga_n == 1 && slot.n_prompt_tokens >= slot.n_ctx) {
+                            // a KV window takes any prompt, its old tokens are evicted while it is evaluated
+                            if (slot.ga_n == 1 && params.n_kv_window == 0 && slot.n_prompt_tokens >= slot.n_ctx) {
                                 const int n_left = slot.n_ctx - slot.params.n_keep;
 
                                 const int n_block_size = n_left / 2;
@@ -2118,6 +3053,45 @@ struct server_context {
                                 // reuse any previously computed tokens that are common with the new prompt
                                 slot.n_past = common_part(slot.cache_tokens, prompt_tokens);
 
+                                // once a KV window has evicted tokens of the slot, only a prompt that continues all of them can reuse it
+                                if (params.n_kv_window > 0 && slot.n_past < (int) slot.cache_tokens.size() &&
+                                    system_tokens.size() + slot.cache_tokens.size() > (size_t) (params.n_kv_sink + params.n_kv_window)) {
+                                    slot.n_past = 0;
+                                }
+
+                                // attach to a longer prefix computed by any slot, if there is one
+                                if (prefix_cache.enabled()) {
+                                    int id_node = 0;
+                                    const int32_t n_match = prefix_cache.match(prompt_tokens, id_node);
+
+                                    if (n_match > slot.n_past) {
+                                        SLT_INF(slot, "attaching to cached prefix, n_past = %d, n_match = %d\n", slot.n_past, n_match);
+
+                                        llama_kv_cache_seq_rm(ctx, slot.id + 1, system_tokens.size(), -1);
+                                        prefix_cache.attach(id_node, n_match, slot.id + 1, system_tokens.size());
+
+                                        prefix_cache.unref(slot.id_prefix);
+                                        prefix_cache.ref(id_node);
+                                        slot.id_prefix = id_node;
+
+                                        slot.cache_tokens.assign(prompt_tokens.begin(), prompt_tokens.begin() + n_match);
+                                        slot.n_past = n_match;
+                                    }
+                                }
+
+                                // or restore an even longer one from disk, the slot waits until it has been read
+                                if (prefix_disk.enabled()) {
+                                    uint64_t key = 0;
+                                    const int32_t n_match = prefix_disk.match(prompt_tokens, key);
+
+                                    if (n_match > slot.n_past) {
+                                        SLT_INF(slot, "restoring prefix from disk, n_past = %d, n_match = %d\n", slot.n_past, n_match);
+
+                                        slot.prefix_load   = prefix_disk.load(key);
+                                        slot.n_prefix_load = n_match;
+                                    }
+                                }
+
                                 // push the prompt into the sampling context (do not apply grammar)
                                 for (int i = 0; i < slot.n_past; ++i) {
                                     gpt_sampler_accept(slot.smpl, slot.cache_tokens[i], false);
@@ -2138,6 +3112,43 @@ struct server_context {
                         slot.n_prompt_tokens_processed = 0;
                     }
 
+                    if (slot.prefix_load.valid()) {
+                        if (slot.prefix_load.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+                            prefix_load_pending = slot.prefix_load;
+                            continue;
+                        }
+
+                        const std::vector<uint8_t> data = slot.prefix_load.get();
+                        slot.prefix_load = {};
+
+                        // restoring replaces the whole sequence of the slot, including the system prompt
+                        if (!data.empty() && llama_state_seq_set_data(ctx, data.data(), data.size(), slot.id + 1) != 0) {
+                            slot.n_past = slot.n_prefix_load;
+                        } else {
+                            SLT_WRN(slot, "%s", "failed to restore prefix from disk\n");
+
+                            llama_kv_cache_seq_rm(ctx, slot.id + 1, -1, -1);
+                            slot.n_past = 0;
+                        }
+
+                        if (!system_tokens.empty()) {
+                            llama_kv_cache_seq_cp(ctx, 0, slot.id + 1, -1, -1);
+                        }
+
+                        slot.cache_tokens.assign(prompt_tokens.begin(), prompt_tokens.begin() + slot.n_past);
+
+                        gpt_sampler_reset(slot.smpl);
+                        for (int i = 0; i < slot.n_past; ++i) {
+                            gpt_sampler_accept(slot.smpl, slot.cache_tokens[i], false);
+                        }
+
+                        if (slot.n_past == slot.n_prompt_tokens) {
+                            slot.n_past--;
+                        }
+
+                        SLT_INF(slot, "restored prefix from disk, n_past = %d\n", slot.n_past);
+                    }
+
                     // non-causal tasks require to fit the entire prompt in the physical batch
                     if (slot.cmpl_type == SERVER_TASK_CMPL_TYPE_EMBEDDING || slot.cmpl_type == SERVER_TASK_CMPL_TYPE_RERANK) {
                         // cannot fit the prompt in the current batch - will try next iter
@@ -2190,7 +3201,7 @@ struct server_context {
 
                     // add prompt tokens for processing in the current batch
                     // TODO: the self-extend stuff here is a mess - simplify and/or abstract it somehow
-                    for (; slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch; ++slot.n_past) {
+                    for (; slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch_prompt; ++slot.n_past) {
                         if (slot.ga_n != 1) {
                             while (slot_npast >= ga_i + ga_w) {
                                 const int bd = (ga_w/ga_n)*(ga_n - 1);
@@ -2227,13 +3238,20 @@ struct server_context {
                     }
                 }
 
-                if (batch.n_tokens >= n_batch) {
+                if (batch.n_tokens >= n_batch_prompt) {
                     break;
                 }
             }
         }
 
         if (batch.n_tokens == 0) {
+            if (prefix_load_pending.valid()) {
+                // only slots waiting for the disk - block on the read instead of spinning through the queue,
+                // with a timeout so that new tasks are still picked up
+                prefix_load_pending.wait_for(std::chrono::milliseconds(100));
+                return;
+            }
+
             SRV_WRN("%s", "no tokens to decode\n");
             return;
         }
@@ -2300,6 +3318,42 @@ struct server_context {
                     break; // break loop of n_batch
                 }
 
+                // make room by dropping the drafts, they are all in the first chunk
+                if (i == 0 && n_drafts > 0) {
+                    for (int32_t k = i_batch_draft + n_drafts; k < batch.n_tokens; ++k) {
+                        batch.token    [k - n_drafts]    = batch.token    [k];
+                        batch.pos      [k - n_drafts]    = batch.pos      [k];
+                        batch.n_seq_id [k - n_drafts]    = batch.n_seq_id [k];
+                        batch.seq_id   [k - n_drafts][0] = batch.seq_id   [k][0];
+                        batch.logits   [k - n_drafts]    = batch.logits   [k];
+                    }
+                    batch.n_tokens -= n_drafts;
+
+                    for (auto & slot : slots) {
+                        if (slot.i_batch >= i_batch_draft) {
+                            slot.i_batch -= n_drafts;
+                        }
+                        slot.n_drafted -= slot.draft.size();
+                        slot.draft.clear();
+                    }
+
+                    n_drafts = 0;
+                    i -= n_batch;
+
+                    SRV_WRN("failed to find free space in the KV cache, dropped the drafts and retrying, i = %d, n_batch = %d, ret = %d\n", i, n_batch, ret);
+
+                    continue; // continue loop of n_batch
+                }
+
+                // make room by dropping unused prefixes before shrinking the batch
+                if (prefix_cache.enabled() && prefix_cache.evict()) {
+                    i -= n_batch;
+
+                    SRV_WRN("failed to find free space in the KV cache, evicted a cached prefix and retrying, i = %d, n_batch = %d, ret = %d\n", i, n_batch, ret);
+
+                    continue; // continue loop of n_batch
+                }
+
                 // retry with half the batch size to try to find a free slot in the KV cache
                 n_batch /= 2;
                 i -= n_batch;
@@ -2309,6 +3363,10 @@ struct server_context {
                 continue; // continue loop of n_batch
             }
 
+            std::vector<server_slot *> slots_sample;
+            std::vector<gpt_sampler *> smpls_sample;
+            std::vector<int>           idxs_sample;
+
             for (auto & slot : slots) {
                 if (slot.i_batch < (int) i || slot.i_batch >= (int) (i + n_tokens)) {
                     continue; // continue loop of slots
@@ -2332,41 +3390,105 @@ struct server_context {
 
                     // prompt evaluated for next-token prediction
                     slot.state = SLOT_STATE_GENERATING;
+
+                    // share the evaluated prompt with the other slots
+                    if (prefix_cache.enabled() && slot.params.cache_prompt && !slot.cache_tokens.empty()) {
+                        // the slot no longer shares the cells past its common part, so its old prefix may be evicted
+                        prefix_cache.unref(slot.id_prefix);
+
+                        const int id_node = prefix_cache.insert(slot.cache_tokens, slot.id + 1, system_tokens.size());
+
+                        prefix_cache.ref(id_node);
+                        slot.id_prefix = id_node;
+                    }
+
+                    // the prompt is the first source of the drafts
+                    if (slot.params.n_draft > 0) {
+                        slot.ngram_tokens = slot.prompt_tokens;
+                        llama_ngram_cache_update(slot.ngram_cache, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, slot.ngram_tokens, slot.ngram_tokens.size(), false);
+                    }
                 } else if (slot.state != SLOT_STATE_GENERATING) {
                     continue; // continue loop of slots
                 }
 
-                completion_token_output result;
-                const llama_token id = gpt_sampler_sample(slot.smpl, ctx, slot.i_batch - i);
+                slots_sample.push_back(&slot);
+                smpls_sample.push_back(slot.smpl);
+                idxs_sample.push_back(slot.i_batch - i);
+            }
+
+            // sample all generating slots of this batch view at once
+            const std::vector<llama_token> ids = gpt_sampler_sample_batch(smpls_sample, ctx, idxs_sample);
 
-                gpt_sampler_accept(slot.smpl, id, true);
+            for (size_t j = 0; j < slots_sample.size(); ++j) {
+                server_slot & slot = *slots_sample[j];
 
-                slot.n_decoded += 1;
-                if (slot.n_decoded == 1) {
-                    slot.t_start_generation = ggml_time_us();
-                    slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process_prompt) / 1e3;
-                    metrics.on_prompt_eval(slot);
-                }
+                llama_token id = ids[j];
 
-                result.tok = id;
+                // the drafted tokens are accepted for as long as they match the sampled ones
+                // the output of each accepted draft token then gives the next token
+                size_t n_accepted = 0;
 
-                const auto * cur_p = gpt_sampler_get_candidates(slot.smpl);
+                while (true) {
+                    completion_token_output result;
 
-                for (size_t i = 0; i < (size_t) slot.sparams.n_probs; ++i) {
-                    result.probs.push_back({
-                        cur_p->data[i].id,
-                        i >= cur_p->size ? 0.0f : cur_p->data[i].p,
-                    });
+                    gpt_sampler_accept(slot.smpl, id, true);
+
+                    slot.n_decoded += 1;
+                    if (slot.n_decoded == 1) {
+                        slot.t_start_generation = ggml_time_us();
+                        slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process_prompt) / 1e3;
+                        metrics.on_prompt_eval(slot);
+                    }
+
+                    if (slot.params.n_draft > 0) {
+                        slot.ngram_tokens.push_back(id);
+                        llama_ngram_cache_update(slot.ngram_cache, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, slot.ngram_tokens, 1, false);
+                    }
+
+                    result.tok = id;
+
+                    const auto * cur_p = gpt_sampler_get_candidates(slot.smpl);
+
+                    for (size_t i = 0; i < (size_t) slot.sparams.n_probs; ++i) {
+                        result.probs.push_back({
+                            cur_p->data[i].id,
+                            i >= cur_p->size ? 0.0f : cur_p->data[i].p,
+                        });
+                    }
+
+                    if (!process_token(result, slot)) {
+                        // release slot because of stop condition
+                        slot.release();
+                        slot.print_timings();
+                        send_final_response(slot);
+                        metrics.on_prediction(slot);
+                        break;
+                    }
+
+                    if (n_accepted >= slot.draft.size() || id != slot.draft[n_accepted]) {
+                        break;
+                    }
+
+                    // the drafted token is already in the KV cache
+                    slot.n_past += 1;
+
+                    if (slot.params.cache_prompt) {
+                        slot.cache_tokens.push_back(id);
+                    }
+
+                    n_accepted += 1;
+                    slot.n_draft_accepted += 1;
+
+                    id = gpt_sampler_sample(slot.smpl, ctx, slot.i_batch_draft - i + n_accepted - 1);
                 }
 
-                if (!process_token(result, slot)) {
-                    // release slot because of stop condition
-                    slot.release();
-                    slot.print_timings();
-                    send_final_response(slot);
-                    metrics.on_prediction(slot);
+                // drop the cells of the rejected drafts
+                if (n_accepted < slot.draft.size()) {
+                    llama_kv_cache_seq_rm(ctx, slot.id + 1, system_tokens.size() + slot.n_past, -1);
                 }
 
+                slot.draft.clear();
+
                 slot.i_batch = -1;
             }
         }
@@ -2707,6 +3829,26 @@ int main(int argc, char ** argv) {
                     {"name",  "n_busy_slots_per_decode"},
                     {"help",  "Average number of busy slots per llama_decode() call"},
                     {"value",  (float) n_busy_slots_total / (float) n_decode_total}
+            }, {
+                    {"name",  "requests_started_total"},
+                    {"help",  "Number of requests that started processing."},
+                    {"value",  (uint64_t) data.at("n_tasks_started_total")}
+            }, {
+                    {"name",  "requests_wait_seconds_total"},
+                    {"help",  "Time requests waited in the queue before they started processing."},
+                    {"value",  (uint64_t) data.at("t_tasks_wait_total") / 1.e6}
+            }, {
+                    {"name",  "requests_deadline_exceeded_total"},
+                    {"help",  "Number of requests dropped because they could not start before their deadline."},
+                    {"value",  (uint64_t) data.at("n_tasks_deadline_exceeded_total")}
+            }, {
+                    {"name",  "tokens_drafted_total"},
+                    {"help",  "Number of tokens drafted from the n-gram caches."},
+                    {"value",  (uint64_t) data.at("n_draft_total")}
+            }, {
+                    {"name",  "tokens_drafted_accepted_total"},
+                    {"help",  "Number of drafted tokens that matched the sampled ones."},
+                    {"value",  (uint64_t) data.at("n_draft_accepted_total")}
             }}},
             {"gauge", {{
                     {"name",  "prompt_tokens_seconds"},
@@ -2732,6 +3874,10 @@ int main(int argc, char ** argv) {
                     {"name",  "requests_deferred"},
                     {"help",  "Number of request deferred."},
                     {"value",  (uint64_t) data.at("deferred")}
+            },{
+                    {"name",  "requests_wait_seconds_max"},
+                    {"help",  "Longest time a request waited in the queue since the last reset."},
+                    {"value",  (uint64_t) data.at("t_tasks_wait_max") / 1.e6}
             }}}
         };
 
@@ -2920,7 +4066,13 @@ int main(int argc, char ** argv) {
             ctx_server.queue_results.remove_waiting_task_ids(task_ids);
         } else {
             const auto chunked_content_provider = [task_ids, &ctx_server](size_t, httplib::DataSink & sink) {
+                std::string buf;
+                buf.reserve(256);
+
                 ctx_server.receive_cmpl_results_stream(task_ids, [&](const server_task_result & result) -> bool {
+                    if (result.partial) {
+                        return server_sent_event_partial(sink, buf, result.content, result.id_slot, result.index);
+                    }
                     return server_sent_event(sink, "data", result.data);
                 }, [&](const json & error_data) {
                     server_sent_event(sink, "error", error_data);
@@ -3377,10 +4529,7 @@ int main(int argc, char ** argv) {
         ctx_server.queue_tasks.terminate();
     };
 
-    LOG_INF("%s: server is listening on %s:%d - starting the main loop\n", __func__, params.hostname.c_str(), params.port);
-
-    ctx_server.queue_tasks.start_loop();
-
+    // the handlers must be set before the main loop blocks, so that a signal stops the loop and the server shuts down cleanly
 #if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
     struct sigaction sigint_action;
     sigint_action.sa_handler = signal_handler;
@@ -3395,6 +4544,10 @@ int main(int argc, char ** argv) {
     SetConsoleCtrlHandler(reinterpret_cast<PHANDLER_ROUTINE>(console_ctrl_handler), true);
 #endif
 
+    LOG_INF("%s: server is listening on %s:%d - starting the main loop\n", __func__, params.hostname.c_str(), params.port);
+
+    ctx_server.queue_tasks.start_loop();
+
     clean_up();
     t.join();
 
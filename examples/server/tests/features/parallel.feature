@@ -107,6 +107,38 @@ Feature: Parallel
       | disabled  | 128       |
       | enabled   | 64        |
 
+  Scenario: Multi users streamed and non-streamed completions with cancellation
+    Given a prompt:
+      """
+      Write a very long story about AI.
+      """
+    And a prompt:
+      """
+      Write another very long music lyrics.
+      """
+    And a prompt:
+      """
+      Write a very long poem.
+      """
+    And a prompt:
+      """
+      Write a very long joke.
+      """
+    And a prompt:
+      """
+      What is LLM?
+      """
+    And a prompt:
+      """
+      The sky is blue and I love it.
+      """
+    And 64 max tokens to predict
+    Given concurrent streamed and non-streamed completion requests, 2 streams cancelled after 4 tokens
+    Then the server is busy
+    Then the server is idle
+    And  all slots are idle
+    Then all non-cancelled prompts are predicted with 64 tokens
+
   Scenario:  Multi users with total number of tokens to predict exceeds the KV Cache size #3969
     Given a prompt:
       """
@@ -0,0 +1,56 @@
+@llama.cpp
+@prefix_cache
+Feature: llama.cpp server prefix cache
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file tinyllamas/stories260K.gguf from HF repo ggml-org/models
+    And   a model file test-model.gguf
+    And   a model alias tinyllama-2
+    And   BOS token is 1
+    And   42 as server seed
+    And   256 KV cache size
+    And   2 slots
+    And   4 cached prefixes
+    And   prompt caching is enabled
+    Then  the server is starting
+    Then  the server is healthy
+
+  Scenario: Context shift of a slot that shares a cached prefix with another slot
+    # slot 0 evaluates the prompt and shares it through the prefix cache
+    Given a prompt:
+    """
+    Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor incididunt ut labore et dolore magna aliqua.
+    Ut enim ad minim veniam, quis nostrud exercitation ullamco laboris nisi ut aliquip ex ea commodo consequat.
+    Duis aute irure dolor in reprehenderit in voluptate velit esse cillum dolore eu fugiat nulla pariatur.
+    Excepteur sint occaecat cupidatat non proident, sunt in culpa qui officia deserunt mollit anim id est laborum.
+    """
+    And   using slot id 0
+    And   8 max tokens to predict
+    And   0.0 temperature
+    And   a completion request with no api error
+    # slot 1 attaches to the same prefix and generates past its context, which shifts the shared cells
+    Given a prompt:
+    """
+    Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor incididunt ut labore et dolore magna aliqua.
+    Ut enim ad minim veniam, quis nostrud exercitation ullamco laboris nisi ut aliquip ex ea commodo consequat.
+    Duis aute irure dolor in reprehenderit in voluptate velit esse cillum dolore eu fugiat nulla pariatur.
+    Excepteur sint occaecat cupidatat non proident, sunt in culpa qui officia deserunt mollit anim id est laborum.
+    """
+    And   using slot id 1
+    And   64 max tokens to predict
+    And   a completion request with no api error
+    Then  64 tokens are predicted
+    And   the completion is  truncated
+    # slot 0 must not see the shifted cells: the same prompt gives the same completion
+    Given a prompt:
+    """
+    Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor incididunt ut labore et dolore magna aliqua.
+    Ut enim ad minim veniam, quis nostrud exercitation ullamco laboris nisi ut aliquip ex ea commodo consequat.
+    Duis aute irure dolor in reprehenderit in voluptate velit esse cillum dolore eu fugiat nulla pariatur.
+    Excepteur sint occaecat cupidatat non proident, sunt in culpa qui officia deserunt mollit anim id est laborum.
+    """
+    And   using slot id 0
+    And   8 max tokens to predict
+    And   a completion request with no api error
+    Then  all predictions are equal
@@ -79,6 +79,7 @@ def step_server_config(context, server_fqdn: str, server_port: str):
     context.temperature = None
     context.lora_file = None
     context.disable_ctx_shift = False
+    context.n_prefix_cache = None
 
     context.tasks_result = []
     context.concurrent_tasks = []
@@ -172,6 +173,11 @@ def step_enable_prompt_cache(context):
     context.cache_prompt = True
 
 
+@step('{n_prefix_cache:d} cached prefixes')
+def step_n_prefix_cache(context, n_prefix_cache: int):
+    context.n_prefix_cache = n_prefix_cache
+
+
 @step('continuous batching')
 def step_server_continuous_batching(context):
     context.server_continuous_batching = True
@@ -608,6 +614,29 @@ async def step_oai_chat_completions(context):
                               if hasattr(context, 'user_api_key') else None)
 
 
+@step('concurrent streamed and non-streamed completion requests, {n_cancelled:d} streams cancelled after {n_tokens:d} tokens')
+@async_run_until_complete
+async def step_concurrent_mixed_completion_requests(context, n_cancelled: int, n_tokens: int):
+    context.n_prompts = len(context.prompts)
+    # even requests are streamed, the first n_cancelled of them disconnect early
+    assert (context.n_prompts + 1) // 2 >= n_cancelled
+    seeds = await completions_seed(context)
+    if seeds is None:
+        seeds = [None] * context.n_prompts
+    for prompt_no in range(context.n_prompts):
+        kwargs = dict(debug=context.debug,
+                      n_predict=context.n_predict if hasattr(context, 'n_predict') else None,
+                      temperature=context.temperature)
+        if prompt_no % 2 == 0:
+            f_completion = request_completion_stream
+            kwargs['cancel_after'] = n_tokens if prompt_no // 2 < n_cancelled else None
+        else:
+            f_completion = request_completion
+        context.concurrent_tasks.append(asyncio.create_task(
+            f_completion(context.prompts.pop(), seeds[prompt_no], context.base_url, **kwargs)))
+    await asyncio.sleep(0.01)
+
+
 @step('all prompts are predicted')
 @async_run_until_complete
 async def step_all_prompts_are_predicted(context):
@@ -620,6 +649,23 @@ async def step_all_prompts_are_predicted_with_n_tokens(context, n_expected_predi
     await all_prompts_are_predicted(context, n_expected_predicted)
 
 
+@step('all non-cancelled prompts are predicted with {n_expected_predicted:d} tokens')
+@async_run_until_complete
+async def step_all_non_cancelled_prompts_are_predicted(context, n_expected_predicted):
+    n_completions = await gather_tasks_results(context)
+    assert n_completions > 0
+    n_cancelled = 0
+    for i in range(n_completions):
+        completion = context.tasks_result.pop()
+        if completion.get('cancelled'):
+            n_cancelled += 1
+            assert len(completion['content']) > 0, "no token received before cancelling"
+        else:
+            assert_n_tokens_predicted(completion, expected_predicted_n=n_expected_predicted)
+    assert n_cancelled > 0, "no request was cancelled"
+    assert len(context.concurrent_tasks) == 0, f"{len(context.concurrent_tasks)} pending requests"
+
+
 async def all_prompts_are_predicted(context, expected_predicted_n=None):
     n_completions = await gather_tasks_results(context)
     assert n_completions > 0
@@ -1012,6 +1058,57 @@ async def request_completion(prompt,
                 return response.status
 
 
+async def request_completion_stream(prompt,
+                                    seed,
+                                    base_url,
+                                    debug=False,
+                                    n_predict=None,
+                                    temperature=None,
+                                    cancel_after=None) -> dict[str, Any]:
+    if debug:
+        print(f"Sending streamed completion request: {prompt}")
+    completion_response = {
+        'content': '',
+        'timings': {
+            'predicted_n': 0,
+            'prompt_n': 0
+        },
+        'cancelled': False,
+    }
+    n_events = 0
+    async with aiohttp.ClientSession(timeout=DEFAULT_TIMEOUT_SECONDS) as session:
+        async with session.post(f'{base_url}/completion',
+                                json={
+                                    "prompt": prompt,
+                                    "n_predict": n_predict if n_predict is not None else -1,
+                                    "seed": seed if seed is not None else 42,
+                                    "temperature": temperature if temperature is not None else 0.8,
+                                    "stream": True,
+                                }) as response:
+            assert response.status == 200
+            assert response.headers['Content-Type'] == "text/event-stream"
+            async for line_in_bytes in response.content:
+                line = line_in_bytes.decode('utf-8').rstrip('\n').rstrip('\r')
+                if line == '':
+                    continue
+                event_data = line.split(': ', 1)
+                assert event_data[0] == 'data', f'Bad event code received: ```{event_data}```'
+                chunk = json.loads(event_data[1])
+                completion_response['content'] += chunk['content']
+                if chunk['stop']:
+                    completion_response['timings'] = chunk['timings']
+                    break
+                n_events += 1
+                if cancel_after is not None and n_events >= cancel_after:
+                    # disconnect in the middle of the generation, the server cancels the task
+                    completion_response['cancelled'] = True
+                    response.close()
+                    break
+    if debug:
+        print("Streamed completion response:", completion_response)
+    return completion_response
+
+
 async def oai_chat_completions(user_prompt,
                                seed,
                                system_prompt,
@@ -1438,6 +1535,8 @@ def start_server_background(context):
         server_args.extend(['--lora', context.lora_file])
     if context.disable_ctx_shift:
         server_args.extend(['--no-context-shift'])
+    if context.n_prefix_cache:
+        server_args.extend(['--prefix-cache', context.n_prefix_cache])
 
     args = [str(arg) for arg in [context.server_path, *server_args]]
     print(f"bench: starting server with: {' '.join(args)}")
@@ -303,6 +303,101 @@ static bool server_sent_event(httplib::DataSink & sink, const char * event, cons
     return sink.write(str.c_str(), str.size());
 }
 
+// append str to out as the contents of a JSON string, escaped the same way as json::dump() does
+// returns false if str is not valid UTF-8 (json::dump() would replace the invalid bytes)
+static bool json_escape_append(std::string & out, const std::string & str) {
+    static const char * hex = "0123456789abcdef";
+
+    const unsigned char * bytes = reinterpret_cast<const unsigned char *>(str.data());
+    const size_t n = str.size();
+
+    for (size_t i = 0; i < n; ) {
+        const unsigned char c = bytes[i];
+
+        if (c < 0x80) {
+            switch (c) {
+                case '"':  out += "\\\""; break;
+                case '\\': out += "\\\\"; break;
+                case '\b': out += "\\b"; break;
+                case '\f': out += "\\f"; break;
+                case '\n': out += "\\n"; break;
+                case '\r': out += "\\r"; break;
+                case '\t': out += "\\t"; break;
+                default:
+                    if (c < 0x20) {
+                        out += "\\u00";
+                        out += hex[c >> 4];
+                        out += hex[c & 0xf];
+                    } else {
+                        out += (char) c;
+                    }
+            }
+            i++;
+            continue;
+        }
+
+        // multi-byte sequence, reject overlong forms, surrogates and code points above U+10FFFF
+        size_t len;
+        unsigned char lo = 0x80;
+        unsigned char hi = 0xBF;
+        if (c >= 0xC2 && c <= 0xDF) {
+            len = 2;
+        } else if (c >= 0xE0 && c <= 0xEF) {
+            len = 3;
+            if (c == 0xE0) { lo = 0xA0; }
+            if (c == 0xED) { hi = 0x9F; }
+        } else if (c >= 0xF0 && c <= 0xF4) {
+            len = 4;
+            if (c == 0xF0) { lo = 0x90; }
+            if (c == 0xF4) { hi = 0x8F; }
+        } else {
+            return false;
+        }
+
+        if (i + len > n || bytes[i + 1] < lo || bytes[i + 1] > hi) {
+            return false;
+        }
+        for (size_t j = 2; j < len; ++j) {
+            if ((bytes[i + j] & 0xC0) != 0x80) {
+                return false;
+            }
+        }
+
+        out.append(str, i, len);
+        i += len;
+    }
+
+    return true;
+}
+
+// send a partial result of a completion stream
+// the event is spliced into a fixed skeleton in buf instead of building and dumping a json object for every token
+// the fields are the same, in the same order, as the json built by send_partial_response()
+static bool server_sent_event_partial(httplib::DataSink & sink, std::string & buf, const std::string & content, int id_slot, size_t index) {
+    buf.clear();
+    buf += "data: {\"content\":\"";
+
+    if (!json_escape_append(buf, content)) {
+        return server_sent_event(sink, "data", json {
+            {"content",    content},
+            {"stop",       false},
+            {"id_slot",    id_slot},
+            {"multimodal", false},
+            {"index",      index},
+        });
+    }
+
+    buf += "\",\"stop\":false,\"id_slot\":";
+    buf += std::to_string(id_slot);
+    buf += ",\"multimodal\":false,\"index\":";
+    buf += std::to_string(index);
+    buf += "}\n\n";
+
+    LOG_DBG("data stream, to_send: %s", buf.c_str());
+
+    return sink.write(buf.data(), buf.size());
+}
+
 //
 // OAI utils
 //
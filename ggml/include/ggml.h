@@ -468,6 +468,8 @@ extern "C" {
 
         GGML_OP_MUL_MAT,
         GGML_OP_MUL_MAT_ID,
+        GGML_OP_RMS_NORM_MUL_MAT,
+        GGML_OP_MUL_MAT_SWIGLU,
         GGML_OP_OUT_PROD,
 
         GGML_OP_SCALE,
@@ -480,6 +482,7 @@ extern "C" {
         GGML_OP_TRANSPOSE,
         GGML_OP_GET_ROWS,
         GGML_OP_GET_ROWS_BACK,
+        GGML_OP_SET_ROWS,
         GGML_OP_DIAG,
         GGML_OP_DIAG_MASK_INF,
         GGML_OP_DIAG_MASK_ZERO,
@@ -500,6 +503,7 @@ extern "C" {
         GGML_OP_ARANGE,
         GGML_OP_TIMESTEP_EMBEDDING,
         GGML_OP_ARGSORT,
+        GGML_OP_TOP_K,
         GGML_OP_LEAKY_RELU,
 
         GGML_OP_FLASH_ATTN_EXT,
@@ -1203,6 +1207,31 @@ extern "C" {
             struct ggml_tensor  * b,
             struct ggml_tensor  * ids);
 
+    // fused rms_norm(a)*b followed by the multiplication with each of the matrices c0, c1, c2
+    // c1 and c2 are optional, all matrices must share the same vec_dot_type
+    // a  -> [k, m] (f32)
+    // b  -> [k]    (f32)
+    // ci -> [k, ni]
+    // result is [n0 + n1 + n2, m] with the outputs of c0, c1, c2 concatenated along dim 0
+    // CPU only, used to fuse the attention norm with the QKV projection
+    GGML_API struct ggml_tensor * ggml_rms_norm_mul_mat(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b,
+            struct ggml_tensor  * c0,
+            struct ggml_tensor  * c1,
+            struct ggml_tensor  * c2,
+            float                 eps);
+
+    // fused silu(gate @ b) * (up @ b)
+    // up and gate must have the same shape and type
+    // CPU only, used to fuse the gate/up projections of a SwiGLU FFN
+    GGML_API struct ggml_tensor * ggml_mul_mat_swiglu(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * up,
+            struct ggml_tensor  * gate,
+            struct ggml_tensor  * b);
+
     // A: m columns, n rows,
     // B: p columns, n rows,
     // result is m columns, p rows
@@ -1416,6 +1445,15 @@ extern "C" {
             struct ggml_tensor  * b,  // row indices
             struct ggml_tensor  * c); // data for ggml_get_rows, only used for its shape
 
+    // a[c[i], i2, i3] = b[i, i2, i3], converting from F32 to the type of a
+    // in-place, returns view(a)
+    // supports strided b rows, the elements of a row must be contiguous
+    GGML_API struct ggml_tensor * ggml_set_rows(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,  // destination
+            struct ggml_tensor  * b,  // F32 source rows
+            struct ggml_tensor  * c); // I32 destination row indices
+
     GGML_API struct ggml_tensor * ggml_diag(
         struct ggml_context     * ctx,
         struct ggml_tensor      * a);
@@ -1793,6 +1831,15 @@ extern "C" {
             struct ggml_tensor  * a,
             int                   k);
 
+    // indices of the k largest elements of each row, sorted by descending value
+    // same result as ggml_top_k, but computed with a partial selection instead of a full sort
+    // a -> [n, m] (f32), result is [k, m] (i32)
+    // CPU only, used to reduce the output logits to the top candidates
+    GGML_API struct ggml_tensor * ggml_top_k_select(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            int                   k);
+
 #define GGML_KQ_MASK_PAD 32
 
     // q:    [n_embd, n_batch,     n_head,    1]
@@ -2104,6 +2151,9 @@ extern "C" {
     GGML_API int                           ggml_threadpool_get_n_threads(struct ggml_threadpool * threadpool);
     GGML_API void                          ggml_threadpool_pause        (struct ggml_threadpool * threadpool);
     GGML_API void                          ggml_threadpool_resume       (struct ggml_threadpool * threadpool);
+    // keep idle workers spinning between graphs for up to hold_us microseconds (-1 - until released, 0 - release)
+    // no-op when ggml is built with OpenMP
+    GGML_API void                          ggml_threadpool_hold         (struct ggml_threadpool * threadpool, int hold_us);
 
     // ggml_graph_plan() has to be called before ggml_graph_compute()
     // when plan.work_size > 0, caller must allocate memory for plan.work_data
@@ -2353,6 +2403,18 @@ extern "C" {
                    int64_t   n_per_row,
                const float * imatrix);
 
+    // runtime repacking of Q4_0 weights into the row-interleaved layout with the fastest gemv/gemm kernels on this CPU
+    // returns cur->type if no interleaved kernels are available or the number of rows does not fit the layout
+    GGML_API enum ggml_type ggml_aarch64_get_optimal_repack_type(const struct ggml_tensor * cur);
+
+    // src and dst may be the same buffer (in-place repack), returns 0 on success
+    GGML_API int ggml_aarch64_repack(
+            enum ggml_type   repack_type,
+                const void * src,
+                      void * dst,
+                   int64_t   nrows,
+                   int64_t   n_per_row);
+
     //
     // gguf
     //
@@ -2490,6 +2552,7 @@ extern "C" {
     GGML_API int ggml_cpu_has_avx512_vbmi(void);
     GGML_API int ggml_cpu_has_avx512_vnni(void);
     GGML_API int ggml_cpu_has_avx512_bf16(void);
+    GGML_API int ggml_cpu_has_amx_int8   (void);
     GGML_API int ggml_cpu_has_fma        (void);
     GGML_API int ggml_cpu_has_neon       (void);
     GGML_API int ggml_cpu_has_sve        (void);
@@ -3207,3 +3207,93 @@ void ggml_gemm_q4_0_8x8_q8_0(int n, float * restrict s, size_t bs, const void *
         }
     }
 }
+
+// Runtime repacking of Q4_0 weights
+
+enum ggml_type ggml_aarch64_get_optimal_repack_type(const struct ggml_tensor * cur) {
+    if (cur->type != GGML_TYPE_Q4_0 || ggml_n_dims(cur) != 2) {
+        return cur->type;
+    }
+
+    // only pick a layout whose gemv/gemm kernels were compiled for this CPU,
+    // otherwise the reference C code would be slower than the plain Q4_0 vec_dot
+#if defined(__AVX2__) || defined(__AVX512F__)
+    if (cur->ne[1] % 8 == 0) {
+        return GGML_TYPE_Q4_0_8_8;
+    }
+#endif
+#if ! ((defined(_MSC_VER)) && ! defined(__clang__)) && defined(__aarch64__)
+#if defined(__ARM_FEATURE_SVE) && defined(__ARM_FEATURE_MATMUL_INT8)
+    if (ggml_cpu_has_sve() && ggml_cpu_has_matmul_int8() && ggml_cpu_get_sve_cnt() == QK8_0 && cur->ne[1] % 8 == 0) {
+        return GGML_TYPE_Q4_0_8_8;
+    }
+#endif
+#if defined(__ARM_NEON) && defined(__ARM_FEATURE_MATMUL_INT8)
+    if (ggml_cpu_has_neon() && ggml_cpu_has_matmul_int8() && cur->ne[1] % 4 == 0) {
+        return GGML_TYPE_Q4_0_4_8;
+    }
+#endif
+#if defined(__ARM_NEON)
+    if (ggml_cpu_has_neon() && cur->ne[1] % 4 == 0) {
+        return GGML_TYPE_Q4_0_4_4;
+    }
+#endif
+#endif
+
+    return cur->type;
+}
+
+int ggml_aarch64_repack(enum ggml_type repack_type, const void * src, void * dst, int64_t nrows, int64_t n_per_row) {
+    int nrows_interleaved;
+    int blck_size_interleave;
+
+    switch (repack_type) {
+        case GGML_TYPE_Q4_0_4_4: nrows_interleaved = 4; blck_size_interleave = 4; break;
+        case GGML_TYPE_Q4_0_4_8: nrows_interleaved = 4; blck_size_interleave = 8; break;
+        case GGML_TYPE_Q4_0_8_8: nrows_interleaved = 8; blck_size_interleave = 8; break;
+        default:
+            return -1;
+    }
+
+    if (n_per_row % QK4_0 != 0 || nrows % nrows_interleaved != 0) {
+        return -1;
+    }
+
+    const int64_t nb = n_per_row / QK4_0;
+
+    // a group of interleaved rows occupies the same bytes as the source rows,
+    // so stage each group in a scratch buffer to allow src == dst
+    block_q4_0 * tmp = (block_q4_0 *) malloc(nrows_interleaved * nb * sizeof(block_q4_0));
+    if (tmp == NULL) {
+        return -1;
+    }
+
+    const block_q4_0 * in = (const block_q4_0 *) src;
+    block_q4_0 dst_tmp[8];
+
+    for (int64_t b = 0; b < nrows; b += nrows_interleaved) {
+        memcpy(tmp, in + b * nb, nrows_interleaved * nb * sizeof(block_q4_0));
+
+        if (nrows_interleaved == 8) {
+            block_q4_0x8 * out = (block_q4_0x8 *) dst + (b / 8) * nb;
+            for (int64_t x = 0; x < nb; x++) {
+                for (int i = 0; i < 8; i++) {
+                    dst_tmp[i] = tmp[i * nb + x];
+                }
+                out[x] = make_block_q4_0x8(dst_tmp, blck_size_interleave, 0x88);
+            }
+        } else {
+            block_q4_0x4 * out = (block_q4_0x4 *) dst + (b / 4) * nb;
+            for (int64_t x = 0; x < nb; x++) {
+                for (int i = 0; i < 4; i++) {
+                    dst_tmp[i] = tmp[i * nb + x];
+                }
+                out[x] = make_block_q4_0x4(dst_tmp, blck_size_interleave, 0x88);
+            }
+        }
+    }
+
+    free(tmp);
+
+    return 0;
+}
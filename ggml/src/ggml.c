@@ -530,7 +530,15 @@ ggml_bf16_t ggml_fp32_to_bf16(float x) {
 }
 
 void ggml_fp16_to_fp32_row(const ggml_fp16_t * x, float * y, int64_t n) {
-    for (int64_t i = 0; i < n; i++) {
+    int64_t i = 0;
+#if defined(__F16C__)
+    for (; i + 7 < n; i += 8) {
+        __m128i x_vec = _mm_loadu_si128((const __m128i *)(x + i));
+        __m256 y_vec = _mm256_cvtph_ps(x_vec);
+        _mm256_storeu_ps(y + i, y_vec);
+    }
+#endif
+    for (; i < n; i++) {
         y[i] = GGML_FP16_TO_FP32(x[i]);
     }
 }
@@ -2081,6 +2089,7 @@ struct ggml_threadpool {
     atomic_bool stop;         // Used for stopping the threadpool altogether
     atomic_bool pause;        // Used for pausing the threadpool or individual threads
     atomic_bool abort;        // Used for aborting processing of a graph
+    atomic_int  hold_us;      // Keep idle workers spinning between graphs (see ggml_threadpool_hold)
 
     struct ggml_compute_state * workers;   // per thread state
     int          n_threads_max; // number of threads in the pool
@@ -3006,6 +3015,8 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
 
     "MUL_MAT",
     "MUL_MAT_ID",
+    "RMS_NORM_MUL_MAT",
+    "MUL_MAT_SWIGLU",
     "OUT_PROD",
 
     "SCALE",
@@ -3018,6 +3029,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "TRANSPOSE",
     "GET_ROWS",
     "GET_ROWS_BACK",
+    "SET_ROWS",
     "DIAG",
     "DIAG_MASK_INF",
     "DIAG_MASK_ZERO",
@@ -3038,6 +3050,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "ARANGE",
     "TIMESTEP_EMBEDDING",
     "ARGSORT",
+    "TOP_K",
     "LEAKY_RELU",
 
     "FLASH_ATTN_EXT",
@@ -3068,7 +3081,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "OPT_STEP_ADAMW",
 };
 
-static_assert(GGML_OP_COUNT == 81, "GGML_OP_COUNT != 81");
+static_assert(GGML_OP_COUNT == 85, "GGML_OP_COUNT != 85");
 
 static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "none",
@@ -3101,6 +3114,8 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
 
     "X*Y",
     "X[i]*Y",
+    "rms_norm(x)*w*Y",
+    "silu(Xg*y)*(Xu*y)",
     "X*Y",
 
     "x*v",
@@ -3113,6 +3128,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "transpose(x)",
     "get_rows(x)",
     "get_rows_back(x)",
+    "set_rows(x)",
     "diag(x)",
     "diag_mask_inf(x)",
     "diag_mask_zero(x)",
@@ -3133,6 +3149,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "arange(start, stop, step)",
     "timestep_embedding(timesteps, dim, max_period)",
     "argsort(x)",
+    "top_k(x)",
     "leaky_relu(x)",
 
     "flash_attn_ext(x)",
@@ -3163,7 +3180,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "adamw(x)",
 };
 
-static_assert(GGML_OP_COUNT == 81, "GGML_OP_COUNT != 81");
+static_assert(GGML_OP_COUNT == 85, "GGML_OP_COUNT != 85");
 
 static_assert(GGML_OP_POOL_COUNT == 2, "GGML_OP_POOL_COUNT != 2");
 
@@ -5701,6 +5718,73 @@ struct ggml_tensor * ggml_mul_mat_id(
     return result;
 }
 
+// ggml_rms_norm_mul_mat
+
+static bool ggml_can_fused_mul_mat(const struct ggml_tensor * w, const struct ggml_tensor * b) {
+    return w->ne[0] == b->ne[0] && ggml_n_dims(w) <= 2 && !ggml_is_transposed(w) &&
+           type_traits[w->type].vec_dot != NULL && type_traits[w->type].gemv == NULL;
+}
+
+struct ggml_tensor * ggml_rms_norm_mul_mat(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        struct ggml_tensor  * c0,
+        struct ggml_tensor  * c1,
+        struct ggml_tensor  * c2,
+        float                 eps) {
+    GGML_ASSERT(a->type == GGML_TYPE_F32 && b->type == GGML_TYPE_F32);
+    GGML_ASSERT(ggml_n_dims(a) <= 2 && a->nb[0] == sizeof(float));
+    GGML_ASSERT(ggml_is_vector(b) && b->ne[0] == a->ne[0]);
+
+    struct ggml_tensor * cs[3] = { c0, c1, c2 };
+
+    int64_t nrows = 0;
+    for (int i = 0; i < 3; ++i) {
+        if (cs[i] == NULL) {
+            continue;
+        }
+        GGML_ASSERT(ggml_can_fused_mul_mat(cs[i], a));
+        GGML_ASSERT(type_traits[cs[i]->type].vec_dot_type == type_traits[c0->type].vec_dot_type);
+        nrows += cs[i]->ne[1];
+    }
+
+    struct ggml_tensor * result = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, nrows, a->ne[1]);
+
+    ggml_set_op_params(result, &eps, sizeof(eps));
+
+    result->op     = GGML_OP_RMS_NORM_MUL_MAT;
+    result->src[0] = a;
+    result->src[1] = b;
+    result->src[2] = c0;
+    result->src[3] = c1;
+    result->src[4] = c2;
+
+    return result;
+}
+
+// ggml_mul_mat_swiglu
+
+struct ggml_tensor * ggml_mul_mat_swiglu(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * up,
+        struct ggml_tensor  * gate,
+        struct ggml_tensor  * b) {
+    GGML_ASSERT(b->type == GGML_TYPE_F32);
+    GGML_ASSERT(ggml_n_dims(b) <= 2 && b->nb[0] == sizeof(float));
+    GGML_ASSERT(ggml_are_same_shape(up, gate) && up->type == gate->type);
+    GGML_ASSERT(ggml_can_fused_mul_mat(up, b));
+
+    struct ggml_tensor * result = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, up->ne[1], b->ne[1]);
+
+    result->op     = GGML_OP_MUL_MAT_SWIGLU;
+    result->src[0] = up;
+    result->src[1] = gate;
+    result->src[2] = b;
+
+    return result;
+}
+
 // ggml_out_prod
 
 struct ggml_tensor * ggml_out_prod(
@@ -6253,6 +6337,31 @@ struct ggml_tensor * ggml_get_rows_back(
     return result;
 }
 
+// ggml_set_rows
+
+struct ggml_tensor * ggml_set_rows(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        struct ggml_tensor  * c) {
+    GGML_ASSERT(a->ne[0] == b->ne[0]);
+    GGML_ASSERT(a->ne[2] == b->ne[2] && a->ne[3] == b->ne[3]);
+    GGML_ASSERT(ggml_is_vector(c) && c->ne[0] == b->ne[1]);
+    GGML_ASSERT(b->type == GGML_TYPE_F32 && b->nb[0] == sizeof(float));
+    GGML_ASSERT(c->type == GGML_TYPE_I32);
+    GGML_ASSERT(a->type == GGML_TYPE_F32 || type_traits[a->type].from_float != NULL);
+    GGML_ASSERT(a->nb[0] == ggml_type_size(a->type));
+
+    struct ggml_tensor * result = ggml_view_tensor(ctx, a);
+
+    result->op     = GGML_OP_SET_ROWS;
+    result->src[0] = a;
+    result->src[1] = b;
+    result->src[2] = c;
+
+    return result;
+}
+
 // ggml_diag
 
 struct ggml_tensor * ggml_diag(
@@ -7092,6 +7201,24 @@ struct ggml_tensor * ggml_top_k(
     return result;
 }
 
+// ggml_top_k_select
+
+struct ggml_tensor * ggml_top_k_select(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        int                   k) {
+    GGML_ASSERT(a->type == GGML_TYPE_F32 && a->nb[0] == sizeof(float));
+    GGML_ASSERT(ggml_n_dims(a) <= 2);
+    GGML_ASSERT(k > 0 && a->ne[0] >= k);
+
+    struct ggml_tensor * result = ggml_new_tensor_2d(ctx, GGML_TYPE_I32, k, a->ne[1]);
+
+    result->op     = GGML_OP_TOP_K;
+    result->src[0] = a;
+
+    return result;
+}
+
 // ggml_flash_attn_ext
 
 struct ggml_tensor * ggml_flash_attn_ext(
@@ -9017,6 +9144,42 @@ static void ggml_compute_forward_dup_bytes(
     }
 }
 
+// dequantizes the rows of src0 into a contiguous F32 dst
+static void ggml_compute_forward_dup_q(
+        const struct ggml_compute_params * params,
+        struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * src0 = dst->src[0];
+
+    GGML_ASSERT(ggml_nelements(dst) == ggml_nelements(src0));
+    GGML_ASSERT(dst->type == GGML_TYPE_F32);
+    GGML_ASSERT(ggml_is_contiguous(dst));
+
+    GGML_TENSOR_UNARY_OP_LOCALS
+
+    const enum ggml_type type = src0->type;
+    ggml_to_float_t const dequantize_row_q = type_traits[type].to_float;
+
+    GGML_ASSERT(nb00 == ggml_type_size(type));
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    // parallelize by rows
+    const int64_t nr  = ne01*ne02*ne03;
+    const int64_t dr  = (nr + nth - 1)/nth;
+    const int64_t ir0 = dr*ith;
+    const int64_t ir1 = MIN(ir0 + dr, nr);
+
+    for (int64_t ir = ir0; ir < ir1; ++ir) {
+        const int64_t i03 = ir/(ne02*ne01);
+        const int64_t i02 = (ir - i03*ne02*ne01)/ne01;
+        const int64_t i01 = (ir - i03*ne02*ne01 - i02*ne01);
+
+        dequantize_row_q((const char *) src0->data + (i01*nb01 + i02*nb02 + i03*nb03), (float *) dst->data + ir*ne00, ne00);
+    }
+}
+
 static void ggml_compute_forward_dup(
         const struct ggml_compute_params * params,
         struct ggml_tensor * dst) {
@@ -9043,6 +9206,10 @@ static void ggml_compute_forward_dup(
             } break;
         default:
             {
+                if (ggml_is_quantized(src0->type) && dst->type == GGML_TYPE_F32) {
+                    ggml_compute_forward_dup_q(params, dst);
+                    break;
+                }
                 GGML_ABORT("fatal error");
             }
     }
@@ -12858,6 +13025,154 @@ static void ggml_compute_forward_mul_mat_id(
 #undef MMID_MATRIX_ROW
 }
 
+// ggml_compute_forward_rms_norm_mul_mat
+
+static void ggml_compute_forward_rms_norm_mul_mat(
+        const struct ggml_compute_params * params,
+              struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * src0 = dst->src[0]; // activations
+    const struct ggml_tensor * src1 = dst->src[1]; // norm weights
+
+    const struct ggml_tensor * ws[3] = { dst->src[2], dst->src[3], dst->src[4] };
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t ne00 = src0->ne[0];
+    const int64_t ne01 = src0->ne[1];
+
+    float eps;
+    memcpy(&eps, dst->op_params, sizeof(float));
+
+    GGML_ASSERT(eps > 0.0f);
+
+    enum ggml_type    const vec_dot_type = type_traits[ws[0]->type].vec_dot_type;
+    ggml_from_float_t const from_float   = type_traits[vec_dot_type].from_float;
+
+    const size_t row_size = ggml_row_size(vec_dot_type, ne00);
+
+    float * wnorm  = (float *) params->wdata;
+    char  * wquant = (char  *) params->wdata + GGML_PAD(ne00*ne01*sizeof(float), CACHE_LINE_SIZE);
+
+    // normalize, scale and convert each activation row exactly once
+    for (int64_t i01 = ith; i01 < ne01; i01 += nth) {
+        const float * x = (const float *) ((const char *) src0->data + i01*src0->nb[1]);
+              float * y = wnorm + i01*ne00;
+
+        ggml_float sum = 0.0;
+        for (int64_t i00 = 0; i00 < ne00; i00++) {
+            sum += (ggml_float)(x[i00] * x[i00]);
+        }
+
+        const float mean  = sum/ne00;
+        const float scale = 1.0f/sqrtf(mean + eps);
+
+        ggml_vec_mul_f32(ne00, y, x, (const float *) src1->data);
+        ggml_vec_scale_f32(ne00, y, scale);
+
+        if (vec_dot_type != GGML_TYPE_F32) {
+            from_float(y, wquant + i01*row_size, ne00);
+        }
+    }
+
+    ggml_barrier(params->threadpool);
+
+    const char * wdata = vec_dot_type == GGML_TYPE_F32 ? (const char *) wnorm : wquant;
+
+    // the output rows of all matrices are split evenly across the threads
+    const int64_t nr  = dst->ne[0];
+    const int64_t dr  = (nr + nth - 1)/nth;
+    const int64_t ir0 = MIN(dr*ith, nr);
+    const int64_t ir1 = MIN(ir0 + dr, nr);
+
+    const int64_t blck_0 = 16;
+
+    int64_t row_base = 0;
+    for (int iw = 0; iw < 3 && ws[iw] != NULL; ++iw) {
+        const struct ggml_tensor * w = ws[iw];
+
+        const int64_t w_start = MAX(ir0, row_base);
+        const int64_t w_end   = MIN(ir1, row_base + w->ne[1]);
+
+        ggml_vec_dot_t const vec_dot = type_traits[w->type].vec_dot;
+
+        for (int64_t iir = w_start; iir < w_end; iir += blck_0) {
+            const int64_t iir_end = MIN(iir + blck_0, w_end);
+            for (int64_t i1 = 0; i1 < ne01; ++i1) {
+                const char * y = wdata + i1*row_size;
+                float * d = (float *) ((char *) dst->data + i1*dst->nb[1]);
+                for (int64_t ir = iir; ir < iir_end; ++ir) {
+                    vec_dot(ne00, &d[ir], 0, (const char *) w->data + (ir - row_base)*w->nb[1], 0, y, 0, 1);
+                }
+            }
+        }
+
+        row_base += w->ne[1];
+    }
+}
+
+// ggml_compute_forward_mul_mat_swiglu
+
+static void ggml_compute_forward_mul_mat_swiglu(
+        const struct ggml_compute_params * params,
+              struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * up   = dst->src[0];
+    const struct ggml_tensor * gate = dst->src[1];
+    const struct ggml_tensor * src1 = dst->src[2];
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t ne10 = src1->ne[0];
+    const int64_t ne11 = src1->ne[1];
+
+    ggml_vec_dot_t    const vec_dot      = type_traits[up->type].vec_dot;
+    enum ggml_type    const vec_dot_type = type_traits[up->type].vec_dot_type;
+    ggml_from_float_t const from_float   = type_traits[vec_dot_type].from_float;
+
+    const size_t row_size = ggml_row_size(vec_dot_type, ne10);
+
+    if (vec_dot_type != GGML_TYPE_F32) {
+        for (int64_t i11 = ith; i11 < ne11; i11 += nth) {
+            from_float((const float *) ((const char *) src1->data + i11*src1->nb[1]),
+                       (char *) params->wdata + i11*row_size, ne10);
+        }
+
+        ggml_barrier(params->threadpool);
+    }
+
+    const char * wdata = vec_dot_type == GGML_TYPE_F32 ? (const char *) src1->data : (const char *) params->wdata;
+    const size_t y_stride = vec_dot_type == GGML_TYPE_F32 ? src1->nb[1] : row_size;
+
+    const int64_t nr  = dst->ne[0];
+    const int64_t dr  = (nr + nth - 1)/nth;
+    const int64_t ir0 = MIN(dr*ith, nr);
+    const int64_t ir1 = MIN(ir0 + dr, nr);
+
+    const int64_t blck_0 = 16;
+
+    float tmp_u[16];
+    float tmp_g[16];
+
+    for (int64_t iir = ir0; iir < ir1; iir += blck_0) {
+        const int64_t iir_end = MIN(iir + blck_0, ir1);
+        for (int64_t i1 = 0; i1 < ne11; ++i1) {
+            const char * y = wdata + i1*y_stride;
+            float * d = (float *) ((char *) dst->data + i1*dst->nb[1]);
+            for (int64_t ir = iir; ir < iir_end; ++ir) {
+                vec_dot(ne10, &tmp_u[ir - iir], 0, (const char *) up->data   + ir*up->nb[1],   0, y, 0, 1);
+                vec_dot(ne10, &tmp_g[ir - iir], 0, (const char *) gate->data + ir*gate->nb[1], 0, y, 0, 1);
+            }
+            // SiLU-multiply epilogue while the dot products are still hot
+            for (int64_t ir = iir; ir < iir_end; ++ir) {
+                d[ir] = ggml_silu_f32(tmp_g[ir - iir])*tmp_u[ir - iir];
+            }
+        }
+    }
+}
+
 // ggml_compute_forward_out_prod
 
 static void ggml_compute_forward_out_prod_f32(
@@ -12878,10 +13193,15 @@ static void ggml_compute_forward_out_prod_f32(
 
     GGML_ASSERT(ne0  == ne00);
     GGML_ASSERT(ne1  == ne10);
-    GGML_ASSERT(ne2  == ne02);
-    GGML_ASSERT(ne02 == ne12);
+    GGML_ASSERT(ne2  == ne12);
     GGML_ASSERT(ne3  == ne13);
-    GGML_ASSERT(ne03 == ne13);
+
+    // src0 is broadcast across dims 2 and 3 of src1
+    GGML_ASSERT(ne12 % ne02 == 0);
+    GGML_ASSERT(ne13 % ne03 == 0);
+
+    const int64_t r2 = ne12/ne02;
+    const int64_t r3 = ne13/ne03;
 
     // we don't support permuted src0 or src1
     GGML_ASSERT(nb00 == sizeof(float));
@@ -12905,7 +13225,7 @@ static void ggml_compute_forward_out_prod_f32(
     //   for i1:
     //     for i01:
     //       for i0:
-    //         dst[i0,i1,i2,i3] += src0[i0,i01,i2,i3] * src1[i1,i01,i2,i3]
+    //         dst[i0,i1,i2,i3] += src0[i0,i01,i2/r2,i3/r3] * src1[i1,i01,i2,i3]
 
     // parallelize by last three dimensions
 
@@ -12933,8 +13253,8 @@ static void ggml_compute_forward_out_prod_f32(
                 const int64_t i2 = (ir - i3*ne2*ne1)/ne1;
                 const int64_t i1 = (ir - i3*ne2*ne1 - i2*ne1);
 
-                const int64_t i02 = i2;
-                const int64_t i03 = i3;
+                const int64_t i02 = i2/r2;
+                const int64_t i03 = i3/r3;
 
                 //const int64_t i10 = i1;
                 const int64_t i12 = i2;
@@ -12991,11 +13311,15 @@ static void ggml_compute_forward_out_prod_q_f32(
     const enum ggml_type type = src0->type;
     ggml_to_float_t const dequantize_row_q = type_traits[type].to_float;
 
-    GGML_ASSERT(ne02 == ne12);
-    GGML_ASSERT(ne03 == ne13);
+    // src0 is broadcast across dims 2 and 3 of src1 (e.g. a KV head shared by several query heads)
+    GGML_ASSERT(ne12 % ne02 == 0);
+    GGML_ASSERT(ne13 % ne03 == 0);
     GGML_ASSERT(ne2  == ne12);
     GGML_ASSERT(ne3  == ne13);
 
+    const int64_t r2 = ne12/ne02;
+    const int64_t r3 = ne13/ne03;
+
     // we don't support permuted src0 dim0
     GGML_ASSERT(nb00 == ggml_type_size(type));
 
@@ -13005,10 +13329,9 @@ static void ggml_compute_forward_out_prod_q_f32(
     // GGML_ASSERT(nb1 <= nb2);
     // GGML_ASSERT(nb2 <= nb3);
 
-    GGML_ASSERT(ne0 == ne00);
-    GGML_ASSERT(ne1 == ne10);
-    GGML_ASSERT(ne2 == ne02);
-    GGML_ASSERT(ne3 == ne03);
+    GGML_ASSERT(ne0  == ne00);
+    GGML_ASSERT(ne1  == ne10);
+    GGML_ASSERT(ne01 == ne11);
 
     // nb01 >= nb00 - src0 is not transposed
     //   compute by src0 rows
@@ -13018,49 +13341,63 @@ static void ggml_compute_forward_out_prod_q_f32(
     }
     ggml_barrier(params->threadpool);
 
-    // parallelize by last three dimensions
+    // dst[:,:,:,:] = 0
+    // for i2,i3:
+    //   for i1:
+    //     for i01:
+    //       for i0:
+    //         dst[i0,i1,i2,i3] += src0[i0,i01,i2/r2,i3/r3] * src1[i1,i01,i2,i3]
 
-    // total rows in dst
-    const int64_t nr = ne1*ne2*ne3;
+    // parallelize by blocks of dst rows of the matrices that share a matrix of src0
+    // each row of src0 is dequantized once per block
+    const int64_t blck_1 = 16;
 
-    // rows per thread
+    // blocks per matrix of src0 and in total
+    const int64_t nb1b = (ne1 + blck_1 - 1)/blck_1;
+    const int64_t nr   = nb1b*ne02*ne3;
+
+    // blocks per thread
     const int64_t dr = (nr + nth - 1)/nth;
 
-    // row range for this thread
+    // block range for this thread
     const int64_t ir0 = dr*ith;
     const int64_t ir1 = MIN(ir0 + dr, nr);
 
-    // dst[:,:,:,:] = 0
-    // for i2,i3:
-    //   for i1:
-    //     for i01:
-    //       for i0:
-    //         dst[i0,i1,i2,i3] += src0[i0,i01,i2,i3] * src1[i1,i01,i2,i3]
-
     float * wdata = (float *) params->wdata + (ne0 + CACHE_LINE_SIZE_F32) * ith;
 
     for (int64_t ir = ir0; ir < ir1; ++ir) {
-        // dst indices
-        const int64_t i3 = ir/(ne2*ne1);
-        const int64_t i2 = (ir - i3*ne2*ne1)/ne1;
-        const int64_t i1 = (ir - i3*ne2*ne1 - i2*ne1);
-
-        const int64_t i02 = i2;
-        const int64_t i03 = i3;
+        // src0 and dst indices
+        const int64_t i3  = ir/(ne02*nb1b);
+        const int64_t i02 = (ir - i3*ne02*nb1b)/nb1b;
+        const int64_t i10 = (ir - i3*ne02*nb1b - i02*nb1b)*blck_1;
+        const int64_t i11 = MIN(i10 + blck_1, ne1);
 
-        //const int64_t i10 = i1;
-        const int64_t i12 = i2;
-        const int64_t i13 = i3;
+        const int64_t i03 = i3/r3;
 
         for (int64_t i01 = 0; i01 < ne01; ++i01) {
-            const int64_t i11 = i01;
+            bool dequantized = false;
+
+            for (int64_t i2 = i02*r2; i2 < (i02 + 1)*r2; ++i2) {
+                const char * s1 = (const char *) src1->data + (i01*nb11 + i2*nb12 + i3*nb13);
+
+                for (int64_t i1 = i10; i1 < i11; ++i1) {
+                    const float v = *(const float *) (s1 + i1*nb10);
+
+                    // skip the zero weights (e.g. masked KV cells after the softmax)
+                    if (v == 0.0f) {
+                        continue;
+                    }
+
+                    if (!dequantized) {
+                        dequantize_row_q((const char *) src0->data + (i01*nb01 + i02*nb02 + i03*nb03), wdata, ne0);
+                        dequantized = true;
+                    }
 
-            float * s0 = (float *) ((char *) src0->data + (          i01*nb01 + i02*nb02 + i03*nb03));
-            float * s1 = (float *) ((char *) src1->data + (i1*nb10 + i11*nb11 + i12*nb12 + i13*nb13));
-            float * d  = (float *) ((char *)  dst->data + (          i1*nb1 + i2*nb2 + i3*nb3));
+                    float * d = (float *) ((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3));
 
-            dequantize_row_q(s0, wdata, ne0);
-            ggml_vec_mad_f32(ne0, d, wdata, *s1);
+                    ggml_vec_mad_f32(ne0, d, wdata, v);
+                }
+            }
         }
     }
 }
@@ -13101,9 +13438,9 @@ static void ggml_compute_forward_out_prod(
             } break;
         case GGML_TYPE_F16:
             {
-                GGML_ABORT("fatal error"); // todo
-                // ggml_compute_forward_out_prod_f16_f32(params, dst);
-            }
+                // the rows are converted like the quantized ones
+                ggml_compute_forward_out_prod_q_f32(params, dst);
+            } break;
         case GGML_TYPE_F32:
             {
                 ggml_compute_forward_out_prod_f32(params, dst);
@@ -13699,6 +14036,56 @@ static void ggml_compute_forward_get_rows_back(
     //}
 }
 
+// ggml_compute_forward_set_rows
+
+static void ggml_compute_forward_set_rows(
+        const struct ggml_compute_params * params,
+        struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * src0 = dst->src[0];
+    const struct ggml_tensor * src1 = dst->src[1];
+    const struct ggml_tensor * src2 = dst->src[2];
+
+    GGML_TENSOR_BINARY_OP_LOCALS
+
+    const int64_t nc = ne00;
+    const int64_t nr = ne11*ne12*ne13;
+
+    assert(ne0 == ne00 && ne1 == ne01 && ne10 == nc);
+    assert(nb10 == sizeof(float));
+    assert(src0->data == dst->data);
+
+    ggml_from_float_t const from_float = type_traits[dst->type].from_float;
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    // rows per thread
+    const int64_t dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int64_t ir0 = dr*ith;
+    const int64_t ir1 = MIN(ir0 + dr, nr);
+
+    for (int64_t i = ir0; i < ir1; ++i) {
+        const int64_t i13 = i/(ne11*ne12);
+        const int64_t i12 = (i - i13*ne11*ne12)/ne11;
+        const int64_t i11 = (i - i13*ne11*ne12 - i12*ne11);
+        const int64_t i01 = *(int32_t *) ((char *) src2->data + i11*src2->nb[0]);
+
+        GGML_ASSERT(i01 >= 0 && i01 < ne01);
+
+        const float * x = (const float *) ((char *) src1->data + i11*nb11 + i12*nb12 + i13*nb13);
+              char  * y = (char *) dst->data + i01*nb1 + i12*nb2 + i13*nb3;
+
+        if (dst->type == GGML_TYPE_F32) {
+            memcpy(y, x, nc*sizeof(float));
+        } else {
+            from_float(x, y, nc);
+        }
+    }
+}
+
 // ggml_compute_forward_diag
 
 static void ggml_compute_forward_diag_f32(
@@ -15605,8 +15992,189 @@ static void ggml_compute_forward_argsort(
     }
 }
 
+// ggml_compute_forward_top_k
+
+// candidates of a partial top-k selection, kept in a min-heap of at most k elements
+struct ggml_top_k_heap {
+    float   * v;
+    int32_t * id;
+    int       n;
+    int       k;
+};
+
+static void ggml_top_k_heap_sift_down(struct ggml_top_k_heap * h, int i) {
+    for (;;) {
+        const int l = 2*i + 1;
+        const int r = l + 1;
+        int m = i;
+        if (l < h->n && h->v[l] < h->v[m]) m = l;
+        if (r < h->n && h->v[r] < h->v[m]) m = r;
+        if (m == i) {
+            break;
+        }
+        const float   tv  = h->v[i];  h->v[i]  = h->v[m];  h->v[m]  = tv;
+        const int32_t tid = h->id[i]; h->id[i] = h->id[m]; h->id[m] = tid;
+        i = m;
+    }
+}
+
+static inline void ggml_top_k_heap_push(struct ggml_top_k_heap * h, float v, int32_t id) {
+    if (h->n < h->k) {
+        // sift up
+        int i = h->n++;
+        while (i > 0 && v < h->v[(i - 1)/2]) {
+            h->v[i]  = h->v[(i - 1)/2];
+            h->id[i] = h->id[(i - 1)/2];
+            i = (i - 1)/2;
+        }
+        h->v[i]  = v;
+        h->id[i] = id;
+    } else if (v > h->v[0]) {
+        h->v[0]  = v;
+        h->id[0] = id;
+        ggml_top_k_heap_sift_down(h, 0);
+    }
+}
+
+// rows are scanned in blocks that are first compared against the smallest selected value with a branch-free count
+// (vectorized by the compiler), so only the few blocks that contain a new candidate touch the heap
+#define GGML_TOP_K_BLOCK 32
+
+static void ggml_top_k_heap_add_row(struct ggml_top_k_heap * h, const float * x, int64_t i0, int64_t i1) {
+    int64_t i = i0;
+    for (; i < i1 && h->n < h->k; ++i) {
+        ggml_top_k_heap_push(h, x[i], (int32_t) i);
+    }
+
+    for (; i + GGML_TOP_K_BLOCK <= i1; i += GGML_TOP_K_BLOCK) {
+        const float thold = h->v[0];
+
+        int n_above = 0;
+        for (int j = 0; j < GGML_TOP_K_BLOCK; ++j) {
+            n_above += x[i + j] > thold;
+        }
+
+        if (n_above == 0) {
+            continue;
+        }
+
+        for (int j = 0; j < GGML_TOP_K_BLOCK; ++j) {
+            ggml_top_k_heap_push(h, x[i + j], (int32_t) (i + j));
+        }
+    }
+
+    for (; i < i1; ++i) {
+        ggml_top_k_heap_push(h, x[i], (int32_t) i);
+    }
+}
+
+// heap sort - the smallest values move to the back, so the ids end up sorted by descending value
+static void ggml_top_k_heap_sort(struct ggml_top_k_heap * h, int32_t * dst) {
+    const int n = h->n;
+    while (h->n > 1) {
+        const int last = --h->n;
+        const float   tv  = h->v[0];  h->v[0]  = h->v[last];  h->v[last]  = tv;
+        const int32_t tid = h->id[0]; h->id[0] = h->id[last]; h->id[last] = tid;
+        ggml_top_k_heap_sift_down(h, 0);
+    }
+    memcpy(dst, h->id, n*sizeof(int32_t));
+}
+
+static void ggml_compute_forward_top_k_f32(
+        const struct ggml_compute_params * params,
+              struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * src0 = dst->src[0];
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t n  = src0->ne[0];
+    const int64_t nr = ggml_nrows(src0);
+    const int     k  = dst->ne[0];
+
+    // per-thread heap storage, see ggml_graph_plan
+    const size_t wsize = GGML_PAD(k*(sizeof(float) + sizeof(int32_t)), CACHE_LINE_SIZE);
+
+    char * wdata = (char *) params->wdata;
+
+    struct ggml_top_k_heap h = {
+        /*.v  =*/ (float   *) (wdata + ith*wsize),
+        /*.id =*/ (int32_t *) (wdata + ith*wsize + k*sizeof(float)),
+        /*.n  =*/ 0,
+        /*.k  =*/ k,
+    };
+
+    if (nr >= nth) {
+        // one row per thread
+        for (int64_t ir = ith; ir < nr; ir += nth) {
+            const float * x = (const float *) ((const char *) src0->data + ir*src0->nb[1]);
+
+            h.n = 0;
+            ggml_top_k_heap_add_row(&h, x, 0, n);
+            ggml_top_k_heap_sort(&h, (int32_t *) ((char *) dst->data + ir*dst->nb[1]));
+        }
+        return;
+    }
+
+    // few rows (typically a single output) - split each row between the threads and merge the candidates
+    const int64_t dr = (n + nth - 1)/nth;
+    const int64_t i0 = MIN(n, ith*dr);
+    const int64_t i1 = MIN(n, i0 + dr);
+
+    for (int64_t ir = 0; ir < nr; ++ir) {
+        const float * x = (const float *) ((const char *) src0->data + ir*src0->nb[1]);
+
+        h.n = 0;
+        ggml_top_k_heap_add_row(&h, x, i0, i1);
+
+        // the heap is full (or empty for trailing threads), so its size is implied by the range
+        ggml_barrier(params->threadpool);
+
+        if (ith == 0) {
+            for (int t = 1; t < nth; ++t) {
+                const int64_t t0 = MIN(n, t*dr);
+                const int     nt = (int) MIN((int64_t) k, MIN(n, t0 + dr) - t0);
+
+                const float   * v  = (const float   *) (wdata + t*wsize);
+                const int32_t * id = (const int32_t *) (wdata + t*wsize + k*sizeof(float));
+
+                for (int j = 0; j < nt; ++j) {
+                    ggml_top_k_heap_push(&h, v[j], id[j]);
+                }
+            }
+
+            ggml_top_k_heap_sort(&h, (int32_t *) ((char *) dst->data + ir*dst->nb[1]));
+        }
+
+        ggml_barrier(params->threadpool);
+    }
+}
+
+static void ggml_compute_forward_top_k(
+        const struct ggml_compute_params * params,
+        struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * src0 = dst->src[0];
+
+    switch (src0->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_top_k_f32(params, dst);
+            } break;
+        default:
+            {
+                GGML_ABORT("fatal error");
+            }
+    }
+}
+
 // ggml_compute_forward_flash_attn_ext
 
+// tile sizes of the CPU flash attention kernel
+#define GGML_FA_TILE_Q  8  // max q rows that share a K/V head and are processed together
+#define GGML_FA_TILE_KV 32 // K/V rows per online softmax step
+
 static void ggml_compute_forward_flash_attn_ext_f16(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * q,
@@ -15658,18 +16226,6 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     const int64_t rv2 = neq2/nev2;
     const int64_t rv3 = neq3/nev3;
 
-    // parallelize by q rows using ggml_vec_dot_f32
-
-    // total rows in q
-    const int nr = neq1*neq2*neq3;
-
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
-
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
-
     float scale         = 1.0f;
     float max_bias      = 0.0f;
     float logit_softcap = 0.0f;
@@ -15693,129 +16249,187 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     ggml_vec_dot_t    const kq_vec_dot     = type_traits[k->type].vec_dot;
     ggml_to_float_t   const v_to_float     = type_traits[v->type].to_float;
 
-    // loop over n_batch and n_head
-    for (int ir = ir0; ir < ir1; ++ir) {
-        // q indices
-        const int iq3 = ir/(neq2*neq1);
-        const int iq2 = (ir - iq3*neq2*neq1)/neq1;
-        const int iq1 = (ir - iq3*neq2*neq1 - iq2*neq1);
+    const size_t q_row_size = ggml_row_size(k_vec_dot_type, D);
 
-        const uint32_t h = iq2; // head index
-        const float slope = (max_bias > 0.0f) ? h < n_head_log2 ? powf(m0, h + 1) : powf(m1, 2*(h - n_head_log2) + 1) : 1.0f;
-
-        float S = 0.0f;      // sum
-        float M = -INFINITY; // maximum KQ value
-
-        float       * VKQ32 = (float       *) params->wdata + ith*(3*D + CACHE_LINE_SIZE_F32); // FP32 VKQ accumulator
-        float       * V32   =                 (VKQ32 + 1*D); // (temporary) FP32 V buffer
-        ggml_fp16_t * VKQ16 = (ggml_fp16_t *) (VKQ32 + 1*D); // (temporary) FP16 VKQ accumulator
-        ggml_fp16_t * Q_q   = (ggml_fp16_t *) (VKQ32 + 2*D); // (temporary) buffer for Q converted to quantized/FP16
+    // the q rows are processed in groups that attend to the same K/V head: up to GGML_FA_TILE_Q rows made of
+    // gh consecutive heads (GQA) times gt consecutive tokens, so that each K/V row is loaded once per group
+    // the groups are shrunk until there is at least one group per thread
+    int64_t gh = 1;
+    if (rk2 == rv2 && rk3 == rv3) {
+        while (2*gh <= GGML_FA_TILE_Q && rk2 % (2*gh) == 0) {
+            gh *= 2;
+        }
+    }
+    int64_t gt = MIN(GGML_FA_TILE_Q/gh, N);
 
-        if (v->type == GGML_TYPE_F16) {
-            memset(VKQ16, 0, D*sizeof(ggml_fp16_t));
+    int64_t ng = neq3*(neq2/gh)*((N + gt - 1)/gt);
+    while (ng < nth && (gt > 1 || gh > 1)) {
+        if (gt > 1) {
+            gt = (gt + 1)/2;
         } else {
-            memset(VKQ32, 0, D*sizeof(float));
+            gh /= 2;
         }
+        ng = neq3*(neq2/gh)*((N + gt - 1)/gt);
+    }
+
+    const int64_t nhb = neq2/gh;           // head blocks
+    const int64_t ntb = (N + gt - 1)/gt;   // token blocks
+
+    // groups per thread
+    const int64_t dg = (ng + nth - 1)/nth;
+
+    // group range for this thread
+    const int64_t ig0 = dg*ith;
+    const int64_t ig1 = MIN(ig0 + dg, ng);
+
+    float * VKQ32 = (float *) params->wdata + ith*(GGML_FA_TILE_Q*(2*D + GGML_FA_TILE_KV + 3) + D + CACHE_LINE_SIZE_F32); // FP32 VKQ accumulators
+    float * V32   = VKQ32 + GGML_FA_TILE_Q*D;                // (temporary) FP32 V row
+    float * KQ    = V32   + D;                               // KQ values of the current K/V tile, softmax-ed in place
+    float * Ms    = KQ    + GGML_FA_TILE_Q*GGML_FA_TILE_KV;  // running maximum KQ value per row
+    float * Ss    = Ms    + GGML_FA_TILE_Q;                  // running sum per row
+    float * slope = Ss    + GGML_FA_TILE_Q;                  // ALiBi slope per row
+    char  * Q_q   = (char *) (slope + GGML_FA_TILE_Q);       // Q rows converted to the vec dot type of K
 
-        const ggml_fp16_t * mp = mask ? (ggml_fp16_t *)((char *) mask->data + iq1*mask->nb[1]) : NULL;
+    for (int64_t ig = ig0; ig < ig1; ++ig) {
+        const int64_t iq3 = ig/(nhb*ntb);
+        const int64_t hb  = (ig - iq3*nhb*ntb)/ntb;
+        const int64_t tb  = (ig - iq3*nhb*ntb - hb*ntb);
+
+        const int64_t h0 = hb*gh;
+        const int64_t t0 = tb*gt;
+        const int64_t nt = MIN(gt, N - t0);
+        const int64_t nr = nt*gh; // rows in the group, row r is token t0 + r/gh of head h0 + r%gh
 
         // k indices
-        const int ik3 = iq3 / rk3;
-        const int ik2 = iq2 / rk2;
+        const int64_t ik3 = iq3 / rk3;
+        const int64_t ik2 = h0  / rk2;
 
         // v indices
-        const int iv3 = iq3 / rv3;
-        const int iv2 = iq2 / rv2;
+        const int64_t iv3 = iq3 / rv3;
+        const int64_t iv2 = h0  / rv2;
+
+        for (int64_t r = 0; r < nr; ++r) {
+            const int64_t  iq1 = t0 + r/gh;
+            const uint32_t h   = h0 + r%gh; // head index
 
-        const float * pq = (const float *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3));
-        q_to_vec_dot(pq, Q_q, D);
+            const float * pq = (const float *) ((char *) q->data + (iq1*nbq1 + h*nbq2 + iq3*nbq3));
+            q_to_vec_dot(pq, Q_q + r*q_row_size, D);
+
+            slope[r] = (max_bias > 0.0f) ? h < n_head_log2 ? powf(m0, h + 1) : powf(m1, 2*(h - n_head_log2) + 1) : 1.0f;
+            Ms[r]    = -INFINITY;
+            Ss[r]    = 0.0f;
+        }
+        memset(VKQ32, 0, nr*D*sizeof(float));
 
-        // online softmax / attention
-        // loop over n_kv and n_head_kv
+        // online softmax / attention, one K/V tile at a time
         // ref: https://arxiv.org/pdf/2112.05682.pdf
-        for (int64_t ic = 0; ic < nek1; ++ic) {
-            const float mv = mp ? slope*GGML_FP16_TO_FP32(mp[ic]) : 0.0f;
-            if (mv == -INFINITY) {
-                continue;
-            }
+        for (int64_t ic0 = 0; ic0 < nek1; ic0 += GGML_FA_TILE_KV) {
+            const int64_t nc = MIN(GGML_FA_TILE_KV, nek1 - ic0);
 
-            float s; // KQ value
+            // KQ = K*Q for the tile
+            for (int64_t c = 0; c < nc; ++c) {
+                const int64_t ic = ic0 + c;
 
-            const char * k_data = (const char *) k->data + ( ic*nbk1 + ik2*nbk2 + ik3*nbk3);
-            kq_vec_dot(D, &s, 0, k_data, 0, Q_q, 0, 1);
+                const char * k_data = (const char *) k->data + (ic*nbk1 + ik2*nbk2 + ik3*nbk3);
 
-            s = s*scale; // scale KQ value
+                for (int64_t t = 0; t < nt; ++t) {
+                    const ggml_fp16_t * mp = mask ? (ggml_fp16_t *)((char *) mask->data + (t0 + t)*mask->nb[1]) : NULL;
+                    const float mv = mp ? GGML_FP16_TO_FP32(mp[ic]) : 0.0f;
 
-            if (logit_softcap != 0.0f) {
-                s = logit_softcap*tanhf(s);
-            }
+                    for (int64_t j = 0; j < gh; ++j) {
+                        const int64_t r = t*gh + j;
 
-            s += mv; // apply mask
+                        if (mv == -INFINITY) {
+                            KQ[r*GGML_FA_TILE_KV + c] = -INFINITY;
+                            continue;
+                        }
 
-            const float Mold = M;
+                        float s; // KQ value
+                        kq_vec_dot(D, &s, 0, k_data, 0, Q_q + r*q_row_size, 0, 1);
 
-            float ms = 1.0f; // upon new higher max val, scale VKQ and KQ sum with this value
-            float vs = 1.0f; // post-softmax KQ value, expf(s - M)
+                        s = s*scale; // scale KQ value
 
-            const char * v_data = ((const char *) v->data + (ic*nbv1 + iv2*nbv2 + iv3*nbv3));
+                        if (logit_softcap != 0.0f) {
+                            s = logit_softcap*tanhf(s);
+                        }
 
-            if (v->type == GGML_TYPE_F16) {
-                if (s > M) {
-                    // s is new maximum, ms < 1.0f, vs == expf(s - s) == 1.0f
-                    M = s;
-                    ms = expf(Mold - M);
+                        s += slope[r]*mv; // apply mask
 
-                    // V = V*expf(Mold - M)
-                    ggml_vec_scale_f16(D, VKQ16, ms);
-                } else {
-                    // no new maximum, ms == 1.0f, vs != 1.0f
-                    vs = expf(s - M);
+                        KQ[r*GGML_FA_TILE_KV + c] = s;
+                    }
                 }
+            }
 
-                // V += v*expf(s - M)
-                ggml_vec_mad_f16(D, VKQ16, (const ggml_fp16_t *) v_data, vs);
-            } else {
-                if (s > M) {
-                    // s is new maximum, ms < 1.0f, vs == expf(s - s) == 1.0f
-                    M = s;
-                    ms = expf(Mold - M);
+            // update the running max and sum, and turn the KQ values into expf(s - M)
+            for (int64_t r = 0; r < nr; ++r) {
+                float * kq = KQ + r*GGML_FA_TILE_KV;
 
-                    // V = V*expf(Mold - M)
-                    ggml_vec_scale_f32(D, VKQ32, ms);
-                } else {
-                    // no new maximum, ms == 1.0f, vs != 1.0f
-                    vs = expf(s - M);
+                float M = -INFINITY;
+                ggml_vec_max_f32(nc, &M, kq);
+
+                if (M == -INFINITY) {
+                    // the whole tile is masked for this row
+                    memset(kq, 0, nc*sizeof(float));
+                    continue;
                 }
 
-                v_to_float(v_data, V32, D);
+                M = MAX(M, Ms[r]);
+
+                // upon new higher max val, scale VKQ and KQ sum with this value
+                const float ms = expf(Ms[r] - M);
+                if (ms != 1.0f) {
+                    ggml_vec_scale_f32(D, VKQ32 + r*D, ms);
+                }
 
-                // V += v*expf(s - M)
-                ggml_vec_mad_f32(D, VKQ32, V32, vs);
+                Ss[r] = Ss[r]*ms + (float) ggml_vec_soft_max_f32(nc, kq, kq, M);
+                Ms[r] = M;
             }
 
-            S = S*ms + vs; // scale and increment sum with partial sum
-        }
+            // VKQ += V*softmax(KQ) for the tile, each V row is converted once for the whole group
+            for (int64_t c = 0; c < nc; ++c) {
+                bool used = false;
+                for (int64_t r = 0; r < nr && !used; ++r) {
+                    used = KQ[r*GGML_FA_TILE_KV + c] != 0.0f;
+                }
+                if (!used) {
+                    continue;
+                }
 
-        if (v->type == GGML_TYPE_F16) {
-            for (int64_t d = 0; d < D; ++d) {
-                VKQ32[d] = GGML_FP16_TO_FP32(VKQ16[d]);
+                const int64_t ic = ic0 + c;
+
+                const char * v_data = (const char *) v->data + (ic*nbv1 + iv2*nbv2 + iv3*nbv3);
+
+                const float * v32 = (const float *) v_data;
+                if (v->type != GGML_TYPE_F32) {
+                    v_to_float(v_data, V32, D);
+                    v32 = V32;
+                }
+
+                for (int64_t r = 0; r < nr; ++r) {
+                    const float vs = KQ[r*GGML_FA_TILE_KV + c];
+                    if (vs != 0.0f) {
+                        ggml_vec_mad_f32(D, VKQ32 + r*D, v32, vs);
+                    }
+                }
             }
         }
 
-        // V /= S
-        const float S_inv = 1.0f/S;
-        ggml_vec_scale_f32(D, VKQ32, S_inv);
+        for (int64_t r = 0; r < nr; ++r) {
+            // V /= S
+            const float S_inv = Ss[r] == 0.0f ? 0.0f : 1.0f/Ss[r];
+            ggml_vec_scale_f32(D, VKQ32 + r*D, S_inv);
 
-        // dst indices
-        const int i1 = iq1;
-        const int i2 = iq2;
-        const int i3 = iq3;
+            // dst indices
+            const int64_t i1 = t0 + r/gh;
+            const int64_t i2 = h0 + r%gh;
+            const int64_t i3 = iq3;
 
-        // original
-        //memcpy((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3), V, nev0*sizeof(float));
+            // original
+            //memcpy((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3), V, nev0*sizeof(float));
 
-        // permute(0, 2, 1, 3)
-        memcpy((char *) dst->data + (i3*ne2*ne1 + i2 + i1*ne1)*nb1, VKQ32, nb1);
+            // permute(0, 2, 1, 3)
+            memcpy((char *) dst->data + (i3*ne2*ne1 + i2 + i1*ne1)*nb1, VKQ32 + r*D, nb1);
+        }
     }
 }
 
@@ -17328,6 +17942,14 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_mul_mat_id(params, tensor);
             } break;
+        case GGML_OP_RMS_NORM_MUL_MAT:
+            {
+                ggml_compute_forward_rms_norm_mul_mat(params, tensor);
+            } break;
+        case GGML_OP_MUL_MAT_SWIGLU:
+            {
+                ggml_compute_forward_mul_mat_swiglu(params, tensor);
+            } break;
         case GGML_OP_OUT_PROD:
             {
                 ggml_compute_forward_out_prod(params, tensor);
@@ -17372,6 +17994,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_get_rows_back(params, tensor);
             } break;
+        case GGML_OP_SET_ROWS:
+            {
+                ggml_compute_forward_set_rows(params, tensor);
+            } break;
         case GGML_OP_DIAG:
             {
                 ggml_compute_forward_diag(params, tensor);
@@ -17452,6 +18078,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_argsort(params, tensor);
             } break;
+        case GGML_OP_TOP_K:
+            {
+                ggml_compute_forward_top_k(params, tensor);
+            } break;
         case GGML_OP_LEAKY_RELU:
             {
                 ggml_compute_forward_leaky_relu(params, tensor);
@@ -18157,6 +18787,11 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
             {
                 GGML_ABORT("fatal error"); // TODO: not implemented
             }
+        case GGML_OP_RMS_NORM_MUL_MAT:
+        case GGML_OP_MUL_MAT_SWIGLU:
+            {
+                GGML_ABORT("fatal error"); // TODO: not implemented
+            }
         case GGML_OP_OUT_PROD:
             {
                 GGML_ABORT("fatal error"); // TODO: not implemented
@@ -18334,6 +18969,10 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
             {
                 GGML_ABORT("fatal error"); // TODO: not implemented
             }
+        case GGML_OP_SET_ROWS:
+            {
+                GGML_ABORT("fatal error"); // TODO: not implemented
+            }
         case GGML_OP_DIAG:
             {
                 GGML_ABORT("fatal error"); // TODO: not implemented
@@ -18525,6 +19164,7 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
                 GGML_ABORT("fatal error"); // TODO: not implemented
             }
         case GGML_OP_ARGSORT:
+        case GGML_OP_TOP_K:
             {
                 GGML_ABORT("fatal error"); // TODO: not implemented
             }
@@ -19283,6 +19923,8 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
         case GGML_OP_CONCAT:
         case GGML_OP_MUL_MAT:
         case GGML_OP_MUL_MAT_ID:
+        case GGML_OP_RMS_NORM_MUL_MAT:
+        case GGML_OP_MUL_MAT_SWIGLU:
         case GGML_OP_OUT_PROD:
             {
                 n_tasks = n_threads;
@@ -19294,6 +19936,10 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
                 //n_tasks = n_threads;
                 n_tasks = 1;
             } break;
+        case GGML_OP_SET_ROWS:
+            {
+                n_tasks = n_threads;
+            } break;
         case GGML_OP_SCALE:
         case GGML_OP_SET:
         case GGML_OP_RESHAPE:
@@ -19340,6 +19986,7 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
         case GGML_OP_ARANGE:
         case GGML_OP_TIMESTEP_EMBEDDING:
         case GGML_OP_ARGSORT:
+        case GGML_OP_TOP_K:
         case GGML_OP_FLASH_ATTN_EXT:
         case GGML_OP_FLASH_ATTN_BACK:
         case GGML_OP_SSM_CONV:
@@ -19685,6 +20332,22 @@ void ggml_threadpool_resume(struct ggml_threadpool * threadpool) {
 #endif
 }
 
+void ggml_threadpool_hold(struct ggml_threadpool * threadpool, int hold_us) {
+#ifndef GGML_USE_OPENMP
+    ggml_mutex_lock(&threadpool->mutex);
+    const int prev_us = atomic_load_explicit(&threadpool->hold_us, memory_order_relaxed);
+    atomic_store_explicit(&threadpool->hold_us, hold_us, memory_order_relaxed);
+    if (prev_us == 0 && hold_us != 0) {
+        // wake up the sleeping workers so that they are already spinning when the next graph arrives
+        ggml_cond_broadcast(&threadpool->cond);
+    }
+    ggml_mutex_unlock(&threadpool->mutex);
+#else
+    UNUSED(threadpool);
+    UNUSED(hold_us);
+#endif
+}
+
 struct ggml_cplan ggml_graph_plan(
           const struct ggml_cgraph * cgraph,
                                int   n_threads,
@@ -19764,10 +20427,26 @@ struct ggml_cplan ggml_graph_plan(
                     cur += n_as * sizeof(int64_t);               // matrix_row_counts
                     cur += n_as * src1->ne[2] * sizeof(int64_t); // matrix_rows
                 } break;
+            case GGML_OP_RMS_NORM_MUL_MAT:
+                {
+                    const struct ggml_tensor * src0 = node->src[0];
+                    const enum ggml_type vec_dot_type = type_traits[node->src[2]->type].vec_dot_type;
+                    cur = GGML_PAD(ggml_nelements(src0)*sizeof(float), CACHE_LINE_SIZE); // normalized rows
+                    if (vec_dot_type != GGML_TYPE_F32) {
+                        cur += ggml_row_size(vec_dot_type, ggml_nelements(src0));
+                    }
+                } break;
+            case GGML_OP_MUL_MAT_SWIGLU:
+                {
+                    const enum ggml_type vec_dot_type = type_traits[node->src[0]->type].vec_dot_type;
+                    if (vec_dot_type != GGML_TYPE_F32) {
+                        cur = ggml_row_size(vec_dot_type, ggml_nelements(node->src[2]));
+                    }
+                } break;
             case GGML_OP_OUT_PROD:
                 {
-                    if (ggml_is_quantized(node->src[0]->type)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
+                    if (ggml_is_quantized(node->src[0]->type) || node->src[0]->type == GGML_TYPE_F16) {
+                        cur = ggml_type_size(GGML_TYPE_F32) * (node->src[0]->ne[0] + CACHE_LINE_SIZE_F32) * n_tasks;
                     }
                 } break;
             case GGML_OP_SOFT_MAX:
@@ -19775,6 +20454,11 @@ struct ggml_cplan ggml_graph_plan(
                 {
                     cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
                 } break;
+            case GGML_OP_TOP_K:
+                {
+                    // one heap of k (value, id) pairs per thread
+                    cur = GGML_PAD(node->ne[0]*(sizeof(float) + sizeof(int32_t)), CACHE_LINE_SIZE) * n_tasks;
+                } break;
             case GGML_OP_CONV_TRANSPOSE_1D:
                 {
                     GGML_ASSERT(node->src[0]->ne[3] == 1);
@@ -19819,7 +20503,7 @@ struct ggml_cplan ggml_graph_plan(
                 {
                     const int64_t ne00 = node->src[0]->ne[0]; // D
 
-                    cur = 3*sizeof(float)*ne00*n_tasks; // 3x head size/thread
+                    cur = sizeof(float)*(GGML_FA_TILE_Q*(2*ne00 + GGML_FA_TILE_KV + 3) + ne00 + CACHE_LINE_SIZE_F32)*n_tasks;
                 } break;
             case GGML_OP_FLASH_ATTN_BACK:
                 {
@@ -19952,6 +20636,22 @@ static inline bool ggml_graph_compute_poll_for_work(struct ggml_compute_state *
         ggml_thread_cpu_relax();
     }
 
+    // While the threadpool is held, keep spinning past the polling budget so that
+    // back-to-back graphs do not pay the cond.var wake-up. The hold is re-checked
+    // periodically so that releasing it lets the workers fall back to sleeping.
+    if (!state->pending && atomic_load_explicit(&threadpool->hold_us, memory_order_relaxed) != 0) {
+        const int64_t t_start = ggml_time_us();
+        for (uint64_t i=1; !ggml_graph_compute_thread_ready(state); i++) {
+            ggml_thread_cpu_relax();
+            if ((i & 1023) == 0) {
+                const int hold_us = atomic_load_explicit(&threadpool->hold_us, memory_order_relaxed);
+                if (hold_us == 0 || (hold_us > 0 && ggml_time_us() - t_start > hold_us)) {
+                    break;
+                }
+            }
+        }
+    }
+
     return state->pending;
 }
 
@@ -19968,6 +20668,11 @@ static inline bool ggml_graph_compute_check_for_work(struct ggml_compute_state *
         // No new work. Wait for the signal.
         GGML_PRINT_DEBUG("thread #%d waiting for work (sleeping)\n", state->ith);
         ggml_cond_wait(&threadpool->cond, &threadpool->mutex);
+
+        // The threadpool got held while we were sleeping. Go back to polling.
+        if (atomic_load_explicit(&threadpool->hold_us, memory_order_relaxed) != 0) {
+            break;
+        }
     }
     ggml_mutex_unlock_shared(&threadpool->mutex);
 
@@ -20086,6 +20791,7 @@ static struct ggml_threadpool * ggml_threadpool_new_impl(
         threadpool->stop             = false;
         threadpool->pause            = tpp->paused;
         threadpool->abort            = false;
+        threadpool->hold_us          = 0;
         threadpool->workers          = NULL;
         threadpool->n_threads_max    = tpp->n_threads;
         threadpool->n_threads_cur    = tpp->n_threads;
@@ -23234,6 +23940,14 @@ int ggml_cpu_has_avx512_bf16(void) {
 #endif
 }
 
+int ggml_cpu_has_amx_int8(void) {
+#if defined(__AMX_INT8__)
+    return 1;
+#else
+    return 0;
+#endif
+}
+
 int ggml_cpu_has_fma(void) {
 #if defined(__FMA__)
     return 1;
@@ -53,6 +53,11 @@
 #include "ggml-cpu-impl.h"
 #include "ggml-quants.h"
 
+#if defined(__AMX_INT8__) && defined(__linux__)
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 #ifdef _MSC_VER
 #define NOINLINE __declspec(noinline)
 #else
@@ -607,6 +612,11 @@ class tinyBLAS_Q0_AVX {
         mnpack(0, m, 0, n);
     }
 
+    // computes the [m0, m) x [n0, n) part of C only
+    void matmul(int64_t m0, int64_t m, int64_t n0, int64_t n) {
+        mnpack(m0, m, n0, n);
+    }
+
   private:
     void mnpack(int64_t m0, int64_t m, int64_t n0, int64_t n) {
         int64_t mc, nc, mp, np;
@@ -985,6 +995,167 @@ class tinyBLAS_Q0_AVX {
 };
 #endif // __AVX__
 
+#if defined(__AMX_INT8__) && defined(__AVX512F__)
+/**
+ * Returns true if the AMX tiles can be used by this process.
+ *
+ * The kernel only hands out the AMX tile state to processes that ask
+ * for it, and refuses if the CPU has no AMX, so this also serves as the
+ * runtime check for binaries built with AMX enabled.
+ */
+static bool amx_int8_usable() {
+    static const bool usable = [] {
+#if defined(__linux__)
+        const int ARCH_REQ_XCOMP_PERM = 0x1023;
+        const int XFEATURE_XTILEDATA  = 18;
+        return syscall(SYS_arch_prctl, ARCH_REQ_XCOMP_PERM, XFEATURE_XTILEDATA) == 0;
+#else
+        return true;
+#endif
+    }();
+    return usable;
+}
+
+/**
+ * Q8_0/Q4_0 x Q8_0 matrix multiplication with AMX int8 tiles.
+ *
+ * Each job is a tile of 16 rows of `A`. Its blocks are unpacked to int8
+ * and transposed into the VNNI layout expected by TDPBSSD, a chunk of K
+ * at a time, and then reused for every 16 column tile of `B`, which is
+ * loaded straight from the Q8_0 blocks. Since every block of 32 values
+ * has its own scale, the int32 result of each block is scaled with
+ * AVX-512 before being accumulated in float.
+ *
+ * Only the part of `C` covered by whole 16x16 tiles is computed here;
+ * the remainder is left to tinyBLAS_Q0_AVX.
+ */
+template <typename TA>
+class tinyBLAS_Q0_AMX {
+  public:
+    tinyBLAS_Q0_AMX(int64_t k,
+                    const TA *A, int64_t lda,
+                    const block_q8_0 *B, int64_t ldb,
+                    float *C, int64_t ldc,
+                    int ith, int nth)
+        : A(A), B(B), C(C), k(k), lda(lda), ldb(ldb), ldc(ldc), ith(ith), nth(nth) {
+    }
+
+    void matmul(int64_t m, int64_t n) {
+        int64_t ytiles = m / TILE_M;
+        int64_t xtiles = n / TILE_N;
+        int64_t duty = (ytiles + nth - 1) / nth;
+        int64_t start = duty * ith;
+        int64_t end = start + duty;
+        if (end > ytiles)
+            end = ytiles;
+        if (start >= end || xtiles == 0)
+            return;
+
+        // tmm0: int32 C tile, tmm1: 16 columns of B, tmm2: 16 packed rows of A
+        tile_config cfg = {};
+        cfg.palette_id = 1;
+        cfg.rows[0] = TILE_N;
+        cfg.colsb[0] = TILE_M * sizeof(int32_t);
+        cfg.rows[1] = TILE_N;
+        cfg.colsb[1] = QK8_0;
+        cfg.rows[2] = QK8_0 / 4;
+        cfg.colsb[2] = TILE_M * 4;
+        _tile_loadconfig(&cfg);
+
+        for (int64_t job = start; job < end; ++job)
+            gemm(job * TILE_M, xtiles);
+
+        _tile_release();
+    }
+
+  private:
+    static constexpr int64_t TILE_M = 16;
+    static constexpr int64_t TILE_N = 16;
+    static constexpr int64_t KC = 64; // blocks of A packed at a time
+
+    struct tile_config {
+        uint8_t palette_id;
+        uint8_t start_row;
+        uint8_t reserved[14];
+        uint16_t colsb[16];
+        uint8_t rows[16];
+    };
+
+    NOINLINE void gemm(int64_t ii, int64_t xtiles) {
+        alignas(64) int8_t Ap[KC][QK8_0 / 4][TILE_M * 4];
+        alignas(64) float Ad[KC][TILE_M];
+        alignas(64) int32_t Ct[TILE_N][TILE_M];
+
+        for (int64_t l0 = 0; l0 < k; l0 += KC) {
+            const int64_t kc = k - l0 < KC ? k - l0 : KC;
+            for (int64_t l = 0; l < kc; ++l)
+                pack(ii, l0 + l, Ap[l], Ad[l]);
+
+            for (int64_t xt = 0; xt < xtiles; ++xt) {
+                int64_t jj = xt * TILE_N;
+                __m512 Cv[TILE_N];
+                for (int64_t j = 0; j < TILE_N; ++j)
+                    Cv[j] = l0 ? _mm512_loadu_ps(C + ldc * (jj + j) + ii) : _mm512_setzero_ps();
+                for (int64_t l = 0; l < kc; ++l) {
+                    const block_q8_0 *b = B + ldb * jj + l0 + l;
+                    _tile_zero(0);
+                    _tile_loadd(1, b->qs, ldb * sizeof(block_q8_0));
+                    _tile_loadd(2, Ap[l], TILE_M * 4);
+                    _tile_dpbssd(0, 1, 2);
+                    _tile_stored(0, Ct, TILE_M * sizeof(int32_t));
+                    __m512 da = _mm512_load_ps(Ad[l]);
+                    for (int64_t j = 0; j < TILE_N; ++j)
+                        Cv[j] = madd(mul(da, _mm512_set1_ps(unhalf(b[ldb * j].d))),
+                                     _mm512_maskz_cvtepi32_ps(0xffff, _mm512_load_si512(Ct[j])),
+                                     Cv[j]);
+                }
+                for (int64_t j = 0; j < TILE_N; ++j)
+                    _mm512_storeu_ps(C + ldc * (jj + j) + ii, Cv[j]);
+            }
+        }
+    }
+
+    // unpacks block l of rows ii..ii+15 and transposes it into the VNNI layout,
+    // i.e. groups of 4 consecutive values of a row are interleaved across rows
+    // (the masked gather/convert forms take a defined source instead of an undefined one, which GCC flags)
+    inline void pack(int64_t ii, int64_t l, int8_t (*dst)[TILE_M * 4], float *d) {
+        alignas(64) int8_t tmp[TILE_M][QK8_0];
+        for (int64_t i = 0; i < TILE_M; ++i) {
+            const TA *a = A + lda * (ii + i) + l;
+            _mm256_store_si256((__m256i *)tmp[i], load(a));
+            d[i] = unhalf(a->d);
+        }
+        const __m512i idx = _mm512_mullo_epi32(_mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0),
+                                               _mm512_set1_epi32(QK8_0 / 4));
+        for (int64_t r = 0; r < QK8_0 / 4; ++r)
+            _mm512_store_si512(dst[r], _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), 0xffff,
+                                                                     _mm512_add_epi32(idx, _mm512_set1_epi32(r)), tmp, 4));
+    }
+
+    inline __m256i load(const block_q8_0 *b) {
+        return _mm256_loadu_si256((const __m256i *)b->qs);
+    }
+
+    inline __m256i load(const block_q4_0 *b) {
+        __m128i x = _mm_loadu_si128((const __m128i *)b->qs);
+        __m256i v = _mm256_and_si256(_mm256_set1_epi8(15),
+                                     _mm256_insertf128_si256(_mm256_castsi128_si256(x),
+                                                             _mm_srli_epi16(x, 4), 1));
+        return _mm256_sub_epi8(v, _mm256_set1_epi8(8));
+    }
+
+    const TA *const A;
+    const block_q8_0 *const B;
+    float *const C;
+    const int64_t k;
+    const int64_t lda;
+    const int64_t ldb;
+    const int64_t ldc;
+    const int ith;
+    const int nth;
+};
+#endif // __AMX_INT8__
+
 } // namespace
 
 /**
@@ -1143,6 +1314,19 @@ bool llamafile_sgemm(int64_t m, int64_t n, int64_t k, const void *A, int64_t lda
             (const block_q8_0 *)B, ldb,
             (float *)C, ldc,
             ith, nth};
+#if defined(__AMX_INT8__) && defined(__AVX512F__)
+        if (m >= 16 && n >= 16 && amx_int8_usable()) {
+            tinyBLAS_Q0_AMX<block_q8_0> amx{
+                k, (const block_q8_0 *)A, lda,
+                (const block_q8_0 *)B, ldb,
+                (float *)C, ldc,
+                ith, nth};
+            amx.matmul(m, n);
+            tb.matmul(m - m % 16, m, 0, n);
+            tb.matmul(0, m - m % 16, n - n % 16, n);
+            return true;
+        }
+#endif
         tb.matmul(m, n);
         return true;
 #elif defined(__ARM_FEATURE_DOTPROD)
@@ -1167,6 +1351,19 @@ bool llamafile_sgemm(int64_t m, int64_t n, int64_t k, const void *A, int64_t lda
             (const block_q8_0 *)B, ldb,
             (float *)C, ldc,
             ith, nth};
+#if defined(__AMX_INT8__) && defined(__AVX512F__)
+        if (m >= 16 && n >= 16 && amx_int8_usable()) {
+            tinyBLAS_Q0_AMX<block_q4_0> amx{
+                k, (const block_q4_0 *)A, lda,
+                (const block_q8_0 *)B, ldb,
+                (float *)C, ldc,
+                ith, nth};
+            amx.matmul(m, n);
+            tb.matmul(m - m % 16, m, 0, n);
+            tb.matmul(0, m - m % 16, n - n % 16, n);
+            return true;
+        }
+#endif
         tb.matmul(m, n);
         return true;
 #elif defined(__ARM_FEATURE_DOTPROD)
@@ -305,11 +305,17 @@ extern "C" {
         // override key-value pairs of the model meta data
         const struct llama_model_kv_override * kv_overrides;
 
+        // number of threads reading the tensor data when mmap is not used (0 = up to 8, depending on the hardware)
+        int32_t n_load_threads;
+
         // Keep the booleans together to avoid misalignment during copy-by-value.
         bool vocab_only;    // only load the vocabulary, no weights
         bool use_mmap;      // use mmap if possible
         bool use_mlock;     // force system to keep model in RAM
         bool check_tensors; // validate model tensor data
+        bool repack;        // repack Q4_0 weights of CPU layers into the interleaved layout for this CPU, cached next to the model file
+        bool warm_start;    // cache the derived vocab structures in "<model>.warm" and restore them on the next load
+        bool hugepages;     // back the model weights with transparent huge pages (Linux only)
     };
 
     // NOTE: changing the default values of parameters marked as [EXPERIMENTAL] may cause crashes or incorrect results in certain configurations
@@ -327,6 +333,11 @@ extern "C" {
         uint32_t    n_seq_max;         // max number of sequences (i.e. distinct states for recurrent models)
         int32_t     n_threads;         // number of threads to use for generation
         int32_t     n_threads_batch;   // number of threads to use for batch processing
+        int32_t     spin_us;           // keep the threadpool workers spinning between the sub-graphs of a decode step, in us (0 = off, -1 = whole step)
+        int32_t     n_top_logits;      // if > 0, only the n_top_logits largest logits of each output are computed and copied back (see llama_get_logits_top_ith)
+        int32_t     kv_block_size;     // if > 0, KV cells are allocated per sequence in blocks of this many cells and need not be contiguous
+        int32_t     n_kv_window;       // if > 0, streaming KV cache: each sequence keeps its n_kv_sink first and n_kv_window last tokens, older tokens are evicted
+        int32_t     n_kv_sink;         // number of attention sink tokens kept at the start of each sequence when n_kv_window > 0
 
         enum llama_rope_scaling_type rope_scaling_type; // RoPE scaling type, from `enum llama_rope_scaling_type`
         enum llama_pooling_type      pooling_type;      // whether to pool (sum) embedding results by sequence id
@@ -354,6 +365,7 @@ extern "C" {
         bool embeddings;  // if true, extract embeddings (together with logits)
         bool offload_kqv; // whether to offload the KQV ops (including the KV cache) to GPU
         bool flash_attn;  // whether to use flash attention [EXPERIMENTAL]
+        bool fused_ops;   // whether to use fused CPU kernels for the attention norm + QKV and the SwiGLU FFN during decode [EXPERIMENTAL]
         bool no_perf;     // whether to measure performance timings
 
         // Abort callback
@@ -450,6 +462,7 @@ extern "C" {
     LLAMA_API uint32_t llama_n_batch    (const struct llama_context * ctx);
     LLAMA_API uint32_t llama_n_ubatch   (const struct llama_context * ctx);
     LLAMA_API uint32_t llama_n_seq_max  (const struct llama_context * ctx);
+    LLAMA_API int32_t  llama_n_top_logits(const struct llama_context * ctx);
 
     LLAMA_API int32_t llama_n_vocab    (const struct llama_model * model);
     LLAMA_API int32_t llama_n_ctx_train(const struct llama_model * model);
@@ -860,14 +873,21 @@ extern "C" {
     // in the order they have appeared in the batch.
     // Rows: number of tokens for which llama_batch.logits[i] != 0
     // Cols: n_vocab
+    // Aborts when llama_context_params.n_top_logits > 0, use llama_get_logits_top_ith instead.
     LLAMA_API float * llama_get_logits(struct llama_context * ctx);
 
     // Logits for the ith token. For positive indices, Equivalent to:
     // llama_get_logits(ctx) + ctx->output_ids[i]*n_vocab
     // Negative indicies can be used to access logits in reverse order, -1 is the last logit.
-    // returns NULL for invalid ids.
+    // returns NULL for invalid ids, aborts when llama_context_params.n_top_logits > 0.
     LLAMA_API float * llama_get_logits_ith(struct llama_context * ctx, int32_t i);
 
+    // Compact logits for the ith output when llama_context_params.n_top_logits > 0 - the full logits are not
+    // available in this mode. Copies up to n_cands_max candidates { id, logit, 0.0f }, sorted by descending logit.
+    // Negative indicies can be used to access the outputs in reverse order, -1 is the last output.
+    // Returns the number of candidates copied, or -1 for invalid ids.
+    LLAMA_API int32_t llama_get_logits_top_ith(struct llama_context * ctx, int32_t i, llama_token_data * cands, int32_t n_cands_max);
+
     // Get all output token embeddings.
     // when pooling_type == LLAMA_POOLING_TYPE_NONE or when using a generative model,
     // the embeddings for which llama_batch.logits[i] != 0 are stored contiguously
@@ -972,6 +992,41 @@ extern "C" {
                             bool   remove_special,
                             bool   unparse_special);
 
+    /// @details Convert n_texts texts into tokens at once, using up to n_threads threads (<= 0 = all cores).
+    /// @param tokens Arena receiving the tokens of all texts, the tokens of texts[i] are tokens[offsets[i] .. offsets[i + 1]).
+    /// @param offsets Must hold n_texts + 1 entries, filled on success and on failure.
+    /// @return Returns the total number of tokens on success, no more than n_tokens_max
+    /// @return Returns a negative number on failure - the total number of tokens that would have been returned
+    LLAMA_API int32_t llama_tokenize_batch(
+        const struct llama_model * model,
+              const char * const * texts,
+                   const int32_t * text_lens,
+                         int32_t   n_texts,
+                     llama_token * tokens,
+                         int32_t   n_tokens_max,
+                         int32_t * offsets,
+                         int32_t   n_threads,
+                            bool   add_special,
+                            bool   parse_special);
+
+    /// @details Convert n_seqs token sequences into text at once (inverse of llama_tokenize_batch()).
+    /// @param tokens Tokens of all sequences, sequence i is tokens[token_offsets[i] .. token_offsets[i + 1]).
+    /// @param text Arena receiving the text of all sequences, the text of sequence i is text[offsets[i] .. offsets[i + 1]), no null terminators.
+    /// @param offsets Must hold n_seqs + 1 entries, filled on success and on failure.
+    /// @return Returns the total number of chars/bytes on success, no more than text_len_max.
+    /// @return Returns a negative number on failure - the total number of chars/bytes that would have been returned.
+    LLAMA_API int32_t llama_detokenize_batch(
+        const struct llama_model * model,
+               const llama_token * tokens,
+                   const int32_t * token_offsets,
+                         int32_t   n_seqs,
+                            char * text,
+                         int32_t   text_len_max,
+                         int32_t * offsets,
+                         int32_t   n_threads,
+                            bool   remove_special,
+                            bool   unparse_special);
+
     //
     // Chat templates
     //
@@ -1077,6 +1132,13 @@ extern "C" {
     // after removing a sampler, the chain will no longer own it, and it will not be freed when the chain is freed
     LLAMA_API struct llama_sampler * llama_sampler_chain_remove(   struct llama_sampler * chain, int32_t i);
 
+    /// @details Apply the chain directly to the raw logits of one output and store the candidates in cur_p.
+    ///          When the chain starts with logit-bias/penalties samplers followed by top-k, the sparse samplers are
+    ///          applied only to the tokens they modify, the top-k selection runs on the float logits, and only the
+    ///          k survivors are materialized for the rest of the chain. Other chains fall back to materializing the
+    ///          full vocabulary. cur_p->data must have room for n_vocab candidates.
+    LLAMA_API void                   llama_sampler_chain_apply_logits(struct llama_sampler * chain, const float * logits, int32_t n_vocab, llama_token_data_array * cur_p);
+
     // available samplers:
 
     LLAMA_API struct llama_sampler * llama_sampler_init_greedy     (void);
@@ -1133,6 +1195,14 @@ extern "C" {
                           const char * grammar_str,
                           const char * grammar_root);
 
+    /// @details Same as llama_sampler_init_grammar, but the tokens allowed in each grammar state are computed once over the
+    ///          whole vocabulary and memoized, so a state seen before is applied as a single mask. Clones share the masks.
+    ///          Only candidate arrays holding a large part of the vocabulary use the masks, small ones are checked directly.
+    LLAMA_API struct llama_sampler * llama_sampler_init_grammar_compiled(
+            const struct llama_model * model,
+                          const char * grammar_str,
+                          const char * grammar_root);
+
     LLAMA_API struct llama_sampler * llama_sampler_init_penalties(
                              int32_t   n_vocab,         // llama_n_vocab()
                          llama_token   special_eos_id,  // llama_token_eos()
@@ -1162,9 +1232,22 @@ extern "C" {
     //    auto token = cur_p.data[cur_p.selected].id;
     //    llama_sampler_accept(smpl, token);
     //    return token;
+    // When llama_context_params.n_top_logits > 0, cur_p holds the candidates of llama_get_logits_top_ith instead
     // Returns the sampled token
     LLAMA_API llama_token llama_sampler_sample(struct llama_sampler * smpl, struct llama_context * ctx, int32_t idx);
 
+    /// @details Sample several sequences at once, e.g. one per sequence after a batched llama_decode:
+    ///          tokens[i] = llama_sampler_sample(smpls[i], ctx, idxs[i])
+    ///          The samplers must be distinct objects. They run in parallel on up to n_threads threads (<= 0 - the
+    ///          number of threads of the context), each reusing the candidate buffer of its chain.
+    LLAMA_API void llama_sampler_sample_batch(
+            struct llama_sampler ** smpls,
+            struct llama_context  * ctx,
+                   const int32_t  * idxs,
+                     llama_token  * tokens,
+                         int32_t    n_smpls,
+                         int32_t    n_threads);
+
     // TODO: extend in the future
     //LLAMA_API void llama_decode_with_sampler(struct llama_context * ctx, struct llama_sampler * smpl, struct llama_batch batch, ...);
 
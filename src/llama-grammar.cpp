@@ -1051,7 +1051,7 @@ void llama_grammar_free_impl(struct llama_grammar * grammar) {
 }
 
 struct llama_grammar * llama_grammar_clone_impl(const struct llama_grammar & grammar) {
-    llama_grammar * result = new llama_grammar { grammar.vocab, grammar.rules, grammar.stacks, grammar.partial_utf8, };
+    llama_grammar * result = new llama_grammar { grammar.vocab, grammar.rules, grammar.stacks, grammar.partial_utf8, grammar.masks, };
 
     // redirect elements in stacks to point to new rules
     for (size_t is = 0; is < result->stacks.size(); is++) {
@@ -1069,9 +1069,142 @@ struct llama_grammar * llama_grammar_clone_impl(const struct llama_grammar & gra
     return result;
 }
 
+// the positions in the stacks are stored as (rule, element) indices, so that the key does not depend on
+// where the rules of a particular llama_grammar instance live in memory
+static std::string llama_grammar_state_key(const struct llama_grammar & grammar) {
+    std::string key;
+
+    auto put = [&key](uint32_t v) {
+        key.append((const char *) &v, sizeof(v));
+    };
+
+    for (const auto & stack : grammar.stacks) {
+        put(stack.size());
+        for (const llama_grammar_element * pos : stack) {
+            for (size_t ir = 0; ir < grammar.rules.size(); ++ir) {
+                const auto & rule = grammar.rules[ir];
+                if (pos >= rule.data() && pos < rule.data() + rule.size()) {
+                    put(ir);
+                    put(pos - rule.data());
+                    break;
+                }
+            }
+        }
+    }
+
+    put(grammar.partial_utf8.value);
+    put(grammar.partial_utf8.n_remain);
+
+    return key;
+}
+
+// same rules as the uncompiled path of llama_grammar_apply_impl, applied to every token of the vocab
+static llama_grammar_masks::mask llama_grammar_build_mask(const struct llama_grammar & grammar, llama_grammar_masks & masks) {
+    const auto & vocab = *grammar.vocab;
+    const size_t n_vocab = vocab.cache_token_to_piece.size();
+
+    const bool pending = grammar.partial_utf8.n_remain != 0;
+
+    if (!pending) {
+        std::call_once(masks.decoded_once, [&]() {
+            masks.decoded.resize(n_vocab);
+            for (size_t id = 0; id < n_vocab; ++id) {
+                masks.decoded[id] = decode_utf8(vocab.cache_token_to_piece[id], {0, 0});
+            }
+        });
+    }
+
+    bool allow_eog = false;
+    for (const auto & stack : grammar.stacks) {
+        if (stack.empty()) {
+            allow_eog = true;
+            break;
+        }
+    }
+
+    llama_grammar_masks::mask mask((n_vocab + 31)/32, 0);
+
+    std::vector<std::pair<std::vector<uint32_t>, llama_partial_utf8>> decoded_pending;
+    if (pending) {
+        decoded_pending.resize(n_vocab);
+    }
+
+    llama_grammar_candidates candidates_grammar;
+    candidates_grammar.reserve(n_vocab);
+
+    for (size_t id = 0; id < n_vocab; ++id) {
+        const std::string & piece = vocab.cache_token_to_piece[id];
+
+        if (llama_token_is_eog_impl(vocab, id)) {
+            if (allow_eog) {
+                mask[id/32] |= 1u << (id % 32);
+            }
+        } else if (!piece.empty() && piece[0] != 0) {
+            if (pending) {
+                decoded_pending[id] = decode_utf8(piece, grammar.partial_utf8);
+            }
+            const auto & decoded = pending ? decoded_pending[id] : masks.decoded[id];
+            candidates_grammar.push_back({ id, decoded.first.data(), decoded.second });
+            mask[id/32] |= 1u << (id % 32);
+        }
+    }
+
+    const auto rejects = llama_grammar_reject_candidates(grammar.rules, grammar.stacks, candidates_grammar);
+    for (const auto & reject : rejects) {
+        mask[reject.index/32] &= ~(1u << (reject.index % 32));
+    }
+
+    return mask;
+}
+
+// bound on the memory used by the masks, ~16 MiB with a 128k vocab
+#define LLAMA_GRAMMAR_MAX_MASKS 1024
+
+// the masks are built without holding the lock, so that the other samplers sharing them are not blocked
+// a state built by two samplers at the same time is stored once
+static std::shared_ptr<const llama_grammar_masks::mask> llama_grammar_get_mask(const struct llama_grammar & grammar) {
+    auto & masks = *grammar.masks;
+
+    const std::string key = llama_grammar_state_key(grammar);
+
+    {
+        std::lock_guard<std::mutex> lock(masks.mutex);
+
+        auto it = masks.masks.find(key);
+        if (it != masks.masks.end()) {
+            return it->second;
+        }
+    }
+
+    auto mask = std::make_shared<const llama_grammar_masks::mask>(llama_grammar_build_mask(grammar, masks));
+
+    std::lock_guard<std::mutex> lock(masks.mutex);
+
+    if (masks.masks.size() >= LLAMA_GRAMMAR_MAX_MASKS) {
+        masks.masks.clear();
+    }
+
+    return masks.masks.emplace(key, mask).first->second;
+}
+
+// a mask is built over the whole vocab, for fewer candidates than n_vocab/LLAMA_GRAMMAR_MASK_MIN_RATIO
+// (e.g. the sampled token checked alone) rejecting the candidates directly is cheaper
+#define LLAMA_GRAMMAR_MASK_MIN_RATIO 4
+
 void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_data_array * cur_p) {
     GGML_ASSERT(grammar.vocab != nullptr);
 
+    if (grammar.masks && LLAMA_GRAMMAR_MASK_MIN_RATIO*cur_p->size >= grammar.vocab->cache_token_to_piece.size()) {
+        const auto mask = llama_grammar_get_mask(grammar);
+        for (size_t i = 0; i < cur_p->size; ++i) {
+            const llama_token id = cur_p->data[i].id;
+            if (!((*mask)[id/32] & (1u << (id % 32)))) {
+                cur_p->data[i].logit = -INFINITY;
+            }
+        }
+        return;
+    }
+
     bool allow_eog = false;
     for (const auto & stack : grammar.stacks) {
         if (stack.empty()) {
@@ -3,6 +3,9 @@
 #include "llama-impl.h"
 
 #include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 
 struct llama_vocab;
 
@@ -106,6 +109,22 @@ struct llama_grammar_parser {
     void print(FILE * file);
 };
 
+// compiled mode: the set of tokens allowed by each grammar state (stacks + partial UTF-8), computed once over
+// the whole vocab and memoized, so that sampling in a state seen before costs a single mask lookup
+// only used for large candidate sets, a few candidates are checked against the stacks directly
+struct llama_grammar_masks {
+    using mask = std::vector<uint32_t>; // bit i set = token i allowed
+
+    std::mutex mutex;
+
+    // state key (see llama_grammar_state_key) -> mask
+    std::unordered_map<std::string, std::shared_ptr<const mask>> masks;
+
+    // the tokens of the vocab decoded without a pending partial UTF-8 sequence, filled on first use
+    std::once_flag decoded_once;
+    std::vector<std::pair<std::vector<uint32_t>, llama_partial_utf8>> decoded;
+};
+
 struct llama_grammar {
     // note: allow null vocab for testing (not great)
     const llama_vocab * vocab;
@@ -115,6 +134,9 @@ struct llama_grammar {
 
     // buffer for partially generated UTF-8 sequence from accepted tokens
     llama_partial_utf8 partial_utf8;
+
+    // compiled mode, shared with clones and with the grammar re-created on reset (nullptr = off)
+    std::shared_ptr<llama_grammar_masks> masks;
 };
 
 //
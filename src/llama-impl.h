@@ -35,6 +35,20 @@ void llama_log_callback_default(ggml_log_level level, const char * text, void *
 // helpers
 //
 
+// runs fn(i, user_data) for i in [0, n) on up to n_threads threads (<= 0 - the number of hardware threads)
+// the calling thread takes part, the other threads come from a pool that is kept alive between calls
+// an exception thrown by fn stops the remaining iterations and is rethrown on the calling thread
+// calls made from inside fn, or while another thread runs a job, are executed on the calling thread
+void llama_parallel_run(int32_t n, int32_t n_threads, void (*fn)(int32_t i, void * user_data), void * user_data);
+
+// runs fn(i) for i in [0, n) on up to n_threads threads of the shared worker pool, exceptions are rethrown on the calling thread
+template <typename F>
+static void llama_parallel_for(int32_t n, int32_t n_threads, const F & fn) {
+    llama_parallel_run(n, n_threads, [](int32_t i, void * user_data) {
+        (*(const F *) user_data)(i);
+    }, (void *) &fn);
+}
+
 struct time_meas {
     time_meas(int64_t & t_acc, bool disable = false) : t_start_us(disable ? -1 : ggml_time_us()), t_acc(t_acc) {}
 
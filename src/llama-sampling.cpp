@@ -231,36 +231,6 @@ void llama_sampler_free(struct llama_sampler * smpl) {
     delete smpl;
 }
 
-llama_token llama_sampler_sample(struct llama_sampler * smpl, struct llama_context * ctx, int32_t idx) {
-    const auto * logits = llama_get_logits_ith(ctx, idx);
-
-    const int n_vocab = llama_n_vocab(llama_get_model(ctx));
-
-    // TODO: do not allocate each time
-    std::vector<llama_token_data> cur;
-    cur.reserve(n_vocab);
-    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-        cur.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
-    }
-
-    llama_token_data_array cur_p = {
-        /* .data       = */ cur.data(),
-        /* .size       = */ cur.size(),
-        /* .selected   = */ -1,
-        /* .sorted     = */ false,
-    };
-
-    llama_sampler_apply(smpl, &cur_p);
-
-    GGML_ASSERT(cur_p.selected >= 0 && cur_p.selected < (int32_t) cur_p.size);
-
-    auto token = cur_p.data[cur_p.selected].id;
-
-    llama_sampler_accept(smpl, token);
-
-    return token;
-}
-
 // sampler chain
 
 static const char * llama_sampler_chain_name(const struct llama_sampler * /*smpl*/) {
@@ -339,6 +309,10 @@ struct llama_sampler * llama_sampler_chain_init(struct llama_sampler_chain_param
             /* .samplers    = */ {},
             /* .t_sample_us = */ 0,
             /* .n_sample    = */ 0,
+            /* .cur         = */ {},
+            /* .top         = */ {},
+            /* .sparse_ids  = */ {},
+            /* .sparse      = */ {},
         },
     };
 }
@@ -1302,6 +1276,9 @@ static void llama_sampler_grammar_reset(struct llama_sampler * smpl) {
 
     auto * grammar_new = llama_grammar_init_impl(ctx->grammar->vocab, ctx->grammar_str.c_str(), ctx->grammar_root.c_str());
 
+    // same rules, so the memoized masks stay valid
+    grammar_new->masks = ctx->grammar->masks;
+
     llama_grammar_free_impl(ctx->grammar);
     ctx->grammar = grammar_new;
 }
@@ -1345,7 +1322,7 @@ static struct llama_sampler_i llama_sampler_grammar_i = {
     /* .free   = */ llama_sampler_grammar_free,
 };
 
-struct llama_sampler * llama_sampler_init_grammar_impl(const struct llama_vocab & vocab, const char * grammar_str, const char * grammar_root) {
+struct llama_sampler * llama_sampler_init_grammar_impl(const struct llama_vocab & vocab, const char * grammar_str, const char * grammar_root, bool compiled) {
     auto * ctx = new llama_sampler_grammar;
 
     if (grammar_str != nullptr && grammar_str[0] != '\0') {
@@ -1355,6 +1332,9 @@ struct llama_sampler * llama_sampler_init_grammar_impl(const struct llama_vocab
             /* .grammar_root = */ grammar_root,
             /* .grammar      = */ llama_grammar_init_impl(&vocab, grammar_str, grammar_root),
         };
+        if (compiled && ctx->grammar) {
+            ctx->grammar->masks = std::make_shared<llama_grammar_masks>();
+        }
     } else {
         *ctx = {
             /* .vocab        = */ &vocab,
@@ -1386,6 +1366,9 @@ struct llama_sampler_penalties {
     const bool    ignore_eos;
 
     ring_buffer<llama_token> prev;
+
+    // number of occurrences of each token in prev, maintained in accept
+    std::unordered_map<llama_token, int> token_count;
 };
 
 static const char * llama_sampler_penalties_name(const struct llama_sampler * /*smpl*/) {
@@ -1398,7 +1381,16 @@ static void llama_sampler_penalties_accept(struct llama_sampler * smpl, llama_to
         return;
     }
 
+    // the oldest token drops out of the window when the buffer is full
+    if (ctx->prev.size() == ctx->prev.capacity) {
+        const auto it = ctx->token_count.find(ctx->prev.front());
+        if (--it->second == 0) {
+            ctx->token_count.erase(it);
+        }
+    }
+
     ctx->prev.push_back(token);
+    ctx->token_count[token]++;
 }
 
 static void llama_sampler_penalties_apply(struct llama_sampler * smpl, llama_token_data_array * cur_p) {
@@ -1450,33 +1442,41 @@ static void llama_sampler_penalties_apply(struct llama_sampler * smpl, llama_tok
         }
     }
 
-    // Create a frequency map to count occurrences of each token in last_tokens
-    // TODO: optimize this by maintaining the token count in the sampler context
-    using llama_token_cnt = std::unordered_map<llama_token, int>;
-    llama_token_cnt token_count;
-
-    for (int i = 0; i < std::min<int>(ctx->penalty_last_n, ctx->prev.size()); ++i) {
-        token_count[ctx->prev.rat(i)]++;
-    }
-
-    // Apply frequency and presence penalties to the cur_p
-    for (size_t i = 0; i < cur_p->size; ++i) {
-        const auto token_iter = token_count.find(cur_p->data[i].id);
-        if (token_iter == token_count.end()) {
-            continue;
+    const auto penalize = [ctx](llama_token_data & cur, int count) {
+        // The academic publication that described this technique actually just only divided, but that would cause tokens with negative logits to become more likely, which is obviously wrong.
+        // This is common fix for this problem, which is to multiply by the penalty instead of dividing.
+        if (cur.logit <= 0) {
+            cur.logit *= ctx->penalty_repeat;
+        } else {
+            cur.logit /= ctx->penalty_repeat;
         }
 
-        const int count = token_iter->second;
+        cur.logit -= float(count) * ctx->penalty_freq + float(count > 0) * ctx->penalty_present;
+    };
 
-        // The academic publication that described this technique actually just only divided, but that would cause tokens with negative logits to become more likely, which is obviously wrong.
-        // This is common fix for this problem, which is to multiply by the penalty instead of dividing.
-        if (cur_p->data[i].logit <= 0) {
-            cur_p->data[i].logit *= ctx->penalty_repeat;
+    // only the tokens in the window are penalized - update the candidates that have not been shuffled in the
+    // vocabulary (i.e. idx == id) directly
+    bool search = false;
+    for (const auto & tc : ctx->token_count) {
+        if (cur_p->size > (size_t) tc.first && cur_p->data[tc.first].id == tc.first) {
+            penalize(cur_p->data[tc.first], tc.second);
         } else {
-            cur_p->data[i].logit /= ctx->penalty_repeat;
+            search = true;
         }
+    }
 
-        cur_p->data[i].logit -= float(count) * ctx->penalty_freq + float(count > 0) * ctx->penalty_present;
+    // look up the remaining candidates, skipping the ones at idx == id that were handled above
+    if (search) {
+        for (size_t i = 0; i < cur_p->size; ++i) {
+            if (cur_p->data[i].id == (llama_token) i) {
+                continue;
+            }
+
+            const auto it = ctx->token_count.find(cur_p->data[i].id);
+            if (it != ctx->token_count.end()) {
+                penalize(cur_p->data[i], it->second);
+            }
+        }
     }
 
     cur_p->sorted = false;
@@ -1490,6 +1490,7 @@ static void llama_sampler_penalties_apply(struct llama_sampler * smpl, llama_tok
 static void llama_sampler_penalties_reset(struct llama_sampler * smpl) {
     auto * ctx = (llama_sampler_penalties *) smpl->ctx;
     ctx->prev.clear();
+    ctx->token_count.clear();
 }
 
 static struct llama_sampler * llama_sampler_penalties_clone(const struct llama_sampler * smpl) {
@@ -1509,7 +1510,8 @@ static struct llama_sampler * llama_sampler_penalties_clone(const struct llama_s
     {
         auto * result_ctx = (llama_sampler_penalties *) result->ctx;
 
-        result_ctx->prev = ctx->prev;
+        result_ctx->prev        = ctx->prev;
+        result_ctx->token_count = ctx->token_count;
     }
 
     return result;
@@ -1561,6 +1563,7 @@ struct llama_sampler * llama_sampler_init_penalties(
             /* .penalize_nl     = */ penalize_nl,
             /* .ignore_eos      = */ ignore_eos,
             /* .prev            = */ ring_buffer<llama_token>(penalty_last_n),
+            /* .token_count     = */ {},
         },
     };
 }
@@ -1644,6 +1647,289 @@ struct llama_sampler * llama_sampler_init_logit_bias(
     };
 }
 
+// fused chain
+
+// select the n largest logits into a min-heap
+// the logits are scanned in blocks that are first tested against the current threshold with a branch-free count,
+// which the compiler turns into a few SIMD compares, so the blocks without a candidate never touch the heap
+#define LLAMA_TOP_K_BLOCK 32
+
+#define LLAMA_TOP_K_MIN_RATIO 8
+
+static void llama_top_k_logits(const float * logits, int32_t n_vocab, int32_t n, std::vector<llama_token_data> & heap) {
+    // min-heap: the smallest of the selected logits is at the front
+    const auto comp = [](const llama_token_data & a, const llama_token_data & b) {
+        return a.logit > b.logit;
+    };
+
+    heap.clear();
+
+    int32_t i = 0;
+    for (; i < n_vocab && (int32_t) heap.size() < n; ++i) {
+        heap.push_back(llama_token_data{i, logits[i], 0.0f});
+    }
+
+    std::make_heap(heap.begin(), heap.end(), comp);
+
+    float thold = heap.front().logit;
+
+    const auto push = [&](int32_t id) {
+        if (logits[id] > thold) {
+            std::pop_heap(heap.begin(), heap.end(), comp);
+            heap.back() = llama_token_data{id, logits[id], 0.0f};
+            std::push_heap(heap.begin(), heap.end(), comp);
+            thold = heap.front().logit;
+        }
+    };
+
+    for (; i + LLAMA_TOP_K_BLOCK <= n_vocab; i += LLAMA_TOP_K_BLOCK) {
+        const float * x = logits + i;
+
+        int n_above = 0;
+        for (int j = 0; j < LLAMA_TOP_K_BLOCK; ++j) {
+            n_above += x[j] > thold;
+        }
+
+        if (n_above == 0) {
+            continue;
+        }
+
+        for (int j = 0; j < LLAMA_TOP_K_BLOCK; ++j) {
+            push(i + j);
+        }
+    }
+
+    for (; i < n_vocab; ++i) {
+        push(i);
+    }
+
+    // descending order of the logits
+    std::sort_heap(heap.begin(), heap.end(), comp);
+}
+
+// materialize the full vocabulary and apply the sampler to it
+static void llama_sampler_apply_full(struct llama_sampler * smpl, const float * logits, int32_t n_vocab, llama_token_data_array * cur_p) {
+    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+        cur_p->data[token_id] = llama_token_data{token_id, logits[token_id], 0.0f};
+    }
+
+    cur_p->size     = n_vocab;
+    cur_p->selected = -1;
+    cur_p->sorted   = false;
+
+    llama_sampler_apply(smpl, cur_p);
+}
+
+void llama_sampler_chain_apply_logits(struct llama_sampler * smpl, const float * logits, int32_t n_vocab, llama_token_data_array * cur_p) {
+    GGML_ASSERT(smpl->iface == &llama_sampler_chain_i);
+
+    auto * chain = (llama_sampler_chain *) smpl->ctx;
+
+    const auto & samplers = chain->samplers;
+
+    // the fused path handles chains of the form: [logit-bias|penalties]* top-k ...
+    size_t i_top_k = 0;
+    while (i_top_k < samplers.size() &&
+          (samplers[i_top_k]->iface == &llama_sampler_logit_bias_i || samplers[i_top_k]->iface == &llama_sampler_penalties_i)) {
+        i_top_k++;
+    }
+
+    int32_t k = 0;
+    if (i_top_k < samplers.size() && samplers[i_top_k]->iface == &llama_sampler_top_k_i) {
+        k = ((const llama_sampler_top_k *) samplers[i_top_k]->ctx)->k;
+    }
+
+    // the heap selection only pays off when k is a small fraction of the vocab
+    if (k <= 0 || LLAMA_TOP_K_MIN_RATIO*k > n_vocab) {
+        llama_sampler_apply_full(smpl, logits, n_vocab, cur_p);
+        return;
+    }
+
+    time_meas tm(chain->t_sample_us, chain->params.no_perf);
+
+    // the logit-bias and penalties samplers only modify a handful of tokens - apply them to those tokens alone
+    auto & sparse_ids = chain->sparse_ids;
+    sparse_ids.clear();
+
+    for (size_t i = 0; i < i_top_k; ++i) {
+        if (samplers[i]->iface == &llama_sampler_logit_bias_i) {
+            const auto * ctx = (const llama_sampler_logit_bias *) samplers[i]->ctx;
+            for (const auto & lb : ctx->logit_bias) {
+                if (lb.token >= 0 && lb.token < n_vocab) {
+                    sparse_ids.push_back(lb.token);
+                }
+            }
+        } else {
+            const auto * ctx = (const llama_sampler_penalties *) samplers[i]->ctx;
+            if (ctx->ignore_eos) {
+                sparse_ids.push_back(ctx->special_eos_id);
+            }
+            for (const auto & tc : ctx->token_count) {
+                sparse_ids.push_back(tc.first);
+            }
+        }
+    }
+
+    std::sort(sparse_ids.begin(), sparse_ids.end());
+    sparse_ids.erase(std::unique(sparse_ids.begin(), sparse_ids.end()), sparse_ids.end());
+
+    auto & sparse = chain->sparse;
+    sparse.clear();
+
+    for (const llama_token id : sparse_ids) {
+        sparse.push_back(llama_token_data{id, logits[id], 0.0f});
+    }
+
+    if (!sparse.empty()) {
+        llama_token_data_array sparse_p = { sparse.data(), sparse.size(), -1, false };
+
+        for (size_t i = 0; i < i_top_k; ++i) {
+            llama_sampler_apply(samplers[i], &sparse_p);
+        }
+    }
+
+    // at most sparse.size() of the k + sparse.size() largest raw logits belong to modified tokens, so the top k of
+    // the unmodified tokens are all in there
+    llama_top_k_logits(logits, n_vocab, std::min<int32_t>(n_vocab, k + sparse.size()), chain->top);
+
+    size_t n = 0;
+    for (const auto & td : chain->top) {
+        if (!std::binary_search(sparse_ids.begin(), sparse_ids.end(), td.id)) {
+            cur_p->data[n++] = td;
+        }
+    }
+    for (const auto & td : sparse) {
+        cur_p->data[n++] = td;
+    }
+
+    std::partial_sort(cur_p->data, cur_p->data + k, cur_p->data + n, [](const llama_token_data & a, const llama_token_data & b) {
+        return a.logit > b.logit;
+    });
+
+    cur_p->size     = k;
+    cur_p->selected = -1;
+    cur_p->sorted   = true;
+
+    for (size_t i = i_top_k + 1; i < samplers.size(); ++i) {
+        llama_sampler_apply(samplers[i], cur_p);
+    }
+}
+
+static llama_token llama_sampler_sample_logits(struct llama_sampler * smpl, const float * logits, int32_t n_vocab) {
+    const bool is_chain = smpl->iface == &llama_sampler_chain_i;
+
+    // chains keep their candidate buffer, single samplers reuse a per-thread one
+    static thread_local std::vector<llama_token_data> cur_tls;
+
+    auto & cur = is_chain ? ((llama_sampler_chain *) smpl->ctx)->cur : cur_tls;
+    cur.resize(n_vocab);
+
+    llama_token_data_array cur_p = { cur.data(), cur.size(), -1, false };
+
+    if (is_chain) {
+        llama_sampler_chain_apply_logits(smpl, logits, n_vocab, &cur_p);
+    } else {
+        llama_sampler_apply_full(smpl, logits, n_vocab, &cur_p);
+    }
+
+    GGML_ASSERT(cur_p.selected >= 0 && cur_p.selected < (int32_t) cur_p.size);
+
+    auto token = cur_p.data[cur_p.selected].id;
+
+    llama_sampler_accept(smpl, token);
+
+    return token;
+}
+
+// sample from the candidates of an output when the context only keeps its top logits
+static llama_token llama_sampler_sample_top(struct llama_sampler * smpl, std::vector<llama_token_data> & cands) {
+    llama_token_data_array cur_p = { cands.data(), cands.size(), -1, true };
+
+    llama_sampler_apply(smpl, &cur_p);
+
+    GGML_ASSERT(cur_p.selected >= 0 && cur_p.selected < (int32_t) cur_p.size);
+
+    auto token = cur_p.data[cur_p.selected].id;
+
+    llama_sampler_accept(smpl, token);
+
+    return token;
+}
+
+static void llama_sampler_fetch_top(struct llama_context * ctx, int32_t idx, std::vector<llama_token_data> & cands) {
+    cands.resize(llama_n_top_logits(ctx));
+
+    const int32_t n = llama_get_logits_top_ith(ctx, idx, cands.data(), cands.size());
+    if (n < 0) {
+        GGML_ABORT("%s: failed to get the top logits of output %d\n", __func__, idx);
+    }
+
+    cands.resize(n);
+}
+
+static const float * llama_sampler_fetch_logits(struct llama_context * ctx, int32_t idx) {
+    const auto * logits = llama_get_logits_ith(ctx, idx);
+    if (logits == nullptr) {
+        GGML_ABORT("%s: failed to get the logits of output %d\n", __func__, idx);
+    }
+
+    return logits;
+}
+
+llama_token llama_sampler_sample(struct llama_sampler * smpl, struct llama_context * ctx, int32_t idx) {
+    // the full logits are not available when the context only keeps the top logits of each output
+    if (llama_n_top_logits(ctx) > 0) {
+        static thread_local std::vector<llama_token_data> cands;
+
+        llama_sampler_fetch_top(ctx, idx, cands);
+
+        return llama_sampler_sample_top(smpl, cands);
+    }
+
+    const auto * logits = llama_sampler_fetch_logits(ctx, idx);
+
+    const int n_vocab = llama_n_vocab(llama_get_model(ctx));
+
+    return llama_sampler_sample_logits(smpl, logits, n_vocab);
+}
+
+void llama_sampler_sample_batch(
+        struct llama_sampler ** smpls,
+        struct llama_context  * ctx,
+               const int32_t  * idxs,
+                 llama_token  * tokens,
+                     int32_t    n_smpls,
+                     int32_t    n_threads) {
+    const int n_vocab = llama_n_vocab(llama_get_model(ctx));
+
+    if (n_threads <= 0) {
+        n_threads = llama_n_threads(ctx);
+    }
+
+    // fetching the logits synchronizes the context - resolve the outputs on this thread
+    if (llama_n_top_logits(ctx) > 0) {
+        std::vector<std::vector<llama_token_data>> cands(n_smpls);
+        for (int32_t i = 0; i < n_smpls; ++i) {
+            llama_sampler_fetch_top(ctx, idxs[i], cands[i]);
+        }
+
+        llama_parallel_for(n_smpls, n_threads, [&](int32_t i) {
+            tokens[i] = llama_sampler_sample_top(smpls[i], cands[i]);
+        });
+
+        return;
+    }
+
+    std::vector<const float *> logits(n_smpls);
+    for (int32_t i = 0; i < n_smpls; ++i) {
+        logits[i] = llama_sampler_fetch_logits(ctx, idxs[i]);
+    }
+
+    llama_parallel_for(n_smpls, n_threads, [&](int32_t i) {
+        tokens[i] = llama_sampler_sample_logits(smpls[i], logits[i], n_vocab);
+    });
+}
+
 // utils
 
 uint32_t llama_sampler_get_seed(const struct llama_sampler * smpl) {
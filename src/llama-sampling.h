@@ -21,9 +21,17 @@ struct llama_sampler_chain {
     mutable int64_t t_sample_us;
 
     mutable int32_t n_sample;
+
+    // scratch buffers of llama_sampler_chain_apply_logits
+
+    std::vector<llama_token_data> cur;
+    std::vector<llama_token_data> top;
+    std::vector<llama_token>      sparse_ids;
+    std::vector<llama_token_data> sparse;
 };
 
 struct llama_sampler * llama_sampler_init_grammar_impl(
         const struct llama_vocab & vocab,
                       const char * grammar_str,
-                      const char * grammar_root);
+                      const char * grammar_root,
+                              bool compiled = false);
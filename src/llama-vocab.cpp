@@ -3,14 +3,19 @@
 #include "unicode.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cfloat>
 #include <climits>
 #include <cstdarg>
 #include <cstring>
+#include <exception>
 #include <forward_list>
+#include <mutex>
 #include <queue>
 #include <sstream>
+#include <thread>
+#include <unordered_map>
 
 //
 // helpers
@@ -488,11 +493,22 @@ struct llm_tokenizer_bpe : llm_tokenizer {
                 };
                 break;
         }
+
+        regex = unicode_regex_compile(regex_exprs);
     }
 
     std::vector<std::string> regex_exprs;
+
+    // regex_exprs prepared for unicode_regex_split
+    std::shared_ptr<const unicode_regex_compiled> regex;
 };
 
+// inputs with at least this many words are merged by several threads
+#define LLAMA_BPE_PARALLEL_MIN_WORDS 4096
+
+// max number of distinct words remembered by a session
+#define LLAMA_BPE_CACHE_MAX_WORDS 65536
+
 struct llm_tokenizer_bpe_session {
     llm_tokenizer_bpe_session(const llama_vocab & vocab) : vocab(vocab),
         bpe_tokenizer(static_cast<const llm_tokenizer_bpe *>(vocab.tokenizer)) {}
@@ -535,110 +551,141 @@ struct llm_tokenizer_bpe_session {
     }
 
     void tokenize(const std::string & text, std::vector<llama_vocab::id> & output) {
-        int final_prev_index = -1;
-        const auto word_collection = unicode_regex_split(text, bpe_tokenizer->regex_exprs);
+        const auto word_collection = unicode_regex_split(text, *bpe_tokenizer->regex);
+
+        // the words are merged independently, so large inputs are split into ranges of words,
+        // each tokenized by its own session
+        const int n_threads = std::min<int>({
+            (int) std::thread::hardware_concurrency(),
+            (int) (word_collection.size() / LLAMA_BPE_PARALLEL_MIN_WORDS),
+            8,
+        });
+
+        if (n_threads <= 1) {
+            for (const auto & word : word_collection) {
+                tokenize_word(word, output);
+            }
+            return;
+        }
 
-        symbols_final.clear();
+        const size_t n_words = word_collection.size();
 
-        for (const auto & word : word_collection) {
-            work_queue = llm_bigram_bpe::queue();
-            symbols.clear();
+        std::vector<std::vector<llama_vocab::id>> outputs(n_threads - 1);
+        std::vector<std::thread> workers;
+        workers.reserve(n_threads - 1);
 
-            int index = 0;
-            size_t offset = 0;
+        for (int ith = 1; ith < n_threads; ++ith) {
+            workers.emplace_back([&, ith]() {
+                llm_tokenizer_bpe_session session(vocab);
+                for (size_t i = n_words*ith/n_threads; i < n_words*(ith + 1)/n_threads; ++i) {
+                    session.tokenize_word(word_collection[i], outputs[ith - 1]);
+                }
+            });
+        }
 
-            if (vocab.tokenizer_ignore_merges && vocab.token_to_id.find(word) != vocab.token_to_id.end()) {
-                symbols.emplace_back(llm_symbol{-1, -1, word.c_str(), word.size()});
-                offset = word.size();
-            }
+        for (size_t i = 0; i < n_words/n_threads; ++i) {
+            tokenize_word(word_collection[i], output);
+        }
 
-            while (offset < word.size()) {
-                llm_symbol sym;
-                size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
-                sym.text = word.c_str() + offset;
-                sym.n = char_len;
-                offset += sym.n;
-                sym.prev = index - 1;
-                sym.next = offset == word.size() ? -1 : index + 1;
-                index++;
-                symbols.emplace_back(sym);
-            }
-            for (size_t i = 1; i < symbols.size(); ++i) {
-                add_new_bigram(i - 1, i);
-            }
+        for (int ith = 1; ith < n_threads; ++ith) {
+            workers[ith - 1].join();
+            output.insert(output.end(), outputs[ith - 1].begin(), outputs[ith - 1].end());
+        }
+    }
 
-            // build token(s)
-            while (!work_queue.empty()) {
-                auto bigram = work_queue.pop_move();
+private:
+    // merges a single pre-tokenized word, repeated words are served from the session cache
+    void tokenize_word(const std::string & word, std::vector<llama_vocab::id> & output) {
+        const auto it = cache.find(word);
+        if (it != cache.end()) {
+            output.insert(output.end(), it->second.begin(), it->second.end());
+            return;
+        }
 
-                auto & left_symbol = symbols[bigram.left];
-                auto & right_symbol = symbols[bigram.right];
+        work_queue = llm_bigram_bpe::queue();
+        symbols.clear();
 
-                if (left_symbol.n == 0 || right_symbol.n == 0) {
-                    continue;
-                }
-                std::string left_token = std::string(left_symbol.text, left_symbol.n);
-                std::string right_token = std::string(right_symbol.text, right_symbol.n);
-                if (left_token + right_token != bigram.text) {
-                    continue;  // Skip this bigram if it's outdated
-                }
+        int index = 0;
+        size_t offset = 0;
+
+        if (vocab.tokenizer_ignore_merges && vocab.token_to_id.find(word) != vocab.token_to_id.end()) {
+            symbols.emplace_back(llm_symbol{-1, -1, word.c_str(), word.size()});
+            offset = word.size();
+        }
+
+        while (offset < word.size()) {
+            llm_symbol sym;
+            size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
+            sym.text = word.c_str() + offset;
+            sym.n = char_len;
+            offset += sym.n;
+            sym.prev = index - 1;
+            sym.next = offset == word.size() ? -1 : index + 1;
+            index++;
+            symbols.emplace_back(sym);
+        }
+        for (size_t i = 1; i < symbols.size(); ++i) {
+            add_new_bigram(i - 1, i);
+        }
 
-                // merge the right sym into the left one
-                left_symbol.n += right_symbol.n;
-                right_symbol.n = 0;
+        // build token(s)
+        while (!work_queue.empty()) {
+            auto bigram = work_queue.pop_move();
 
-                // remove the right sym from the chain
-                left_symbol.next = right_symbol.next;
-                if (right_symbol.next >= 0) {
-                    symbols[right_symbol.next].prev = bigram.left;
-                }
+            auto & left_symbol = symbols[bigram.left];
+            auto & right_symbol = symbols[bigram.right];
 
-                add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
-                add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
+            if (left_symbol.n == 0 || right_symbol.n == 0) {
+                continue;
+            }
+            std::string left_token = std::string(left_symbol.text, left_symbol.n);
+            std::string right_token = std::string(right_symbol.text, right_symbol.n);
+            if (left_token + right_token != bigram.text) {
+                continue;  // Skip this bigram if it's outdated
             }
 
-            // add the finished tokens to the final list keeping correct order for next and prev
-            for (auto & sym : symbols) {
-                if (sym.n > 0) {
-                    sym.prev = final_prev_index;
-                    sym.next = -1;
-                    if (final_prev_index != -1) {
-                        symbols_final[final_prev_index].next = symbols_final.size();
-                    }
-                    symbols_final.emplace_back(sym);
-                    final_prev_index = symbols_final.size() - 1;
-                }
+            // merge the right sym into the left one
+            left_symbol.n += right_symbol.n;
+            right_symbol.n = 0;
+
+            // remove the right sym from the chain
+            left_symbol.next = right_symbol.next;
+            if (right_symbol.next >= 0) {
+                symbols[right_symbol.next].prev = bigram.left;
             }
+
+            add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
+            add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
         }
 
-        symbols = symbols_final;
+        const size_t n_output = output.size();
 
-        if (!symbols.empty()) {
-            for (int i = 0; i != -1; i = symbols[i].next) {
-                auto & symbol = symbols[i];
-                if (symbol.n == 0) {
-                    continue;
-                }
+        for (const auto & symbol : symbols) {
+            if (symbol.n == 0) {
+                continue;
+            }
 
-                const std::string str = std::string(symbol.text, symbol.n);
-                const auto token = vocab.token_to_id.find(str);
+            const std::string str = std::string(symbol.text, symbol.n);
+            const auto token = vocab.token_to_id.find(str);
 
-                if (token == vocab.token_to_id.end()) {
-                    for (auto j = str.begin(); j != str.end(); ++j) {
-                        std::string byte_str(1, *j);
-                        auto token_multibyte = vocab.token_to_id.find(byte_str);
-                        if (token_multibyte != vocab.token_to_id.end()) {
-                            output.push_back(token_multibyte->second);
-                        }
+            if (token == vocab.token_to_id.end()) {
+                for (auto j = str.begin(); j != str.end(); ++j) {
+                    std::string byte_str(1, *j);
+                    auto token_multibyte = vocab.token_to_id.find(byte_str);
+                    if (token_multibyte != vocab.token_to_id.end()) {
+                        output.push_back(token_multibyte->second);
                     }
-                } else {
-                    output.push_back((*token).second);
                 }
+            } else {
+                output.push_back((*token).second);
             }
         }
+
+        if (cache.size() < LLAMA_BPE_CACHE_MAX_WORDS) {
+            cache.emplace(word, std::vector<llama_vocab::id>(output.begin() + n_output, output.end()));
+        }
     }
 
-private:
     void add_new_bigram(int left, int right) {
         if (left == -1 || right == -1) {
             return;
@@ -669,8 +716,10 @@ private:
     const llm_tokenizer_bpe * bpe_tokenizer;
 
     std::vector<llm_symbol> symbols;
-    std::vector<llm_symbol> symbols_final;
     llm_bigram_bpe::queue work_queue;
+
+    // tokens of the words seen by this session
+    std::unordered_map<std::string, std::vector<llama_vocab::id>> cache;
 };
 
 //
@@ -1330,6 +1379,7 @@ static void tokenizer_st_partition(const llama_vocab & vocab, std::forward_list<
 
         // for each text fragment
         std::forward_list<fragment_buffer_variant>::iterator it = buffer.begin();
+        std::forward_list<fragment_buffer_variant>::iterator it_prev = buffer.before_begin();
         while (it != buffer.end()) {
             auto & fragment = (*it);
 
@@ -1343,20 +1393,22 @@ static void tokenizer_st_partition(const llama_vocab & vocab, std::forward_list<
                 // loop over the text
                 while (true) {
                     // find the first occurrence of a given special token in this fragment
-                    //  passing offset argument only limit the "search area" but match coordinates
+                    //  the search does not go past the end of the fragment, but match coordinates
                     //  are still relative to the source full raw_text
-                    auto match = raw_text.find(special_token, raw_text_base_offset);
+                    const auto fragment_begin = raw_text.begin() + raw_text_base_offset;
+                    const auto fragment_end   = fragment_begin + raw_text_base_length;
+                    const auto match_it = std::search(fragment_begin, fragment_end, special_token.begin(), special_token.end());
 
                     // no occurrences found, stop processing this fragment for a given special token
-                    if (match == std::string::npos) break;
+                    if (match_it == fragment_end) break;
 
-                    // check if match is within bounds of offset <-> length
-                    if (match + special_token.length() > raw_text_base_offset + raw_text_base_length) break;
+                    const size_t match = match_it - raw_text.begin();
 
 #ifdef PRETOKENIZERDEBUG
                     LLAMA_LOG_WARN("FF: (%ld %ld %ld) '%s'\n", raw_text->length(), raw_text_base_offset, raw_text_base_length, raw_text->substr(raw_text_base_offset, raw_text_base_length).c_str());
 #endif
-                    auto source = std::distance(buffer.begin(), it);
+                    // the fragment being split, erased once its pieces are in place
+                    const auto source_prev = it_prev;
 
                     // if match is further than base offset
                     //  then we have some text to the left of it
@@ -1384,6 +1436,7 @@ static void tokenizer_st_partition(const llama_vocab & vocab, std::forward_list<
                     // special token
                     buffer.emplace_after(it, special_id);
                     it++;
+                    const auto it_special = it;
 
                     // right
                     if (match + special_token.length() < raw_text_base_offset + raw_text_base_length) {
@@ -1406,11 +1459,8 @@ static void tokenizer_st_partition(const llama_vocab & vocab, std::forward_list<
                         LLAMA_LOG_WARN("FR: (%ld %ld) '%s'\n", right_reminder_offset, right_reminder_length, raw_text->substr(right_reminder_offset, right_reminder_length).c_str());
 #endif
 
-                        if (source == 0) {
-                            buffer.erase_after(buffer.before_begin());
-                        } else {
-                            buffer.erase_after(std::next(buffer.begin(), (source-1)));
-                        }
+                        buffer.erase_after(source_prev);
+                        it_prev = it_special;
 
                         // repeat for the right side
                         raw_text_base_offset = right_reminder_offset;
@@ -1420,15 +1470,12 @@ static void tokenizer_st_partition(const llama_vocab & vocab, std::forward_list<
                         LLAMA_LOG_WARN("RR: (%ld %ld) '%s'\n", raw_text_base_offset, raw_text_base_length, raw_text->substr(raw_text_base_offset, raw_text_base_length).c_str());
 #endif
                     } else {
-                        if (source == 0) {
-                            buffer.erase_after(buffer.before_begin());
-                        } else {
-                            buffer.erase_after(std::next(buffer.begin(), (source-1)));
-                        }
+                        buffer.erase_after(source_prev);
                         break;
                     }
                 }
             }
+            it_prev = it;
             it++;
         }
     }
@@ -1942,3 +1989,82 @@ int32_t llama_detokenize_impl(
 
     return total <= text_len_max ? total : -total;
 }
+
+int32_t llama_tokenize_batch_impl(
+        const struct llama_vocab & vocab,
+              const char * const * texts,
+                   const int32_t * text_lens,
+                         int32_t   n_texts,
+                     llama_token * tokens,
+                         int32_t   n_tokens_max,
+                         int32_t * offsets,
+                         int32_t   n_threads,
+                            bool   add_special,
+                            bool   parse_special) {
+    std::vector<std::vector<llama_vocab::id>> res(n_texts);
+
+    llama_parallel_for(n_texts, n_threads, [&](int32_t i) {
+        res[i] = llama_tokenize_internal(vocab, std::string(texts[i], text_lens[i]), add_special, parse_special);
+    });
+
+    offsets[0] = 0;
+    for (int32_t i = 0; i < n_texts; ++i) {
+        offsets[i + 1] = offsets[i] + (int32_t) res[i].size();
+    }
+
+    const int32_t total = offsets[n_texts];
+    if (n_tokens_max < total) {
+        return -total;
+    }
+
+    for (int32_t i = 0; i < n_texts; ++i) {
+        std::copy(res[i].begin(), res[i].end(), tokens + offsets[i]);
+    }
+
+    return total;
+}
+
+int32_t llama_detokenize_batch_impl(
+        const struct llama_vocab & vocab,
+               const llama_token * tokens,
+                   const int32_t * token_offsets,
+                         int32_t   n_seqs,
+                            char * text,
+                         int32_t   text_len_max,
+                         int32_t * offsets,
+                         int32_t   n_threads,
+                            bool   remove_special,
+                            bool   unparse_special) {
+    std::vector<std::string> res(n_seqs);
+
+    llama_parallel_for(n_seqs, n_threads, [&](int32_t i) {
+        const llama_token * seq = tokens + token_offsets[i];
+        const int32_t n_tokens = token_offsets[i + 1] - token_offsets[i];
+
+        std::string & piece = res[i];
+        piece.resize(std::max<size_t>(piece.capacity(), n_tokens));
+        int32_t n_chars = llama_detokenize_impl(vocab, seq, n_tokens, &piece[0], piece.size(), remove_special, unparse_special);
+        if (n_chars < 0) {
+            piece.resize(-n_chars);
+            n_chars = llama_detokenize_impl(vocab, seq, n_tokens, &piece[0], piece.size(), remove_special, unparse_special);
+            GGML_ASSERT(n_chars <= (int32_t) piece.size());  // whitespace trimming is performed after per-token detokenization
+        }
+        piece.resize(n_chars);
+    });
+
+    offsets[0] = 0;
+    for (int32_t i = 0; i < n_seqs; ++i) {
+        offsets[i + 1] = offsets[i] + (int32_t) res[i].size();
+    }
+
+    const int32_t total = offsets[n_seqs];
+    if (text_len_max < total) {
+        return -total;
+    }
+
+    for (int32_t i = 0; i < n_seqs; ++i) {
+        memcpy(text + offsets[i], res[i].data(), res[i].size());
+    }
+
+    return total;
+}
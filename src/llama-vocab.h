@@ -144,3 +144,27 @@ int32_t llama_detokenize_impl(
                          int32_t   text_len_max,
                             bool   remove_special,
                             bool   unparse_special);
+
+int32_t llama_tokenize_batch_impl(
+        const struct llama_vocab & vocab,
+              const char * const * texts,
+                   const int32_t * text_lens,
+                         int32_t   n_texts,
+                     llama_token * tokens,
+                         int32_t   n_tokens_max,
+                         int32_t * offsets,
+                         int32_t   n_threads,
+                            bool   add_special,
+                            bool   parse_special);
+
+int32_t llama_detokenize_batch_impl(
+        const struct llama_vocab & vocab,
+               const llama_token * tokens,
+                   const int32_t * token_offsets,
+                         int32_t   n_seqs,
+                            char * text,
+                         int32_t   text_len_max,
+                         int32_t * offsets,
+                         int32_t   n_threads,
+                            bool   remove_special,
+                            bool   unparse_special);
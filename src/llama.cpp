@@ -53,6 +53,8 @@
     #include <io.h>
 #endif
 
+#include <sys/stat.h>
+
 #if __cplusplus >= 202000L
     #define LU8(x) (const char*)(u8##x)
 #else
@@ -61,18 +63,22 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <bitset>
 #include <cassert>
 #include <cctype>
 #include <cfloat>
 #include <cinttypes>
 #include <climits>
 #include <cmath>
+#include <condition_variable>
 #include <cstdarg>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <ctime>
+#include <exception>
 #include <fstream>
 #include <functional>
 #include <future>
@@ -97,6 +103,7 @@
 // bump if necessary
 #define LLAMA_MAX_LAYERS  512
 #define LLAMA_MAX_EXPERTS 160  // DeepSeekV2
+#define LLAMA_MAX_SEQ     256  // width of the per-cell sequence mask of the KV cache
 
 #define timer(name) auto _timer_##name = Timer(#name)
 
@@ -1790,6 +1797,27 @@ public:
         } ;
     }
 
+    // positioned read, does not use or change the file pointer and can be called from several threads at once
+    void read_raw_at(void * ptr, size_t len, size_t offset) const {
+        size_t bytes_read = 0;
+        while (bytes_read < len) {
+            size_t chunk_size = std::min<size_t>(len - bytes_read, 64*1024*1024);
+            OVERLAPPED ov = {};
+            ov.Offset     = (DWORD) ((offset + bytes_read) & 0xFFFFFFFF);
+            ov.OffsetHigh = (DWORD) ((offset + bytes_read) >> 32);
+            DWORD chunk_read = 0;
+            BOOL result = ReadFile(fp_win32, reinterpret_cast<char*>(ptr) + bytes_read, chunk_size, &chunk_read, &ov);
+            if (!result) {
+                throw std::runtime_error(format("read error: %s", GetErrorMessageWin32(GetLastError()).c_str()));
+            }
+            if (chunk_read == 0) {
+                throw std::runtime_error("unexpectedly reached end of file");
+            }
+
+            bytes_read += chunk_read;
+        }
+    }
+
     uint32_t read_u32() const {
         uint32_t val;
         read_raw(&val, sizeof(val));
@@ -1877,6 +1905,25 @@ public:
         }
     }
 
+    // positioned read, does not use or change the file position and can be called from several threads at once
+    void read_raw_at(void * ptr, size_t len, size_t offset) const {
+        const int fd = fileno(fp);
+        size_t bytes_read = 0;
+        while (bytes_read < len) {
+            ssize_t ret = pread(fd, (char *) ptr + bytes_read, len - bytes_read, (off_t) (offset + bytes_read));
+            if (ret == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(format("read error: %s", strerror(errno)));
+            }
+            if (ret == 0) {
+                throw std::runtime_error("unexpectedly reached end of file");
+            }
+            bytes_read += ret;
+        }
+    }
+
     uint32_t read_u32() const {
         uint32_t ret;
         read_raw(&ret, sizeof(ret));
@@ -1907,6 +1954,26 @@ public:
 };
 using llama_files = std::vector<std::unique_ptr<llama_file>>;
 
+#define LLAMA_HUGE_PAGE_SIZE (2*1024*1024)
+
+// ask the kernel to back [addr, addr + size) with transparent huge pages
+// only the part of the range that is aligned to the huge page size is affected
+static void llama_madvise_hugepage(void * addr, size_t size) {
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    const uintptr_t first = GGML_PAD((uintptr_t) addr, LLAMA_HUGE_PAGE_SIZE);
+    const uintptr_t last  = ((uintptr_t) addr + size) & ~((uintptr_t) LLAMA_HUGE_PAGE_SIZE - 1);
+    if (last <= first) {
+        return;
+    }
+    if (madvise((void *) first, last - first, MADV_HUGEPAGE)) {
+        LLAMA_LOG_WARN("warning: madvise(.., MADV_HUGEPAGE) failed: %s\n", strerror(errno));
+    }
+#else
+    GGML_UNUSED(addr);
+    GGML_UNUSED(size);
+#endif
+}
+
 struct llama_mmap {
     void * addr;
     size_t size;
@@ -1919,7 +1986,7 @@ struct llama_mmap {
     // list of mapped fragments (first_offset, last_offset)
     std::vector<std::pair<size_t, size_t>> mapped_fragments;
 
-    llama_mmap(struct llama_file * file, size_t prefetch = (size_t) -1 /* -1 = max value */, bool numa = false) {
+    llama_mmap(struct llama_file * file, size_t prefetch = (size_t) -1 /* -1 = max value */, bool numa = false, bool hugepages = false) {
         size = file->size;
         int fd = fileno(file->fp);
         int flags = MAP_SHARED;
@@ -1933,11 +2000,41 @@ struct llama_mmap {
         }
         if (prefetch) { flags |= MAP_POPULATE; }
 #endif
-        addr = mmap(NULL, file->size, PROT_READ, flags, fd, 0);
+        addr = MAP_FAILED;
+#ifdef __linux__
+        if (hugepages) {
+            // file-backed huge pages need the addresses and the file offsets to agree modulo the huge page size,
+            // so reserve a slightly larger range and place the mapping at its first huge page boundary
+            const size_t map_size = GGML_PAD(file->size, (size_t) sysconf(_SC_PAGESIZE));
+            uint8_t * reserved = (uint8_t *) mmap(NULL, map_size + LLAMA_HUGE_PAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (reserved != MAP_FAILED) {
+                uint8_t * aligned = (uint8_t *) GGML_PAD((uintptr_t) reserved, LLAMA_HUGE_PAGE_SIZE);
+                addr = mmap(aligned, file->size, PROT_READ, flags | MAP_FIXED, fd, 0);
+                if (addr == MAP_FAILED) {
+                    munmap(reserved, map_size + LLAMA_HUGE_PAGE_SIZE);
+                } else {
+                    // release the unused head and tail of the reservation
+                    if (aligned > reserved) {
+                        munmap(reserved, aligned - reserved);
+                    }
+                    if (aligned + map_size < reserved + map_size + LLAMA_HUGE_PAGE_SIZE) {
+                        munmap(aligned + map_size, reserved + LLAMA_HUGE_PAGE_SIZE - aligned);
+                    }
+                }
+            }
+        }
+#endif
+        if (addr == MAP_FAILED) { // NOLINT
+            addr = mmap(NULL, file->size, PROT_READ, flags, fd, 0);
+        }
         if (addr == MAP_FAILED) { // NOLINT
             throw std::runtime_error(format("mmap failed: %s", strerror(errno)));
         }
 
+        if (hugepages) {
+            llama_madvise_hugepage(addr, file->size);
+        }
+
         if (prefetch > 0) {
             // advise the kernel to preload the mapped memory
             if (posix_madvise(addr, std::min(file->size, prefetch), POSIX_MADV_WILLNEED)) { 
@@ -2032,8 +2129,9 @@ struct llama_mmap {
 #elif defined(_WIN32)
     static constexpr bool SUPPORTED = true;
 
-    llama_mmap(struct llama_file * file, size_t prefetch = (size_t) -1, bool numa = false) {
+    llama_mmap(struct llama_file * file, size_t prefetch = (size_t) -1, bool numa = false, bool hugepages = false) {
         GGML_UNUSED(numa);
+        GGML_UNUSED(hugepages);
 
         size = file->size;
 
@@ -2094,10 +2192,11 @@ struct llama_mmap {
 #else
     static constexpr bool SUPPORTED = false;
 
-    llama_mmap(struct llama_file * file, size_t prefetch = -1, bool numa = false) {
+    llama_mmap(struct llama_file * file, size_t prefetch = -1, bool numa = false, bool hugepages = false) {
         GGML_UNUSED(file);
         GGML_UNUSED(prefetch);
         GGML_UNUSED(numa);
+        GGML_UNUSED(hugepages);
 
         throw std::runtime_error("mmap not supported");
     }
@@ -2120,11 +2219,18 @@ struct llama_mlock {
 
     bool failed_already = false;
 
+    // [begin, end) offsets locked by lock_range, in the order they were locked
+    std::vector<std::pair<size_t, size_t>> ranges;
+
     llama_mlock() {}
     llama_mlock(const llama_mlock &) = delete;
 
     ~llama_mlock() {
-        if (size) {
+        if (!ranges.empty()) {
+            for (const auto & range : ranges) {
+                raw_unlock((uint8_t *) addr + range.first, range.second - range.first);
+            }
+        } else if (size) {
             raw_unlock(addr, size);
         }
     }
@@ -2150,6 +2256,37 @@ struct llama_mlock {
         }
     }
 
+    // lock only [offs, offs + len) instead of growing the locked prefix,
+    // so that a mapping shared by all layers only pins the tensors this process uses
+    void lock_range(size_t offs, size_t len) {
+        GGML_ASSERT(addr);
+        GGML_ASSERT(size == 0 || !ranges.empty()); // do not mix with grow_to
+        if (failed_already || len == 0) {
+            return;
+        }
+        size_t granularity = lock_granularity();
+        size_t first = offs & ~(granularity - 1);
+        size_t last  = (offs + len + granularity - 1) & ~(granularity - 1);
+        // tensors are mostly loaded in file order, so extend the last range when they are contiguous
+        const bool extend = !ranges.empty() && first >= ranges.back().first && first <= ranges.back().second;
+        if (extend) {
+            first = ranges.back().second;
+            if (last <= first) {
+                return;
+            }
+        }
+        if (!raw_lock((uint8_t *) addr + first, last - first)) {
+            failed_already = true;
+            return;
+        }
+        size += last - first;
+        if (extend) {
+            ranges.back().second = last;
+        } else {
+            ranges.emplace_back(first, last);
+        }
+    }
+
 #ifdef _POSIX_MEMLOCK_RANGE
     static constexpr bool SUPPORTED = true;
 
@@ -2575,6 +2712,11 @@ struct llama_cparams {
     uint32_t n_seq_max;
     int      n_threads;       // number of threads to use for generation
     int      n_threads_batch; // number of threads to use for batch processing
+    int      spin_us;         // threadpool spin budget between sub-graphs
+    int      n_top_logits;    // > 0: only the top logits of each output are kept
+    uint32_t kv_block_size;   // > 0: paged KV cell allocation
+    uint32_t n_kv_window;     // > 0: streaming KV cache, see llama_kv_cache_evict_window()
+    uint32_t n_kv_sink;
 
     float rope_freq_base;
     float rope_freq_scale;
@@ -2592,6 +2734,7 @@ struct llama_cparams {
     bool causal_attn;
     bool offload_kqv;
     bool flash_attn;
+    bool fused_ops;
     bool no_perf;
 
     enum llama_pooling_type pooling_type;
@@ -2760,7 +2903,7 @@ struct llama_ubatch {
     llama_token  *  token;    // [n_tokens]
     float        *  embd;     // [n_embd, n_tokens]
     float        *  backend_embd;  // [n_embd, n_tokens]
-    float        *  out_embd; // [n_embd]
+    float        *  out_embd; // [n_embd, n_outputs]
     llama_pos    *  pos;      // [n_tokens]
     int32_t      *  n_seq_id; // [n_seqs]
     llama_seq_id ** seq_id;   // [n_seqs]
@@ -2773,14 +2916,15 @@ struct llama_kv_cell {
     int32_t   src   = -1; // used by recurrent state models to copy states
     int32_t   tail  = -1;
 
-    std::set<llama_seq_id> seq_id;
+    // sequences of the cell, seq_id < LLAMA_MAX_SEQ (checked in llama_decode_internal)
+    std::bitset<LLAMA_MAX_SEQ> seq_id;
 
     bool has_seq_id(const llama_seq_id & id) const {
-        return seq_id.find(id) != seq_id.end();
+        return id >= 0 && id < LLAMA_MAX_SEQ && seq_id[id];
     }
 
     bool is_empty() const {
-        return seq_id.empty();
+        return seq_id.none();
     }
 
     bool is_same_seq(const llama_kv_cell & other) const {
@@ -2805,6 +2949,22 @@ struct llama_kv_cache {
     // computed before each graph build
     uint32_t n = 0;
 
+    // paged allocation: cells are handed out per sequence in blocks of block_size cells, so the new
+    // tokens of a ubatch do not need a contiguous range and freed sequences leave whole blocks behind
+    // (0 = tokens are stored in the contiguous range [head, head + n_tokens))
+    uint32_t block_size = 0;
+
+    // cells of the tokens of the ubatch being processed, set by llama_kv_cache_find_slot when paged
+    std::vector<int32_t> slot;
+
+    // 1 + the highest cell that the sequences of the ubatch being processed can attend to (paged only)
+    uint32_t slot_max = 0;
+
+    // streaming: each sequence keeps its n_sink first and n_window last cells, see llama_kv_cache_evict_window
+    // (0 = no eviction)
+    uint32_t n_sink   = 0;
+    uint32_t n_window = 0;
+
     ggml_type type_k = GGML_TYPE_F16;
     ggml_type type_v = GGML_TYPE_F16;
 
@@ -3009,7 +3169,7 @@ struct llama_sbatch {
         ubatch_token.resize(!has_embd ? n_ubatch : 0);
         ubatch_embd.resize(has_embd ? n_embd * n_ubatch : 0);
         ubatch_backend_embd.resize(n_embd * n_tokens);
-        ubatch_out_embd.resize(n_embd);
+        ubatch_out_embd.resize(n_embd * n_ubatch);
         ubatch_pos.resize(n_ubatch);
         ubatch_n_seq_id.resize(n_ubatch);
         ubatch_seq_id.resize(n_ubatch);
@@ -3311,6 +3471,10 @@ struct llama_context {
         }
 
         ggml_backend_buffer_free(buf_output);
+
+        if (threadpool_spin) {
+            ggml_threadpool_free(threadpool_spin);
+        }
     }
 
     const struct llama_model  & model;
@@ -3329,6 +3493,7 @@ struct llama_context {
 
     ggml_threadpool_t threadpool       = nullptr;
     ggml_threadpool_t threadpool_batch = nullptr;
+    ggml_threadpool_t threadpool_spin  = nullptr; // owned, used with spin_us when no threadpool is attached
 
     bool has_evaluated_once = false;
 
@@ -3350,6 +3515,12 @@ struct llama_context {
     size_t  logits_size = 0; // capacity (of floats) for logits
     float * logits      = nullptr;
 
+    // compact decode output when cparams.n_top_logits > 0 (2-dimensional arrays: [n_outputs][n_top_logits])
+    // the ids are sorted by descending logit
+    size_t    logits_top_size = 0; // capacity (of elements) for each of the arrays
+    float   * logits_top      = nullptr;
+    int32_t * logits_top_ids  = nullptr;
+
     std::vector<int32_t> output_ids; // map batch token positions to ids of the logits and embd buffers
     size_t  output_size = 0; // capacity (of tokens positions) for the output buffers
     int32_t n_outputs   = 0; // number of actually-used outputs in the current ubatch or last logical batch
@@ -3372,6 +3543,9 @@ struct llama_context {
     std::vector<float> embd_enc;
     std::vector<std::set<llama_seq_id>> seq_ids_enc;
 
+    // scratch for the KQ mask: cell positions per sequence of the ubatch ([n_rows][n_kv])
+    std::vector<llama_pos> kq_mask_pos;
+
     // memory buffers used to evaluate the model
     std::vector<uint8_t> buf_compute_meta;
     std::vector<ggml_backend_sched_t> sched = {};
@@ -3397,6 +3571,7 @@ struct llama_context {
     struct ggml_tensor * inp_pos_bucket;    // I32 [n_batch|n_kv, n_batch]
     struct ggml_tensor * inp_embd_enc;      // F32 [n_embd, n_outputs_enc]
     struct ggml_tensor * inp_KQ_mask_cross; // F32 [n_outputs_enc, n_batch]
+    struct ggml_tensor * inp_kv_idxs;       // I32 [n_batch]
 
     // sockets
     std::string      master_ip     = "localhost";
@@ -3685,7 +3860,8 @@ static bool llama_kv_cache_init(
 
     cache.has_shift = false;
     cache.recurrent = llama_model_is_recurrent(&model);
-    cache.v_trans   = !cache.recurrent && !cparams.flash_attn;
+    // a quantized V cache keeps the rows of the cells, the blocks cannot be laid across cells written one at a time
+    cache.v_trans   = !cache.recurrent && !cparams.flash_attn && !ggml_is_quantized(type_v);
     cache.head = 0;
     cache.size = kv_size;
     cache.used = 0;
@@ -3694,6 +3870,25 @@ static bool llama_kv_cache_init(
     cache.cells.clear();
     cache.cells.resize(kv_size);
 
+    cache.slot.clear();
+
+    // the pending K shifts of the evicting sequences are only applied by the llama graph
+    cache.n_sink   = 0;
+    cache.n_window = 0;
+    if (cparams.n_kv_window > 0) {
+        if (cache.recurrent || model.arch != LLM_ARCH_LLAMA) {
+            LLAMA_LOG_WARN("%s: streaming KV cache is not supported for this model, tokens are not evicted\n", __func__);
+        } else {
+            cache.n_sink   = std::min(cparams.n_kv_sink, kv_size);
+            cache.n_window = cparams.n_kv_window;
+
+            if ((cache.n_sink + cache.n_window)*cparams.n_seq_max > kv_size) {
+                LLAMA_LOG_WARN("%s: %u cells cannot hold %u sinks and %u window tokens for each of %u sequences\n",
+                    __func__, kv_size, cache.n_sink, cache.n_window, cparams.n_seq_max);
+            }
+        }
+    }
+
     // count used buffer types
     std::map<ggml_backend_buffer_type_t, int> buft_layer_count;
     int32_t  local_i;
@@ -3716,6 +3911,23 @@ static bool llama_kv_cache_init(
         my_layers++;
     }
 
+    // the scattered KV stores are only wired into the llama graph, and ggml_set_rows only runs on the CPU backend
+    cache.block_size = 0;
+    if (cparams.kv_block_size > 0) {
+        bool kv_host = true;
+        for (const auto & it : buft_layer_count) {
+            kv_host = kv_host && ggml_backend_buft_is_host(it.first);
+        }
+
+        if (cache.recurrent || model.arch != LLM_ARCH_LLAMA) {
+            LLAMA_LOG_WARN("%s: paged KV cache is not supported for this model, using a contiguous cache\n", __func__);
+        } else if (!kv_host) {
+            LLAMA_LOG_WARN("%s: paged KV cache requires the KV cache in host memory, using a contiguous cache\n", __func__);
+        } else {
+            cache.block_size = std::min(cparams.kv_block_size, kv_size);
+        }
+    }
+
     // create a context for each buffer type
     std::map<ggml_backend_buffer_type_t, ggml_context *> ctx_map;
     for (auto & it : buft_layer_count) {
@@ -3777,9 +3989,146 @@ static bool llama_kv_cache_init(
 // updates the cache head
 // Note: On success, it's important that cache.head points
 // to the first cell of the slot.
-static bool llama_kv_cache_find_slot(
+// paged variant of llama_kv_cache_find_slot, the cells of the ubatch are returned in cache.slot
+// the tokens of a sequence are appended to the block holding its last cell, then to free blocks,
+// lowest first to keep the attended range short, and as a last resort to any free cell
+static bool llama_kv_cache_find_slot_paged(
            struct llama_kv_cache & cache,
        const struct llama_ubatch & batch) {
+    const uint32_t n_tokens     = batch.n_tokens;
+    const uint32_t n_seqs       = batch.n_seqs;
+    const uint32_t n_seq_tokens = batch.n_seq_tokens;
+    const uint32_t block_size   = cache.block_size;
+    const uint32_t n_blocks     = (cache.size + block_size - 1)/block_size;
+
+    if (n_tokens > cache.size - cache.used) {
+        return false;
+    }
+
+    llama_seq_id seq_id_max = 0;
+    for (uint32_t s = 0; s < n_seqs; ++s) {
+        for (int32_t j = 0; j < batch.n_seq_id[s]; ++j) {
+            GGML_ASSERT(batch.seq_id[s][j] >= 0);
+            seq_id_max = std::max(seq_id_max, batch.seq_id[s][j]);
+        }
+    }
+
+    std::bitset<LLAMA_MAX_SEQ> in_batch;
+    for (uint32_t s = 0; s < n_seqs; ++s) {
+        for (int32_t j = 0; j < batch.n_seq_id[s]; ++j) {
+            in_batch.set(batch.seq_id[s][j]);
+        }
+    }
+
+    // a single pass over the cells: the free cells of each block, the last cell of each
+    // sequence of the ubatch and the range of cells these sequences attend to
+    std::vector<uint32_t>  n_free  (n_blocks, 0);
+    std::vector<int32_t>   tail    (seq_id_max + 1, -1);
+    std::vector<llama_pos> tail_pos(seq_id_max + 1, -1);
+
+    uint32_t slot_max = 0;
+
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        const llama_kv_cell & cell = cache.cells[i];
+
+        if (cell.pos < 0) {
+            n_free[i/block_size]++;
+            continue;
+        }
+
+        const std::bitset<LLAMA_MAX_SEQ> seq_in_batch = cell.seq_id & in_batch;
+        if (seq_in_batch.none()) {
+            continue;
+        }
+
+        slot_max = i + 1;
+        for (llama_seq_id seq_id = 0; seq_id <= seq_id_max; ++seq_id) {
+            if (seq_in_batch[seq_id] && cell.pos >= tail_pos[seq_id]) {
+                tail_pos[seq_id] = cell.pos;
+                tail[seq_id]     = i;
+            }
+        }
+    }
+
+    // next cell of each sequence in the block of its last cell (-1 = take a new block)
+    std::vector<int32_t> next(seq_id_max + 1, -1);
+    for (llama_seq_id seq_id = 0; seq_id <= seq_id_max; ++seq_id) {
+        const uint32_t i = tail[seq_id] + 1;
+        if (tail[seq_id] >= 0 && i < cache.size && i % block_size != 0) {
+            next[seq_id] = i;
+        }
+    }
+
+    cache.slot.resize(n_tokens);
+
+    uint32_t next_block = 0;
+    uint32_t next_cell  = 0;
+
+    for (uint32_t s = 0; s < n_seqs; ++s) {
+        const llama_seq_id seq_id = batch.seq_id[s][0];
+
+        for (uint32_t i = 0; i < n_seq_tokens; ++i) {
+            const uint32_t k = s*n_seq_tokens + i;
+
+            int32_t c = next[seq_id];
+
+            if (c >= 0 && cache.cells[c].pos >= 0) {
+                c = -1;
+            }
+
+            if (c < 0) {
+                for (; next_block < n_blocks; ++next_block) {
+                    if (n_free[next_block] == std::min(block_size, cache.size - next_block*block_size)) {
+                        break;
+                    }
+                }
+                if (next_block < n_blocks) {
+                    c = next_block*block_size;
+                    n_free[next_block++] = 0;
+                }
+            }
+
+            if (c < 0) {
+                while (next_cell < cache.size && cache.cells[next_cell].pos >= 0) {
+                    next_cell++;
+                }
+                if (next_cell == cache.size) {
+                    // should not happen as enough cells are free - undo the cells taken so far
+                    for (uint32_t j = 0; j < k; ++j) {
+                        cache.cells[cache.slot[j]].pos = -1;
+                        cache.cells[cache.slot[j]].seq_id.reset();
+                    }
+                    cache.slot.clear();
+                    return false;
+                }
+                c = next_cell;
+            }
+
+            llama_kv_cell & cell = cache.cells[c];
+
+            cell.pos = batch.pos[k];
+            for (int32_t j = 0; j < batch.n_seq_id[s]; j++) {
+                cell.seq_id.set(batch.seq_id[s][j]);
+            }
+
+            cache.slot[k] = c;
+
+            next[seq_id] = (uint32_t) c + 1 < cache.size && (c + 1) % block_size != 0 ? c + 1 : -1;
+            slot_max = std::max(slot_max, (uint32_t) c + 1);
+        }
+    }
+
+    cache.head     = *std::min_element(cache.slot.begin(), cache.slot.end());
+    cache.used    += n_tokens;
+    cache.slot_max = slot_max;
+
+    return true;
+}
+
+static bool llama_kv_cache_find_slot(
+           struct llama_kv_cache & cache,
+       const struct llama_ubatch & batch,
+                            bool   contiguous = false) {
     const uint32_t n_tokens = batch.n_tokens;
     const uint32_t n_seqs   = batch.n_seqs;
     const uint32_t n_seq_tokens = batch.n_seq_tokens;
@@ -3813,9 +4162,9 @@ static bool llama_kv_cache_find_slot(
                         llama_kv_cell & cell = cache.cells[seq.tail];
                         // clear cells from seq_ids that become shared
                         // (should not normally happen, but let's handle it anyway)
-                        cell.seq_id.erase(seq_id);
+                        cell.seq_id.reset(seq_id);
                         seq.tail = -1;
-                        if (cell.seq_id.empty()) {
+                        if (cell.seq_id.none()) {
                             cell.pos = -1;
                             cell.src = -1;
                             cache.used -= 1;
@@ -3831,7 +4180,10 @@ static bool llama_kv_cache_find_slot(
             tails_verif.assign(cache.size, -1);
             for (uint32_t i = 0; i < cache.size; ++i) {
                 llama_kv_cell & cell = cache.cells[i];
-                for (llama_seq_id seq_id : cell.seq_id) {
+                for (llama_seq_id seq_id = 0; seq_id < LLAMA_MAX_SEQ; ++seq_id) {
+                    if (!cell.seq_id[seq_id]) {
+                        continue;
+                    }
                     if (tails_verif[seq_id] != -1) {
                         LLAMA_LOG_ERROR("%s: duplicate tail for seq_id %d in cell %d and %d\n", __func__, seq_id, i, tails_verif[seq_id]);
                     }
@@ -3865,7 +4217,7 @@ static bool llama_kv_cache_find_slot(
                 llama_kv_cell & cell = cache.cells[seq_meta.tail];
                 GGML_ASSERT(cell.has_seq_id(seq_id));
                 // does this seq_id "own" the cell?
-                if (cell.seq_id.size() == 1) { has_cell = true; }
+                if (cell.seq_id.count() == 1) { has_cell = true; }
             }
             if (!has_cell) {
                 llama_kv_cell & empty_cell = cache.cells[next_empty_cell];
@@ -3875,8 +4227,8 @@ static bool llama_kv_cache_find_slot(
                     llama_kv_cell & orig_cell = cache.cells[seq_meta.tail];
                     empty_cell.pos = orig_cell.pos;
                     empty_cell.src = orig_cell.src;
-                    orig_cell.seq_id.erase(seq_id);
-                    empty_cell.seq_id.insert(seq_id); // will be overwritten
+                    orig_cell.seq_id.reset(seq_id);
+                    empty_cell.seq_id.set(seq_id); // will be overwritten
                 }
                 seq_meta.tail = next_empty_cell;
                 // find next empty cell
@@ -3907,11 +4259,13 @@ static bool llama_kv_cache_find_slot(
                 std::swap(dst_cell.seq_id, src_cell.seq_id);
 
                 // swap tails (assuming they NEVER overlap)
-                for (const llama_seq_id seq_id : src_cell.seq_id) {
-                    cache.cells[seq_id].tail = src_id;
-                }
-                for (const llama_seq_id seq_id : dst_cell.seq_id) {
-                    cache.cells[seq_id].tail = dst_id;
+                for (llama_seq_id seq_id = 0; seq_id < LLAMA_MAX_SEQ; ++seq_id) {
+                    if (src_cell.seq_id[seq_id]) {
+                        cache.cells[seq_id].tail = src_id;
+                    }
+                    if (dst_cell.seq_id[seq_id]) {
+                        cache.cells[seq_id].tail = dst_id;
+                    }
                 }
             }
         }
@@ -3929,10 +4283,10 @@ static bool llama_kv_cache_find_slot(
                     __func__, last_pos, cell.pos, batch.seq_id[s][0], n_seq_tokens);
             }
             cell.pos = last_pos;
-            cell.seq_id.clear();
+            cell.seq_id.reset();
             for (int32_t j = 0; j < batch.n_seq_id[s]; ++j) {
                 const llama_seq_id seq_id = batch.seq_id[s][j];
-                cell.seq_id.insert(seq_id);
+                cell.seq_id.set(seq_id);
                 cache.cells[seq_id].tail = cell_id;
             }
         }
@@ -3946,6 +4300,12 @@ static bool llama_kv_cache_find_slot(
     }
     // otherwise, one cell per token.
 
+    if (cache.block_size > 0 && !contiguous) {
+        return llama_kv_cache_find_slot_paged(cache, batch);
+    }
+
+    cache.slot.clear();
+
     if (n_tokens > cache.size) {
         LLAMA_LOG_ERROR("%s: n_tokens=%d > cache.size=%d\n", __func__, n_tokens, cache.size);
         return false;
@@ -3986,7 +4346,7 @@ static bool llama_kv_cache_find_slot(
             cache.cells[cache.head + k].pos = batch.pos[k];
 
             for (int32_t j = 0; j < batch.n_seq_id[s]; j++) {
-                cache.cells[cache.head + k].seq_id.insert(batch.seq_id[s][j]);
+                cache.cells[cache.head + k].seq_id.set(batch.seq_id[s][j]);
             }
         }
     }
@@ -3996,6 +4356,123 @@ static bool llama_kv_cache_find_slot(
     return true;
 }
 
+// streaming KV cache: makes room for the new tokens of the ubatch by evicting the oldest tokens of their
+// sequences, so that each sequence keeps at most its n_sink first (the attention sinks) and n_window last tokens
+// the freed cells are reused as they are, without defragmentation; the positions of the cells are those given by
+// the caller and K is not rotated again, except for the sinks of the sequence: once they are more than n_window/8
+// positions behind the window, they move right in front of it, so the distances that the queries see stay within
+// n_sink + n_window + n_window/8 and the K rows of the sinks are rounded again only every n_window/8 tokens
+// the shift of a sink is applied by the next graph, sinks shared with other sequences are not moved
+static void llama_kv_cache_evict_window(
+           struct llama_kv_cache & cache,
+       const struct llama_ubatch & batch) {
+    const uint32_t n_sink = cache.n_sink;
+    const uint32_t n_keep = cache.n_sink + cache.n_window;
+
+    // new tokens and their first position for each sequence of the ubatch
+    std::vector<llama_seq_id> seq_ids;
+    std::vector<uint32_t>     n_new  (LLAMA_MAX_SEQ, 0);
+    std::vector<llama_pos>    pos_new(LLAMA_MAX_SEQ, std::numeric_limits<llama_pos>::max());
+
+    for (uint32_t s = 0; s < batch.n_seqs; ++s) {
+        for (int32_t j = 0; j < batch.n_seq_id[s]; ++j) {
+            const llama_seq_id seq_id = batch.seq_id[s][j];
+            if (n_new[seq_id] == 0) {
+                seq_ids.push_back(seq_id);
+            }
+            n_new[seq_id] += batch.n_seq_tokens;
+            for (uint32_t i = 0; i < batch.n_seq_tokens; ++i) {
+                pos_new[seq_id] = std::min(pos_new[seq_id], batch.pos[s*batch.n_seq_tokens + i]);
+            }
+        }
+    }
+
+    std::vector<uint32_t> n_cells(LLAMA_MAX_SEQ, 0);
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        const llama_kv_cell & cell = cache.cells[i];
+        if (cell.pos < 0) {
+            continue;
+        }
+        for (const llama_seq_id seq_id : seq_ids) {
+            n_cells[seq_id] += cell.has_seq_id(seq_id);
+        }
+    }
+
+    uint32_t new_head = cache.size;
+
+    std::vector<std::pair<llama_pos, uint32_t>> cells; // (pos, cell) of a sequence
+
+    for (const llama_seq_id seq_id : seq_ids) {
+        const uint32_t n = n_cells[seq_id];
+
+        if (n + n_new[seq_id] <= n_keep || n <= n_sink) {
+            continue;
+        }
+
+        const uint32_t n_evict = std::min(n + n_new[seq_id] - n_keep, n - n_sink);
+
+        cells.clear();
+        for (uint32_t i = 0; i < cache.size; ++i) {
+            if (cache.cells[i].pos >= 0 && cache.cells[i].has_seq_id(seq_id)) {
+                cells.emplace_back(cache.cells[i].pos, i);
+            }
+        }
+
+        // the sinks, the evicted cells and the first cell of the remaining window, in position order
+        const uint32_t n_sorted = std::min(n, n_sink + n_evict + 1);
+        std::partial_sort(cells.begin(), cells.begin() + n_sorted, cells.end());
+
+        for (uint32_t k = n_sink; k < n_sink + n_evict; ++k) {
+            llama_kv_cell & cell = cache.cells[cells[k].second];
+
+            cell.seq_id.reset(seq_id);
+            if (cell.is_empty()) {
+                cell.pos   = -1;
+                cell.delta = 0;
+                cache.used--;
+                new_head = std::min(new_head, cells[k].second);
+            }
+        }
+
+        const llama_pos pos_window = n_sink + n_evict < n ? cells[n_sink + n_evict].first : pos_new[seq_id];
+
+        if (n_sink == 0 || pos_window - cells[n_sink - 1].first - 1 <= (llama_pos) (cache.n_window/8)) {
+            continue;
+        }
+
+        for (uint32_t k = 0; k < n_sink; ++k) {
+            llama_kv_cell & cell = cache.cells[cells[k].second];
+
+            const llama_pos delta = pos_window - (llama_pos) (n_sink - k) - cell.pos;
+            if (delta > 0 && cell.seq_id.count() == 1) {
+                cache.has_shift = true;
+                cell.pos   += delta;
+                cell.delta += delta;
+            }
+        }
+    }
+
+    // search for the slot of the new tokens from the first freed cell
+    if (new_head != cache.size) {
+        cache.head = new_head;
+    }
+}
+
+// range [beg, end) of the cells with a pending K shift
+static void llama_kv_cache_shift_range(const struct llama_kv_cache & cache, uint32_t & beg, uint32_t & end) {
+    beg = cache.size;
+    end = 0;
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        if (cache.cells[i].delta != 0) {
+            beg = std::min(beg, i);
+            end = i + 1;
+        }
+    }
+    if (beg >= end) {
+        beg = end = 0;
+    }
+}
+
 // find how many cells are currently in use
 static uint32_t llama_kv_cache_cell_max(const struct llama_kv_cache & cache) {
     for (uint32_t i = cache.size; i > 0; --i) {
@@ -4012,7 +4489,7 @@ static uint32_t llama_kv_cache_cell_max(const struct llama_kv_cache & cache) {
 static void llama_kv_cache_clear(struct llama_kv_cache & cache) {
     for (int32_t i = 0; i < (int32_t) cache.size; ++i) {
         cache.cells[i].pos = -1;
-        cache.cells[i].seq_id.clear();
+        cache.cells[i].seq_id.reset();
         cache.cells[i].src = -1;
         cache.cells[i].tail = -1;
     }
@@ -4064,9 +4541,9 @@ static bool llama_kv_cache_seq_rm(
     for (uint32_t i = 0; i < cache.size; ++i) {
         if (cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
             if (seq_id < 0) {
-                cache.cells[i].seq_id.clear();
+                cache.cells[i].seq_id.reset();
             } else if (cache.cells[i].has_seq_id(seq_id)) {
-                cache.cells[i].seq_id.erase(seq_id);
+                cache.cells[i].seq_id.reset(seq_id);
             } else {
                 continue;
             }
@@ -4104,9 +4581,9 @@ static void llama_kv_cache_seq_cp(
                 // clear destination seq_id if it wasn't empty
                 llama_kv_cell & cell_dst = cache.cells[tail_dst.tail];
 
-                cell_dst.seq_id.erase(seq_id_dst);
+                cell_dst.seq_id.reset(seq_id_dst);
                 tail_dst.tail = -1;
-                if (cell_dst.seq_id.empty()) {
+                if (cell_dst.seq_id.none()) {
                     cell_dst.pos = -1;
                     cell_dst.delta = -1;
                     cell_dst.src = -1;
@@ -4116,7 +4593,7 @@ static void llama_kv_cache_seq_cp(
             if (tail_src.tail >= 0) {
                 llama_kv_cell & cell_src = cache.cells[tail_src.tail];
 
-                cell_src.seq_id.insert(seq_id_dst);
+                cell_src.seq_id.set(seq_id_dst);
                 tail_dst.tail = tail_src.tail;
             }
         }
@@ -4129,7 +4606,7 @@ static void llama_kv_cache_seq_cp(
 
     for (uint32_t i = 0; i < cache.size; ++i) {
         if (cache.cells[i].has_seq_id(seq_id_src) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            cache.cells[i].seq_id.insert(seq_id_dst);
+            cache.cells[i].seq_id.set(seq_id_dst);
         }
     }
 }
@@ -4145,11 +4622,11 @@ static void llama_kv_cache_seq_keep(struct llama_kv_cache & cache, llama_seq_id
             if (cache.cells[i].pos >= 0) cache.used--;
             cache.cells[i].pos = -1;
             cache.cells[i].src = -1;
-            cache.cells[i].seq_id.clear();
+            cache.cells[i].seq_id.reset();
             if (new_head == cache.size) new_head = i;
         } else {
-            cache.cells[i].seq_id.clear();
-            cache.cells[i].seq_id.insert(seq_id);
+            cache.cells[i].seq_id.reset();
+            cache.cells[i].seq_id.set(seq_id);
         }
     }
 
@@ -4195,7 +4672,7 @@ static void llama_kv_cache_seq_add(
                     cache.used--;
                 }
                 cache.cells[i].pos = -1;
-                cache.cells[i].seq_id.clear();
+                cache.cells[i].seq_id.reset();
                 if (new_head == cache.size) {
                     new_head = i;
                 }
@@ -4501,6 +4978,8 @@ struct llama_model_loader {
 
     bool use_mmap = false;
     bool check_tensors;
+    int  n_load_threads = 1; // threads reading the tensor data when not using mmap
+    bool use_hugepages = false; // back the model data with transparent huge pages
 
     llama_files files;
     llama_ftype ftype;
@@ -5072,7 +5551,7 @@ struct llama_model_loader {
             mappings.reserve(files.size());
             mmaps_used.reserve(files.size());
             for (const auto & file : files) {
-                std::unique_ptr<llama_mmap> mapping(new llama_mmap(file.get(), prefetch ? -1 : 0, ggml_is_numa()));
+                std::unique_ptr<llama_mmap> mapping(new llama_mmap(file.get(), prefetch ? -1 : 0, ggml_is_numa(), use_hugepages));
                 mmaps_used.emplace_back(mapping->size, 0);
                 if (mlock_mmaps) {
                     std::unique_ptr<llama_mlock> mlock_mmap(new llama_mlock());
@@ -5173,6 +5652,119 @@ struct llama_model_loader {
     size_t size_data = 0;
     std::vector<std::pair<size_t, size_t>> mmaps_used;
 
+    // Reads the tensor data of ctx from the files with n_load_threads threads using positioned reads, so that
+    // several requests are in flight at once on multi-drive setups. Tensors are split into row-aligned chunks
+    // to keep all the threads busy until the end, and each chunk is validated by the thread that read it.
+    // Returns false if cancelled by progress_callback
+    bool load_all_data_parallel(
+            struct ggml_context   * ctx,
+            llama_progress_callback progress_callback,
+            void                  * progress_callback_user_data) {
+        constexpr size_t chunk_size = 16 * 1024 * 1024; // 16MB
+
+        struct load_chunk {
+            ggml_tensor      * cur;
+            const llama_file * file;
+            size_t             file_offs;
+            size_t             offs; // offset in the tensor
+            size_t             size;
+        };
+
+        std::vector<load_chunk> chunks;
+        for (struct ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != NULL; cur = ggml_get_next_tensor(ctx, cur)) {
+            const auto * weight = get_weight(ggml_get_name(cur));
+            if (weight == nullptr) {
+                // this can happen with split experts models
+                continue;
+            }
+            GGML_ASSERT(weight->idx < files.size());
+
+            const size_t n_size   = ggml_nbytes(cur);
+            const size_t row_size = ggml_row_size(cur->type, cur->ne[0]);
+            const size_t step     = std::max(row_size, chunk_size - chunk_size % row_size);
+
+            for (size_t offs = 0; offs < n_size; offs += step) {
+                chunks.push_back({ cur, files.at(weight->idx).get(), weight->offs + offs, offs, std::min(step, n_size - offs) });
+            }
+        }
+
+        std::atomic<size_t> next_chunk(0);
+        std::atomic<size_t> bytes_done(0);
+        std::atomic<bool>   stop(false);
+
+        std::mutex  mutex; // guards error and the uploads to non-host buffers
+        std::string error;
+
+        const size_t size_start = size_done;
+
+        auto worker = [&](bool is_main) {
+            std::vector<no_init<uint8_t>> read_buf;
+            try {
+                while (!stop) {
+                    const size_t i = next_chunk++;
+                    if (i >= chunks.size()) {
+                        break;
+                    }
+                    const load_chunk & chunk = chunks[i];
+
+                    uint8_t * data;
+                    if (ggml_backend_buffer_is_host(chunk.cur->buffer)) {
+                        data = (uint8_t *) chunk.cur->data + chunk.offs;
+                        chunk.file->read_raw_at(data, chunk.size, chunk.file_offs);
+                    } else {
+                        read_buf.resize(chunk.size);
+                        data = (uint8_t *) read_buf.data();
+                        chunk.file->read_raw_at(data, chunk.size, chunk.file_offs);
+                        std::lock_guard<std::mutex> lock(mutex);
+                        ggml_backend_tensor_set(chunk.cur, data, chunk.offs, chunk.size);
+                    }
+
+                    if (check_tensors && !ggml_validate_row_data(chunk.cur->type, data, chunk.size)) {
+                        throw std::runtime_error(format("tensor '%s' has invalid data", ggml_get_name(chunk.cur)));
+                    }
+
+                    bytes_done += chunk.size;
+
+                    // the progress callback is only ever called from the loading thread
+                    if (is_main && progress_callback) {
+                        if (!progress_callback((float) (size_start + bytes_done) / size_data, progress_callback_user_data)) {
+                            stop = true;
+                        }
+                    }
+                }
+            } catch (const std::exception & e) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (error.empty()) {
+                    error = e.what();
+                }
+                stop = true;
+            }
+        };
+
+        const int n_threads = std::min<int>(n_load_threads, std::max<size_t>(chunks.size(), 1));
+
+        std::vector<std::thread> workers;
+        workers.reserve(n_threads - 1);
+        for (int i = 1; i < n_threads; ++i) {
+            workers.emplace_back(worker, false);
+        }
+        worker(true);
+        for (auto & w : workers) {
+            w.join();
+        }
+
+        if (!error.empty()) {
+            throw std::runtime_error(error);
+        }
+        if (stop) {
+            return false;
+        }
+
+        size_done += bytes_done;
+
+        return true;
+    }
+
     // Returns false if cancelled by progress_callback
     bool load_all_data(
             struct ggml_context   * ctx,
@@ -5186,9 +5778,9 @@ struct llama_model_loader {
         std::vector<std::future<std::pair<ggml_tensor *, bool>>> validation_result;
 
         // 4 staging buffers for async uploads, each sized 1MB seems to be a good default for single NVMe drives.
-        // NVMe raid configurations might require more / larger buffers.
+        // NVMe raid configurations require larger buffers, the size is picked from the measured read bandwidth.
         constexpr size_t n_buffers = 4;
-        constexpr size_t buffer_size = 1 * 1024 * 1024; // 1MB
+        size_t buffer_size = 1 * 1024 * 1024; // 1MB
 
         std::vector<ggml_backend_buffer_t> host_buffers;
         std::vector<ggml_backend_event_t> events;
@@ -5235,6 +5827,27 @@ struct llama_model_loader {
                 return nullptr;
             }
 
+            // Time a read of the first large tensor and size the staging buffers so that filling one takes ~4ms.
+            for (struct ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != NULL; cur = ggml_get_next_tensor(ctx, cur)) {
+                const auto * weight = get_weight(ggml_get_name(cur));
+                const size_t n_probe = std::min<size_t>(ggml_nbytes(cur), 16 * 1024 * 1024);
+                if (weight == nullptr || n_probe < 4 * 1024 * 1024) {
+                    continue;
+                }
+
+                std::vector<no_init<uint8_t>> probe(n_probe);
+                const int64_t t_start_us = ggml_time_us();
+                files.at(weight->idx)->read_raw_at(probe.data(), n_probe, weight->offs);
+                const double bytes_per_us = n_probe / std::max<double>(ggml_time_us() - t_start_us, 1.0);
+
+                while (buffer_size < 64 * 1024 * 1024 && buffer_size < bytes_per_us * 4000) {
+                    buffer_size *= 2;
+                }
+                LLAMA_LOG_DEBUG("%s: read bandwidth %.1f MB/s, using %zu MB staging buffers\n", fn,
+                    bytes_per_us, buffer_size / (1024 * 1024));
+                break;
+            }
+
             // If the backend is supported, create pinned memory buffers and events for synchronisation.
             for (size_t idx = 0; idx < n_buffers; ++idx) {
                 auto * buf = ggml_backend_buft_alloc_buffer(host_buft, buffer_size);
@@ -5274,7 +5887,13 @@ struct llama_model_loader {
                 ggml_backend_name(upload_backend));
         }
 
-        for (struct ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != NULL; cur = ggml_get_next_tensor(ctx, cur)) {
+        // without mmap and async uploads the data can be read by several threads, see load_all_data_parallel
+        const bool parallel = !use_mmap && !upload_backend && n_load_threads > 1;
+        if (parallel && !load_all_data_parallel(ctx, progress_callback, progress_callback_user_data)) {
+            return false;
+        }
+
+        for (struct ggml_tensor * cur = parallel ? NULL : ggml_get_first_tensor(ctx); cur != NULL; cur = ggml_get_next_tensor(ctx, cur)) {
             const auto * weight = get_weight(ggml_get_name(cur));
             if (weight == nullptr) {
                 // this can happen with split experts models
@@ -5308,7 +5927,8 @@ struct llama_model_loader {
                     ggml_backend_tensor_alloc(buf_mmap, cur, data);
                     if (lmlocks) {
                         const auto & lmlock = lmlocks->at(weight->idx);
-                        lmlock->grow_to(weight->offs + n_size);
+                        // only the tensors of this layer window are locked, not the mapping up to them
+                        lmlock->lock_range(weight->offs, n_size);
                     }
 
                     auto & mmap_used = mmaps_used[weight->idx];
@@ -6330,15 +6950,176 @@ static void llm_load_hparams(
     hparams.rope_type = llama_rope_type(&model);
 }
 
+//
+// warm start snapshot
+//
+
+static bool llama_model_file_id(const std::string & fname, uint64_t & size, uint64_t & mtime) {
+    struct stat st;
+    if (stat(fname.c_str(), &st) != 0) {
+        return false;
+    }
+    size  = (uint64_t) st.st_size;
+    mtime = (uint64_t) st.st_mtime;
+    return true;
+}
+
+// the vocab structures that are expensive to derive from the GGUF metadata are cached next to the model file
+// in a sidecar "<model>.warm" so that a restart can read them back instead of rebuilding them:
+//
+//   header  : llama_warm_header
+//   merges  : n_merges  x { u32 rank, u32 n_first, first, u32 n_second, second }, in bpe_ranks order
+//   special : n_special x i32, cache_special_tokens
+//   pieces  : n_vocab   x { u32 n, piece }, cache_token_to_piece
+//
+#define LLAMA_WARM_MAGIC   0x6767776du // 'ggwm'
+#define LLAMA_WARM_VERSION 1
+
+struct llama_warm_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t model_size;  // size of the model file the snapshot was built from
+    uint64_t model_mtime; // modification time of the model file the snapshot was built from
+    uint32_t n_vocab;
+    uint32_t n_merges;
+    uint32_t n_special;
+    uint32_t padding;
+};
+
+struct llama_warm_snapshot {
+    std::map<std::pair<std::string, std::string>, int> bpe_ranks;
+
+    std::vector<llama_vocab::id>    cache_special_tokens;
+    std::vector<llama_vocab::token> cache_token_to_piece;
+};
+
+// returns false if the snapshot is missing, truncated or was built from a different model file
+static bool llama_warm_read(const std::string & path, const llama_warm_header & expected, llama_warm_snapshot & snap) {
+    std::vector<uint8_t> buf;
+    try {
+        llama_file file(path.c_str(), "rb");
+        buf.resize(file.size);
+        file.read_raw(buf.data(), buf.size());
+    } catch (const std::exception &) {
+        return false;
+    }
+
+    size_t pos = 0;
+    auto read = [&](void * dst, size_t n) {
+        if (buf.size() - pos < n) {
+            throw std::runtime_error("truncated warm start snapshot");
+        }
+        memcpy(dst, buf.data() + pos, n);
+        pos += n;
+    };
+    auto read_str = [&]() {
+        uint32_t n;
+        read(&n, sizeof(n));
+        std::string str(n, '\0');
+        read(&str[0], n);
+        return str;
+    };
+
+    try {
+        llama_warm_header header;
+        read(&header, sizeof(header));
+        if (header.magic       != expected.magic      ||
+            header.version     != expected.version    ||
+            header.model_size  != expected.model_size ||
+            header.model_mtime != expected.model_mtime ||
+            header.n_vocab     != expected.n_vocab) {
+            return false;
+        }
+
+        for (uint32_t i = 0; i < header.n_merges; ++i) {
+            int32_t rank;
+            read(&rank, sizeof(rank));
+            std::string first  = read_str();
+            std::string second = read_str();
+            // the merges are stored in map order so every insertion goes at the end
+            snap.bpe_ranks.emplace_hint(snap.bpe_ranks.end(), std::make_pair(std::move(first), std::move(second)), rank);
+        }
+
+        snap.cache_special_tokens.resize(header.n_special);
+        read(snap.cache_special_tokens.data(), header.n_special*sizeof(llama_vocab::id));
+
+        snap.cache_token_to_piece.resize(header.n_vocab);
+        for (uint32_t i = 0; i < header.n_vocab; ++i) {
+            snap.cache_token_to_piece[i] = read_str();
+        }
+    } catch (const std::exception &) {
+        return false;
+    }
+
+    return pos == buf.size();
+}
+
+static void llama_warm_write(const std::string & path, llama_warm_header header, const llama_vocab & vocab) {
+    header.n_vocab   = vocab.n_vocab;
+    header.n_merges  = vocab.bpe_ranks.size();
+    header.n_special = vocab.cache_special_tokens.size();
+
+    auto write_str = [](const llama_file & file, const std::string & str) {
+        const uint32_t n = str.size();
+        file.write_raw(&n, sizeof(n));
+        file.write_raw(str.data(), n);
+    };
+
+    // write to a temporary file first so that a concurrent reader never sees a partial snapshot
+    const std::string tmp_path = path + ".tmp";
+    try {
+        llama_file file(tmp_path.c_str(), "wb");
+        file.write_raw(&header, sizeof(header));
+        for (const auto & it : vocab.bpe_ranks) {
+            const int32_t rank = it.second;
+            file.write_raw(&rank, sizeof(rank));
+            write_str(file, it.first.first);
+            write_str(file, it.first.second);
+        }
+        file.write_raw(vocab.cache_special_tokens.data(), vocab.cache_special_tokens.size()*sizeof(llama_vocab::id));
+        for (const auto & piece : vocab.cache_token_to_piece) {
+            write_str(file, piece);
+        }
+    } catch (const std::exception & err) {
+        LLAMA_LOG_WARN("%s: failed to write '%s': %s\n", __func__, tmp_path.c_str(), err.what());
+        std::remove(tmp_path.c_str());
+        return;
+    }
+
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        LLAMA_LOG_WARN("%s: failed to rename '%s' to '%s'\n", __func__, tmp_path.c_str(), path.c_str());
+        std::remove(tmp_path.c_str());
+    }
+}
+
 static void llm_load_vocab(
         llama_model_loader & ml,
-        llama_model & model) {
+        llama_model & model,
+        const std::string & fname,
+        bool warm_start) {
     auto & vocab = model.vocab;
 
     struct gguf_context * ctx = ml.meta;
 
     const auto kv = LLM_KV(model.arch);
 
+    // derived structures restored from the warm start snapshot, see llama_warm_read
+    llama_warm_header   warm_header = {};
+    llama_warm_snapshot warm;
+    bool                warm_loaded = false;
+    if (warm_start) {
+        const int list_idx = gguf_find_key(ctx, kv(LLM_KV_TOKENIZER_LIST).c_str());
+
+        warm_header.magic   = LLAMA_WARM_MAGIC;
+        warm_header.version = LLAMA_WARM_VERSION;
+        warm_header.n_vocab = list_idx == -1 ? 0 : gguf_get_arr_n(ctx, list_idx);
+        if (!llama_model_file_id(fname, warm_header.model_size, warm_header.model_mtime)) {
+            warm_start = false;
+        } else {
+            warm_loaded = llama_warm_read(fname + ".warm", warm_header, warm);
+        }
+    }
+
     // determine vocab type
     {
         std::string tokenizer_model;
@@ -6399,22 +7180,26 @@ static void llm_load_vocab(
                 throw std::runtime_error("cannot find tokenizer merges in model file\n");
             }
 
-            const int n_merges = gguf_get_arr_n(ctx, merges_keyidx);
-            for (int i = 0; i < n_merges; i++) {
-                const std::string word = gguf_get_arr_str(ctx, merges_keyidx, i);
-                GGML_ASSERT(unicode_cpts_from_utf8(word).size() > 0);
+            if (warm_loaded) {
+                std::swap(vocab.bpe_ranks, warm.bpe_ranks);
+            } else {
+                const int n_merges = gguf_get_arr_n(ctx, merges_keyidx);
+                for (int i = 0; i < n_merges; i++) {
+                    const std::string word = gguf_get_arr_str(ctx, merges_keyidx, i);
+                    GGML_ASSERT(unicode_cpts_from_utf8(word).size() > 0);
 
-                std::string first;
-                std::string second;
+                    std::string first;
+                    std::string second;
 
-                const size_t pos = word.find(' ', 1);
+                    const size_t pos = word.find(' ', 1);
 
-                if (pos != std::string::npos) {
-                    first  = word.substr(0, pos);
-                    second = word.substr(pos + 1);
-                }
+                    if (pos != std::string::npos) {
+                        first  = word.substr(0, pos);
+                        second = word.substr(pos + 1);
+                    }
 
-                vocab.bpe_ranks.emplace(std::make_pair(first, second), i);
+                    vocab.bpe_ranks.emplace(std::make_pair(first, second), i);
+                }
             }
 
             // default special tokens
@@ -6635,6 +7420,7 @@ static void llm_load_vocab(
 
     vocab.n_vocab = n_vocab;
     vocab.id_to_token.resize(n_vocab);
+    vocab.token_to_id.reserve(n_vocab);
 
     for (uint32_t i = 0; i < n_vocab; i++) {
         std::string word = gguf_get_arr_str(ctx, token_idx, i);
@@ -6863,7 +7649,11 @@ static void llm_load_vocab(
     }
 
     // build special tokens cache
-    {
+    if (warm_loaded) {
+        std::swap(vocab.cache_special_tokens, warm.cache_special_tokens);
+
+        LLAMA_LOG_INFO("%s: special tokens cache size = %u\n", __func__, (uint32_t)vocab.cache_special_tokens.size());
+    } else {
         for (llama_vocab::id id = 0; id < (llama_vocab::id)n_vocab; ++id) {
             if (vocab.id_to_token[id].attr & (LLAMA_TOKEN_ATTR_CONTROL | LLAMA_TOKEN_ATTR_USER_DEFINED | LLAMA_TOKEN_ATTR_UNKNOWN)) {
                 vocab.cache_special_tokens.push_back(id);
@@ -6885,10 +7675,17 @@ static void llm_load_vocab(
 
         std::vector<llama_vocab::token> cache_token_to_piece(n_vocab);
 
-        for (uint32_t id = 0; id < n_vocab; ++id) {
-            cache_token_to_piece[id] = llama_token_to_piece(&model, id, true);
+        if (warm_loaded) {
+            std::swap(cache_token_to_piece, warm.cache_token_to_piece);
+            for (uint32_t id = 0; id < n_vocab; ++id) {
+                size_cache += cache_token_to_piece[id].size();
+            }
+        } else {
+            for (uint32_t id = 0; id < n_vocab; ++id) {
+                cache_token_to_piece[id] = llama_token_to_piece(&model, id, true);
 
-            size_cache += cache_token_to_piece[id].size();
+                size_cache += cache_token_to_piece[id].size();
+            }
         }
 
         std::swap(vocab.cache_token_to_piece, cache_token_to_piece);
@@ -6896,6 +7693,12 @@ static void llm_load_vocab(
         LLAMA_LOG_INFO("%s: token to piece cache size = %.4f MB\n", __func__, size_cache / 1024.0 / 1024.0);
     }
 
+    if (warm_loaded) {
+        LLAMA_LOG_INFO("%s: restored the derived vocab from '%s.warm'\n", __func__, fname.c_str());
+    } else if (warm_start) {
+        llama_warm_write(fname + ".warm", warm_header, vocab);
+    }
+
     // Handle per token attributes
     //NOTE: Each model customizes per token attributes.
     //NOTE: Per token attributes are missing from the GGUF file.
@@ -7093,6 +7896,278 @@ static void llm_load_print_meta(llama_model_loader & ml, llama_model & model) {
     }
 }
 
+//
+// runtime weight repacking
+//
+
+// repacked weights are cached next to the model file in a sidecar "<model>.<type>.repack" so that
+// the next start can mmap them instead of repacking again:
+//
+//   header  : llama_repack_header
+//   entries : n_tensors x llama_repack_entry
+//   data    : tensor data, each tensor aligned to LLAMA_REPACK_ALIGNMENT
+//
+#define LLAMA_REPACK_MAGIC     0x67677270u // 'ggrp'
+#define LLAMA_REPACK_VERSION   1
+#define LLAMA_REPACK_ALIGNMENT 64
+
+struct llama_repack_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t n_tensors;
+    uint32_t padding;
+    uint64_t model_size;  // size of the model file the sidecar was built from
+    uint64_t model_mtime; // modification time of the model file the sidecar was built from
+};
+
+struct llama_repack_entry {
+    char     name[GGML_MAX_NAME];
+    uint32_t type;
+    uint32_t padding;
+    uint64_t offs;
+    uint64_t size;
+};
+
+// read the entries of an existing sidecar, returns false if it is missing or was built from a different model file
+static bool llama_repack_read_index(const std::string & path, const llama_repack_header & expected, std::vector<llama_repack_entry> & entries) {
+    try {
+        llama_file file(path.c_str(), "rb");
+
+        llama_repack_header header;
+        if (file.size < sizeof(header)) {
+            return false;
+        }
+        file.read_raw(&header, sizeof(header));
+        if (header.magic       != expected.magic      ||
+            header.version     != expected.version    ||
+            header.model_size  != expected.model_size ||
+            header.model_mtime != expected.model_mtime) {
+            return false;
+        }
+
+        entries.resize(header.n_tensors);
+        if (file.size < sizeof(header) + entries.size()*sizeof(llama_repack_entry)) {
+            return false;
+        }
+        file.read_raw(entries.data(), entries.size()*sizeof(llama_repack_entry));
+
+        for (const auto & e : entries) {
+            if (e.name[GGML_MAX_NAME - 1] != '\0' || e.offs + e.size > file.size) {
+                return false;
+            }
+        }
+    } catch (const std::exception & err) {
+        return false;
+    }
+
+    return true;
+}
+
+// repack the Q4_0 weights held in CPU buffers into the interleaved layout with the fastest kernels on this CPU
+//   - tensors in allocated buffers are repacked in place
+//   - tensors in the (read-only) model mapping are served from the sidecar, which is (re)built if needed
+static void llm_repack_tensors(
+        llama_model_loader                & ml,
+        llama_model                       & model,
+        const std::string                 & fname,
+        const std::vector<ggml_context *> & ctxs,
+        bool                                use_mlock) {
+    const std::string tok_embd_name = LLM_TN(model.arch)(LLM_TENSOR_TOKEN_EMBD, "weight");
+
+    auto is_mapped = [&](const ggml_tensor * t) {
+        for (const auto & mapping : ml.mappings) {
+            const char * addr = (const char *) mapping->addr;
+            if ((const char *) t->data >= addr && (const char *) t->data < addr + mapping->size) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    std::vector<std::pair<ggml_tensor *, ggml_type>> mapped;
+    size_t n_inplace = 0;
+
+    for (ggml_context * ctx : ctxs) {
+        for (ggml_tensor * t = ggml_get_first_tensor(ctx); t != nullptr; t = ggml_get_next_tensor(ctx, t)) {
+            // the token embeddings are consumed by ggml_get_rows, which has no interleaved implementation
+            if (t->data == nullptr || tok_embd_name == ggml_get_name(t)) {
+                continue;
+            }
+            const ggml_type type = ggml_aarch64_get_optimal_repack_type(t);
+            if (type == t->type) {
+                continue;
+            }
+            if (is_mapped(t)) {
+                mapped.emplace_back(t, type);
+                continue;
+            }
+            if (ggml_aarch64_repack(type, t->data, t->data, t->ne[1], t->ne[0]) != 0) {
+                throw std::runtime_error(format("failed to repack tensor '%s'", ggml_get_name(t)));
+            }
+            t->type = type;
+            n_inplace++;
+        }
+    }
+
+    if (n_inplace > 0) {
+        LLAMA_LOG_INFO("%s: repacked %zu tensors in place\n", __func__, n_inplace);
+    }
+
+    if (mapped.empty()) {
+        return;
+    }
+
+    llama_repack_header header = {};
+    header.magic   = LLAMA_REPACK_MAGIC;
+    header.version = LLAMA_REPACK_VERSION;
+    if (!llama_model_file_id(fname, header.model_size, header.model_mtime)) {
+        LLAMA_LOG_WARN("%s: failed to stat '%s', not repacking mmapped weights\n", __func__, fname.c_str());
+        return;
+    }
+
+    // the sidecar is keyed by the preferred layout so that hosts with different ISAs can share one model directory
+    const std::string path = fname + "." + ggml_type_name(mapped[0].second) + ".repack";
+
+    std::vector<llama_repack_entry> entries;
+    bool valid = llama_repack_read_index(path, header, entries);
+
+    std::unordered_map<std::string, const llama_repack_entry *> index;
+    auto build_index = [&]() {
+        index.clear();
+        for (const auto & e : entries) {
+            index.emplace(e.name, &e);
+        }
+    };
+    auto is_cached = [&](const ggml_tensor * t, ggml_type type) {
+        auto it = index.find(ggml_get_name(t));
+        return it != index.end() && it->second->type == (uint32_t) type && it->second->size == ggml_nbytes(t);
+    };
+
+    build_index();
+    for (const auto & it : mapped) {
+        valid = valid && is_cached(it.first, it.second);
+    }
+
+    if (!valid) {
+        LLAMA_LOG_INFO("%s: building repacked weights cache '%s'\n", __func__, path.c_str());
+
+        // keep the tensors cached by other nodes that share this model file
+        std::unique_ptr<llama_mmap> old_mapping;
+        std::vector<llama_repack_entry> old_entries;
+        if (!entries.empty()) {
+            try {
+                llama_file old_file(path.c_str(), "rb");
+                old_mapping.reset(new llama_mmap(&old_file, 0));
+                for (const auto & e : entries) {
+                    const bool ours = std::any_of(mapped.begin(), mapped.end(), [&](const std::pair<ggml_tensor *, ggml_type> & it) {
+                        return strcmp(ggml_get_name(it.first), e.name) == 0;
+                    });
+                    if (!ours) {
+                        old_entries.push_back(e);
+                    }
+                }
+            } catch (const std::exception & err) {
+                old_mapping.reset();
+                old_entries.clear();
+            }
+        }
+
+        entries.clear();
+        for (const auto & it : mapped) {
+            llama_repack_entry e = {};
+            strncpy(e.name, ggml_get_name(it.first), GGML_MAX_NAME - 1);
+            e.type = it.second;
+            e.size = ggml_nbytes(it.first);
+            entries.push_back(e);
+        }
+        entries.insert(entries.end(), old_entries.begin(), old_entries.end());
+
+        header.n_tensors = entries.size();
+        size_t offs = GGML_PAD(sizeof(header) + entries.size()*sizeof(llama_repack_entry), LLAMA_REPACK_ALIGNMENT);
+        for (auto & e : entries) {
+            e.offs = offs;
+            offs = GGML_PAD(offs + e.size, LLAMA_REPACK_ALIGNMENT);
+        }
+
+        // write to a temporary file first so that a concurrent reader never sees a partial sidecar
+        const std::string tmp_path = path + ".tmp";
+        try {
+            llama_file file(tmp_path.c_str(), "wb");
+            file.write_raw(&header, sizeof(header));
+            file.write_raw(entries.data(), entries.size()*sizeof(llama_repack_entry));
+
+            std::vector<uint8_t> buf;
+            for (size_t i = 0; i < entries.size(); ++i) {
+                const auto & e = entries[i];
+                const uint8_t zeros[LLAMA_REPACK_ALIGNMENT] = {};
+                file.write_raw(zeros, e.offs - file.tell());
+
+                if (i < mapped.size()) {
+                    const ggml_tensor * t = mapped[i].first;
+                    buf.resize(e.size);
+                    if (ggml_aarch64_repack(mapped[i].second, t->data, buf.data(), t->ne[1], t->ne[0]) != 0) {
+                        throw std::runtime_error(format("failed to repack tensor '%s'", ggml_get_name(t)));
+                    }
+                    file.write_raw(buf.data(), e.size);
+                } else {
+                    const auto & old = old_entries[i - mapped.size()];
+                    file.write_raw((const uint8_t *) old_mapping->addr + old.offs, e.size);
+                }
+            }
+        } catch (const std::exception & err) {
+            LLAMA_LOG_WARN("%s: failed to write '%s': %s, not repacking mmapped weights\n", __func__, tmp_path.c_str(), err.what());
+            std::remove(tmp_path.c_str());
+            return;
+        }
+        old_mapping.reset();
+
+        if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+            LLAMA_LOG_WARN("%s: failed to rename '%s' to '%s', not repacking mmapped weights\n", __func__, tmp_path.c_str(), path.c_str());
+            std::remove(tmp_path.c_str());
+            return;
+        }
+
+        entries.clear();
+        if (!llama_repack_read_index(path, header, entries)) {
+            LLAMA_LOG_WARN("%s: failed to read back '%s', not repacking mmapped weights\n", __func__, path.c_str());
+            return;
+        }
+        build_index();
+    }
+
+    std::unique_ptr<llama_mmap> mapping;
+    try {
+        llama_file file(path.c_str(), "rb");
+        mapping.reset(new llama_mmap(&file, 0, ggml_is_numa()));
+    } catch (const std::exception & err) {
+        LLAMA_LOG_WARN("%s: failed to mmap '%s': %s, not repacking mmapped weights\n", __func__, path.c_str(), err.what());
+        return;
+    }
+
+    size_t size_used = 0;
+    for (const auto & it : mapped) {
+        ggml_tensor * t = it.first;
+        if (!is_cached(t, it.second)) {
+            continue;
+        }
+        const llama_repack_entry * e = index.at(ggml_get_name(t));
+        t->data = (uint8_t *) mapping->addr + e->offs;
+        t->type = it.second;
+        size_used = std::max(size_used, (size_t) (e->offs + e->size));
+    }
+
+    if (use_mlock) {
+        std::unique_ptr<llama_mlock> mlock_mmap(new llama_mlock());
+        mlock_mmap->init(mapping->addr);
+        mlock_mmap->grow_to(size_used);
+        model.mlock_mmaps.emplace_back(std::move(mlock_mmap));
+    }
+
+    LLAMA_LOG_INFO("%s: using %zu repacked tensors from '%s'\n", __func__, mapped.size(), path.c_str());
+
+    model.mappings.emplace_back(std::move(mapping));
+}
+
 // Returns false if cancelled by progress_callback
 static bool llm_load_tensors(
         llama_model_loader   &  ml,
@@ -7104,6 +8179,8 @@ static bool llm_load_tensors(
         enum llama_split_mode   split_mode,
         int                     main_gpu,
         bool                    use_mlock,
+        bool                    repack,
+        const std::string     & fname,
         llama_progress_callback progress_callback,
         void                  * progress_callback_user_data) {
     auto & hparams = model.hparams;
@@ -9020,6 +10097,9 @@ static bool llm_load_tensors(
     size_t n_max_backend_buffer = ctx_map.size() * ml.files.size();
     model.bufs.reserve(n_max_backend_buffer);
 
+    // contexts whose weights are computed by the CPU backend, candidates for repacking
+    std::vector<ggml_context *> ctxs_cpu;
+
     for (auto & it : ctx_map) {
         ggml_backend_buffer_type_t buft = it.first;
         ggml_context * ctx              = it.second;
@@ -9033,6 +10113,9 @@ static bool llm_load_tensors(
         if (buft_type == nullptr) {
             continue;
         }
+        if (buft_type == ggml_backend_cpu_buffer_type()) {
+            ctxs_cpu.push_back(ctx);
+        }
         ggml_backend_dev_t dev = ggml_backend_buft_get_device(buft_type);
         
         bool buffer_from_host_ptr_supported = false;
@@ -9067,6 +10150,10 @@ static bool llm_load_tensors(
                 throw std::runtime_error(format("unable to allocate %s buffer", ggml_backend_buft_name(buft)));
             }
             model.bufs.push_back(buf);
+            if (ml.use_hugepages && ggml_backend_buffer_is_host(buf)) {
+                // before the pages are touched by mlock or the loader
+                llama_madvise_hugepage(ggml_backend_buffer_get_base(buf), ggml_backend_buffer_get_size(buf));
+            }
             if (use_mlock && ggml_backend_buffer_is_host(buf)) {
                 model.mlock_bufs.emplace_back(new llama_mlock);
                 auto & mlock_buf = model.mlock_bufs.back();
@@ -9107,6 +10194,10 @@ static bool llm_load_tensors(
         }
     }
 
+    if (repack) {
+        llm_repack_tensors(ml, model, fname, ctxs_cpu, use_mlock);
+    }
+
     if (use_mmap_buffer) {
         for (auto & mapping : ml.mappings) {
             model.mappings.emplace_back(std::move(mapping));
@@ -9122,6 +10213,8 @@ static int llama_model_load(const std::string & fname, llama_model & model, llam
 
     try {
         llama_model_loader ml(fname, params.use_mmap, params.check_tensors, params.kv_overrides);
+        ml.n_load_threads = params.n_load_threads > 0 ? params.n_load_threads : std::min<int>(8, std::max(1u, std::thread::hardware_concurrency()));
+        ml.use_hugepages  = params.hugepages;
 
         model.hparams.vocab_only = params.vocab_only;
 
@@ -9136,7 +10229,7 @@ static int llama_model_load(const std::string & fname, llama_model & model, llam
             throw std::runtime_error("error loading model hyperparameters: " + std::string(e.what()));
         }
         try {
-            llm_load_vocab(ml, model);
+            llm_load_vocab(ml, model, fname, params.warm_start);
         } catch(const std::exception & e) {
             throw std::runtime_error("error loading model vocabulary: " + std::string(e.what()));
         }
@@ -9172,7 +10265,7 @@ static int llama_model_load(const std::string & fname, llama_model & model, llam
 
         if (!llm_load_tensors(
             ml, model, params.n_world, params.rank, params.n_layer_window, params.n_gpu_layers, params.split_mode, 
-            params.main_gpu, params.use_mlock, params.progress_callback, params.progress_callback_user_data
+            params.main_gpu, params.use_mlock, params.repack, fname, params.progress_callback, params.progress_callback_user_data
         )) {
             return -2;
         }
@@ -9255,6 +10348,7 @@ static void llm_build_kv_store(
          struct ggml_tensor * v_cur,
                     int32_t   n_tokens,
                     int32_t   kv_head,
+         struct ggml_tensor * kv_idxs,
          const llm_build_cb & cb,
                     int       il) {
     const int64_t    n_ctx          = cparams.n_ctx;
@@ -9267,6 +10361,37 @@ static void llm_build_kv_store(
 
     GGML_ASSERT(kv.size == n_ctx);
 
+    if (kv_idxs) {
+        // paged cache: scatter the new rows to the cells picked by llama_kv_cache_find_slot
+        // ggml_set_rows is CPU-only, llama_kv_cache_init only pages a KV cache in host memory
+        GGML_ASSERT(ggml_is_contiguous(k_cur));
+        GGML_ASSERT(ggml_backend_buffer_is_host(kv.k_l[local_il]->buffer) && ggml_backend_buffer_is_host(kv.v_l[local_il]->buffer));
+
+        struct ggml_tensor * k_cache = ggml_view_2d(ctx, kv.k_l[local_il], n_embd_k_gqa, n_ctx,
+                ggml_row_size(kv.k_l[local_il]->type, n_embd_k_gqa), 0);
+        cb(k_cache, "k_cache_view", il);
+
+        // note: storing RoPE-ed version of K in the KV cache
+        ggml_build_forward_expand(graph, ggml_set_rows(ctx, k_cache, ggml_reshape_2d(ctx, k_cur, n_embd_k_gqa, n_tokens), kv_idxs));
+
+        struct ggml_tensor * v_cache = nullptr;
+
+        if (!kv.v_trans) {
+            v_cache = ggml_view_2d(ctx, kv.v_l[local_il], n_embd_v_gqa, n_ctx,
+                    ggml_row_size(kv.v_l[local_il]->type, n_embd_v_gqa), 0);
+        } else {
+            // the V cache is transposed: every element of a token goes to its own row of length 1
+            v_cache = ggml_view_3d(ctx, kv.v_l[local_il], 1, n_ctx, n_embd_v_gqa,
+                    ggml_element_size(kv.v_l[local_il]), n_ctx*ggml_element_size(kv.v_l[local_il]), 0);
+            v_cur   = ggml_view_3d(ctx, v_cur, 1, n_tokens, n_embd_v_gqa, v_cur->nb[1], v_cur->nb[0], 0);
+        }
+        cb(v_cache, "v_cache_view", il);
+
+        ggml_build_forward_expand(graph, ggml_set_rows(ctx, v_cache, v_cur, kv_idxs));
+
+        return;
+    }
+
     struct ggml_tensor * k_cache_view = ggml_view_1d(ctx, kv.k_l[local_il], n_tokens*n_embd_k_gqa, ggml_row_size(kv.k_l[local_il]->type, n_embd_k_gqa)*kv_head);
     cb(k_cache_view, "k_cache_view", il);
 
@@ -9277,10 +10402,10 @@ static void llm_build_kv_store(
 
     struct ggml_tensor * v_cache_view = nullptr;
 
-    if (cparams.flash_attn) {
+    if (!kv.v_trans) {
         v_cache_view = ggml_view_1d(ctx, kv.v_l[local_il], n_tokens*n_embd_v_gqa, ggml_row_size(kv.v_l[local_il]->type, n_embd_v_gqa)*kv_head);
     } else {
-        // note: the V cache is transposed when not using flash attention
+        // note: the V cache is transposed when not using flash attention, unless it is quantized
         v_cache_view = ggml_view_2d(ctx, kv.v_l[local_il], n_tokens, n_embd_v_gqa,
                 (  n_ctx)*ggml_element_size(kv.v_l[local_il]),
                 (kv_head)*ggml_element_size(kv.v_l[local_il]));
@@ -9703,16 +10828,33 @@ static struct ggml_tensor * llm_build_kqv(
 
         GGML_ASSERT(kv.size == n_ctx);
 
-        // split cached v into n_head heads
-        struct ggml_tensor * v =
-            ggml_view_3d(ctx, kv.v_l[local_il],
-                    n_kv, n_embd_head_v, n_head_kv,
-                    ggml_element_size(kv.v_l[local_il])*n_ctx,
-                    ggml_element_size(kv.v_l[local_il])*n_ctx*n_embd_head_v,
-                    0);
-        cb(v, "v", il);
+        struct ggml_tensor * kqv = nullptr;
+
+        if (kv.v_trans) {
+            // split cached v into n_head heads
+            struct ggml_tensor * v =
+                ggml_view_3d(ctx, kv.v_l[local_il],
+                        n_kv, n_embd_head_v, n_head_kv,
+                        ggml_element_size(kv.v_l[local_il])*n_ctx,
+                        ggml_element_size(kv.v_l[local_il])*n_ctx*n_embd_head_v,
+                        0);
+            cb(v, "v", il);
+
+            kqv = ggml_mul_mat(ctx, v, kq);
+        } else {
+            // quantized v: split the rows of the cached v into n_head heads (not transposed)
+            // and accumulate them weighted by kq, dequantizing each row once for a block of tokens
+            // the broadcasting ggml_out_prod is CPU-only, llama_new_context_with_model keeps this cache on the CPU
+            struct ggml_tensor * v =
+                ggml_view_3d(ctx, kv.v_l[local_il],
+                        n_embd_head_v, n_kv, n_head_kv,
+                        ggml_row_size(kv.v_l[local_il]->type, n_embd_v_gqa),
+                        ggml_row_size(kv.v_l[local_il]->type, n_embd_head_v),
+                        0);
+            cb(v, "v", il);
 
-        struct ggml_tensor * kqv = ggml_mul_mat(ctx, v, kq);
+            kqv = ggml_out_prod(ctx, v, ggml_transpose(ctx, kq));
+        }
         cb(kqv, "kqv", il);
 
         struct ggml_tensor * kqv_merged = ggml_permute(ctx, kqv, 0, 2, 1, 3);
@@ -9765,7 +10907,7 @@ static struct ggml_tensor * llm_build_kv(
     ggml_build_forward_expand(graph, k_cur);
     ggml_build_forward_expand(graph, v_cur);
 
-    llm_build_kv_store(ctx, hparams, cparams, kv, graph, k_cur, v_cur, n_tokens, kv_head, cb, il);
+    llm_build_kv_store(ctx, hparams, cparams, kv, graph, k_cur, v_cur, n_tokens, kv_head, lctx.inp_kv_idxs, cb, il);
 
     struct ggml_tensor * cur;
 
@@ -10145,6 +11287,8 @@ struct llm_build_context {
     const int32_t kv_head;  // index of where we store new KV data in the cache
     const int32_t n_ctx_orig;
 
+    uint32_t k_shift_beg = 0; // first cell of inp_K_shift
+
     const bool flash_attn;
 
     const enum llama_pooling_type pooling_type;
@@ -10228,6 +11372,7 @@ struct llm_build_context {
         lctx.inp_pos_bucket    = nullptr;
         lctx.inp_embd_enc      = nullptr;
         lctx.inp_KQ_mask_cross = nullptr;
+        lctx.inp_kv_idxs       = nullptr;
     }
 
     void free() {
@@ -10237,51 +11382,73 @@ struct llm_build_context {
         }
     }
 
+    // K_shift - the position deltas of the cells [k_shift_beg, k_shift_beg + n) with a pending shift
+    struct ggml_tensor * build_inp_K_shift() {
+        uint32_t end;
+        llama_kv_cache_shift_range(kv_self, k_shift_beg, end);
+
+        lctx.inp_K_shift = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, end - k_shift_beg);
+        cb(lctx.inp_K_shift, "K_shift", -1);
+        ggml_set_input(lctx.inp_K_shift);
+        return lctx.inp_K_shift;
+    }
+
+    // rotates the K rows of the shifted cells of a layer by their position deltas
+    struct ggml_tensor * build_k_shift_layer(int il, int local_il) {
+        const int64_t n_head_kv    = hparams.n_head_kv(il);
+        const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
+        const int64_t n_shift      = lctx.inp_K_shift->ne[0];
+
+        struct ggml_tensor * rope_factors = build_rope_factors(local_il);
+        struct ggml_tensor * k =
+            ggml_view_3d(ctx0, kv_self.k_l[local_il],
+                n_embd_head_k, n_head_kv, n_shift,
+                ggml_row_size(kv_self.k_l[local_il]->type, n_embd_head_k),
+                ggml_row_size(kv_self.k_l[local_il]->type, n_embd_k_gqa),
+                ggml_row_size(kv_self.k_l[local_il]->type, n_embd_k_gqa)*k_shift_beg);
+
+        struct ggml_tensor * tmp;
+        if (ggml_is_quantized(k->type)) {
+            // dequantize to f32 -> RoPE -> quantize back
+            tmp = ggml_cast(ctx0, k, GGML_TYPE_F32);
+            cb(tmp, "K_f32", il);
+            for (auto * backend : lctx.backends) {
+                // Figure out which backend KV cache belongs to
+                if (ggml_backend_supports_buft(backend, lctx.model.buft_layer[local_il].buft)) {
+                    ggml_backend_sched_set_tensor_backend(lctx.sched.at(0), tmp, backend); // todo.
+                    break;
+                }
+            }
+            tmp = ggml_rope_ext_inplace(ctx0, tmp,
+                    lctx.inp_K_shift, rope_factors, n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
+                    ext_factor, attn_factor, beta_fast, beta_slow);
+            cb(tmp, "K_shifted_f32", il);
+            tmp = ggml_cpy(ctx0, tmp, k);
+        } else {
+            // we rotate only the first n_rot dimensions
+            tmp = ggml_rope_ext_inplace(ctx0, k,
+                    lctx.inp_K_shift, rope_factors, n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
+                    ext_factor, attn_factor, beta_fast, beta_slow);
+        }
+        cb(tmp, "K_shifted", il);
+
+        return tmp;
+    }
+
     struct ggml_cgraph * build_k_shift() {
         struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
 
         GGML_ASSERT(kv_self.size == n_ctx);
 
-        lctx.inp_K_shift = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_ctx);
-        cb(lctx.inp_K_shift, "K_shift", -1);
-        ggml_set_input(lctx.inp_K_shift);
+        build_inp_K_shift();
 
         for (int il = 0; il < n_layer; ++il) {
-            const int64_t n_head_kv = hparams.n_head_kv(il);
-            const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
-            struct ggml_tensor * rope_factors = build_rope_factors(il);
-            struct ggml_tensor * k =
-                ggml_view_3d(ctx0, kv_self.k_l[il],
-                    n_embd_head_k, n_head_kv, n_ctx,
-                    ggml_row_size(kv_self.k_l[il]->type, n_embd_head_k),
-                    ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa),
-                    0);
-
-            struct ggml_tensor * tmp;
-            if (ggml_is_quantized(k->type)) {
-                // dequantize to f32 -> RoPE -> quantize back
-                tmp = ggml_cast(ctx0, k, GGML_TYPE_F32);
-                cb(tmp, "K_f32", il);
-                for (auto * backend : lctx.backends) {
-                    // Figure out which backend KV cache belongs to
-                    if (ggml_backend_supports_buft(backend, lctx.model.buft_layer[il].buft)) {
-                        ggml_backend_sched_set_tensor_backend(lctx.sched.at(0), tmp, backend); // todo.
-                        break;
-                    }
-                }
-                tmp = ggml_rope_ext_inplace(ctx0, tmp,
-                        lctx.inp_K_shift, rope_factors, n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
-                        ext_factor, attn_factor, beta_fast, beta_slow);
-                cb(tmp, "K_shifted_f32", il);
-                tmp = ggml_cpy(ctx0, tmp, k);
-            } else {
-                // we rotate only the first n_rot dimensions
-                tmp = ggml_rope_ext_inplace(ctx0, k,
-                        lctx.inp_K_shift, rope_factors, n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
-                        ext_factor, attn_factor, beta_fast, beta_slow);
+            if (!this_layer_is_mine(il, cparams.n_world, cparams.rank, cparams.n_layer_window)) {
+                continue;
             }
-            cb(tmp, "K_shifted", il);
-            ggml_build_forward_expand(gf, tmp);
+            const int local_il = map_layer_to_local_id(il, cparams.n_world, cparams.rank, cparams.n_layer_window);
+
+            ggml_build_forward_expand(gf, build_k_shift_layer(il, local_il));
         }
 
         return gf;
@@ -10320,8 +11487,8 @@ struct llm_build_context {
                 ggml_tensor * view_v_src;
                 ggml_tensor * view_v_dst;
 
-                if (flash_attn) {
-                    // NOTE: the V cache is not transposed when using flash attention
+                if (!kv_self.v_trans) {
+                    // NOTE: the V cache is not transposed when using flash attention or when it is quantized
                     view_v_src = ggml_view_2d(ctx0, kv_self.v_l[il],
                             n_embd_v_gqa, nm,
                             ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa),
@@ -10426,6 +11593,13 @@ struct llm_build_context {
         return flash_attn ? ggml_cast(ctx0, lctx.inp_KQ_mask_swa, GGML_TYPE_F16) : lctx.inp_KQ_mask_swa;
     }
 
+    struct ggml_tensor * build_inp_kv_idxs() {
+        lctx.inp_kv_idxs = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+        cb(lctx.inp_kv_idxs, "inp_kv_idxs", -1);
+        ggml_set_input(lctx.inp_kv_idxs);
+        return lctx.inp_kv_idxs;
+    }
+
     struct ggml_tensor * build_inp_mean() {
         lctx.inp_mean = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_tokens, n_tokens);
         cb(lctx.inp_mean, "inp_mean", -1);
@@ -10519,6 +11693,24 @@ struct llm_build_context {
         return gf;
     }
 
+    // reduce the logits of each output to the cparams.n_top_logits largest ones, see llama_get_logits_top_ith
+    struct ggml_cgraph * append_top_logits(struct ggml_cgraph * gf) {
+        struct ggml_tensor * logits = ggml_graph_node(gf, -1);
+        GGML_ASSERT(strcmp(logits->name, "result_output") == 0 && "missing result_output tensor");
+
+        struct ggml_tensor * ids = ggml_top_k_select(ctx0, logits, cparams.n_top_logits);
+        ggml_set_output(ids); // read back together with the logits, keep it out of the allocator's reuse
+        cb(ids, "result_top_ids", -1);
+
+        // [1, n_top_logits, n_outputs]
+        struct ggml_tensor * cur = ggml_get_rows(ctx0, ggml_reshape_3d(ctx0, logits, 1, logits->ne[0], logits->ne[1]), ids);
+        cb(cur, "result_top_logits", -1);
+
+        ggml_build_forward_expand(gf, cur);
+
+        return gf;
+    }
+
     struct ggml_tensor * llm_build_pos_bucket(bool causal) {
         if (causal) {
             lctx.inp_pos_bucket = ggml_new_tensor_2d(ctx0, GGML_TYPE_I32, n_kv,     n_tokens);
@@ -10551,12 +11743,38 @@ struct llm_build_context {
         return pos_bias;
     }
 
-    struct ggml_tensor * llm_build_inp_embd_enc() {
-        const int64_t n_embd = hparams.n_embd;
-        lctx.inp_embd_enc = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, n_outputs_enc);
-        ggml_set_input(lctx.inp_embd_enc);
-        cb(lctx.inp_embd_enc, "embd_enc", -1);
-        return lctx.inp_embd_enc;
+    struct ggml_tensor * llm_build_inp_embd_enc() {
+        const int64_t n_embd = hparams.n_embd;
+        lctx.inp_embd_enc = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, n_outputs_enc);
+        ggml_set_input(lctx.inp_embd_enc);
+        cb(lctx.inp_embd_enc, "embd_enc", -1);
+        return lctx.inp_embd_enc;
+    }
+
+    // the fused CPU kernels (ggml_rms_norm_mul_mat, ggml_mul_mat_swiglu) replace several passes over the
+    // hidden state during decode, but they have no LoRA path and do not use the sgemm kernels for prefill
+    bool can_use_fused_ops(std::initializer_list<const struct ggml_tensor *> ws) const {
+        if (!cparams.fused_ops || n_tokens >= 32 || !lctx.lora_adapters.empty()) {
+            return false;
+        }
+
+        enum ggml_type vec_dot_type = GGML_TYPE_COUNT;
+        for (const struct ggml_tensor * w : ws) {
+            if (w == nullptr || w->buffer == nullptr || !ggml_backend_buffer_is_host(w->buffer)) {
+                return false;
+            }
+
+            const ggml_type_traits_t traits = ggml_internal_get_type_traits(w->type);
+            if (traits.vec_dot == nullptr || traits.gemv != nullptr) {
+                return false;
+            }
+            if (vec_dot_type != GGML_TYPE_COUNT && traits.vec_dot_type != vec_dot_type) {
+                return false;
+            }
+            vec_dot_type = traits.vec_dot_type;
+        }
+
+        return true;
     }
 
     struct ggml_tensor * llm_build_inp_KQ_mask_cross() {
@@ -10605,6 +11823,17 @@ struct llm_build_context {
         // KQ_mask (mask for 1 head, it will be broadcasted to all heads)
         struct ggml_tensor * KQ_mask = build_inp_KQ_mask();
 
+        // destination cells of the new KV rows, used by llm_build_kv when the cache is paged
+        if (kv_self.block_size > 0) {
+            build_inp_kv_idxs();
+        }
+
+        // pending position shifts of KV cells (e.g. the sinks of a streaming KV cache), applied to the K
+        // rows of these cells before the attention of each layer instead of in a separate K-shift graph
+        if (kv_self.has_shift) {
+            build_inp_K_shift();
+        }
+
         const float kq_scale = hparams.f_attention_scale == 0.0f ? 1.0f/sqrtf(float(n_embd_head)) : hparams.f_attention_scale;
         for (int il = 0; il < n_layer; ++il) {
             if (!this_layer_is_mine(il, n_world, my_rank, n_layer_window)) {
@@ -10632,48 +11861,81 @@ struct llm_build_context {
             struct ggml_tensor * inpSA = inpL;  // use for shortcut
             int local_il = map_layer_to_local_id(il, n_world, my_rank, n_layer_window);
 
-            // norm
-            cur = llm_build_norm(ctx0, inpL, hparams,
-                    model.layers[local_il].attn_norm, NULL,
-                    LLM_NORM_RMS, cb, il);
-            cb(cur, "attn_norm", il);
+            // fused CPU kernels for decode, see can_use_fused_ops()
+            const bool fused_attn =
+                !model.layers[local_il].bq && !model.layers[local_il].bk && !model.layers[local_il].bv &&
+                can_use_fused_ops({ model.layers[local_il].wq, model.layers[local_il].wk, model.layers[local_il].wv });
+            const bool fused_ffn =
+                !model.layers[local_il].ffn_up_b && !model.layers[local_il].ffn_gate_b &&
+                model.layers[local_il].ffn_up && model.layers[local_il].ffn_gate &&
+                model.layers[local_il].ffn_up->type == model.layers[local_il].ffn_gate->type &&
+                can_use_fused_ops({ model.layers[local_il].ffn_up, model.layers[local_il].ffn_gate });
 
             // self-attention
             {
+                if (lctx.inp_K_shift) {
+                    ggml_build_forward_expand(sub_gf, build_k_shift_layer(il, local_il));
+                }
+
                 // rope freq factors for llama3; may return nullptr for llama2 and other models
                 struct ggml_tensor * rope_factors = build_rope_factors(local_il);
 
-                // compute Q and K and RoPE them
-                struct ggml_tensor * Qcur = llm_build_lora_mm(lctx, ctx0, model.layers[local_il].wq, cur);
-                cb(Qcur, "Qcur", il);
-                if (model.layers[local_il].bq) {
-                    Qcur = ggml_add(ctx0, Qcur, model.layers[local_il].bq);
+                struct ggml_tensor * Qcur = nullptr;
+                struct ggml_tensor * Kcur = nullptr;
+                struct ggml_tensor * Vcur = nullptr;
+
+                if (fused_attn) {
+                    // norm and QKV projection in a single pass over the hidden state
+                    struct ggml_tensor * wqkv = ggml_rms_norm_mul_mat(ctx0, inpL, model.layers[local_il].attn_norm,
+                            model.layers[local_il].wq, model.layers[local_il].wk, model.layers[local_il].wv, norm_rms_eps);
+                    cb(wqkv, "wqkv", il);
+
+                    Qcur = ggml_view_3d(ctx0, wqkv, n_embd_head, n_head,    n_tokens, n_embd_head*sizeof(float), wqkv->nb[1], 0);
+                    Kcur = ggml_view_3d(ctx0, wqkv, n_embd_head, n_head_kv, n_tokens, n_embd_head*sizeof(float), wqkv->nb[1], n_embd_head*n_head*sizeof(float));
+                    Vcur = ggml_view_2d(ctx0, wqkv, n_embd_v_gqa, n_tokens, wqkv->nb[1], (n_embd_head*n_head + n_embd_k_gqa)*sizeof(float));
+                    cb(Vcur, "Vcur", il);
+                } else {
+                    // norm
+                    cur = llm_build_norm(ctx0, inpL, hparams,
+                            model.layers[local_il].attn_norm, NULL,
+                            LLM_NORM_RMS, cb, il);
+                    cb(cur, "attn_norm", il);
+
+                    // compute Q and K and RoPE them
+                    Qcur = llm_build_lora_mm(lctx, ctx0, model.layers[local_il].wq, cur);
                     cb(Qcur, "Qcur", il);
-                }
+                    if (model.layers[local_il].bq) {
+                        Qcur = ggml_add(ctx0, Qcur, model.layers[local_il].bq);
+                        cb(Qcur, "Qcur", il);
+                    }
 
-                struct ggml_tensor * Kcur = llm_build_lora_mm(lctx, ctx0, model.layers[local_il].wk, cur);
-                cb(Kcur, "Kcur", il);
-                if (model.layers[local_il].bk) {
-                    Kcur = ggml_add(ctx0, Kcur, model.layers[local_il].bk);
+                    Kcur = llm_build_lora_mm(lctx, ctx0, model.layers[local_il].wk, cur);
                     cb(Kcur, "Kcur", il);
-                }
+                    if (model.layers[local_il].bk) {
+                        Kcur = ggml_add(ctx0, Kcur, model.layers[local_il].bk);
+                        cb(Kcur, "Kcur", il);
+                    }
 
-                struct ggml_tensor * Vcur = llm_build_lora_mm(lctx, ctx0, model.layers[local_il].wv, cur);
-                cb(Vcur, "Vcur", il);
-                if (model.layers[local_il].bv) {
-                    Vcur = ggml_add(ctx0, Vcur, model.layers[local_il].bv);
+                    Vcur = llm_build_lora_mm(lctx, ctx0, model.layers[local_il].wv, cur);
                     cb(Vcur, "Vcur", il);
+                    if (model.layers[local_il].bv) {
+                        Vcur = ggml_add(ctx0, Vcur, model.layers[local_il].bv);
+                        cb(Vcur, "Vcur", il);
+                    }
+
+                    Qcur = ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head,    n_tokens);
+                    Kcur = ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens);
                 }
 
                 Qcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_pos, rope_factors,
+                    ctx0, Qcur, inp_pos, rope_factors,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Qcur, "Qcur", il);
 
                 Kcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, rope_factors,
+                    ctx0, Kcur, inp_pos, rope_factors,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
@@ -10707,12 +11969,23 @@ struct llm_build_context {
                         LLM_NORM_RMS, cb, il);
                 cb(cur, "ffn_norm", il);
 
-                cur = llm_build_ffn(ctx0, lctx, cur,
-                        model.layers[local_il].ffn_up,   model.layers[local_il].ffn_up_b,   NULL,
-                        model.layers[local_il].ffn_gate, model.layers[local_il].ffn_gate_b, NULL,
-                        model.layers[local_il].ffn_down, model.layers[local_il].ffn_down_b, NULL,
-                        NULL,
-                        LLM_FFN_SILU, LLM_FFN_PAR, cb, il);
+                if (fused_ffn) {
+                    // gate/up projections with the SiLU-multiply applied in the epilogue
+                    cur = ggml_mul_mat_swiglu(ctx0, model.layers[local_il].ffn_up, model.layers[local_il].ffn_gate, cur);
+                    cb(cur, "ffn_swiglu", il);
+
+                    cur = llm_build_lora_mm(lctx, ctx0, model.layers[local_il].ffn_down, cur);
+                    if (model.layers[local_il].ffn_down_b) {
+                        cur = ggml_add(ctx0, cur, model.layers[local_il].ffn_down_b);
+                    }
+                } else {
+                    cur = llm_build_ffn(ctx0, lctx, cur,
+                            model.layers[local_il].ffn_up,   model.layers[local_il].ffn_up_b,   NULL,
+                            model.layers[local_il].ffn_gate, model.layers[local_il].ffn_gate_b, NULL,
+                            model.layers[local_il].ffn_down, model.layers[local_il].ffn_down_b, NULL,
+                            NULL,
+                            LLM_FFN_SILU, LLM_FFN_PAR, cb, il);
+                }
                 cb(cur, "ffn_out", il);
             } else {
                 // MoE branch
@@ -15499,7 +16772,7 @@ struct llm_build_context {
                 struct ggml_tensor * Vcur = llm_build_lora_mm(lctx, ctx0, model.layers[il].wv, cur);
                 cb(Vcur, "Vcur", il);
 
-                llm_build_kv_store(ctx0, hparams, cparams, kv_self, gf, Kcur, Vcur, n_tokens, kv_head, cb, il);
+                llm_build_kv_store(ctx0, hparams, cparams, kv_self, gf, Kcur, Vcur, n_tokens, kv_head, nullptr, cb, il);
 
                 struct ggml_tensor * k =
                     ggml_view_3d(ctx0, kv_self.k_l[il],
@@ -16695,6 +17968,8 @@ static std::vector<struct ggml_cgraph *> llama_build_graph(
     if (lctx.cparams.embeddings) {
         struct ggml_cgraph * pooled_sub_gf = llm.append_pooling(result.back());
         result.back() = pooled_sub_gf; 
+    } else if (lctx.cparams.n_top_logits > 0 && my_rank == 0) {
+        result.back() = llm.append_top_logits(result.back());
     }
 
     llm.free();
@@ -16703,14 +17978,17 @@ static std::vector<struct ggml_cgraph *> llama_build_graph(
 }
 
 static void llama_set_k_shift(llama_context & lctx) {
-    const int64_t kv_size = lctx.kv_self.size;
+    uint32_t beg;
+    uint32_t end;
+    llama_kv_cache_shift_range(lctx.kv_self, beg, end);
 
-    assert(ggml_backend_buffer_is_host(lctx.inp_K_shift->buffer));
+    GGML_ASSERT(ggml_backend_buffer_is_host(lctx.inp_K_shift->buffer));
+    GGML_ASSERT(lctx.inp_K_shift->ne[0] == end - beg);
 
     int32_t * data = (int32_t *) lctx.inp_K_shift->data;
 
-    for (int i = 0; i < kv_size; ++i) {
-        data[i] = lctx.kv_self.cells[i].delta;
+    for (uint32_t i = beg; i < end; ++i) {
+        data[i - beg] = lctx.kv_self.cells[i].delta;
     }
 }
 
@@ -16815,6 +18093,19 @@ static void llama_set_inputs(llama_context & lctx, const llama_ubatch & batch) {
         ggml_backend_tensor_set(lctx.inp_pos, batch.pos, 0, n_tokens*ggml_element_size(lctx.inp_pos));
     }
 
+    if (lctx.inp_K_shift && lctx.inp_K_shift->data != nullptr) {
+        llama_set_k_shift(lctx);
+    }
+
+    if (lctx.inp_kv_idxs) {
+        const int64_t n_tokens = batch.n_tokens;
+
+        GGML_ASSERT(ggml_backend_buffer_is_host(lctx.inp_kv_idxs->buffer));
+        GGML_ASSERT(kv_self.slot.size() == (size_t) n_tokens);
+
+        memcpy(lctx.inp_kv_idxs->data, kv_self.slot.data(), n_tokens*ggml_element_size(lctx.inp_kv_idxs));
+    }
+
     if (lctx.inp_out_ids && (hparams.causal_attn || cparams.pooling_type == LLAMA_POOLING_TYPE_NONE)) {
         GGML_ASSERT(lctx.inp_out_ids && "every model that can must skip unused outputs");
         const int64_t n_tokens = batch.n_tokens;
@@ -16875,35 +18166,50 @@ static void llama_set_inputs(llama_context & lctx, const llama_ubatch & batch) {
             // For causal attention, use only the previous KV cells
             // of the correct sequence for each token of the batch.
             // It's assumed that if a token in the batch has multiple sequences, they are equivalent.
+            //
+            // The cell positions of each sequence of the ubatch are gathered once into a contiguous row,
+            // with cells of other sequences set to a position that is in the future of every token,
+            // so that the per-token loop is a plain compare over the row
+            std::vector<llama_pos> & kv_pos = lctx.kq_mask_pos;
+            std::vector<int32_t>     seq_row(LLAMA_MAX_SEQ, -1);
+            int32_t n_rows = 0;
+
+            for (int s = 0; s < n_seqs; ++s) {
+                const llama_seq_id seq_id = batch.seq_id[s][0];
+                if (seq_row[seq_id] >= 0) {
+                    continue;
+                }
+                seq_row[seq_id] = n_rows++;
+                kv_pos.resize(n_rows*n_kv);
+
+                llama_pos * row = kv_pos.data() + seq_row[seq_id]*n_kv;
+                for (int i = 0; i < n_kv; ++i) {
+                    row[i] = kv_self.cells[i].has_seq_id(seq_id) ? kv_self.cells[i].pos : std::numeric_limits<llama_pos>::max();
+                }
+            }
+
+            const bool    use_alibi = hparams.use_alibi;
+            const int32_t n_swa     = hparams.n_swa;
+
             for (int h = 0; h < 1; ++h) {
                 for (int s = 0; s < n_seqs; ++s) {
-                    const llama_seq_id seq_id = batch.seq_id[s][0];
+                    const llama_pos * row = kv_pos.data() + seq_row[batch.seq_id[s][0]]*n_kv;
 
                     for (int j = 0; j < n_seq_tokens; ++j) {
                         const llama_pos pos = batch.pos[s*n_seq_tokens + j];
 
-                        for (int i = 0; i < n_kv; ++i) {
-                            float f;
-                            if (!kv_self.cells[i].has_seq_id(seq_id) || kv_self.cells[i].pos > pos) {
-                                f = -INFINITY;
-                            } else {
-                                if (hparams.use_alibi) {
-                                    f = -std::abs(kv_self.cells[i].pos - pos);
-                                } else {
-                                    f = 0.0f;
-                                }
-                            }
-
-                            if (data) {
-                                data[h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv + i] = f;
+                        if (data) {
+                            float * dst = data + h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv;
+                            for (int i = 0; i < n_kv; ++i) {
+                                dst[i] = row[i] > pos ? -INFINITY : (use_alibi ? -(float) (pos - row[i]) : 0.0f);
                             }
+                        }
 
-                            // may need to cut off old tokens for sliding window
-                            if (data_swa) {
-                                if (pos - kv_self.cells[i].pos >= (int32_t)hparams.n_swa) {
-                                    f = -INFINITY;
-                                }
-                                data_swa[h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv + i] = f;
+                        // may need to cut off old tokens for sliding window
+                        if (data_swa) {
+                            float * dst = data_swa + h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv;
+                            for (int i = 0; i < n_kv; ++i) {
+                                dst[i] = row[i] > pos || pos - row[i] >= n_swa ? -INFINITY : (use_alibi ? -(float) (pos - row[i]) : 0.0f);
                             }
                         }
                     }
@@ -17202,10 +18508,12 @@ static size_t llama_output_reserve(llama_context & lctx, size_t n_outputs) {
     const auto n_embd  = hparams.n_embd;
 
     // TODO: use a per-batch flag for logits presence instead
-    const bool has_logits = !cparams.embeddings;
+    const bool has_logits = !cparams.embeddings && cparams.n_top_logits == 0;
+    const bool has_top    = !cparams.embeddings && cparams.n_top_logits  > 0;
     const bool has_embd   =  cparams.embeddings && (cparams.pooling_type == LLAMA_POOLING_TYPE_NONE);
 
     const size_t logits_size = has_logits ? n_vocab * n_outputs_max : 0;
+    const size_t top_size    = has_top    ? cparams.n_top_logits * n_outputs_max : 0;
     const size_t embd_size   = has_embd   ?  n_embd * n_outputs_max : 0;
 
     if (lctx.output_ids.empty()) {
@@ -17214,7 +18522,7 @@ static size_t llama_output_reserve(llama_context & lctx, size_t n_outputs) {
     }
 
     const size_t prev_size = lctx.buf_output ? ggml_backend_buffer_get_size(lctx.buf_output) : 0;
-    const size_t new_size  = (logits_size + embd_size) * sizeof(float);
+    const size_t new_size  = (logits_size + embd_size + top_size) * sizeof(float) + top_size * sizeof(int32_t);
 
     // alloc only when more than the current capacity is required
     // TODO: also consider shrinking the buffer
@@ -17228,6 +18536,8 @@ static size_t llama_output_reserve(llama_context & lctx, size_t n_outputs) {
             lctx.buf_output = nullptr;
             lctx.logits = nullptr;
             lctx.embd = nullptr;
+            lctx.logits_top = nullptr;
+            lctx.logits_top_ids = nullptr;
         }
 
         lctx.buf_output = ggml_backend_buft_alloc_buffer(llama_default_buffer_type_cpu(lctx.model, true), new_size);
@@ -17241,9 +18551,12 @@ static size_t llama_output_reserve(llama_context & lctx, size_t n_outputs) {
 
     lctx.logits              = has_logits ? output_base : nullptr;
     lctx.embd                = has_embd   ? output_base + logits_size : nullptr;
+    lctx.logits_top          = has_top    ? output_base + logits_size + embd_size : nullptr;
+    lctx.logits_top_ids      = has_top    ? (int32_t *) (output_base + logits_size + embd_size + top_size) : nullptr;
 
     lctx.output_size         = n_outputs_max;
     lctx.logits_size         = logits_size;
+    lctx.logits_top_size     = top_size;
     lctx.embd_size           = embd_size;
 
     // set all ids as invalid (negative)
@@ -17285,6 +18598,13 @@ static void llama_output_reorder(struct llama_context * ctx) {
                     std::swap(ctx->embd[i*n_embd + k], ctx->embd[j_min*n_embd + k]);
                 }
             }
+            if (ctx->logits_top_size > 0) {
+                const int32_t n_top = ctx->cparams.n_top_logits;
+                for (int32_t k = 0; k < n_top; k++) {
+                    std::swap(ctx->logits_top    [i*n_top + k], ctx->logits_top    [j_min*n_top + k]);
+                    std::swap(ctx->logits_top_ids[i*n_top + k], ctx->logits_top_ids[j_min*n_top + k]);
+                }
+            }
         }
         std::fill(ctx->output_ids.begin(), ctx->output_ids.end(), -1);
         for (int32_t i = 0; i < n_outputs; ++i) {
@@ -17316,6 +18636,24 @@ static void llama_graph_compute(
     }
 }
 
+// holds the threadpool workers in the spinning state for the lifetime of the object
+struct llama_threadpool_hold {
+    ggml_threadpool_t threadpool;
+
+    llama_threadpool_hold(ggml_threadpool_t threadpool, int spin_us)
+        : threadpool(spin_us != 0 ? threadpool : nullptr) {
+        if (this->threadpool) {
+            ggml_threadpool_hold(this->threadpool, spin_us);
+        }
+    }
+
+    ~llama_threadpool_hold() {
+        if (threadpool) {
+            ggml_threadpool_hold(threadpool, 0);
+        }
+    }
+};
+
 struct input_tensors {
     ggml_tensor * sub_gf_out;
     ggml_tensor * inp_pos;
@@ -17478,10 +18816,11 @@ static float is_graph_loaded(struct ggml_cgraph * cgraph) {
 }
 
 static void manage_graph_tensors(struct ggml_cgraph * cgraph, int advice, bool force = false) {
-    size_t first = SIZE_MAX;
-    size_t last  = 0;
     long page_size = sysconf(_SC_PAGESIZE);
 
+    // weights may live in several mappings (e.g. the model file and the repacked weights cache),
+    // so advise each contiguous run of tensor data separately instead of the whole span
+    std::vector<std::pair<size_t, size_t>> ranges;
     for (int i = 0; i < ggml_graph_n_leafs(cgraph); i++) {
         struct ggml_tensor * cur = ggml_graph_leaf(cgraph, i);
 
@@ -17490,24 +18829,39 @@ static void manage_graph_tensors(struct ggml_cgraph * cgraph, int advice, bool f
         }
 
         size_t addr = reinterpret_cast<size_t>(cur->data);
-        first = std::min(first, addr);
-        last  = std::max(last,  addr + ggml_nbytes(cur));
+        ranges.emplace_back(addr, addr + ggml_nbytes(cur));
+    }
+    std::sort(ranges.begin(), ranges.end());
+
+    std::vector<std::pair<size_t, size_t>> merged;
+    for (const auto & range : ranges) {
+        // tensors in the same mapping are separated by at most a few pages of unused data
+        if (!merged.empty() && range.first <= merged.back().second + 16 * page_size) {
+            merged.back().second = std::max(merged.back().second, range.second);
+        } else {
+            merged.push_back(range);
+        }
     }
 
-    // align addr 
-    llama_mmap::align_range(&first, &last, page_size);
-    size_t len = std::max(last - first, static_cast<size_t>(page_size));
+    for (const auto & range : merged) {
+        size_t first = range.first;
+        size_t last  = range.second;
+
+        // align addr 
+        llama_mmap::align_range(&first, &last, page_size);
+        size_t len = std::max(last - first, static_cast<size_t>(page_size));
 
-    // hint to load memory
-    posix_madvise(reinterpret_cast<void *>(first), len, advice);
+        // hint to load memory
+        posix_madvise(reinterpret_cast<void *>(first), len, advice);
 
-    // if advice is POSIX_MADV_WILLNEED, force to prefetch data
-    if (force && advice == POSIX_MADV_WILLNEED) {
-        // coarse-grained prefetch
-        char * ptr = reinterpret_cast<char *>(first);
-        for (size_t off = 0; off < len; off += page_size * 32) {
-            volatile char data = ptr[off];
-            (void)data;
+        // if advice is POSIX_MADV_WILLNEED, force to prefetch data
+        if (force && advice == POSIX_MADV_WILLNEED) {
+            // coarse-grained prefetch, only touch bytes that belong to the run
+            char * ptr = reinterpret_cast<char *>(range.first);
+            for (size_t off = 0; off < range.second - range.first; off += page_size * 32) {
+                volatile char data = ptr[off];
+                (void)data;
+            }
         }
     }
 }
@@ -17547,6 +18901,17 @@ static int llama_decode_internal(
         }
     }
 
+    if (batch_all.seq_id) {
+        for (uint32_t i = 0; i < n_tokens_all; ++i) {
+            for (int32_t j = 0; j < batch_all.n_seq_id[i]; ++j) {
+                if (batch_all.seq_id[i][j] < 0 || batch_all.seq_id[i][j] >= LLAMA_MAX_SEQ) {
+                    LLAMA_LOG_ERROR("%s: invalid seq_id[%d][%d] = %d, must be in [0, %d)\n", __func__, i, j, batch_all.seq_id[i][j], LLAMA_MAX_SEQ);
+                    return -1;
+                }
+            }
+        }
+    }
+
     GGML_ASSERT(n_tokens_all <= cparams.n_batch);
 
     GGML_ASSERT((cparams.causal_attn || cparams.n_ubatch >= n_tokens_all) && "non-causal attention requires n_ubatch >= n_tokens");
@@ -17644,11 +19009,18 @@ static int llama_decode_internal(
 
         int n_threads = n_tokens == 1 ? cparams.n_threads : cparams.n_threads_batch;
         ggml_threadpool_t threadpool = n_tokens == 1 ? lctx.threadpool : lctx.threadpool_batch;
+        if (threadpool == nullptr) {
+            threadpool = lctx.threadpool_spin;
+        }
 
         GGML_ASSERT(n_threads > 0);
 
         // non-causal masks do not use the KV cache
         if (hparams.causal_attn) {
+            if (kv_self.n_window > 0) {
+                llama_kv_cache_evict_window(kv_self, ubatch);
+            }
+
             llama_kv_cache_update(&lctx);
 
             // if we have enough unused cells before the current head ->
@@ -17665,8 +19037,10 @@ static int llama_decode_internal(
                 // a heuristic, to avoid attending the full cache if it is not yet utilized
                 // after enough generations, the benefit from this heuristic disappears
                 // if we start defragmenting the cache, the benefit from this will be more important
+                // with the paged cache only the cells of the sequences in the ubatch need to be attended
                 const uint32_t pad = llama_kv_cache_get_padding(cparams);
-                kv_self.n = std::min(kv_self.size, std::max(pad, GGML_PAD(llama_kv_cache_cell_max(kv_self), pad)));
+                const uint32_t cell_max = kv_self.block_size > 0 ? kv_self.slot_max : llama_kv_cache_cell_max(kv_self);
+                kv_self.n = std::min(kv_self.size, std::max(pad, GGML_PAD(cell_max, pad)));
             }
         }
 
@@ -17679,6 +19053,7 @@ static int llama_decode_internal(
 
         // the output is always the last tensor in the graph
         struct ggml_tensor * res        = nullptr;
+        struct ggml_tensor * res_ids    = nullptr; // ids of the top logits when cparams.n_top_logits > 0
         struct ggml_tensor * embd       = nullptr;
         struct ggml_tensor * sub_gf_out = nullptr;
         const  int64_t       n_embd     = hparams.n_embd;
@@ -17703,6 +19078,16 @@ static int llama_decode_internal(
             GGML_ASSERT(embd != nullptr && "missing embeddings tensor");
         } else {
             embd = nullptr; // do not extract embeddings when not needed
+
+            if (res && cparams.n_top_logits > 0) {
+                for (int i = ggml_graph_n_nodes(gf.back()) - 1; i >= 0; --i) {
+                    if (strcmp(ggml_graph_node(gf.back(), i)->name, "result_top_ids") == 0) {
+                        res_ids = ggml_graph_node(gf.back(), i);
+                        break;
+                    }
+                }
+                GGML_ASSERT(res_ids != nullptr && strcmp(res->name, "result_top_logits") == 0 && "missing top logits tensors");
+            }
         }
         
         GGML_ASSERT(lctx.sched.size() == gf.size());
@@ -17717,7 +19102,10 @@ static int llama_decode_internal(
         bool           is_output = false;
         bool           is_last_l = false;
         GGML_ASSERT(my_rank == 0 || n_world > 1);
-        
+
+        // keep the workers hot while we move between sub-graphs and wait on the other nodes
+        llama_threadpool_hold hold(threadpool, cparams.spin_us);
+
         for (size_t i = 0; i < (size_t)gf.size(); ++i) {
             sub_gf = gf[i];
 
@@ -17740,7 +19128,7 @@ static int llama_decode_internal(
             }
 
             sub_gf_out = ggml_graph_node(sub_gf, -1);
-            is_output  = strcmp(sub_gf_out->name, "result_output") == 0;
+            is_output  = strcmp(sub_gf_out->name, "result_output") == 0 || strcmp(sub_gf_out->name, "result_top_logits") == 0;
             if (is_output) {
                 break;
             }
@@ -17792,6 +19180,15 @@ static int llama_decode_internal(
             }
         }
 
+        // the pending K shifts were applied by the graph
+        if (lctx.inp_K_shift) {
+            kv_self.has_shift = false;
+
+            for (uint32_t i = 0; i < kv_self.size; ++i) {
+                kv_self.cells[i].delta = 0;
+            }
+        }
+
         // update the kv ring buffer
         {
             kv_self.head += n_tokens;
@@ -17802,8 +19199,22 @@ static int llama_decode_internal(
             }
         }
 
-        // extract logits
-        if (res) {
+        // extract the top logits and their ids
+        if (res && res_ids) {
+            ggml_backend_t backend_res = ggml_backend_sched_get_tensor_backend(lctx.sched.back(), res);
+            GGML_ASSERT(backend_res != nullptr);
+            GGML_ASSERT(lctx.logits_top != nullptr);
+
+            const int32_t n_top         = cparams.n_top_logits;
+            const int32_t n_outputs_new = lctx.n_outputs;
+
+            if (n_outputs_new) {
+                GGML_ASSERT( n_outputs_prev + n_outputs_new <= n_outputs);
+                GGML_ASSERT((n_outputs_prev + n_outputs_new) * n_top <= (int64_t) lctx.logits_top_size);
+                ggml_backend_tensor_get_async(backend_res, res,     lctx.logits_top     + n_outputs_prev * n_top, 0, n_outputs_new * n_top * sizeof(float));
+                ggml_backend_tensor_get_async(backend_res, res_ids, lctx.logits_top_ids + n_outputs_prev * n_top, 0, n_outputs_new * n_top * sizeof(int32_t));
+            }
+        } else if (res) {
             ggml_backend_t backend_res = ggml_backend_sched_get_tensor_backend(lctx.sched.back(), res);
             GGML_ASSERT(backend_res != nullptr);
             GGML_ASSERT(lctx.logits != nullptr);
@@ -18320,7 +19731,8 @@ static void llama_kv_cache_update_internal(struct llama_context & lctx) {
     bool need_reserve = false;
 
     // apply K-shift if needed
-    if (lctx.model.hparams.rope_type != LLAMA_ROPE_TYPE_NONE && lctx.kv_self.has_shift) {
+    // (the llama graph applies it to the cells that moved, before the attention of each layer)
+    if (lctx.model.hparams.rope_type != LLAMA_ROPE_TYPE_NONE && lctx.kv_self.has_shift && lctx.model.arch != LLM_ARCH_LLAMA) {
         throw std::runtime_error("shift not supported\n");
 
         if (lctx.model.arch == LLM_ARCH_DEEPSEEK2) { // not supported due to MLA
@@ -19489,10 +20901,14 @@ struct llama_model_params llama_model_default_params() {
         /*.progress_callback           =*/ nullptr,
         /*.progress_callback_user_data =*/ nullptr,
         /*.kv_overrides                =*/ nullptr,
+        /*.n_load_threads              =*/ 0,
         /*.vocab_only                  =*/ false,
         /*.use_mmap                    =*/ true,
         /*.use_mlock                   =*/ false,
         /*.check_tensors               =*/ false,
+        /*.repack                      =*/ false,
+        /*.warm_start                  =*/ false,
+        /*.hugepages                   =*/ false,
     };
 
 #ifdef GGML_USE_METAL
@@ -19517,6 +20933,11 @@ struct llama_context_params llama_context_default_params() {
         /*.n_seq_max                   =*/ 1,
         /*.n_threads                   =*/ GGML_DEFAULT_N_THREADS, // TODO: better default
         /*.n_threads_batch             =*/ GGML_DEFAULT_N_THREADS,
+        /*.spin_us                     =*/ 0,
+        /*.n_top_logits                =*/ 0,
+        /*.kv_block_size               =*/ 0,
+        /*.n_kv_window                 =*/ 0,
+        /*.n_kv_sink                   =*/ 4,
         /*.rope_scaling_type           =*/ LLAMA_ROPE_SCALING_TYPE_UNSPECIFIED,
         /*.pooling_type                =*/ LLAMA_POOLING_TYPE_UNSPECIFIED,
         /*.attention_type              =*/ LLAMA_ATTENTION_TYPE_UNSPECIFIED,
@@ -19536,6 +20957,7 @@ struct llama_context_params llama_context_default_params() {
         /*.embeddings                  =*/ false,
         /*.offload_kqv                 =*/ true,
         /*.flash_attn                  =*/ false,
+        /*.fused_ops                   =*/ false,
         /*.no_perf                     =*/ true,
         /*.abort_callback              =*/ nullptr,
         /*.abort_callback_data         =*/ nullptr,
@@ -19799,11 +21221,29 @@ struct llama_context * llama_new_context_with_model(
         params.flash_attn = false;
     }
 
-    if (params.type_v != GGML_TYPE_F16 && !params.flash_attn) {
+    if (params.type_v != GGML_TYPE_F16 && !params.flash_attn && (!ggml_is_quantized(params.type_v) || model->arch == LLM_ARCH_T5)) {
         LLAMA_LOG_ERROR("%s: V cache quantization requires flash_attn\n", __func__);
         return nullptr;
     }
 
+    // without flash_attn, the attention reads a quantized V cache through a broadcasting ggml_out_prod, which only the CPU backend implements
+    if (ggml_is_quantized(params.type_v) && !params.flash_attn && params.offload_kqv) {
+        bool kv_host = true;
+        for (const auto & buft : model->buft_layer) {
+            kv_host = kv_host && ggml_backend_buft_is_host(buft.buft);
+        }
+
+        if (!kv_host) {
+            LLAMA_LOG_ERROR("%s: V cache quantization without flash_attn requires the KV cache on the CPU (see offload_kqv)\n", __func__);
+            return nullptr;
+        }
+    }
+
+    if (params.n_seq_max > LLAMA_MAX_SEQ) {
+        LLAMA_LOG_ERROR("%s: n_seq_max must be <= %d\n", __func__, LLAMA_MAX_SEQ);
+        return nullptr;
+    }
+
     llama_context * ctx  = new llama_context(*model);
 
     const auto & hparams = model->hparams;
@@ -19816,6 +21256,11 @@ struct llama_context * llama_new_context_with_model(
     cparams.n_seq_max        = std::max(1u, params.n_seq_max);
     cparams.n_threads        = params.n_threads;
     cparams.n_threads_batch  = params.n_threads_batch;
+    cparams.spin_us          = params.spin_us;
+    cparams.n_top_logits     = std::max(0, std::min(params.n_top_logits, (int32_t) hparams.n_vocab));
+    cparams.kv_block_size    = std::max(0, params.kv_block_size);
+    cparams.n_kv_window      = std::max(0, params.n_kv_window);
+    cparams.n_kv_sink        = std::max(0, params.n_kv_sink);
     cparams.yarn_ext_factor  = params.yarn_ext_factor;
     cparams.yarn_attn_factor = params.yarn_attn_factor;
     cparams.yarn_beta_fast   = params.yarn_beta_fast;
@@ -19824,6 +21269,7 @@ struct llama_context * llama_new_context_with_model(
     cparams.embeddings       = params.embeddings;
     cparams.offload_kqv      = params.offload_kqv;
     cparams.flash_attn       = params.flash_attn;
+    cparams.fused_ops        = params.fused_ops;
     cparams.no_perf          = params.no_perf;
     cparams.pooling_type     = params.pooling_type;
 
@@ -20078,6 +21524,16 @@ struct llama_context * llama_new_context_with_model(
         }
         ctx->backends.push_back(ctx->backend_cpu);
 
+        // without an attached threadpool the CPU backend starts a new one for every sub-graph,
+        // so keep our own around for the workers to spin on between sub-graphs
+        if (cparams.spin_us != 0) {
+            struct ggml_threadpool_params tpp = ggml_threadpool_params_default(std::max(cparams.n_threads, cparams.n_threads_batch));
+            ctx->threadpool_spin = ggml_threadpool_new(&tpp);
+            if (ctx->threadpool_spin == nullptr) {
+                LLAMA_LOG_WARN("%s: failed to create the threadpool for spin_us = %d\n", __func__, cparams.spin_us);
+            }
+        }
+
         // create a list of the set_n_threads functions in the backends
         for (auto * backend : ctx->backends) {
             ggml_backend_dev_t dev = ggml_backend_get_device(backend);
@@ -20243,6 +21699,10 @@ uint32_t llama_n_seq_max(const struct llama_context * ctx) {
     return ctx->kv_self.size;
 }
 
+int32_t llama_n_top_logits(const struct llama_context * ctx) {
+    return ctx->cparams.n_top_logits;
+}
+
 enum llama_vocab_type llama_vocab_type(const struct llama_model * model) {
     return model->vocab.type;
 }
@@ -20610,7 +22070,7 @@ void llama_kv_cache_view_update(const struct llama_context * ctx, struct llama_k
     int32_t max_contig_idx = -1;
 
     for (int32_t i = 0; i < int32_t(ctx->kv_self.size); i++, c_curr++, cs_curr += view->n_seq_max) {
-        const size_t curr_size = kv_cells[i].seq_id.size();
+        const size_t curr_size = kv_cells[i].seq_id.count();
         token_count += curr_size;
         c_curr->pos = kv_cells[i].pos + kv_cells[i].delta;
 
@@ -20625,12 +22085,14 @@ void llama_kv_cache_view_update(const struct llama_context * ctx, struct llama_k
         }
 
         int seq_idx = 0;
-        for (const llama_seq_id it : kv_cells[i].seq_id) {
+        for (llama_seq_id it = 0; it < LLAMA_MAX_SEQ && curr_size > 0; ++it) {
             if (seq_idx >= view->n_seq_max) {
                 break;
             }
-            cs_curr[seq_idx] = it;
-            seq_idx++;
+            if (kv_cells[i].seq_id[it]) {
+                cs_curr[seq_idx] = it;
+                seq_idx++;
+            }
         }
         if (seq_idx != 0) {
             used_cells++;
@@ -20657,7 +22119,7 @@ int32_t llama_get_kv_cache_token_count(const struct llama_context * ctx) {
     int result = 0;
 
     for (uint32_t i = 0; i < ctx->kv_self.size; i++) {
-        result += ctx->kv_self.cells[i].seq_id.size();
+        result += ctx->kv_self.cells[i].seq_id.count();
     }
 
     return result;
@@ -20825,14 +22287,16 @@ struct llama_data_write {
             for (uint32_t i = range.first; i < range.second; ++i) {
                 const auto & cell = kv_self.cells[i];
                 const llama_pos pos      = cell.pos;
-                const uint32_t  n_seq_id = seq_id == -1 ? cell.seq_id.size() : 0;
+                const uint32_t  n_seq_id = seq_id == -1 ? cell.seq_id.count() : 0;
 
                 write(&pos,      sizeof(pos));
                 write(&n_seq_id, sizeof(n_seq_id));
 
                 if (n_seq_id) {
-                    for (auto seq_id : cell.seq_id) {
-                        write(&seq_id, sizeof(seq_id));
+                    for (llama_seq_id id = 0; id < LLAMA_MAX_SEQ; ++id) {
+                        if (cell.seq_id[id]) {
+                            write(&id, sizeof(id));
+                        }
                     }
                 }
             }
@@ -21079,7 +22543,8 @@ struct llama_data_read {
             }
             batch.n_seq_id[0] = 1;
             batch.seq_id[0] = &dest_seq_id;
-            if (!llama_kv_cache_find_slot(kv_self, batch)) {
+            // the restored cells are written as one contiguous range
+            if (!llama_kv_cache_find_slot(kv_self, batch, /* contiguous */ true)) {
                 LLAMA_LOG_ERROR("%s: failed to find available cells in kv cache\n", __func__);
                 return false;
             }
@@ -21121,7 +22586,7 @@ struct llama_data_read {
                         return false;
                     }
 
-                    cell.seq_id.insert(seq_id);
+                    cell.seq_id.set(seq_id);
 
                     if (kv_self.recurrent) {
                         int32_t & tail = kv_self.cells[seq_id].tail;
@@ -21824,6 +23289,10 @@ void llama_synchronize(struct llama_context * ctx) {
 }
 
 float * llama_get_logits(struct llama_context * ctx) {
+    if (ctx->cparams.n_top_logits > 0) {
+        GGML_ABORT("%s: only the top %d logits of each output are kept, use llama_get_logits_top_ith\n", __func__, ctx->cparams.n_top_logits);
+    }
+
     llama_synchronize(ctx);
 
     // reorder logits for backward compatibility
@@ -21834,6 +23303,10 @@ float * llama_get_logits(struct llama_context * ctx) {
 }
 
 float * llama_get_logits_ith(struct llama_context * ctx, int32_t i) {
+    if (ctx->cparams.n_top_logits > 0) {
+        GGML_ABORT("%s: only the top %d logits of each output are kept, use llama_get_logits_top_ith\n", __func__, ctx->cparams.n_top_logits);
+    }
+
     int32_t j = -1;
     llama_synchronize(ctx);
 
@@ -21872,6 +23345,55 @@ float * llama_get_logits_ith(struct llama_context * ctx, int32_t i) {
     }
 }
 
+int32_t llama_get_logits_top_ith(struct llama_context * ctx, int32_t i, llama_token_data * cands, int32_t n_cands_max) {
+    int32_t j = -1;
+    llama_synchronize(ctx);
+
+    try {
+        if (ctx->logits_top == nullptr) {
+            throw std::runtime_error("no top logits, n_top_logits is not set");
+        }
+
+        if (i < 0) {
+            j = ctx->n_outputs + i;
+            if (j < 0) {
+                throw std::runtime_error(format("negative index out of range [0, %d)", ctx->n_outputs));
+            }
+        } else if ((size_t) i >= ctx->output_ids.size()) {
+            throw std::runtime_error(format("out of range [0, %lu)", ctx->output_ids.size()));
+        } else {
+            j = ctx->output_ids[i];
+        }
+
+        if (j < 0) {
+            throw std::runtime_error(format("batch.logits[%d] != true", i));
+        }
+        if (j >= ctx->n_outputs) {
+            // This should not happen
+            throw std::runtime_error(format("corrupt output buffer (j=%d, n_outputs=%d)", j, ctx->n_outputs));
+        }
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: invalid logits id %d, reason: %s\n", __func__, i, err.what());
+#ifndef NDEBUG
+        GGML_ABORT("fatal error");
+#else
+        return -1;
+#endif
+    }
+
+    const int32_t n_top = ctx->cparams.n_top_logits;
+    const int32_t n     = std::min(n_top, n_cands_max);
+
+    const float   * logits = ctx->logits_top     + (size_t) j*n_top;
+    const int32_t * ids    = ctx->logits_top_ids + (size_t) j*n_top;
+
+    for (int32_t k = 0; k < n; ++k) {
+        cands[k] = llama_token_data{ ids[k], logits[k], 0.0f };
+    }
+
+    return n;
+}
+
 float * llama_get_embeddings(struct llama_context * ctx) {
     llama_synchronize(ctx);
 
@@ -22041,6 +23563,34 @@ int32_t llama_detokenize(
     return llama_detokenize_impl(model->vocab, tokens, n_tokens, text, text_len_max, remove_special, unparse_special);
 }
 
+int32_t llama_tokenize_batch(
+    const struct llama_model * model,
+          const char * const * texts,
+               const int32_t * text_lens,
+                     int32_t   n_texts,
+                 llama_token * tokens,
+                     int32_t   n_tokens_max,
+                     int32_t * offsets,
+                     int32_t   n_threads,
+                        bool   add_special,
+                        bool   parse_special) {
+    return llama_tokenize_batch_impl(model->vocab, texts, text_lens, n_texts, tokens, n_tokens_max, offsets, n_threads, add_special, parse_special);
+}
+
+int32_t llama_detokenize_batch(
+    const struct llama_model * model,
+           const llama_token * tokens,
+               const int32_t * token_offsets,
+                     int32_t   n_seqs,
+                        char * text,
+                     int32_t   text_len_max,
+                     int32_t * offsets,
+                     int32_t   n_threads,
+                        bool   remove_special,
+                        bool   unparse_special) {
+    return llama_detokenize_batch_impl(model->vocab, tokens, token_offsets, n_seqs, text, text_len_max, offsets, n_threads, remove_special, unparse_special);
+}
+
 //
 // chat templates
 //
@@ -22360,6 +23910,10 @@ struct llama_sampler * llama_sampler_init_grammar(const struct llama_model * mod
     return llama_sampler_init_grammar_impl(model->vocab, grammar_str, grammar_root);
 }
 
+struct llama_sampler * llama_sampler_init_grammar_compiled(const struct llama_model * model, const char * grammar_str, const char * grammar_root) {
+    return llama_sampler_init_grammar_impl(model->vocab, grammar_str, grammar_root, true);
+}
+
 //
 // model split
 //
@@ -22399,6 +23953,7 @@ const char * llama_print_system_info(void) {
     s += "AVX512_VBMI = " + std::to_string(ggml_cpu_has_avx512_vbmi()) + " | ";
     s += "AVX512_VNNI = " + std::to_string(ggml_cpu_has_avx512_vnni()) + " | ";
     s += "AVX512_BF16 = " + std::to_string(ggml_cpu_has_avx512_bf16()) + " | ";
+    s += "AMX_INT8 = "    + std::to_string(ggml_cpu_has_amx_int8())    + " | ";
     s += "FMA = "         + std::to_string(ggml_cpu_has_fma())         + " | ";
     s += "NEON = "        + std::to_string(ggml_cpu_has_neon())        + " | ";
     s += "SVE = "         + std::to_string(ggml_cpu_has_sve())         + " | ";
@@ -22518,3 +24073,132 @@ void llama_log_callback_default(ggml_log_level level, const char * text, void *
     fputs(text, stderr);
     fflush(stderr);
 }
+
+//
+// worker pool
+//
+
+// threads that are kept alive between the llama_parallel_run calls
+// the jobs are serialized, a call that cannot get the pool runs on the calling thread
+// the pool is never destroyed: its idle threads are left blocked until the process exits instead of being joined
+// during static destruction
+struct llama_worker_pool {
+    std::mutex mutex_job;
+
+    std::mutex              mutex;
+    std::condition_variable cv_start;
+    std::condition_variable cv_done;
+
+    int32_t n_spawned = 0; // number of pool threads started so far
+
+    uint64_t gen = 0;
+
+    // current job
+    void (*fn)(int32_t, void *) = nullptr;
+    void * user_data = nullptr;
+
+    int32_t n         = 0;
+    int32_t n_workers = 0; // number of workers that take part in the job
+    int32_t n_running = 0;
+
+    std::atomic<int32_t> next{0};
+    std::exception_ptr   error;
+
+    // set on the pool threads and on the thread that runs a job
+    static thread_local bool busy;
+
+    void work() {
+        try {
+            for (int32_t i = next++; i < n; i = next++) {
+                fn(i, user_data);
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+            next = n;
+        }
+    }
+
+    void worker(int32_t ith) {
+        busy = true;
+
+        uint64_t gen_seen = 0;
+
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv_start.wait(lock, [&] { return gen != gen_seen; });
+                gen_seen = gen;
+                if (ith >= n_workers) {
+                    continue;
+                }
+            }
+
+            work();
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--n_running == 0) {
+                    cv_done.notify_one();
+                }
+            }
+        }
+    }
+
+    void run(int32_t n_iter, int32_t n_threads, void (*fn_iter)(int32_t, void *), void * data) {
+        std::unique_lock<std::mutex> lock_job(mutex_job, std::defer_lock);
+        if (n_threads <= 1 || busy || !lock_job.try_lock()) {
+            for (int32_t i = 0; i < n_iter; ++i) {
+                fn_iter(i, data);
+            }
+            return;
+        }
+
+        for (; n_spawned < n_threads - 1; ++n_spawned) {
+            std::thread(&llama_worker_pool::worker, this, n_spawned).detach();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            fn        = fn_iter;
+            user_data = data;
+            n         = n_iter;
+            n_workers = n_threads - 1;
+            n_running = n_workers;
+            next      = 0;
+            error     = nullptr;
+            gen++;
+        }
+        cv_start.notify_all();
+
+        busy = true;
+        work();
+        busy = false;
+
+        std::exception_ptr err;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv_done.wait(lock, [&] { return n_running == 0; });
+            std::swap(err, error);
+        }
+
+        if (err) {
+            std::rethrow_exception(err);
+        }
+    }
+};
+
+thread_local bool llama_worker_pool::busy = false;
+
+void llama_parallel_run(int32_t n, int32_t n_threads, void (*fn)(int32_t i, void * user_data), void * user_data) {
+    static llama_worker_pool * pool = new llama_worker_pool();
+
+    if (n_threads <= 0) {
+        n_threads = std::thread::hardware_concurrency();
+    }
+    n_threads = std::max(1, std::min(n_threads, n));
+
+    pool->run(n, n_threads, fn, user_data);
+}
@@ -205,31 +205,11 @@ static inline std::wstring unicode_wstring_from_utf8(const std::string & s) {
     return conv.from_bytes(s);
 }
 
-static std::vector<std::string> unicode_byte_encoding_process(const std::vector<std::string> & bpe_words) {
-    std::vector<std::string> bpe_encoded_words;
-    for (const auto & word : bpe_words) {
-        std::string text_utf;
-        auto utf_word =  unicode_cpts_from_utf8(word);
-        for (size_t i = 0; i < utf_word.size(); ++i) {
-            text_utf += unicode_cpt_to_utf8(utf_word[i]);
-        }
-
-        std::string encoded_token;
-        for (char & c : text_utf) {
-            encoded_token += unicode_byte_to_utf8(c);
-        }
-        bpe_encoded_words.emplace_back(encoded_token);
-    }
-    return bpe_encoded_words;
-}
-
 // GPT2 system regex:  's|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+
-static std::vector<size_t> unicode_regex_split_custom_gpt2(const std::string & text, const std::vector<size_t> & offsets) {
+static std::vector<size_t> unicode_regex_split_custom_gpt2(const std::vector<uint32_t> & cpts, const std::vector<size_t> & offsets) {
     std::vector<size_t> bpe_offsets; // store the offset of each word
     bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
 
-    const auto cpts = unicode_cpts_from_utf8(text);
-
     size_t start = 0;
     for (auto offset : offsets) {
         const size_t offset_ini = start;
@@ -342,12 +322,11 @@ static std::vector<size_t> unicode_regex_split_custom_gpt2(const std::string & t
 }
 
 // LLAMA3 system regex: "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\p{L}\p{N}]?\p{L}+|\p{N}{1,3}| ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+(?!\S)|\s+"
-static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string & text, const std::vector<size_t> & offsets) {
+// max_digits = 1 gives the QWEN2 variant, which has \p{N} in place of \p{N}{1,3}
+static std::vector<size_t> unicode_regex_split_custom_llama3(const std::vector<uint32_t> & cpts, const std::vector<size_t> & offsets, size_t max_digits = 3) {
     std::vector<size_t> bpe_offsets; // store the offset of each word
     bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
 
-    const auto cpts = unicode_cpts_from_utf8(text);
-
     size_t start = 0;
     for (auto offset : offsets) {
         const size_t offset_ini = start;
@@ -419,7 +398,7 @@ static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string &
             if (flags.is_number) {
                 size_t ini = pos;
                 while (_get_flags(pos).is_number) {
-                    if (++pos - ini >= 3 ) {
+                    if (++pos - ini >= max_digits) {
                         _add_token(pos);
                         ini = pos;
                     }
@@ -483,8 +462,7 @@ static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string &
 }
 
 // use std::wregex to split the text
-static std::vector<size_t> unicode_regex_split_stl(const std::wstring & wtext, const std::wstring & regex_expr, const std::vector<size_t> & offsets) {
-    std::wregex expr(regex_expr);
+static std::vector<size_t> unicode_regex_split_stl(const std::wstring & wtext, const std::wregex & expr, const std::vector<size_t> & offsets) {
     std::vector<size_t> bpe_offsets; // store the offset of each word
     bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
     size_t start = 0;
@@ -513,8 +491,7 @@ static std::vector<size_t> unicode_regex_split_stl(const std::wstring & wtext, c
 }
 
 // use std::regex to split the text
-static std::vector<size_t> unicode_regex_split_stl(const std::string & text, const std::string & regex_expr, const std::vector<size_t> & offsets) {
-    std::regex expr(regex_expr);
+static std::vector<size_t> unicode_regex_split_stl(const std::string & text, const std::regex & expr, const std::vector<size_t> & offsets) {
     std::vector<size_t> bpe_offsets; // store the offset of each word
     bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
     size_t start = 0;
@@ -542,19 +519,150 @@ static std::vector<size_t> unicode_regex_split_stl(const std::string & text, con
     return bpe_offsets;
 }
 
-static std::vector<size_t> unicode_regex_split_custom(const std::string & text, const std::string & regex_expr, const std::vector<size_t> & offsets) {
-    std::vector<size_t> bpe_offsets;
+//
+// pre-tokenizer regexes
+//
+
+struct unicode_regex_compiled {
+    enum split_type {
+        SPLIT_GPT2,          // hand-written splitter for the GPT2 regex
+        SPLIT_LLAMA3,        // hand-written splitter for the LLAMA3 regex and its QWEN2 variant
+        SPLIT_STL_COLLAPSED, // std::regex over the collapsed text, the regex uses unicode categories
+        SPLIT_STL_WIDE,      // std::wregex over the codepoints
+    };
 
-    if (regex_expr == "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)") {
-        bpe_offsets = unicode_regex_split_custom_gpt2(text, offsets);
-    } else if (
-            regex_expr == "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+" ||
-            regex_expr == "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+") {
+    struct expr {
+        split_type  type;
+        size_t      max_digits = 3; // SPLIT_LLAMA3: longest run of digits in a word
+        std::regex  re;
+        std::wregex wre;
+    };
+
+    std::vector<expr> exprs;
+
+    bool need_collapse = false;
+    bool need_wide     = false;
+};
+
+// unicode categories
+static const std::map<std::string, int> k_ucat_enum = {
+    { "\\p{N}", codepoint_flags::NUMBER },
+    { "\\p{L}", codepoint_flags::LETTER },
+    { "\\p{P}", codepoint_flags::PUNCTUATION },
+};
+
+static const std::map<int, int> k_ucat_cpt = {
+    { codepoint_flags::NUMBER,        0xD1 },
+    { codepoint_flags::LETTER,        0xD2 },
+    { codepoint_flags::PUNCTUATION,   0xD3 },
+};
+
+static const std::map<int, std::string> k_ucat_map = {
+    { codepoint_flags::NUMBER,        "\x30-\x39" }, // 0-9
+    { codepoint_flags::LETTER,        "\x41-\x5A\x61-\x7A" }, // A-Za-z
+    { codepoint_flags::PUNCTUATION,   "\x21-\x23\x25-\x2A\x2C-\x2F\x3A-\x3B\x3F-\x40\\\x5B-\\\x5D\x5F\\\x7B\\\x7D" }, // !-#%-*,-/:-;?-@\[-\]_\{\}
+};
+
+static bool unicode_regex_has_category(const std::string & regex_expr) {
+    for (const auto & ucat : k_ucat_enum) {
+        if (std::string::npos != regex_expr.find(ucat.first)) {
+            return true;
+        }
+    }
+    return false;
+}
 
-        bpe_offsets = unicode_regex_split_custom_llama3(text, offsets);
+// generate a collapsed representation of the regex, where each unicode category is replaced by its collapsed codepoint
+// and the ASCII characters of the category
+static std::string unicode_regex_collapse(const std::string & regex_expr) {
+    // sanity-check that the original regex does not contain any non-ASCII characters
+    const auto cpts_regex = unicode_cpts_from_utf8(regex_expr);
+    for (size_t i = 0; i < cpts_regex.size(); ++i) {
+        if (cpts_regex[i] >= 128) {
+            throw std::runtime_error("Regex includes both unicode categories and non-ASCII characters - not supported");
+        }
     }
 
-    return bpe_offsets;
+    std::string regex_expr_collapsed;
+
+    // track if we are inside [], because nested [] are not allowed
+    bool inside = false;
+    for (size_t i = 0; i < regex_expr.size(); ++i) {
+        if (regex_expr[i] == '[' && (i == 0 || regex_expr[i - 1] != '\\')) {
+            regex_expr_collapsed += '[';
+            inside = true;
+            continue;
+        }
+
+        if (inside && regex_expr[i] == ']' && regex_expr[i - 1] != '\\') {
+            regex_expr_collapsed += ']';
+            inside = false;
+            continue;
+        }
+
+        if (regex_expr[i + 0] == '\\' && i + 4 < regex_expr.size() &&
+            regex_expr[i + 1] == 'p' &&
+            regex_expr[i + 2] == '{' &&
+            regex_expr[i + 4] == '}') {
+            const std::string pat = regex_expr.substr(i, 5);
+            if (k_ucat_enum.find(pat) != k_ucat_enum.end()) {
+                if (!inside) {
+                    regex_expr_collapsed += '[';
+                }
+                regex_expr_collapsed += k_ucat_cpt.at(k_ucat_enum.at(pat));
+                regex_expr_collapsed += k_ucat_map.at(k_ucat_enum.at(pat));
+                if (!inside) {
+                    regex_expr_collapsed += ']';
+                }
+                i += 4;
+                continue;
+            }
+        }
+
+        regex_expr_collapsed += regex_expr[i];
+    }
+
+    return regex_expr_collapsed;
+}
+
+static unicode_regex_compiled::expr unicode_regex_compile_expr(const std::string & regex_expr) {
+    unicode_regex_compiled::expr res;
+
+    // first, see if we have an efficient custom regex implementation
+    if (regex_expr == "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)") {
+        res.type = unicode_regex_compiled::SPLIT_GPT2;
+        return res;
+    }
+    if (regex_expr == "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+" ||
+        regex_expr == "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+") {
+        res.type = unicode_regex_compiled::SPLIT_LLAMA3;
+        return res;
+    }
+    if (regex_expr == "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+") {
+        res.type = unicode_regex_compiled::SPLIT_LLAMA3;
+        res.max_digits = 1;
+        return res;
+    }
+
+    // fallback to general-purpose std::regex / std::wregex
+    try {
+        // if a unicode category is used in the regex, we use the collapsed text and replace the unicode category
+        // with the corresponding collapsed representation
+        if (unicode_regex_has_category(regex_expr)) {
+            res.type = unicode_regex_compiled::SPLIT_STL_COLLAPSED;
+            res.re   = std::regex(unicode_regex_collapse(regex_expr));
+        } else {
+            // no unicode category used, we can use std::wregex directly
+            res.type = unicode_regex_compiled::SPLIT_STL_WIDE;
+            res.wre  = std::wregex(unicode_wstring_from_utf8(regex_expr));
+        }
+    } catch (std::regex_error & e) {
+        fprintf(stderr, "Failed to process regex: '%s'\n", regex_expr.c_str());
+        fprintf(stderr, "Regex error: %s\n", e.what());
+        throw std::runtime_error("Failed to process regex");
+    }
+
+    return res;
 }
 
 //
@@ -650,44 +758,32 @@ uint32_t unicode_tolower(uint32_t cp) {
     return cp;  // Return the original code point if no lowercase mapping is found
 }
 
-std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs) {
-    // unicode categories
-    static const std::map<std::string, int> k_ucat_enum = {
-        { "\\p{N}", codepoint_flags::NUMBER },
-        { "\\p{L}", codepoint_flags::LETTER },
-        { "\\p{P}", codepoint_flags::PUNCTUATION },
-    };
+std::shared_ptr<const unicode_regex_compiled> unicode_regex_compile(const std::vector<std::string> & regex_exprs) {
+    auto res = std::make_shared<unicode_regex_compiled>();
 
-    static const std::map<int, int> k_ucat_cpt = {
-        { codepoint_flags::NUMBER,        0xD1 },
-        { codepoint_flags::LETTER,        0xD2 },
-        { codepoint_flags::PUNCTUATION,   0xD3 },
-    };
-
-    static const std::map<int, std::string> k_ucat_map = {
-        { codepoint_flags::NUMBER,        "\x30-\x39" }, // 0-9
-        { codepoint_flags::LETTER,        "\x41-\x5A\x61-\x7A" }, // A-Za-z
-        { codepoint_flags::PUNCTUATION,   "\x21-\x23\x25-\x2A\x2C-\x2F\x3A-\x3B\x3F-\x40\\\x5B-\\\x5D\x5F\\\x7B\\\x7D" }, // !-#%-*,-/:-;?-@\[-\]_\{\}
-    };
+    res->exprs.reserve(regex_exprs.size());
+    for (const auto & regex_expr : regex_exprs) {
+        res->exprs.push_back(unicode_regex_compile_expr(regex_expr));
 
-    // compute collapsed codepoints only if needed by at least one regex
-    bool need_collapse = false;
-    for (auto & regex_expr : regex_exprs) {
-        // search for unicode categories
-        for (const auto & ucat : k_ucat_enum) {
-            if (std::string::npos != regex_expr.find(ucat.first)) {
-                need_collapse = true;
-                break;
-            }
-        }
+        // compute collapsed codepoints only if needed by at least one regex
+        res->need_collapse |= res->exprs.back().type == unicode_regex_compiled::SPLIT_STL_COLLAPSED;
+        res->need_wide     |= res->exprs.back().type == unicode_regex_compiled::SPLIT_STL_WIDE;
     }
 
+    return res;
+}
+
+std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs) {
+    return unicode_regex_split(text, *unicode_regex_compile(regex_exprs));
+}
+
+std::vector<std::string> unicode_regex_split(const std::string & text, const unicode_regex_compiled & compiled) {
     const auto cpts = unicode_cpts_from_utf8(text);
 
     // generate a "collapsed" representation of the text, where all codepoints are replaced by a single byte
     // ref: https://github.com/ggerganov/llama.cpp/pull/6920#issuecomment-2081479935
     std::string text_collapsed;
-    if (need_collapse) {
+    if (compiled.need_collapse) {
         // collapse all unicode categories
         text_collapsed.resize(cpts.size());
 
@@ -712,104 +808,45 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
         }
     }
 
-    std::vector<size_t> bpe_offsets = { cpts.size() };
-
-    for (auto & regex_expr : regex_exprs) {
-        // first, see if we have an efficient custom regex implementation
-        auto tmp = unicode_regex_split_custom(text, regex_expr, bpe_offsets);
-
-        if (!tmp.empty()) {
-            bpe_offsets = std::move(tmp);
-            continue;
-        }
-
-        // fallback to general-purpose std::regex / std::wregex
-        try {
-            // if a unicode category is used in the regex, we use the collapsed text and replace the unicode category
-            // with the corresponding collapsed representation
-            bool use_collapsed = false;
-            for (auto & ucat : k_ucat_enum) {
-                if (std::string::npos != regex_expr.find(ucat.first)) {
-                    use_collapsed = true;
-                    break;
-                }
+    // std::wregex \s does not mach non-ASCII whitespaces, using 0x0B as fallback
+    std::wstring wtext;
+    if (compiled.need_wide) {
+        wtext.assign(cpts.begin(), cpts.end());
+        for (size_t i = 0; i < wtext.size(); ++i) {
+            if (wtext[i] > 0x7F && unicode_cpt_flags(wtext[i]).is_whitespace) {
+                wtext[i] = 0x0B;
             }
+        }
+    }
 
-            if (use_collapsed) {
-                // sanity-check that the original regex does not contain any non-ASCII characters
-                const auto cpts_regex = unicode_cpts_from_utf8(regex_expr);
-                for (size_t i = 0; i < cpts_regex.size(); ++i) {
-                    if (cpts_regex[i] >= 128) {
-                        throw std::runtime_error("Regex includes both unicode categories and non-ASCII characters - not supported");
-                    }
-                }
-
-                // generate a collapsed representation of the regex
-                std::string regex_expr_collapsed;
-
-                // track if we are inside [], because nested [] are not allowed
-                bool inside = false;
-                for (size_t i = 0; i < regex_expr.size(); ++i) {
-                    if (regex_expr[i] == '[' && (i == 0 || regex_expr[i - 1] != '\\')) {
-                        regex_expr_collapsed += '[';
-                        inside = true;
-                        continue;
-                    }
-
-                    if (inside && regex_expr[i] == ']' && regex_expr[i - 1] != '\\') {
-                        regex_expr_collapsed += ']';
-                        inside = false;
-                        continue;
-                    }
-
-                    if (regex_expr[i + 0] == '\\' && i + 4 < regex_expr.size() &&
-                        regex_expr[i + 1] == 'p' &&
-                        regex_expr[i + 2] == '{' &&
-                        regex_expr[i + 4] == '}') {
-                        const std::string pat = regex_expr.substr(i, 5);
-                        if (k_ucat_enum.find(pat) != k_ucat_enum.end()) {
-                            if (!inside) {
-                                regex_expr_collapsed += '[';
-                            }
-                            regex_expr_collapsed += k_ucat_cpt.at(k_ucat_enum.at(pat));
-                            regex_expr_collapsed += k_ucat_map.at(k_ucat_enum.at(pat));
-                            if (!inside) {
-                                regex_expr_collapsed += ']';
-                            }
-                            i += 4;
-                            continue;
-                        }
-                    }
-
-                    regex_expr_collapsed += regex_expr[i];
-                }
-
-                //printf("text_collapsed: %s\n", text_collapsed.c_str());
-                //printf("regex_expr_collapsed: %s\n", regex_expr_collapsed.c_str());
-                bpe_offsets = unicode_regex_split_stl(text_collapsed, regex_expr_collapsed, bpe_offsets);
-            } else {
-                // no unicode category used, we can use std::wregex directly
-                const std::wstring wregex_expr = unicode_wstring_from_utf8(regex_expr);
-
-                // std::wregex \s does not mach non-ASCII whitespaces, using 0x0B as fallback
-                std::wstring wtext(cpts.begin(), cpts.end());
-                for (size_t i = 0; i < wtext.size(); ++i) {
-                    if (wtext[i] > 0x7F && unicode_cpt_flags(wtext[i]).is_whitespace) {
-                        wtext[i] = 0x0B;
-                    }
-                }
+    std::vector<size_t> bpe_offsets = { cpts.size() };
 
-                //printf("text: %s\n", text.c_str());
-                //printf("regex_expr: %s\n", regex_expr.c_str());
-                bpe_offsets = unicode_regex_split_stl(wtext, wregex_expr, bpe_offsets);
-            }
-        } catch (std::regex_error & e) {
-            fprintf(stderr, "Failed to process regex: '%s'\n", regex_expr.c_str());
-            fprintf(stderr, "Regex error: %s\n", e.what());
-            throw std::runtime_error("Failed to process regex");
+    for (const auto & expr : compiled.exprs) {
+        switch (expr.type) {
+            case unicode_regex_compiled::SPLIT_GPT2:
+                bpe_offsets = unicode_regex_split_custom_gpt2(cpts, bpe_offsets);
+                break;
+            case unicode_regex_compiled::SPLIT_LLAMA3:
+                bpe_offsets = unicode_regex_split_custom_llama3(cpts, bpe_offsets, expr.max_digits);
+                break;
+            case unicode_regex_compiled::SPLIT_STL_COLLAPSED:
+                bpe_offsets = unicode_regex_split_stl(text_collapsed, expr.re, bpe_offsets);
+                break;
+            case unicode_regex_compiled::SPLIT_STL_WIDE:
+                bpe_offsets = unicode_regex_split_stl(wtext, expr.wre, bpe_offsets);
+                break;
         }
     }
 
+    // byte-level encoding of the words, see unicode_byte_to_utf8
+    static const auto byte_to_utf8 = [] {
+        std::vector<std::string> res(256);
+        for (int i = 0; i < 256; ++i) {
+            res[i] = unicode_byte_to_utf8(i);
+        }
+        return res;
+    }();
+
     std::vector<std::string> bpe_words;
     bpe_words.reserve(bpe_offsets.size()); // reserve memory for the approximate size
 
@@ -817,10 +854,12 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
     for (size_t & offset : bpe_offsets) {
         bpe_words.emplace_back();
         for (size_t i = start; i < start + offset; ++i) {
-            bpe_words.back() += unicode_cpt_to_utf8(cpts[i]);
+            for (const char c : unicode_cpt_to_utf8(cpts[i])) {
+                bpe_words.back() += byte_to_utf8[(uint8_t) c];
+            }
         }
         start += offset;
     }
 
-    return unicode_byte_encoding_process(bpe_words);
+    return bpe_words;
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstdint>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -64,4 +65,10 @@ uint8_t unicode_utf8_to_byte(const std::string & utf8);
 
 uint32_t unicode_tolower(uint32_t cp);
 
+// pre-tokenizer regexes prepared once, e.g. at vocab load, instead of on every unicode_regex_split call
+struct unicode_regex_compiled;
+
+std::shared_ptr<const unicode_regex_compiled> unicode_regex_compile(const std::vector<std::string> & regex_exprs);
+
 std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs);
+std::vector<std::string> unicode_regex_split(const std::string & text, const unicode_regex_compiled & compiled);
@@ -4,9 +4,12 @@
 
 #include "unicode.h"
 #include "llama-grammar.h"
+#include "llama-vocab.h"
 #include "json-schema-to-grammar.h"
 
 #include <cassert>
+#include <cmath>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -1295,6 +1298,92 @@ static void test_json_schema() {
     );
 }
 
+// apply the grammar to the candidates and return which of them are allowed
+static std::vector<bool> apply_grammar(const llama_grammar & grammar, const std::vector<llama_token> & ids) {
+    std::vector<llama_token_data> cur;
+    for (const llama_token id : ids) {
+        cur.push_back({ id, 0.0f, 0.0f });
+    }
+
+    llama_token_data_array cur_p = { cur.data(), cur.size(), -1, false };
+    llama_grammar_apply_impl(grammar, &cur_p);
+
+    std::vector<bool> allowed;
+    for (const auto & td : cur) {
+        allowed.push_back(!std::isinf(td.logit));
+    }
+    return allowed;
+}
+
+// the compiled grammar must allow exactly the tokens the uncompiled one allows, for the masks built over the whole
+// vocab, the masks looked up again and the small candidate sets that are checked without a mask
+static void test_compiled(const std::string & test_desc, const llama_vocab & vocab, const std::string & grammar_str, const std::vector<std::string> & pieces) {
+    fprintf(stderr, "⚫ Testing compiled grammar %s\n%s\n", test_desc.c_str(), grammar_str.c_str());
+    fflush(stderr);
+
+    const llama_token n_vocab = vocab.cache_token_to_piece.size();
+
+    auto * grammar_ref = llama_grammar_init_impl(&vocab, grammar_str.c_str(), "root");
+    auto * grammar_cmp = llama_grammar_init_impl(&vocab, grammar_str.c_str(), "root");
+    grammar_cmp->masks = std::make_shared<llama_grammar_masks>();
+
+    std::vector<llama_token> ids_all;
+    for (llama_token id = 0; id < n_vocab; ++id) {
+        ids_all.push_back(id);
+    }
+
+    for (size_t i = 0; i <= pieces.size(); ++i) {
+        for (int rep = 0; rep < 2; ++rep) {
+            assert(apply_grammar(*grammar_ref, ids_all) == apply_grammar(*grammar_cmp, ids_all));
+        }
+
+        for (llama_token id = 0; id + 1 < n_vocab; ++id) {
+            const std::vector<llama_token> ids_small = { id, id + 1 };
+            assert(apply_grammar(*grammar_ref, ids_small) == apply_grammar(*grammar_cmp, ids_small));
+        }
+
+        if (i == pieces.size()) {
+            break;
+        }
+
+        const llama_token id = std::find(vocab.cache_token_to_piece.begin(), vocab.cache_token_to_piece.end(), pieces[i]) - vocab.cache_token_to_piece.begin();
+        assert(id < n_vocab);
+        assert(apply_grammar(*grammar_ref, { id })[0]);
+
+        llama_grammar_accept_impl(*grammar_ref, id);
+        llama_grammar_accept_impl(*grammar_cmp, id);
+    }
+
+    llama_grammar_free_impl(grammar_ref);
+    llama_grammar_free_impl(grammar_cmp);
+
+    fprintf(stderr, "  ✅︎\n");
+}
+
+static void test_compiled_grammar() {
+    // "\xE2" and "\x82\xAC" are the two halves of "€", the second one is only valid after the first
+    llama_vocab vocab;
+    vocab.cache_token_to_piece = {
+        "</s>", "", "[", "]", ",", "[a", "],", "a", "b", "ab", "abc", "1", "12", " ", "€", "x€", "\xE2", "\x82\xAC", "\x82", "\"", "{", "}", ":", "\"a\"",
+    };
+    vocab.special_eog_ids.insert(0);
+
+    const std::string grammar_list = R"""(
+        root ::= "[" ( item ( "," item )* )? "]"
+        item ::= [a-z]+ | "€" | [0-9]+ | root)""";
+
+    test_compiled("nested lists", vocab, grammar_list, { "[", "ab", ",", "\xE2", "\x82\xAC", ",", "[a", "],", "12", "]" });
+    test_compiled("nested lists, split code point first", vocab, grammar_list, { "[", "\xE2", "\x82\xAC", "]", "</s>" });
+
+    const std::string grammar_object = R"""(
+        root  ::= "{" ws ( pair ( ws "," ws pair )* )? ws "}"
+        pair  ::= "\"" [a-z€]* "\"" ws ":" ws value
+        value ::= root | [0-9]+ | "\"" [a-z]* "\""
+        ws    ::= " "?)""";
+
+    test_compiled("nested objects", vocab, grammar_object, { "{", "\"a\"", ":", " ", "{", "\"", "\xE2", "\x82\xAC", "\"", ":", "1", "}", ",", "\"a\"", ":", "12", "}" });
+}
+
 int main() {
     fprintf(stdout, "Running grammar integration tests...\n");
     test_simple_grammar();
@@ -1305,6 +1394,7 @@ int main() {
     test_failure_missing_reference();
     test_failure_left_recursion();
     test_json_schema();
+    test_compiled_grammar();
     fprintf(stdout, "All tests passed.\n");
     return 0;
 }
@@ -248,6 +248,112 @@ static void test_sampler_queue(const size_t n_vocab, const std::string & sampler
            samplers_sequence.c_str(), n_vocab, top_k, top_p, min_p);
 }
 
+static void test_logit_bias_shuffled(const std::vector<float> & logits, const std::vector<llama_logit_bias> & biases) {
+    const size_t n_vocab = logits.size();
+
+    // reverse the candidates so that idx != id for all but the middle token
+    std::vector<llama_token_data> cur;
+    cur.reserve(n_vocab);
+    for (llama_token token_id = n_vocab - 1; token_id >= 0; token_id--) {
+        cur.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+    }
+
+    llama_token_data_array cur_p = { cur.data(), cur.size(), -1, false };
+    APPLY(llama_sampler_init_logit_bias(n_vocab, biases.size(), biases.data()), &cur_p);
+    DUMP(&cur_p);
+
+    GGML_ASSERT(cur_p.size == n_vocab);
+    for (size_t i = 0; i < cur_p.size; i++) {
+        const llama_token id = cur_p.data[i].id;
+
+        float expected = logits[id];
+        for (const auto & lb : biases) {
+            if (lb.token == id) {
+                expected += lb.bias;
+            }
+        }
+
+        GGML_ASSERT(id == (llama_token) (n_vocab - 1 - i));
+        GGML_ASSERT(cur_p.data[i].logit == expected);
+    }
+}
+
+// compare the fused llama_sampler_chain_apply_logits path with applying the chain sampler by sampler
+static void test_chain_apply_logits(int32_t n_vocab, int32_t k, bool penalties, bool logit_bias) {
+    std::vector<float> logits(n_vocab);
+    for (int32_t i = 0; i < n_vocab; i++) {
+        logits[i] = 2.0f*((float)(rand())/RAND_MAX - 0.5f);
+    }
+
+    // lift tokens from the bottom into the top-k, push the largest logit out of it and bias an out-of-vocab token
+    std::vector<llama_logit_bias> biases;
+    if (logit_bias) {
+        const int32_t i_max = std::max_element(logits.begin(), logits.end()) - logits.begin();
+
+        biases.push_back({ 1,           5.0f});
+        biases.push_back({ n_vocab - 2, 3.0f});
+        biases.push_back({ i_max,      -5.0f});
+        biases.push_back({ n_vocab + 7, 1.0f});
+    }
+
+    const auto make_chain = [&]() {
+        auto * chain = llama_sampler_chain_init(llama_sampler_chain_default_params());
+        if (logit_bias) {
+            llama_sampler_chain_add(chain, llama_sampler_init_logit_bias(n_vocab, biases.size(), biases.data()));
+        }
+        if (penalties) {
+            llama_sampler_chain_add(chain, llama_sampler_init_penalties(n_vocab, LLAMA_TOKEN_NULL, LLAMA_TOKEN_NULL, 64, 1.5f, 0.5f, 0.5f, false, false));
+        }
+        llama_sampler_chain_add(chain, llama_sampler_init_top_k(k));
+        return chain;
+    };
+
+    auto * chain_fused = make_chain();
+    auto * chain_ref   = make_chain();
+
+    // penalize a few of the largest logits, some of them more than once
+    if (penalties) {
+        std::vector<llama_token> ids(n_vocab);
+        for (int32_t i = 0; i < n_vocab; i++) {
+            ids[i] = i;
+        }
+        std::partial_sort(ids.begin(), ids.begin() + k, ids.end(), [&](llama_token a, llama_token b) {
+            return logits[a] > logits[b];
+        });
+
+        for (int32_t i = 0; i < k; i += 2) {
+            for (int32_t j = 0; j <= i % 3; j++) {
+                llama_sampler_accept(chain_fused, ids[i]);
+                llama_sampler_accept(chain_ref,   ids[i]);
+            }
+        }
+    }
+
+    std::vector<llama_token_data> cur_fused(n_vocab);
+    llama_token_data_array cur_p_fused = { cur_fused.data(), cur_fused.size(), -1, false };
+    llama_sampler_chain_apply_logits(chain_fused, logits.data(), n_vocab, &cur_p_fused);
+
+    std::vector<llama_token_data> cur_ref;
+    cur_ref.reserve(n_vocab);
+    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+        cur_ref.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+    }
+    llama_token_data_array cur_p_ref = { cur_ref.data(), cur_ref.size(), -1, false };
+    llama_sampler_apply(chain_ref, &cur_p_ref);
+
+    GGML_ASSERT(cur_p_fused.size == (size_t) k);
+    GGML_ASSERT(cur_p_fused.size == cur_p_ref.size);
+    for (size_t i = 0; i < cur_p_ref.size; i++) {
+        GGML_ASSERT(cur_p_fused.data[i].id    == cur_p_ref.data[i].id);
+        GGML_ASSERT(cur_p_fused.data[i].logit == cur_p_ref.data[i].logit);
+    }
+
+    llama_sampler_free(chain_fused);
+    llama_sampler_free(chain_ref);
+
+    printf("Fused chain OK with n_vocab=%05d top_k=%03d penalties=%d logit_bias=%d\n", n_vocab, k, penalties, logit_bias);
+}
+
 static void bench(llama_sampler * cnstr, const char * cnstr_name, const std::vector<llama_token_data> & data, int n_iter) {
     std::vector<llama_token_data> cur(data.size());
     std::copy(data.begin(), data.end(), cur.begin());
@@ -352,6 +458,17 @@ int main(void) {
     test_sampler_queue(10000, "mkp", 100, 0.8f, 0.1f);
     test_sampler_queue(10000, "mpk", 100, 0.8f, 0.1f);
 
+    test_logit_bias_shuffled({0.1f, 0.2f, 0.3f, 0.4f, 0.5f}, {{0, 1.0f}, {3, -2.0f}, {4, 0.5f}});
+    test_logit_bias_shuffled({0.1f, 0.2f, 0.3f, 0.4f, 0.5f}, {{2, 1.0f}, {7, 1.0f}});
+
+    // top-k below and above LLAMA_TOP_K_BLOCK (32), with a vocab that is not a multiple of the block
+    for (int32_t k : {5, 50}) {
+        test_chain_apply_logits(10003, k, false, false);
+        test_chain_apply_logits(10003, k, true,  false);
+        test_chain_apply_logits(10003, k, false, true);
+        test_chain_apply_logits(10003, k, true,  true);
+    }
+
     printf("OK\n");
 
     test_perf();